@@ -2,15 +2,10 @@
 ; Handles arithmetic, logical operations, and SIMD
 
 BITS 64
-SECTION .text
 
-; External symbols
-extern vm_state
+%include "context.inc"
 
-; Constants
-%define VM_GPRS 24
-%define VM_VREGS (VM_GPRS + 32 * 8)
-%define VM_FLAGS 16
+SECTION .text
 
 ; Flags register bits
 %define FLAG_ZERO 0
@@ -56,7 +51,7 @@ update_flags:
     mov rbp, rsp
     
     ; Get flags register
-    lea rbx, [vm_state]
+    mov rbx, r13
     mov cl, [rbx + VM_FLAGS]
     and cl, 0xF0  ; Clear arithmetic flags
     
@@ -78,8 +73,8 @@ update_flags:
     ; For now, we'll set it based on whether result is smaller than operands
     
     ; Negative flag
-    test rax, 0x8000000000000000
-    jz .clear_negative
+    test rax, rax
+    jns .clear_negative
     or cl, (1 << FLAG_NEGATIVE)
     jmp .overflow_check
     
@@ -492,8 +487,12 @@ simd_rsqrt_f64:
     ; Load vector
     vmovupd ymm0, [rdi]
     
-    ; Reciprocal square root (approximate)
-    vrsqrtpd ymm1, ymm0
+    ; Reciprocal square root (AVX has no packed-double estimate)
+    vsqrtpd ymm0, ymm0
+    mov rax, 0x3FF0000000000000  ; 1.0
+    vmovq xmm1, rax
+    vbroadcastsd ymm1, xmm1
+    vdivpd ymm1, ymm1, ymm0
     
     ; Store result
     vmovupd [rsi], ymm1
@@ -669,11 +668,11 @@ simd_shl_i64:
     ; Load vector
     vmovupd ymm0, [rdi]
     
-    ; Create shift count vector
-    vpbroadcastq ymm1, rsi
+    ; Shift count in the low quadword
+    vmovq xmm1, rsi
     
     ; Shift left
-    vpsllq ymm2, ymm0, ymm1
+    vpsllq ymm2, ymm0, xmm1
     
     ; Store result
     vmovupd [rdx], ymm2
@@ -693,11 +692,11 @@ simd_shr_i64:
     ; Load vector
     vmovupd ymm0, [rdi]
     
-    ; Create shift count vector
-    vpbroadcastq ymm1, rsi
+    ; Shift count in the low quadword
+    vmovq xmm1, rsi
     
     ; Shift right
-    vpsrlq ymm2, ymm0, ymm1
+    vpsrlq ymm2, ymm0, xmm1
     
     ; Store result
     vmovupd [rdx], ymm2
@@ -2,20 +2,15 @@
 ; Handles I/O devices, MMIO, and device drivers
 
 BITS 64
+
+%include "context.inc"
+
 SECTION .text
 
 ; External symbols
-extern vm_state
-extern memory_read
-extern memory_write
-extern interrupt_trigger
-
-; Constants
-%define VM_PC 0
-%define VM_FLAGS 16
-%define VM_GPRS 24
-%define VM_VREGS (VM_GPRS + 32 * 8)
-%define VM_PERF (VM_VREGS + 16 * 32)
+extern memory_read_body
+extern memory_write_body
+extern interrupt_trigger_body
 
 ; Device types
 %define DEV_CONSOLE 0
@@ -57,28 +52,6 @@ extern interrupt_trigger
 %define SERIAL_CONTROL 0x10
 %define SERIAL_BAUD 0x18
 
-; Device structure
-struc device
-    .type: resb 1           ; Device type
-    .base_addr: resq 1      ; MMIO base address
-    .size: resq 1           ; Device size
-    .handler: resq 1        ; Device handler function
-    .data: resq 1           ; Device-specific data
-    .enabled: resb 1        ; Device enabled flag
-    .irq: resb 1            ; IRQ number
-    .reserved: resb 5       ; Alignment
-endstruc
-
-; Device state
-struc device_state
-    .devices: resb device_size * 8  ; 8 devices
-    .mmio_handlers: resq 64         ; MMIO handler functions
-    .mmio_ranges: resq 64 * 2       ; MMIO address ranges
-    .num_devices: resd 1            ; Number of registered devices
-    .reserved: resd 1               ; Alignment
-    .stats: resq 8                  ; Device statistics
-endstruc
-
 ; Global symbols
 global device_init
 global device_register
@@ -90,15 +63,6 @@ global device_io_write
 global mmio_read
 global mmio_write
 
-SECTION .bss
-align 64
-device_state: resb device_state_size
-console_buffer: resb 1024  ; Console input/output buffer
-timer_counter: resq 1      ; Timer counter
-keyboard_buffer: resb 256  ; Keyboard input buffer
-keyboard_head: resd 1      ; Keyboard buffer head
-keyboard_tail: resd 1      ; Keyboard buffer tail
-
 SECTION .data
 align 64
 ; Device statistics indices
@@ -113,89 +77,84 @@ align 64
 
 SECTION .text
 
+; Install MMIO range %1, [%2, %2 + 0x1000), served by %3 and %4; RBX and
+; R12 point at the handler and range tables. Clobbers RAX.
+%macro MMIO_RANGE 4
+    lea rax, [%3]
+    mov [rbx + %1 * 16], rax
+    lea rax, [%4]
+    mov [rbx + %1 * 16 + 8], rax
+    mov rax, %2
+    mov [r12 + %1 * 16], rax
+    add rax, 0x1000
+    mov [r12 + %1 * 16 + 8], rax
+%endmacro
+
 ; Initialize device subsystem
 global device_init
-device_init:
+global device_init_body:function hidden
+CONTEXT_ENTRY device_init
+device_init_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
     
     ; Clear device state
-    lea rdi, [device_state]
+    lea rdi, [r13 + CTX_DEVICES]
     xor eax, eax
     mov ecx, device_state_size / 8
     rep stosq
     
     ; Clear device buffers
-    lea rdi, [console_buffer]
+    lea rdi, [r13 + CTX_DEVICES + device_state.console_buffer]
     xor eax, eax
     mov ecx, 1024 / 8
     rep stosq
     
-    lea rdi, [keyboard_buffer]
+    lea rdi, [r13 + CTX_DEVICES + device_state.keyboard_buffer]
     mov ecx, 256 / 8
     rep stosq
     
     ; Initialize timer counter
-    mov qword [timer_counter], 0
+    mov qword [r13 + CTX_DEVICES + device_state.timer_counter], 0
     
     ; Initialize keyboard buffer pointers
-    mov dword [keyboard_head], 0
-    mov dword [keyboard_tail], 0
+    mov dword [r13 + CTX_DEVICES + device_state.keyboard_head], 0
+    mov dword [r13 + CTX_DEVICES + device_state.keyboard_tail], 0
     
     ; Register default devices
     mov rdi, DEV_CONSOLE
     mov rsi, CONSOLE_BASE
     mov rdx, 0x1000
     lea rcx, [console_handler]
-    call device_register
+    call device_register_body
     
     mov rdi, DEV_TIMER
     mov rsi, TIMER_BASE
     mov rdx, 0x1000
     lea rcx, [timer_handler]
-    call device_register
+    call device_register_body
     
     mov rdi, DEV_KEYBOARD
     mov rsi, KEYBOARD_BASE
     mov rdx, 0x1000
     lea rcx, [keyboard_handler]
-    call device_register
+    call device_register_body
     
     mov rdi, DEV_SERIAL
     mov rsi, SERIAL_BASE
     mov rdx, 0x1000
     lea rcx, [serial_handler]
-    call device_register
+    call device_register_body
     
     ; Set up MMIO handlers
-    lea rbx, [device_state + device_state.mmio_handlers]
-    lea r12, [device_state + device_state.mmio_ranges]
-    
-    ; Console MMIO
-    mov qword [rbx + 0 * 8], console_mmio_read
-    mov qword [rbx + 1 * 8], console_mmio_write
-    mov qword [r12 + 0 * 16], CONSOLE_BASE
-    mov qword [r12 + 0 * 16 + 8], CONSOLE_BASE + 0x1000
-    
-    ; Timer MMIO
-    mov qword [rbx + 2 * 8], timer_mmio_read
-    mov qword [rbx + 3 * 8], timer_mmio_write
-    mov qword [r12 + 1 * 16], TIMER_BASE
-    mov qword [r12 + 1 * 16 + 8], TIMER_BASE + 0x1000
-    
-    ; Keyboard MMIO
-    mov qword [rbx + 4 * 8], keyboard_mmio_read
-    mov qword [rbx + 5 * 8], keyboard_mmio_write
-    mov qword [r12 + 2 * 16], KEYBOARD_BASE
-    mov qword [r12 + 2 * 16 + 8], KEYBOARD_BASE + 0x1000
-    
-    ; Serial MMIO
-    mov qword [rbx + 6 * 8], serial_mmio_read
-    mov qword [rbx + 7 * 8], serial_mmio_write
-    mov qword [r12 + 3 * 16], SERIAL_BASE
-    mov qword [r12 + 3 * 16 + 8], SERIAL_BASE + 0x1000
+    lea rbx, [r13 + CTX_DEVICES + device_state.mmio_handlers]
+    lea r12, [r13 + CTX_DEVICES + device_state.mmio_ranges]
+    MMIO_RANGE 0, CONSOLE_BASE, console_mmio_read, console_mmio_write
+    MMIO_RANGE 1, TIMER_BASE, timer_mmio_read, timer_mmio_write
+    MMIO_RANGE 2, KEYBOARD_BASE, keyboard_mmio_read, keyboard_mmio_write
+    MMIO_RANGE 3, SERIAL_BASE, serial_mmio_read, serial_mmio_write
     
     xor eax, eax
     pop r12
@@ -207,33 +166,36 @@ device_init:
 ; Input: RDI = device type, RSI = base address, RDX = size, RCX = handler
 ; Output: RAX = device ID (0-7) or -1 on error
 global device_register
-device_register:
+global device_register_body:function hidden
+CONTEXT_ENTRY device_register
+device_register_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Device type
-    mov r13, rsi  ; Base address
+    mov r15, rsi  ; Base address
     mov r14, rcx  ; Handler
     
     ; Check if we have room for another device
-    lea rbx, [device_state + device_state.num_devices]
+    lea rbx, [r13 + CTX_DEVICES + device_state.num_devices]
     mov eax, [rbx]
     cmp eax, 8
     jae .error
     
     ; Find free device slot
-    lea rbx, [device_state + device_state.devices]
+    lea rbx, [r13 + CTX_DEVICES + device_state.devices]
     mov ecx, 0
     
 .find_slot:
     cmp ecx, 8
     jae .error
     
-    lea rdi, [rbx + rcx * device_size]
+    imul rdi, rcx, device_size
+    add rdi, rbx
     cmp byte [rdi + device.enabled], 0
     je .found_slot
     
@@ -243,7 +205,7 @@ device_register:
 .found_slot:
     ; Register device
     mov byte [rdi + device.type], r12b
-    mov [rdi + device.base_addr], r13
+    mov [rdi + device.base_addr], r15
     mov [rdi + device.size], rdx
     mov [rdi + device.handler], r14
     mov qword [rdi + device.data], 0
@@ -251,7 +213,7 @@ device_register:
     mov byte [rdi + device.irq], 0
     
     ; Increment device count
-    lea rbx, [device_state + device_state.num_devices]
+    lea rbx, [r13 + CTX_DEVICES + device_state.num_devices]
     inc dword [rbx]
     
     ; Return device ID
@@ -263,7 +225,7 @@ device_register:
     
 .done:
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -273,7 +235,9 @@ device_register:
 ; Input: RDI = device ID
 ; Output: RAX = 0 on success, -1 on error
 global device_unregister
-device_unregister:
+global device_unregister_body:function hidden
+CONTEXT_ENTRY device_unregister
+device_unregister_body:
     push rbp
     mov rbp, rsp
     push rbx
@@ -283,8 +247,9 @@ device_unregister:
     jae .error
     
     ; Get device
-    lea rbx, [device_state + device_state.devices]
-    lea rdi, [rbx + rdi * device_size]
+    lea rbx, [r13 + CTX_DEVICES + device_state.devices]
+    imul rdi, rdi, device_size
+    add rdi, rbx
     
     ; Check if device is enabled
     cmp byte [rdi + device.enabled], 0
@@ -294,7 +259,7 @@ device_unregister:
     mov byte [rdi + device.enabled], 0
     
     ; Decrement device count
-    lea rbx, [device_state + device_state.num_devices]
+    lea rbx, [r13 + CTX_DEVICES + device_state.num_devices]
     dec dword [rbx]
     
     xor eax, eax
@@ -312,17 +277,17 @@ device_unregister:
 ; Input: RDI = device ID, RSI = offset, RDX = buffer, RCX = size
 ; Output: RAX = bytes read or error code
 global device_read
-device_read:
+global device_read_body:function hidden
+CONTEXT_ENTRY device_read
+device_read_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
     push r14
     push r15
     
     mov r12, rdi  ; Device ID
-    mov r13, rsi  ; Offset
     mov r14, rdx  ; Buffer
     mov r15, rcx  ; Size
     
@@ -331,27 +296,27 @@ device_read:
     jae .error
     
     ; Get device
-    lea rbx, [device_state + device_state.devices]
-    lea rdi, [rbx + r12 * device_size]
+    lea rbx, [r13 + CTX_DEVICES + device_state.devices]
+    imul rdi, r12, device_size
+    add rdi, rbx
     
     ; Check if device is enabled
     cmp byte [rdi + device.enabled], 0
     je .error
     
     ; Check offset range
-    cmp r13, [rdi + device.size]
+    cmp rsi, [rdi + device.size]
     jae .error
     
     ; Call device handler
     mov rax, [rdi + device.handler]
     mov rdi, r12  ; Device ID
-    mov rsi, r13  ; Offset
     mov rdx, r14  ; Buffer
     mov rcx, r15  ; Size
     call rax
     
     ; Update statistics
-    lea rbx, [device_state + device_state.stats]
+    lea rbx, [r13 + CTX_DEVICES + device_state.stats]
     inc qword [rbx + STAT_DEVICE_READS * 8]
     add [rbx + STAT_BYTES_READ * 8], rax
     
@@ -361,13 +326,12 @@ device_read:
     mov eax, -1
     
     ; Update error statistics
-    lea rbx, [device_state + device_state.stats]
+    lea rbx, [r13 + CTX_DEVICES + device_state.stats]
     inc qword [rbx + STAT_ERRORS * 8]
     
 .done:
     pop r15
     pop r14
-    pop r13
     pop r12
     pop rbx
     pop rbp
@@ -377,17 +341,17 @@ device_read:
 ; Input: RDI = device ID, RSI = offset, RDX = buffer, RCX = size
 ; Output: RAX = bytes written or error code
 global device_write
-device_write:
+global device_write_body:function hidden
+CONTEXT_ENTRY device_write
+device_write_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
     push r14
     push r15
     
     mov r12, rdi  ; Device ID
-    mov r13, rsi  ; Offset
     mov r14, rdx  ; Buffer
     mov r15, rcx  ; Size
     
@@ -396,27 +360,27 @@ device_write:
     jae .error
     
     ; Get device
-    lea rbx, [device_state + device_state.devices]
-    lea rdi, [rbx + r12 * device_size]
+    lea rbx, [r13 + CTX_DEVICES + device_state.devices]
+    imul rdi, r12, device_size
+    add rdi, rbx
     
     ; Check if device is enabled
     cmp byte [rdi + device.enabled], 0
     je .error
     
     ; Check offset range
-    cmp r13, [rdi + device.size]
+    cmp rsi, [rdi + device.size]
     jae .error
     
     ; Call device handler
     mov rax, [rdi + device.handler]
     mov rdi, r12  ; Device ID
-    mov rsi, r13  ; Offset
     mov rdx, r14  ; Buffer
     mov rcx, r15  ; Size
     call rax
     
     ; Update statistics
-    lea rbx, [device_state + device_state.stats]
+    lea rbx, [r13 + CTX_DEVICES + device_state.stats]
     inc qword [rbx + STAT_DEVICE_WRITES * 8]
     add [rbx + STAT_BYTES_WRITTEN * 8], rax
     
@@ -426,13 +390,12 @@ device_write:
     mov eax, -1
     
     ; Update error statistics
-    lea rbx, [device_state + device_state.stats]
+    lea rbx, [r13 + CTX_DEVICES + device_state.stats]
     inc qword [rbx + STAT_ERRORS * 8]
     
 .done:
     pop r15
     pop r14
-    pop r13
     pop r12
     pop rbx
     pop rbp
@@ -442,23 +405,25 @@ device_write:
 ; Input: RDI = port number, RSI = buffer, RDX = size
 ; Output: RAX = bytes read or error code
 global device_io_read
-device_io_read:
+global device_io_read_body:function hidden
+CONTEXT_ENTRY device_io_read
+device_io_read_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Port number
-    mov r13, rsi  ; Buffer
+    mov r15, rsi  ; Buffer
     mov r14, rdx  ; Size
     
     ; For now, just return 0 (no I/O ports implemented)
     xor eax, eax
     
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -468,23 +433,25 @@ device_io_read:
 ; Input: RDI = port number, RSI = buffer, RDX = size
 ; Output: RAX = bytes written or error code
 global device_io_write
-device_io_write:
+global device_io_write_body:function hidden
+CONTEXT_ENTRY device_io_write
+device_io_write_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Port number
-    mov r13, rsi  ; Buffer
+    mov r15, rsi  ; Buffer
     mov r14, rdx  ; Size
     
     ; For now, just return size (all bytes written)
     mov rax, r14
     
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -494,34 +461,36 @@ device_io_write:
 ; Input: RDI = address, RSI = buffer, RDX = size
 ; Output: RAX = bytes read or error code
 global mmio_read
-mmio_read:
+global mmio_read_body:function hidden
+CONTEXT_ENTRY mmio_read
+mmio_read_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
     push r14
     push r15
     
     mov r12, rdi  ; Address
-    mov r13, rsi  ; Buffer
     mov r14, rdx  ; Size
     
-    ; Check if address is in MMIO range
-    cmp r12, MMIO_BASE
-    jb .error
+    ; Check if address is in MMIO range (the upper half, MMIO_BASE = 1 << 63)
+    test r12, r12
+    jns .error
     
     ; Find MMIO handler
-    lea rbx, [device_state + device_state.mmio_ranges]
-    lea r15, [device_state + device_state.mmio_handlers]
+    lea rbx, [r13 + CTX_DEVICES + device_state.mmio_ranges]
+    lea r15, [r13 + CTX_DEVICES + device_state.mmio_handlers]
     mov ecx, 0
     
 .find_handler:
     cmp ecx, 64
     jae .error
     
-    mov rax, [rbx + rcx * 16]      ; Range start
-    mov rdx, [rbx + rcx * 16 + 8]  ; Range end
+    mov r8, rcx
+    shl r8, 4                      ; Ranges and handler pairs are 16 bytes
+    mov rax, [rbx + r8]            ; Range start
+    mov rdx, [rbx + r8 + 8]        ; Range end
     
     cmp r12, rax
     jb .next_handler
@@ -529,18 +498,17 @@ mmio_read:
     jae .next_handler
     
     ; Found handler
-    mov rax, [r15 + rcx * 8]
+    mov rax, [r15 + r8]           ; Read handler
     test rax, rax
     jz .error
     
     ; Call handler
     mov rdi, r12  ; Address
-    mov rsi, r13  ; Buffer
     mov rdx, r14  ; Size
     call rax
     
     ; Update statistics
-    lea rbx, [device_state + device_state.stats]
+    lea rbx, [r13 + CTX_DEVICES + device_state.stats]
     inc qword [rbx + STAT_MMIO_READS * 8]
     add [rbx + STAT_BYTES_READ * 8], rax
     
@@ -554,13 +522,12 @@ mmio_read:
     mov eax, -1
     
     ; Update error statistics
-    lea rbx, [device_state + device_state.stats]
+    lea rbx, [r13 + CTX_DEVICES + device_state.stats]
     inc qword [rbx + STAT_ERRORS * 8]
     
 .done:
     pop r15
     pop r14
-    pop r13
     pop r12
     pop rbx
     pop rbp
@@ -570,34 +537,36 @@ mmio_read:
 ; Input: RDI = address, RSI = buffer, RDX = size
 ; Output: RAX = bytes written or error code
 global mmio_write
-mmio_write:
+global mmio_write_body:function hidden
+CONTEXT_ENTRY mmio_write
+mmio_write_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
     push r14
     push r15
     
     mov r12, rdi  ; Address
-    mov r13, rsi  ; Buffer
     mov r14, rdx  ; Size
     
-    ; Check if address is in MMIO range
-    cmp r12, MMIO_BASE
-    jb .error
+    ; Check if address is in MMIO range (the upper half, MMIO_BASE = 1 << 63)
+    test r12, r12
+    jns .error
     
     ; Find MMIO handler
-    lea rbx, [device_state + device_state.mmio_ranges]
-    lea r15, [device_state + device_state.mmio_handlers]
+    lea rbx, [r13 + CTX_DEVICES + device_state.mmio_ranges]
+    lea r15, [r13 + CTX_DEVICES + device_state.mmio_handlers]
     mov ecx, 0
     
 .find_handler:
     cmp ecx, 64
     jae .error
     
-    mov rax, [rbx + rcx * 16]      ; Range start
-    mov rdx, [rbx + rcx * 16 + 8]  ; Range end
+    mov r8, rcx
+    shl r8, 4                      ; Ranges and handler pairs are 16 bytes
+    mov rax, [rbx + r8]            ; Range start
+    mov rdx, [rbx + r8 + 8]        ; Range end
     
     cmp r12, rax
     jb .next_handler
@@ -605,18 +574,17 @@ mmio_write:
     jae .next_handler
     
     ; Found handler
-    mov rax, [r15 + rcx * 8 + 8]  ; Write handler
+    mov rax, [r15 + r8 + 8]       ; Write handler
     test rax, rax
     jz .error
     
     ; Call handler
     mov rdi, r12  ; Address
-    mov rsi, r13  ; Buffer
     mov rdx, r14  ; Size
     call rax
     
     ; Update statistics
-    lea rbx, [device_state + device_state.stats]
+    lea rbx, [r13 + CTX_DEVICES + device_state.stats]
     inc qword [rbx + STAT_MMIO_WRITES * 8]
     add [rbx + STAT_BYTES_WRITTEN * 8], rax
     
@@ -630,13 +598,12 @@ mmio_write:
     mov eax, -1
     
     ; Update error statistics
-    lea rbx, [device_state + device_state.stats]
+    lea rbx, [r13 + CTX_DEVICES + device_state.stats]
     inc qword [rbx + STAT_ERRORS * 8]
     
 .done:
     pop r15
     pop r14
-    pop r13
     pop r12
     pop rbx
     pop rbp
@@ -650,21 +617,21 @@ console_handler:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r11
     push r14
     push r15
     
     mov r12, rdi  ; Device ID
-    mov r13, rsi  ; Offset
+    mov r11, rsi  ; Offset
     mov r14, rdx  ; Buffer
     mov r15, rcx  ; Size
     
     ; Handle different offsets
-    cmp r13, CONSOLE_DATA
+    cmp r11, CONSOLE_DATA
     je .data
-    cmp r13, CONSOLE_STATUS
+    cmp r11, CONSOLE_STATUS
     je .status
-    cmp r13, CONSOLE_CONTROL
+    cmp r11, CONSOLE_CONTROL
     je .control
     
     ; Unknown offset
@@ -678,8 +645,8 @@ console_handler:
     
     ; For now, just copy data
     mov rdi, r14
-    lea rsi, [console_buffer]
-    add rsi, r13
+    lea rsi, [r13 + CTX_DEVICES + device_state.console_buffer]
+    add rsi, r11
     mov rcx, r15
     rep movsb
     
@@ -700,7 +667,7 @@ console_handler:
 .done:
     pop r15
     pop r14
-    pop r13
+    pop r11
     pop r12
     pop rbx
     pop rbp
@@ -712,23 +679,23 @@ timer_handler:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r11
     push r14
     push r15
     
     mov r12, rdi  ; Device ID
-    mov r13, rsi  ; Offset
+    mov r11, rsi  ; Offset
     mov r14, rdx  ; Buffer
     mov r15, rcx  ; Size
     
     ; Handle different offsets
-    cmp r13, TIMER_COUNTER
+    cmp r11, TIMER_COUNTER
     je .counter
-    cmp r13, TIMER_COMPARE
+    cmp r11, TIMER_COMPARE
     je .compare
-    cmp r13, TIMER_CONTROL
+    cmp r11, TIMER_CONTROL
     je .control
-    cmp r13, TIMER_STATUS
+    cmp r11, TIMER_STATUS
     je .status
     
     ; Unknown offset
@@ -737,7 +704,7 @@ timer_handler:
     
 .counter:
     ; Read/write timer counter
-    mov rax, [timer_counter]
+    mov rax, [r13 + CTX_DEVICES + device_state.timer_counter]
     mov [r14], rax
     mov rax, 8
     jmp .done
@@ -762,7 +729,7 @@ timer_handler:
 .done:
     pop r15
     pop r14
-    pop r13
+    pop r11
     pop r12
     pop rbx
     pop rbp
@@ -774,21 +741,21 @@ keyboard_handler:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r11
     push r14
     push r15
     
     mov r12, rdi  ; Device ID
-    mov r13, rsi  ; Offset
+    mov r11, rsi  ; Offset
     mov r14, rdx  ; Buffer
     mov r15, rcx  ; Size
     
     ; Handle different offsets
-    cmp r13, KEYBOARD_DATA
+    cmp r11, KEYBOARD_DATA
     je .data
-    cmp r13, KEYBOARD_STATUS
+    cmp r11, KEYBOARD_STATUS
     je .status
-    cmp r13, KEYBOARD_CONTROL
+    cmp r11, KEYBOARD_CONTROL
     je .control
     
     ; Unknown offset
@@ -797,18 +764,18 @@ keyboard_handler:
     
 .data:
     ; Read keyboard data
-    mov eax, [keyboard_head]
-    cmp eax, [keyboard_tail]
+    mov eax, [r13 + CTX_DEVICES + device_state.keyboard_head]
+    cmp eax, [r13 + CTX_DEVICES + device_state.keyboard_tail]
     je .no_data
     
     ; Read from buffer
-    lea rbx, [keyboard_buffer]
+    lea rbx, [r13 + CTX_DEVICES + device_state.keyboard_buffer]
     movzx eax, byte [rbx + rax]
     mov [r14], rax
     
     ; Increment head
-    inc dword [keyboard_head]
-    and dword [keyboard_head], 0xFF
+    inc dword [r13 + CTX_DEVICES + device_state.keyboard_head]
+    and dword [r13 + CTX_DEVICES + device_state.keyboard_head], 0xFF
     
     mov rax, 1
     jmp .done
@@ -819,8 +786,8 @@ keyboard_handler:
     
 .status:
     ; Read keyboard status
-    mov eax, [keyboard_head]
-    cmp eax, [keyboard_tail]
+    mov eax, [r13 + CTX_DEVICES + device_state.keyboard_head]
+    cmp eax, [r13 + CTX_DEVICES + device_state.keyboard_tail]
     setne al
     movzx rax, al
     mov [r14], rax
@@ -835,7 +802,7 @@ keyboard_handler:
 .done:
     pop r15
     pop r14
-    pop r13
+    pop r11
     pop r12
     pop rbx
     pop rbp
@@ -847,23 +814,23 @@ serial_handler:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r11
     push r14
     push r15
     
     mov r12, rdi  ; Device ID
-    mov r13, rsi  ; Offset
+    mov r11, rsi  ; Offset
     mov r14, rdx  ; Buffer
     mov r15, rcx  ; Size
     
     ; Handle different offsets
-    cmp r13, SERIAL_DATA
+    cmp r11, SERIAL_DATA
     je .data
-    cmp r13, SERIAL_STATUS
+    cmp r11, SERIAL_STATUS
     je .status
-    cmp r13, SERIAL_CONTROL
+    cmp r11, SERIAL_CONTROL
     je .control
-    cmp r13, SERIAL_BAUD
+    cmp r11, SERIAL_BAUD
     je .baud
     
     ; Unknown offset
@@ -896,7 +863,7 @@ serial_handler:
 .done:
     pop r15
     pop r14
-    pop r13
+    pop r11
     pop r12
     pop rbx
     pop rbp
@@ -910,15 +877,16 @@ console_mmio_read:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Address
-    mov r13, rsi  ; Buffer
+    mov r15, rsi  ; Buffer
     mov r14, rdx  ; Size
     
     ; Calculate offset
-    sub r12, CONSOLE_BASE
+    mov rax, CONSOLE_BASE
+    sub r12, rax
     
     ; Handle different offsets
     cmp r12, CONSOLE_DATA
@@ -934,24 +902,24 @@ console_mmio_read:
     
 .data:
     ; Read console data
-    mov qword [r13], 0x00  ; No data
+    mov qword [r15], 0x00  ; No data
     mov rax, 8
     jmp .done
     
 .status:
     ; Read console status
-    mov qword [r13], 0x01  ; Ready
+    mov qword [r15], 0x01  ; Ready
     mov rax, 8
     jmp .done
     
 .control:
     ; Read console control
-    mov qword [r13], 0x00  ; No special control
+    mov qword [r15], 0x00  ; No special control
     mov rax, 8
     
 .done:
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -963,15 +931,16 @@ console_mmio_write:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Address
-    mov r13, rsi  ; Buffer
+    mov r15, rsi  ; Buffer
     mov r14, rdx  ; Size
     
     ; Calculate offset
-    sub r12, CONSOLE_BASE
+    mov rax, CONSOLE_BASE
+    sub r12, rax
     
     ; Handle different offsets
     cmp r12, CONSOLE_DATA
@@ -1001,7 +970,7 @@ console_mmio_write:
     
 .done:
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -1013,15 +982,16 @@ timer_mmio_read:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Address
-    mov r13, rsi  ; Buffer
+    mov r15, rsi  ; Buffer
     mov r14, rdx  ; Size
     
     ; Calculate offset
-    sub r12, TIMER_BASE
+    mov rax, TIMER_BASE
+    sub r12, rax
     
     ; Handle different offsets
     cmp r12, TIMER_COUNTER
@@ -1039,31 +1009,31 @@ timer_mmio_read:
     
 .counter:
     ; Read timer counter
-    mov rax, [timer_counter]
-    mov [r13], rax
+    mov rax, [r13 + CTX_DEVICES + device_state.timer_counter]
+    mov [r15], rax
     mov rax, 8
     jmp .done
     
 .compare:
     ; Read timer compare value
-    mov qword [r13], 0x1000
+    mov qword [r15], 0x1000
     mov rax, 8
     jmp .done
     
 .control:
     ; Read timer control
-    mov qword [r13], 0x01
+    mov qword [r15], 0x01
     mov rax, 8
     jmp .done
     
 .status:
     ; Read timer status
-    mov qword [r13], 0x00
+    mov qword [r15], 0x00
     mov rax, 8
     
 .done:
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -1075,15 +1045,16 @@ timer_mmio_write:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Address
-    mov r13, rsi  ; Buffer
+    mov r15, rsi  ; Buffer
     mov r14, rdx  ; Size
     
     ; Calculate offset
-    sub r12, TIMER_BASE
+    mov rax, TIMER_BASE
+    sub r12, rax
     
     ; Handle different offsets
     cmp r12, TIMER_COUNTER
@@ -1101,8 +1072,8 @@ timer_mmio_write:
     
 .counter:
     ; Write timer counter
-    mov rax, [r13]
-    mov [timer_counter], rax
+    mov rax, [r15]
+    mov [r13 + CTX_DEVICES + device_state.timer_counter], rax
     mov rax, r14
     jmp .done
     
@@ -1122,7 +1093,7 @@ timer_mmio_write:
     
 .done:
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -1134,15 +1105,16 @@ keyboard_mmio_read:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Address
-    mov r13, rsi  ; Buffer
+    mov r15, rsi  ; Buffer
     mov r14, rdx  ; Size
     
     ; Calculate offset
-    sub r12, KEYBOARD_BASE
+    mov rax, KEYBOARD_BASE
+    sub r12, rax
     
     ; Handle different offsets
     cmp r12, KEYBOARD_DATA
@@ -1158,43 +1130,43 @@ keyboard_mmio_read:
     
 .data:
     ; Read keyboard data
-    mov eax, [keyboard_head]
-    cmp eax, [keyboard_tail]
+    mov eax, [r13 + CTX_DEVICES + device_state.keyboard_head]
+    cmp eax, [r13 + CTX_DEVICES + device_state.keyboard_tail]
     je .no_data
     
-    lea rbx, [keyboard_buffer]
+    lea rbx, [r13 + CTX_DEVICES + device_state.keyboard_buffer]
     movzx eax, byte [rbx + rax]
-    mov [r13], rax
+    mov [r15], rax
     
-    inc dword [keyboard_head]
-    and dword [keyboard_head], 0xFF
+    inc dword [r13 + CTX_DEVICES + device_state.keyboard_head]
+    and dword [r13 + CTX_DEVICES + device_state.keyboard_head], 0xFF
     
     mov rax, 8
     jmp .done
     
 .no_data:
-    mov qword [r13], 0x00
+    mov qword [r15], 0x00
     mov rax, 8
     jmp .done
     
 .status:
     ; Read keyboard status
-    mov eax, [keyboard_head]
-    cmp eax, [keyboard_tail]
+    mov eax, [r13 + CTX_DEVICES + device_state.keyboard_head]
+    cmp eax, [r13 + CTX_DEVICES + device_state.keyboard_tail]
     setne al
     movzx rax, al
-    mov [r13], rax
+    mov [r15], rax
     mov rax, 8
     jmp .done
     
 .control:
     ; Read keyboard control
-    mov qword [r13], 0x01
+    mov qword [r15], 0x01
     mov rax, 8
     
 .done:
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -1206,15 +1178,16 @@ keyboard_mmio_write:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Address
-    mov r13, rsi  ; Buffer
+    mov r15, rsi  ; Buffer
     mov r14, rdx  ; Size
     
     ; Calculate offset
-    sub r12, KEYBOARD_BASE
+    mov rax, KEYBOARD_BASE
+    sub r12, rax
     
     ; Handle different offsets
     cmp r12, KEYBOARD_DATA
@@ -1244,7 +1217,7 @@ keyboard_mmio_write:
     
 .done:
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -1256,15 +1229,16 @@ serial_mmio_read:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Address
-    mov r13, rsi  ; Buffer
+    mov r15, rsi  ; Buffer
     mov r14, rdx  ; Size
     
     ; Calculate offset
-    sub r12, SERIAL_BASE
+    mov rax, SERIAL_BASE
+    sub r12, rax
     
     ; Handle different offsets
     cmp r12, SERIAL_DATA
@@ -1282,30 +1256,30 @@ serial_mmio_read:
     
 .data:
     ; Read serial data
-    mov qword [r13], 0x00
+    mov qword [r15], 0x00
     mov rax, 8
     jmp .done
     
 .status:
     ; Read serial status
-    mov qword [r13], 0x01
+    mov qword [r15], 0x01
     mov rax, 8
     jmp .done
     
 .control:
     ; Read serial control
-    mov qword [r13], 0x01
+    mov qword [r15], 0x01
     mov rax, 8
     jmp .done
     
 .baud:
     ; Read baud rate
-    mov qword [r13], 115200
+    mov qword [r15], 115200
     mov rax, 8
     
 .done:
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -1317,15 +1291,16 @@ serial_mmio_write:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Address
-    mov r13, rsi  ; Buffer
+    mov r15, rsi  ; Buffer
     mov r14, rdx  ; Size
     
     ; Calculate offset
-    sub r12, SERIAL_BASE
+    mov rax, SERIAL_BASE
+    sub r12, rax
     
     ; Handle different offsets
     cmp r12, SERIAL_DATA
@@ -1362,7 +1337,7 @@ serial_mmio_write:
     
 .done:
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
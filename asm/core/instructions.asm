@@ -2,10 +2,12 @@
 ; Handles instruction decoding and execution
 
 BITS 64
+
+%include "context.inc"
+
 SECTION .text
 
 ; External symbols
-extern vm_state
 extern alu_add
 extern alu_sub
 extern alu_mul
@@ -21,16 +23,11 @@ extern alu_rol
 extern alu_ror
 extern alu_cmp
 extern alu_test
-extern memory_read
-extern memory_write
-extern interrupt_trigger
-
-; Constants
-%define VM_PC 0
-%define VM_FLAGS 16
-%define VM_GPRS 24
-%define VM_VREGS (VM_GPRS + 32 * 8)
-%define VM_PERF (VM_VREGS + 16 * 32)
+extern memory_read_body
+extern memory_write_body
+extern memory_load64_body
+extern memory_store64_body
+extern interrupt_trigger_body
 
 ; Instruction opcodes
 %define OP_ADD 0x00
@@ -121,12 +118,11 @@ execute_instruction:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
     push r14
     push r15
+    push rsi      ; rd, kept in [rbp - 40] (R13 is the context)
     
     mov r12, rdi  ; Opcode
-    mov r13, rsi  ; rd
     mov r14, rdx  ; rs1
     mov r15, rcx  ; rs2
     mov rbx, r8   ; immediate
@@ -203,8 +199,8 @@ execute_instruction:
 .add:
     mov rdi, r14
     mov rsi, r15
-    call alu_add
-    mov rdi, r13
+    call alu_add wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
@@ -212,8 +208,8 @@ execute_instruction:
 .sub:
     mov rdi, r14
     mov rsi, r15
-    call alu_sub
-    mov rdi, r13
+    call alu_sub wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
@@ -221,8 +217,8 @@ execute_instruction:
 .mul:
     mov rdi, r14
     mov rsi, r15
-    call alu_mul
-    mov rdi, r13
+    call alu_mul wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
@@ -230,8 +226,8 @@ execute_instruction:
 .div:
     mov rdi, r14
     mov rsi, r15
-    call alu_div
-    mov rdi, r13
+    call alu_div wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
@@ -239,8 +235,8 @@ execute_instruction:
 .and:
     mov rdi, r14
     mov rsi, r15
-    call alu_and
-    mov rdi, r13
+    call alu_and wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
@@ -248,8 +244,8 @@ execute_instruction:
 .or:
     mov rdi, r14
     mov rsi, r15
-    call alu_or
-    mov rdi, r13
+    call alu_or wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
@@ -257,16 +253,16 @@ execute_instruction:
 .xor:
     mov rdi, r14
     mov rsi, r15
-    call alu_xor
-    mov rdi, r13
+    call alu_xor wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
     
 .not:
     mov rdi, r14
-    call alu_not
-    mov rdi, r13
+    call alu_not wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
@@ -274,8 +270,8 @@ execute_instruction:
 .shl:
     mov rdi, r14
     mov rsi, r15
-    call alu_shl
-    mov rdi, r13
+    call alu_shl wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
@@ -283,8 +279,8 @@ execute_instruction:
 .shr:
     mov rdi, r14
     mov rsi, r15
-    call alu_shr
-    mov rdi, r13
+    call alu_shr wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
@@ -292,8 +288,8 @@ execute_instruction:
 .sar:
     mov rdi, r14
     mov rsi, r15
-    call alu_sar
-    mov rdi, r13
+    call alu_sar wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
@@ -301,8 +297,8 @@ execute_instruction:
 .rol:
     mov rdi, r14
     mov rsi, r15
-    call alu_rol
-    mov rdi, r13
+    call alu_rol wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
@@ -310,8 +306,8 @@ execute_instruction:
 .ror:
     mov rdi, r14
     mov rsi, r15
-    call alu_ror
-    mov rdi, r13
+    call alu_ror wrt ..plt
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
@@ -319,36 +315,32 @@ execute_instruction:
 .cmp:
     mov rdi, r14
     mov rsi, r15
-    call alu_cmp
+    call alu_cmp wrt ..plt
     jmp .success
     
 .test:
     mov rdi, r14
     mov rsi, r15
-    call alu_test
+    call alu_test wrt ..plt
     jmp .success
     
 .ld:
-    ; Load from memory
+    ; Load from memory (fast TLB first)
     mov rdi, r14  ; Address
-    lea rsi, [rsp - 8]  ; Buffer
-    mov rdx, 8  ; Size
-    call memory_read
-    test rax, rax
+    call memory_load64_body
+    test edx, edx
     jnz .error
     
-    mov rax, [rsp - 8]
-    mov rdi, r13
+    mov rdi, [rbp - 40]
     mov rsi, rax
     call set_register_value
     jmp .success
     
 .st:
-    ; Store to memory
+    ; Store to memory (fast TLB first)
     mov rdi, r14  ; Address
-    lea rsi, [r15]  ; Data
-    mov rdx, 8  ; Size
-    call memory_write
+    mov rsi, r15  ; Value
+    call memory_store64_body
     test rax, rax
     jnz .error
     jmp .success
@@ -359,7 +351,7 @@ execute_instruction:
     test al, 1  ; Zero flag
     jz .success
     ; Update PC
-    lea rbx, [vm_state]
+    mov rbx, r13
     add qword [rbx + VM_PC], rbx
     jmp .success
     
@@ -369,7 +361,7 @@ execute_instruction:
     test al, 1  ; Zero flag
     jnz .success
     ; Update PC
-    lea rbx, [vm_state]
+    mov rbx, r13
     add qword [rbx + VM_PC], rbx
     jmp .success
     
@@ -379,7 +371,7 @@ execute_instruction:
     test al, 8  ; Negative flag
     jz .success
     ; Update PC
-    lea rbx, [vm_state]
+    mov rbx, r13
     add qword [rbx + VM_PC], rbx
     jmp .success
     
@@ -389,19 +381,19 @@ execute_instruction:
     test al, 8  ; Negative flag
     jnz .success
     ; Update PC
-    lea rbx, [vm_state]
+    mov rbx, r13
     add qword [rbx + VM_PC], rbx
     jmp .success
     
 .jmp:
     ; Jump
-    lea rbx, [vm_state]
+    mov rbx, r13
     mov [rbx + VM_PC], r14
     jmp .success
     
 .call:
     ; Call function
-    lea rbx, [vm_state]
+    mov rbx, r13
     mov rax, [rbx + VM_PC]
     add rax, 4
     mov rdi, 31  ; Link register
@@ -414,19 +406,19 @@ execute_instruction:
     ; Return
     mov rdi, 31  ; Link register
     call get_register_value
-    lea rbx, [vm_state]
+    mov rbx, r13
     mov [rbx + VM_PC], rax
     jmp .success
     
 .syscall:
     ; System call
     mov rdi, 0x80  ; System call interrupt
-    call interrupt_trigger
+    call interrupt_trigger_body
     jmp .success
     
 .halt:
     ; Halt VM
-    lea rbx, [vm_state]
+    mov rbx, r13
     or byte [rbx + VM_FLAGS], 0x80
     jmp .success
     
@@ -442,9 +434,9 @@ execute_instruction:
     mov eax, -1
     
 .done:
+    add rsp, 8
     pop r15
     pop r14
-    pop r13
     pop r12
     pop rbx
     pop rbp
@@ -464,7 +456,7 @@ get_register_value:
     jz .zero
     
     ; Get register value
-    lea rbx, [vm_state]
+    mov rbx, r13
     mov rax, [rbx + VM_GPRS + rdi * 8]
     jmp .done
     
@@ -489,7 +481,7 @@ set_register_value:
     jz .done
     
     ; Set register value
-    lea rbx, [vm_state]
+    mov rbx, r13
     mov [rbx + VM_GPRS + rdi * 8], rsi
     
 .done:
@@ -505,7 +497,7 @@ get_flags:
     mov rbp, rsp
     push rbx
     
-    lea rbx, [vm_state]
+    mov rbx, r13
     mov al, [rbx + VM_FLAGS]
     
     pop rbx
@@ -520,7 +512,7 @@ set_flags:
     mov rbp, rsp
     push rbx
     
-    lea rbx, [vm_state]
+    mov rbx, r13
     mov [rbx + VM_FLAGS], al
     
     pop rbx
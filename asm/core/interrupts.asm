@@ -2,19 +2,18 @@
 ; Handles hardware interrupts, exceptions, and system calls
 
 BITS 64
+
+%include "context.inc"
+
 SECTION .text
 
 ; External symbols
-extern vm_state
-extern memory_read
-extern memory_write
+extern memory_read_body
+extern memory_write_body
+extern vm_raise_slow_work_body
 
-; Constants
-%define VM_PC 0
-%define VM_FLAGS 16
-%define VM_GPRS 24
-%define VM_VREGS (VM_GPRS + 32 * 8)
-%define VM_PERF (VM_VREGS + 16 * 32)
+; Slow-work bit polled by vm_run (matches vm.asm)
+%define SLOW_IRQ 0x04
 
 ; Interrupt types
 %define INT_SYSCALL 0x80
@@ -36,17 +35,6 @@ extern memory_write
 %define ERR_RESERVED 8
 %define ERR_FETCH 16
 
-; Interrupt descriptor table entry
-struc idt_entry
-    .offset_low: resw 1     ; Offset bits 0-15
-    .selector: resw 1       ; Code segment selector
-    .ist: resb 1            ; Interrupt stack table offset
-    .flags: resb 1          ; Type and attributes
-    .offset_mid: resw 1     ; Offset bits 16-31
-    .offset_high: resd 1    ; Offset bits 32-63
-    .reserved: resd 1       ; Reserved
-endstruc
-
 ; Interrupt frame (saved registers)
 struc interrupt_frame
     .rax: resq 1
@@ -73,16 +61,6 @@ struc interrupt_frame
     .padding: resq 1
 endstruc
 
-; Interrupt state
-struc interrupt_state
-    .idt: resb idt_entry_size * 256  ; Interrupt descriptor table
-    .handlers: resq 256              ; Interrupt handler pointers
-    .enabled: resb 1                 ; Interrupts enabled flag
-    .nested: resb 1                  ; Nested interrupt counter
-    .reserved: resb 6                ; Alignment
-    .stats: resq 256                 ; Interrupt statistics
-endstruc
-
 ; Global symbols
 global interrupt_init
 global interrupt_enable
@@ -93,11 +71,6 @@ global interrupt_dispatch
 global exception_handler
 global syscall_handler
 
-SECTION .bss
-align 64
-interrupt_state: resb interrupt_state_size
-interrupt_stack: resb 16384  ; 16KB interrupt stack
-
 SECTION .data
 align 64
 ; Default interrupt handlers
@@ -130,30 +103,32 @@ SECTION .text
 
 ; Initialize interrupt subsystem
 global interrupt_init
-interrupt_init:
+global interrupt_init_body:function hidden
+CONTEXT_ENTRY interrupt_init
+interrupt_init_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r14
     
     ; Clear interrupt state
-    lea rdi, [interrupt_state]
+    lea rdi, [r13 + CTX_INTERRUPTS]
     xor eax, eax
     mov ecx, interrupt_state_size / 8
     rep stosq
     
     ; Initialize IDT entries
-    lea rbx, [interrupt_state + interrupt_state.idt]
+    lea rbx, [r13 + CTX_INTERRUPTS + interrupt_state.idt]
     lea r12, [default_handlers]
-    mov r13, 0  ; Interrupt number
+    mov r14, 0  ; Interrupt number
     
 .init_idt:
-    cmp r13, 256
+    cmp r14, 256
     jae .setup_idt
     
     ; Get handler address
-    mov rax, [r12 + r13 * 8]
+    mov rax, [r12 + r14 * 8]
     
     ; Set up IDT entry
     mov [rbx + idt_entry.offset_low], ax
@@ -172,31 +147,31 @@ interrupt_init:
     mov byte [rbx + idt_entry.ist], 0
     
     ; Store handler pointer
-    lea rdi, [interrupt_state + interrupt_state.handlers]
-    mov [rdi + r13 * 8], rax
+    lea rdi, [r13 + CTX_INTERRUPTS + interrupt_state.handlers]
+    mov [rdi + r14 * 8], rax
     
     ; Next entry
     add rbx, idt_entry_size
-    inc r13
+    inc r14
     jmp .init_idt
     
 .setup_idt:
     ; Load IDT
-    lea rdi, [interrupt_state + interrupt_state.idt]
+    lea rdi, [r13 + CTX_INTERRUPTS + interrupt_state.idt]
     mov rsi, 256 * idt_entry_size - 1
     lidt [rdi]
     
     ; Enable interrupts
-    mov byte [interrupt_state + interrupt_state.enabled], 1
+    mov byte [r13 + CTX_INTERRUPTS + interrupt_state.enabled], 1
     
     ; Clear statistics
-    lea rdi, [interrupt_state + interrupt_state.stats]
+    lea rdi, [r13 + CTX_INTERRUPTS + interrupt_state.stats]
     xor eax, eax
     mov ecx, 256
     rep stosq
     
     xor eax, eax
-    pop r13
+    pop r14
     pop r12
     pop rbx
     pop rbp
@@ -204,12 +179,14 @@ interrupt_init:
 
 ; Enable interrupts
 global interrupt_enable
-interrupt_enable:
+global interrupt_enable_body:function hidden
+CONTEXT_ENTRY interrupt_enable
+interrupt_enable_body:
     push rbp
     mov rbp, rsp
     
     ; Set enabled flag
-    mov byte [interrupt_state + interrupt_state.enabled], 1
+    mov byte [r13 + CTX_INTERRUPTS + interrupt_state.enabled], 1
     
     ; Enable hardware interrupts
     sti
@@ -219,7 +196,9 @@ interrupt_enable:
 
 ; Disable interrupts
 global interrupt_disable
-interrupt_disable:
+global interrupt_disable_body:function hidden
+CONTEXT_ENTRY interrupt_disable
+interrupt_disable_body:
     push rbp
     mov rbp, rsp
     
@@ -227,7 +206,7 @@ interrupt_disable:
     cli
     
     ; Clear enabled flag
-    mov byte [interrupt_state + interrupt_state.enabled], 0
+    mov byte [r13 + CTX_INTERRUPTS + interrupt_state.enabled], 0
     
     pop rbp
     ret
@@ -235,7 +214,9 @@ interrupt_disable:
 ; Register interrupt handler
 ; Input: RDI = interrupt number, RSI = handler function
 global interrupt_register_handler
-interrupt_register_handler:
+global interrupt_register_handler_body:function hidden
+CONTEXT_ENTRY interrupt_register_handler
+interrupt_register_handler_body:
     push rbp
     mov rbp, rsp
     push rbx
@@ -245,11 +226,11 @@ interrupt_register_handler:
     jae .error
     
     ; Store handler
-    lea rbx, [interrupt_state + interrupt_state.handlers]
+    lea rbx, [r13 + CTX_INTERRUPTS + interrupt_state.handlers]
     mov [rbx + rdi * 8], rsi
     
     ; Update IDT entry
-    lea rbx, [interrupt_state + interrupt_state.idt]
+    lea rbx, [r13 + CTX_INTERRUPTS + interrupt_state.idt]
     mov rax, rdi
     imul rax, idt_entry_size
     add rbx, rax
@@ -275,35 +256,43 @@ interrupt_register_handler:
 ; Trigger interrupt
 ; Input: RDI = interrupt number
 global interrupt_trigger
-interrupt_trigger:
+global interrupt_trigger_body:function hidden
+CONTEXT_ENTRY interrupt_trigger
+interrupt_trigger_body:
     push rbp
     mov rbp, rsp
     push rbx
     
     ; Check if interrupts are enabled
-    cmp byte [interrupt_state + interrupt_state.enabled], 0
+    cmp byte [r13 + CTX_INTERRUPTS + interrupt_state.enabled], 0
     je .disabled
     
     ; Check interrupt number range
     cmp rdi, 256
     jae .error
     
+    ; Let the dispatch loop poll check_interrupts at its next boundary
+    push rdi
+    mov edi, SLOW_IRQ
+    call vm_raise_slow_work_body
+    pop rdi
+    
     ; Increment nested counter
-    inc byte [interrupt_state + interrupt_state.nested]
+    inc byte [r13 + CTX_INTERRUPTS + interrupt_state.nested]
     
     ; Get handler
-    lea rbx, [interrupt_state + interrupt_state.handlers]
+    lea rbx, [r13 + CTX_INTERRUPTS + interrupt_state.handlers]
     mov rax, [rbx + rdi * 8]
     
     ; Update statistics
-    lea rbx, [interrupt_state + interrupt_state.stats]
+    lea rbx, [r13 + CTX_INTERRUPTS + interrupt_state.stats]
     inc qword [rbx + rdi * 8]
     
     ; Call handler
     call rax
     
     ; Decrement nested counter
-    dec byte [interrupt_state + interrupt_state.nested]
+    dec byte [r13 + CTX_INTERRUPTS + interrupt_state.nested]
     
     xor eax, eax
     jmp .done
@@ -349,7 +338,7 @@ interrupt_dispatch:
     
     ; Regular interrupt
     mov rdi, rax
-    call interrupt_trigger
+    call interrupt_trigger_body
     jmp .restore
     
 .syscall:
@@ -384,15 +373,15 @@ exception_handler:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Exception number
-    mov r13, rsi  ; Error code
+    mov r15, rsi  ; Error code
     mov r14, rdx  ; Fault address
     
     ; Log exception
-    lea rbx, [interrupt_state + interrupt_state.stats]
+    lea rbx, [r13 + CTX_INTERRUPTS + interrupt_state.stats]
     inc qword [rbx + r12 * 8]
     
     ; Handle specific exceptions
@@ -411,7 +400,7 @@ exception_handler:
 .page_fault:
     ; Handle page fault
     mov rdi, r14  ; Fault address
-    mov rsi, r13  ; Error code
+    mov rsi, r15  ; Error code
     call handle_page_fault
     jmp .done
     
@@ -427,12 +416,12 @@ exception_handler:
     
 .halt:
     ; Halt VM on unhandled exception
-    lea rbx, [vm_state]
+    mov rbx, r13
     or byte [rbx + VM_FLAGS], 0x80  ; Set halt flag
     
 .done:
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -453,7 +442,7 @@ syscall_handler:
     mov r12, rax  ; System call number
     
     ; Update statistics
-    lea rbx, [interrupt_state + interrupt_state.stats]
+    lea rbx, [r13 + CTX_INTERRUPTS + interrupt_state.stats]
     inc qword [rbx + INT_SYSCALL * 8]
     
     ; Dispatch system call
@@ -692,7 +681,7 @@ handle_exit:
     mov rbp, rsp
     
     ; Set exit code and halt VM
-    lea rbx, [vm_state]
+    mov rbx, r13
     mov [rbx + VM_GPRS + 0 * 8], rdi  ; Store exit code in R0
     or byte [rbx + VM_FLAGS], 0x80    ; Set halt flag
     
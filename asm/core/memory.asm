@@ -2,40 +2,21 @@
 ; Handles virtual memory, paging, TLB, and MMIO
 
 BITS 64
+
+%include "context.inc"
+
 SECTION .text
 
 ; External symbols
 extern malloc
+extern calloc
 extern free
 extern memset
 extern memcpy
 
-; Constants
-%define PAGE_SIZE 4096
-%define PAGE_SHIFT 12
-%define PAGE_MASK 0xFFF
-%define NUM_PAGE_TABLES 4
-%define TLB_ENTRIES 256
+; Constants (page geometry lives in context.inc)
 %define MMIO_BASE 0x8000000000000000
 
-; Memory management structure
-struc memory_state
-    .memory_size: resq 1          ; Total memory size
-    .memory_base: resq 1          ; Base address of memory
-    .page_tables: resq NUM_PAGE_TABLES  ; Page table pointers
-    .tlb: resq TLB_ENTRIES * 2    ; TLB entries (virtual, physical)
-    .tlb_valid: resb TLB_ENTRIES  ; TLB valid bits
-    .mmio_handlers: resq 64       ; MMIO handler functions
-    .mmio_ranges: resq 64 * 2     ; MMIO address ranges
-    .num_mmio: resd 1             ; Number of MMIO regions
-    .reserved: resd 1             ; Alignment
-endstruc
-
-; Global memory state
-SECTION .bss
-align 64
-memory_state: resb memory_state_size
-
 SECTION .data
 align 64
 ; Default page table (identity mapping for first 1GB)
@@ -47,86 +28,41 @@ SECTION .text
 ; Input: RDI = memory size in bytes
 ; Output: RAX = 0 on success, error code otherwise
 global memory_init
-memory_init:
+global memory_init_body:function hidden
+CONTEXT_ENTRY memory_init
+memory_init_body:
     push rbp
     mov rbp, rsp
-    push rbx
-    push r12
-    push r13
-    push r14
-    push r15
     
     ; Save memory size
-    mov [memory_state + memory_state.memory_size], rdi
+    mov [r13 + CTX_MEMORY + memory_state.memory_size], rdi
     
     ; Allocate memory
-    call malloc
+    call malloc wrt ..plt
     test rax, rax
     jz .error
-    mov [memory_state + memory_state.memory_base], rax
-    
-    ; Initialize page tables
-    lea r12, [memory_state + memory_state.page_tables]
-    mov r13, 0  ; Page table index
-    
-.init_page_tables:
-    cmp r13, NUM_PAGE_TABLES
-    jae .page_tables_done
-    
-    ; Allocate page table
-    mov rdi, PAGE_SIZE
-    call malloc
+    mov [r13 + CTX_MEMORY + memory_state.memory_base], rax
+    
+    ; Dirty bitmap, one bit per page rounded up to whole qwords
+    mov rdi, [r13 + CTX_MEMORY + memory_state.memory_size]
+    add rdi, PAGE_SIZE * 64 - 1
+    shr rdi, PAGE_SHIFT + 6
+    shl rdi, 3
+    mov [r13 + CTX_MEMORY + memory_state.dirty_bytes], rdi
+    mov esi, 1
+    call calloc wrt ..plt
     test rax, rax
     jz .error
+    mov [r13 + CTX_MEMORY + memory_state.dirty_bitmap], rax
     
-    mov [r12 + r13 * 8], rax
-    
-    ; Initialize with identity mapping
-    mov rdi, rax
-    mov rsi, 0
-    mov rdx, PAGE_SIZE
-    call memset
-    
-    ; Set up identity mapping for this page table
-    mov r14, [r12 + r13 * 8]
-    mov r15, 0  ; Page index
-    
-.setup_mapping:
-    cmp r15, 512
-    jae .next_page_table
-    
-    ; Calculate virtual and physical addresses
-    mov rax, r13
-    shl rax, 39  ; Page table level
-    mov rbx, r15
-    shl rbx, 12  ; Page offset
-    or rax, rbx
-    
-    ; Set page table entry (present, writable, user)
-    mov rbx, rax
-    or rbx, 0x87  ; Present, writable, user, accessed, dirty
-    mov [r14 + r15 * 8], rbx
-    
-    inc r15
-    jmp .setup_mapping
-    
-.next_page_table:
-    inc r13
-    jmp .init_page_tables
-    
-.page_tables_done:
-    
-    ; Initialize TLB
-    lea rdi, [memory_state + memory_state.tlb_valid]
-    mov rsi, 0
-    mov rdx, TLB_ENTRIES
-    call memset
+    ; Initialize the fast TLB
+    call memory_tlb_flush_body
     
     ; Initialize MMIO handlers
-    lea rdi, [memory_state + memory_state.mmio_handlers]
+    lea rdi, [r13 + CTX_MEMORY + memory_state.mmio_handlers]
     mov rsi, 0
     mov rdx, 64 * 8
-    call memset
+    call memset wrt ..plt
     
     ; Set up default MMIO regions
     call setup_default_mmio
@@ -138,11 +74,6 @@ memory_init:
     mov eax, -1
     
 .done:
-    pop r15
-    pop r14
-    pop r13
-    pop r12
-    pop rbx
     pop rbp
     ret
 
@@ -152,14 +83,16 @@ setup_default_mmio:
     mov rbp, rsp
     
     ; Console MMIO (0x8000000000000000 - 0x8000000000001000)
-    lea rdi, [memory_state + memory_state.mmio_ranges]
-    mov qword [rdi], MMIO_BASE
-    mov qword [rdi + 8], MMIO_BASE + 0x1000
+    lea rdi, [r13 + CTX_MEMORY + memory_state.mmio_ranges]
+    mov rax, MMIO_BASE
+    mov [rdi], rax
+    add rax, 0x1000
+    mov [rdi + 8], rax
     
-    lea rdi, [memory_state + memory_state.mmio_handlers]
-    mov qword [rdi], console_mmio_handler
+    lea rax, [console_mmio_handler]
+    mov [r13 + CTX_MEMORY + memory_state.mmio_handlers], rax
     
-    mov dword [memory_state + memory_state.num_mmio], 1
+    mov dword [r13 + CTX_MEMORY + memory_state.num_mmio], 1
     
     pop rbp
     ret
@@ -168,26 +101,27 @@ setup_default_mmio:
 ; Input: RDI = virtual address, RSI = buffer, RDX = size
 ; Output: RAX = 0 on success, error code otherwise
 global memory_read
-memory_read:
+global memory_read_body:function hidden
+CONTEXT_ENTRY memory_read
+memory_read_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
     push r14
     push r15
     
     mov r12, rdi  ; Virtual address
-    mov r13, rsi  ; Buffer
+    mov rbx, rsi  ; Buffer
     mov r14, rdx  ; Size
     
-    ; Check if address is in MMIO space
-    cmp r12, MMIO_BASE
-    jb .not_mmio
+    ; Check if address is in MMIO space (the upper half)
+    test r12, r12
+    jns .not_mmio
     
     ; Handle MMIO read
     mov rdi, r12
-    mov rsi, r13
+    mov rsi, rbx
     mov rdx, r14
     call mmio_read
     jmp .done
@@ -196,23 +130,23 @@ memory_read:
     ; Translate virtual address to physical
     mov rdi, r12
     call translate_address
-    test rax, rax
-    jz .error
+    cmp rax, -1
+    je .error
     
     mov r15, rax  ; Physical address
     
     ; Check bounds
-    mov rax, [memory_state + memory_state.memory_size]
+    mov rax, [r13 + CTX_MEMORY + memory_state.memory_size]
     sub rax, r14
     cmp r15, rax
     ja .error
     
     ; Copy data
-    mov rdi, r13
-    mov rsi, [memory_state + memory_state.memory_base]
+    mov rdi, rbx
+    mov rsi, [r13 + CTX_MEMORY + memory_state.memory_base]
     add rsi, r15
     mov rdx, r14
-    call memcpy
+    call memcpy wrt ..plt
     
     xor eax, eax
     jmp .done
@@ -223,7 +157,6 @@ memory_read:
 .done:
     pop r15
     pop r14
-    pop r13
     pop r12
     pop rbx
     pop rbp
@@ -233,26 +166,27 @@ memory_read:
 ; Input: RDI = virtual address, RSI = data, RDX = size
 ; Output: RAX = 0 on success, error code otherwise
 global memory_write
-memory_write:
+global memory_write_body:function hidden
+CONTEXT_ENTRY memory_write
+memory_write_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
     push r14
     push r15
     
     mov r12, rdi  ; Virtual address
-    mov r13, rsi  ; Data
+    mov rbx, rsi  ; Data
     mov r14, rdx  ; Size
     
-    ; Check if address is in MMIO space
-    cmp r12, MMIO_BASE
-    jb .not_mmio
+    ; Check if address is in MMIO space (the upper half)
+    test r12, r12
+    jns .not_mmio
     
     ; Handle MMIO write
     mov rdi, r12
-    mov rsi, r13
+    mov rsi, rbx
     mov rdx, r14
     call mmio_write
     jmp .done
@@ -261,27 +195,27 @@ memory_write:
     ; Translate virtual address to physical
     mov rdi, r12
     call translate_address
-    test rax, rax
-    jz .error
+    cmp rax, -1
+    je .error
     
     mov r15, rax  ; Physical address
     
     ; Check bounds
-    mov rax, [memory_state + memory_state.memory_size]
+    mov rax, [r13 + CTX_MEMORY + memory_state.memory_size]
     sub rax, r14
     cmp r15, rax
     ja .error
     
-    ; Copy data
-    mov rdi, [memory_state + memory_state.memory_base]
+    ; Copy data (a store does not change the mapping, so TLBs stay valid)
+    mov rdi, [r13 + CTX_MEMORY + memory_state.memory_base]
     add rdi, r15
-    mov rsi, r13
+    mov rsi, rbx
     mov rdx, r14
-    call memcpy
+    call memcpy wrt ..plt
     
-    ; Invalidate TLB entry
-    mov rdi, r12
-    call invalidate_tlb
+    mov rdi, r15
+    mov rsi, r14
+    call mark_dirty
     
     xor eax, eax
     jmp .done
@@ -292,168 +226,507 @@ memory_write:
 .done:
     pop r15
     pop r14
-    pop r13
     pop r12
     pop rbx
     pop rbp
     ret
 
+; Set the dirty bits of the physical pages under [RDI, RDI + RSI)
+; Clobbers RAX, RCX, RDX
+mark_dirty:
+    test rsi, rsi
+    jz .done
+    lea rcx, [rdi + rsi - 1]
+    shr rcx, PAGE_SHIFT  ; Last page
+    mov rax, rdi
+    shr rax, PAGE_SHIFT
+    mov rdx, [r13 + CTX_MEMORY + memory_state.dirty_bitmap]
+.page:
+    bts [rdx], rax
+    inc rax
+    cmp rax, rcx
+    jbe .page
+.done:
+    ret
+
 ; Translate virtual address to physical address
 ; Input: RDI = virtual address
-; Output: RAX = physical address (0 if translation failed)
+; Output: RAX = physical address (-1 if translation failed)
+; Guest RAM is identity-mapped; callers still bounds-check the access size.
 translate_address:
+    mov rax, rdi
+    cmp rax, [r13 + CTX_MEMORY + memory_state.memory_size]
+    jb .done
+    mov rax, -1
+.done:
+    ret
+
+; Invalidate the fast-TLB entry for a page
+; Input: RDI = virtual address
+tlb_invalidate:
+    mov rax, rdi
+    shr rax, PAGE_SHIFT
+    and eax, FAST_TLB_ENTRIES - 1
+    shl eax, FAST_TLB_ENTRY_SHIFT
+    mov rcx, FAST_TLB_INVALID
+    mov [r13 + CTX_MEMORY + memory_state.fast_tlb + rax + fast_tlb_entry.read_tag], rcx
+    mov [r13 + CTX_MEMORY + memory_state.fast_tlb + rax + fast_tlb_entry.write_tag], rcx
+    mov [r13 + CTX_MEMORY + memory_state.fast_tlb + rax + fast_tlb_entry.page], rcx
+    ret
+
+; Invalidate every fast-TLB entry
+global memory_tlb_flush
+global memory_tlb_flush_body:function hidden
+CONTEXT_ENTRY memory_tlb_flush
+memory_tlb_flush_body:
+    push rdi
+    lea rdi, [r13 + CTX_MEMORY + memory_state.fast_tlb]
+    mov rax, FAST_TLB_INVALID
+    mov ecx, FAST_TLB_ENTRIES * fast_tlb_entry_size / 8
+    rep stosq
+    pop rdi
+    ret
+
+; Enter a guest RAM page in the fast TLB
+; Input: RDI = virtual address, ESI = 0 for a load, 1 for a store
+fast_tlb_fill:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
     
     mov r12, rdi
+    and r12, ~PAGE_MASK  ; Virtual page
+    mov ebx, esi
     
-    ; Check TLB first
-    mov rdi, r12
-    call tlb_lookup
-    test rax, rax
-    jnz .found
-    
-    ; Walk page tables
-    mov r13, r12
-    shr r13, 39  ; Level 4 index
-    and r13, 0x1FF
-    
-    mov rax, [memory_state + memory_state.page_tables + 3 * 8]
-    test rax, rax
-    jz .error
+    ; MMIO pages always take the slow path
+    mov rax, MMIO_BASE
+    cmp r12, rax
+    jae .done
     
-    mov rax, [rax + r13 * 8]
-    test rax, 1  ; Present bit
-    jz .error
+    mov rdi, r12
+    call translate_address
+    cmp rax, -1
+    je .done
+    
+    ; The whole physical page must be backed by guest RAM
+    mov rcx, [r13 + CTX_MEMORY + memory_state.memory_size]
+    cmp rcx, PAGE_SIZE
+    jb .done
+    sub rcx, PAGE_SIZE
+    cmp rax, rcx
+    ja .done
+    mov r8, rax  ; Physical page
+    
+    ; Host address of the page minus its virtual address
+    add rax, [r13 + CTX_MEMORY + memory_state.memory_base]
+    sub rax, r12
+    
+    mov rcx, r12
+    shr rcx, PAGE_SHIFT
+    and ecx, FAST_TLB_ENTRIES - 1
+    shl ecx, FAST_TLB_ENTRY_SHIFT
+    lea rcx, [r13 + CTX_MEMORY + memory_state.fast_tlb + rcx]
+    
+    ; A different page in this slot loses both of its tags
+    cmp [rcx + fast_tlb_entry.page], r12
+    je .same_page
+    mov rdx, FAST_TLB_INVALID
+    mov [rcx + fast_tlb_entry.read_tag], rdx
+    mov [rcx + fast_tlb_entry.write_tag], rdx
+    mov [rcx + fast_tlb_entry.page], r12
+.same_page:
+    mov [rcx + fast_tlb_entry.addend], rax
+    test ebx, ebx
+    jnz .writable
+    mov [rcx + fast_tlb_entry.read_tag], r12
+    jmp .done
+.writable:
+    mov [rcx + fast_tlb_entry.write_tag], r12
     
-    and rax, ~0xFFF  ; Clear flags
+    ; Fast-TLB stores bypass memory_write, so a page counts as dirty from
+    ; the moment it becomes writable here
+    shr r8, PAGE_SHIFT
+    mov rdx, [r13 + CTX_MEMORY + memory_state.dirty_bitmap]
+    bts [rdx], r8
     
-    ; Level 3
-    mov r13, r12
-    shr r13, 30
-    and r13, 0x1FF
+.done:
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
+; Load slow path: refill the fast TLB, then go through memory_read
+; Input: RDI = virtual address, RSI = size
+; Output: RAX = zero-extended value, EDX = 0 on success or -1 on a fault
+memory_load_slow:
+    push rbp
+    mov rbp, rsp
+    push rbx
+    push r12
+    sub rsp, 16
     
-    mov rax, [rax + r13 * 8]
-    test rax, 1
-    jz .error
-    and rax, ~0xFFF
+    mov r12, rdi
+    mov rbx, rsi
+    mov qword [rsp], 0
     
-    ; Level 2
-    mov r13, r12
-    shr r13, 21
-    and r13, 0x1FF
+    xor esi, esi
+    call fast_tlb_fill
     
-    mov rax, [rax + r13 * 8]
-    test rax, 1
-    jz .error
-    and rax, ~0xFFF
+    mov rdi, r12
+    mov rsi, rsp
+    mov rdx, rbx
+    call memory_read_body
+    mov edx, eax
+    mov rax, [rsp]
+    test edx, edx
+    jz .done
+    xor eax, eax
     
-    ; Level 1
-    mov r13, r12
-    shr r13, 12
-    and r13, 0x1FF
+.done:
+    add rsp, 16
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
+; Store slow path: refill the fast TLB, then go through memory_write
+; Input: RDI = virtual address, RSI = value, RDX = size
+; Output: EAX = 0 on success or -1 on a fault
+memory_store_slow:
+    push rbp
+    mov rbp, rsp
+    push rbx
+    push r12
+    sub rsp, 16
     
-    mov rax, [rax + r13 * 8]
-    test rax, 1
-    jz .error
-    and rax, ~0xFFF
+    mov r12, rdi
+    mov rbx, rdx
+    mov [rsp], rsi
     
-    ; Add page offset
-    mov r13, r12
-    and r13, PAGE_MASK
-    add rax, r13
+    mov esi, 1
+    call fast_tlb_fill
     
-    ; Update TLB
     mov rdi, r12
-    mov rsi, rax
-    call tlb_update
+    mov rsi, rsp
+    mov rdx, rbx
+    call memory_write_body
     
-.found:
-    pop r13
+    add rsp, 16
     pop r12
     pop rbx
     pop rbp
     ret
+
+; Sized guest loads: RDI = virtual address
+; Output: RAX = zero-extended value, EDX = 0 on success or -1 on a fault
+; Callers usually inline FAST_TLB_LOAD and come here only on a miss.
+%macro MEMORY_LOAD 2
+global memory_load%1_body:function hidden
+memory_load%1_body:
+    FAST_TLB_LOAD %2, .miss
+    xor edx, edx
+    ret
+.miss:
+    mov esi, %2
+    jmp memory_load_slow
+%endmacro
+
+; Sized guest stores: RDI = virtual address, RSI = value
+; Output: EAX = 0 on success or -1 on a fault
+%macro MEMORY_STORE 2
+global memory_store%1_body:function hidden
+memory_store%1_body:
+    FAST_TLB_STORE %2, .miss
+    xor eax, eax
+    ret
+.miss:
+    mov edx, %2
+    jmp memory_store_slow
+%endmacro
+
+MEMORY_LOAD 8, 1
+MEMORY_LOAD 16, 2
+MEMORY_LOAD 32, 4
+MEMORY_LOAD 64, 8
+MEMORY_STORE 8, 1
+MEMORY_STORE 16, 2
+MEMORY_STORE 32, 4
+MEMORY_STORE 64, 8
+
+; Host address of a guest RAM byte, refilling the fast TLB on a miss
+; Input: RDI = virtual address, ESI = 0 for a load, 1 for a store
+; Output: RAX = host address, or 0 for MMIO and unmapped addresses
+global memory_host_address:function hidden
+memory_host_address:
+    push rbx
+    push r12
+    push r14
     
-.error:
+    mov r12, rdi
+    mov ebx, esi
+    mov r14d, 2  ; Probe, refill, probe again
+    
+.probe:
+    mov rax, r12
+    shr rax, PAGE_SHIFT
+    and eax, FAST_TLB_ENTRIES - 1
+    shl eax, FAST_TLB_ENTRY_SHIFT
+    lea rdx, [r13 + CTX_MEMORY + memory_state.fast_tlb + rax]
+    mov rcx, r12
+    and rcx, ~PAGE_MASK
+    cmp rcx, [rdx + fast_tlb_entry.read_tag + rbx * 8]  ; write_tag follows read_tag
+    je .hit
+    dec r14d
+    jz .fail
+    mov rdi, r12
+    mov esi, ebx
+    call fast_tlb_fill
+    jmp .probe
+    
+.hit:
+    mov rax, [rdx + fast_tlb_entry.addend]
+    add rax, r12
+    jmp .done
+    
+.fail:
     xor eax, eax
-    pop r13
+    
+.done:
+    pop r14
     pop r12
     pop rbx
-    pop rbp
     ret
 
-; TLB lookup
-; Input: RDI = virtual address
-; Output: RAX = physical address (0 if not found)
-tlb_lookup:
-    push rbp
-    mov rbp, rsp
-    
-    ; Calculate TLB index
-    mov rax, rdi
-    shr rax, 12  ; Page number
-    and rax, 0xFF  ; 256 entries
+; Start a new dirty-tracking interval: clear the bitmap and revoke every
+; fast-TLB write tag, so the next store to each page takes the slow path
+; and marks it again
+global memory_clear_dirty
+global memory_clear_dirty_body:function hidden
+CONTEXT_ENTRY memory_clear_dirty
+memory_clear_dirty_body:
+    push rbx
     
-    ; Check if valid
-    lea rbx, [memory_state + memory_state.tlb_valid]
-    mov cl, [rbx + rax]
-    test cl, cl
-    jz .not_found
+    mov rdi, [r13 + CTX_MEMORY + memory_state.dirty_bitmap]
+    xor esi, esi
+    mov rdx, [r13 + CTX_MEMORY + memory_state.dirty_bytes]
+    call memset wrt ..plt
     
-    ; Get physical address
-    lea rbx, [memory_state + memory_state.tlb]
-    mov rax, [rbx + rax * 16 + 8]  ; Physical address
+    lea rdx, [r13 + CTX_MEMORY + memory_state.fast_tlb]
+    mov rax, FAST_TLB_INVALID
+    mov ecx, FAST_TLB_ENTRIES
+.revoke:
+    mov [rdx + fast_tlb_entry.write_tag], rax
+    add rdx, fast_tlb_entry_size
+    dec ecx
+    jnz .revoke
     
-    pop rbp
+    pop rbx
+    xor eax, eax
     ret
+
+; Copy out the dirty bitmap; bit n of the result is physical page n
+; Input: RDI = buffer, RSI = buffer size in bytes
+; Output: RAX = bitmap size in bytes, or -1 if the buffer is too small
+global memory_get_dirty
+global memory_get_dirty_body:function hidden
+CONTEXT_ENTRY memory_get_dirty
+memory_get_dirty_body:
+    push rbx
     
-.not_found:
-    xor eax, eax
-    pop rbp
+    mov rbx, [r13 + CTX_MEMORY + memory_state.dirty_bytes]
+    cmp rsi, rbx
+    jb .too_small
+    mov rsi, [r13 + CTX_MEMORY + memory_state.dirty_bitmap]
+    mov rdx, rbx
+    call memcpy wrt ..plt
+    mov rax, rbx
+    jmp .done
+    
+.too_small:
+    mov rax, -1
+    
+.done:
+    pop rbx
     ret
 
-; TLB update
-; Input: RDI = virtual address, RSI = physical address
-tlb_update:
+; Bulk copy with memmove semantics, translating once per page and moving
+; each run that stays within one source and one destination page with
+; rep movsb
+; Input: RDI = destination, RSI = source, RDX = length
+; Output: EAX = 0 on success, -1 if a page is MMIO or unmapped (the copy
+; stops there)
+global memory_copy
+global memory_copy_body:function hidden
+CONTEXT_ENTRY memory_copy
+memory_copy_body:
     push rbp
     mov rbp, rsp
+    push rbx
+    push r12
+    push r14
+    push r15
+    sub rsp, 16
     
-    ; Calculate TLB index
-    mov rax, rdi
-    shr rax, 12
-    and rax, 0xFF
+    mov r12, rdi  ; Destination
+    mov r14, rsi  ; Source
+    mov r15, rdx  ; Bytes left
     
-    ; Store entry
-    lea rbx, [memory_state + memory_state.tlb]
-    mov [rbx + rax * 16], rdi      ; Virtual address
-    mov [rbx + rax * 16 + 8], rsi  ; Physical address
+    ; A destination inside the source range has to be copied from the end
+    mov rax, r12
+    sub rax, r14
+    cmp rax, r15
+    jb .backward
+    
+.forward:
+    test r15, r15
+    jz .ok
+    
+    ; Run length: up to the nearer of the two page ends
+    mov eax, r12d
+    and eax, PAGE_MASK
+    mov ecx, r14d
+    and ecx, PAGE_MASK
+    cmp eax, ecx
+    cmovb eax, ecx
+    mov ebx, PAGE_SIZE
+    sub ebx, eax
+    cmp rbx, r15
+    cmova rbx, r15
+    
+    mov rdi, r14
+    xor esi, esi
+    call memory_host_address
+    test rax, rax
+    jz .fault
+    mov [rsp], rax
+    mov rdi, r12
+    mov esi, 1
+    call memory_host_address
+    test rax, rax
+    jz .fault
     
-    ; Mark as valid
-    lea rbx, [memory_state + memory_state.tlb_valid]
-    mov byte [rbx + rax], 1
+    mov rdi, rax
+    mov rsi, [rsp]
+    mov rcx, rbx
+    rep movsb
+    
+    add r12, rbx
+    add r14, rbx
+    sub r15, rbx
+    jmp .forward
+    
+.backward:
+    test r15, r15
+    jz .ok
+    
+    ; Run length: back to the nearer of the two page starts
+    lea rax, [r12 + r15 - 1]
+    and eax, PAGE_MASK
+    lea rcx, [r14 + r15 - 1]
+    and ecx, PAGE_MASK
+    cmp eax, ecx
+    cmova eax, ecx
+    lea ebx, [rax + 1]
+    cmp rbx, r15
+    cmova rbx, r15
+    sub r15, rbx  ; Offset of this run
+    
+    lea rdi, [r14 + r15]
+    xor esi, esi
+    call memory_host_address
+    test rax, rax
+    jz .fault
+    mov [rsp], rax
+    lea rdi, [r12 + r15]
+    mov esi, 1
+    call memory_host_address
+    test rax, rax
+    jz .fault
+    
+    lea rdi, [rax + rbx - 1]
+    mov rsi, [rsp]
+    lea rsi, [rsi + rbx - 1]
+    mov rcx, rbx
+    std
+    rep movsb
+    cld
+    jmp .backward
+    
+.ok:
+    xor eax, eax
+    jmp .done
+    
+.fault:
+    mov eax, -1
     
+.done:
+    add rsp, 16
+    pop r15
+    pop r14
+    pop r12
+    pop rbx
     pop rbp
     ret
 
-; Invalidate TLB entry
-; Input: RDI = virtual address
-tlb_invalidate:
+; Bulk fill, translating once per page and filling each run within a
+; page with rep stosb
+; Input: RDI = destination, RSI = byte value, RDX = length
+; Output: EAX = 0 on success, -1 if a page is MMIO or unmapped (the fill
+; stops there)
+global memory_fill
+global memory_fill_body:function hidden
+CONTEXT_ENTRY memory_fill
+memory_fill_body:
     push rbp
     mov rbp, rsp
+    push rbx
+    push r12
+    push r14
+    push r15
     
-    ; Calculate TLB index
-    mov rax, rdi
-    shr rax, 12
-    and rax, 0xFF
+    mov r12, rdi  ; Destination
+    mov r14, rsi  ; Fill byte
+    mov r15, rdx  ; Bytes left
+    
+.run:
+    test r15, r15
+    jz .ok
+    
+    mov eax, r12d
+    and eax, PAGE_MASK
+    mov ebx, PAGE_SIZE
+    sub ebx, eax
+    cmp rbx, r15
+    cmova rbx, r15
+    
+    mov rdi, r12
+    mov esi, 1
+    call memory_host_address
+    test rax, rax
+    jz .fault
+    
+    mov rdi, rax
+    mov eax, r14d
+    mov rcx, rbx
+    rep stosb
+    
+    add r12, rbx
+    sub r15, rbx
+    jmp .run
     
-    ; Mark as invalid
-    lea rbx, [memory_state + memory_state.tlb_valid]
-    mov byte [rbx + rax], 0
+.ok:
+    xor eax, eax
+    jmp .done
+    
+.fault:
+    mov eax, -1
     
+.done:
+    pop r15
+    pop r14
+    pop r12
+    pop rbx
     pop rbp
     ret
 
@@ -464,25 +737,27 @@ mmio_read:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Address
-    mov r13, rsi  ; Buffer
+    mov r15, rsi  ; Buffer
     mov r14, rdx  ; Size
     
     ; Find MMIO handler
-    lea rbx, [memory_state + memory_state.mmio_ranges]
-    lea rcx, [memory_state + memory_state.mmio_handlers]
-    mov rdx, [memory_state + memory_state.num_mmio]
+    lea rbx, [r13 + CTX_MEMORY + memory_state.mmio_ranges]
+    lea rcx, [r13 + CTX_MEMORY + memory_state.mmio_handlers]
+    mov rdx, [r13 + CTX_MEMORY + memory_state.num_mmio]
     
 .find_handler:
     test rdx, rdx
     jz .no_handler
     
     dec rdx
-    mov rax, [rbx + rdx * 16]      ; Start address
-    mov r8, [rbx + rdx * 16 + 8]   ; End address
+    mov rax, rdx
+    shl rax, 4                     ; 16-byte range entries
+    mov r8, [rbx + rax + 8]        ; End address
+    mov rax, [rbx + rax]           ; Start address
     
     cmp r12, rax
     jb .find_handler
@@ -496,12 +771,12 @@ mmio_read:
     
     ; Call handler
     mov rdi, r12
-    mov rsi, r13
+    mov rsi, r15
     mov rdx, r14
     call rax
     
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -509,14 +784,14 @@ mmio_read:
     
 .no_handler:
     ; Default: return zeros
-    mov rdi, r13
+    mov rdi, r15
     mov rsi, 0
     mov rdx, r14
-    call memset
+    call memset wrt ..plt
     
     xor eax, eax
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -529,25 +804,27 @@ mmio_write:
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Address
-    mov r13, rsi  ; Data
+    mov r15, rsi  ; Data
     mov r14, rdx  ; Size
     
     ; Find MMIO handler (similar to read)
-    lea rbx, [memory_state + memory_state.mmio_ranges]
-    lea rcx, [memory_state + memory_state.mmio_handlers]
-    mov rdx, [memory_state + memory_state.num_mmio]
+    lea rbx, [r13 + CTX_MEMORY + memory_state.mmio_ranges]
+    lea rcx, [r13 + CTX_MEMORY + memory_state.mmio_handlers]
+    mov rdx, [r13 + CTX_MEMORY + memory_state.num_mmio]
     
 .find_handler:
     test rdx, rdx
     jz .no_handler
     
     dec rdx
-    mov rax, [rbx + rdx * 16]
-    mov r8, [rbx + rdx * 16 + 8]
+    mov rax, rdx
+    shl rax, 4
+    mov r8, [rbx + rax + 8]
+    mov rax, [rbx + rax]
     
     cmp r12, rax
     jb .find_handler
@@ -561,13 +838,13 @@ mmio_write:
     
     ; Call handler with write flag
     mov rdi, r12
-    mov rsi, r13
+    mov rsi, r15
     mov rdx, r14
     mov rcx, 1  ; Write flag
     call rax
     
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -577,7 +854,7 @@ mmio_write:
     ; Default: ignore writes
     xor eax, eax
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
@@ -611,35 +888,24 @@ console_mmio_handler:
 
 ; Clean up memory subsystem
 global memory_cleanup
-memory_cleanup:
+global memory_cleanup_body:function hidden
+CONTEXT_ENTRY memory_cleanup
+memory_cleanup_body:
     push rbp
     mov rbp, rsp
-    push rbx
     
     ; Free memory
-    mov rdi, [memory_state + memory_state.memory_base]
+    mov rdi, [r13 + CTX_MEMORY + memory_state.memory_base]
     test rdi, rdi
     jz .no_memory
-    call free
+    call free wrt ..plt
     
 .no_memory:
-    
-    ; Free page tables
-    lea rbx, [memory_state + memory_state.page_tables]
-    mov rcx, NUM_PAGE_TABLES
-    
-.free_page_tables:
-    test rcx, rcx
-    jz .done
-    
-    dec rcx
-    mov rdi, [rbx + rcx * 8]
+    mov rdi, [r13 + CTX_MEMORY + memory_state.dirty_bitmap]
     test rdi, rdi
-    jz .free_page_tables
-    call free
-    jmp .free_page_tables
+    jz .done
+    call free wrt ..plt
     
 .done:
-    pop rbx
     pop rbp
     ret
\ No newline at end of file
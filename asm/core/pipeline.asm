@@ -1,840 +1,427 @@
 ; NanoCore Pipeline Module
-; Handles 5-stage pipeline: Fetch, Decode, Execute, Memory, Writeback
+; Timing model for an in-order 5-stage pipeline: Fetch, Decode, Execute,
+; Memory, Writeback
+;
+; The model runs only in timing mode (vm_set_timing_mode), where every
+; dispatch goes through pipeline_issue before the handler. The handlers
+; themselves stay functional; the model charges each instruction one
+; issue cycle plus:
+;   - load-use bubbles (full forwarding otherwise) and multi-cycle
+;     execute latencies, counted in PERF_PIPELINE_STALL
+;   - branch redirects: a gshare predictor and return address stack at
+;     fetch, targets from decode, conditions resolved in execute
+;   - cache misses reported by the cache model since the last retire
+; PERF_CYCLE_COUNT accumulates the result.
 
 BITS 64
-SECTION .text
-
-; External symbols
-extern vm_state
-extern memory_read
-extern memory_write
-
-; Constants
-%define VM_PC 0
-%define VM_FLAGS 16
-%define VM_GPRS 24
-%define VM_VREGS (VM_GPRS + 32 * 8)
-%define VM_PERF (VM_VREGS + 16 * 32)
 
-; Pipeline stage constants
-%define STAGE_FETCH 0
-%define STAGE_DECODE 1
-%define STAGE_EXECUTE 2
-%define STAGE_MEMORY 3
-%define STAGE_WRITEBACK 4
+%include "context.inc"
 
-; Pipeline structure
-struc pipeline_stage
-    .valid: resb 1          ; Stage valid
-    .opcode: resb 1         ; Instruction opcode
-    .rd: resb 1             ; Destination register
-    .rs1: resb 1            ; Source register 1
-    .rs2: resb 1            ; Source register 2
-    .imm: resd 1            ; Immediate value
-    .pc: resq 1             ; Program counter
-    .result: resq 1         ; Execution result
-    .mem_addr: resq 1       ; Memory address
-    .mem_data: resq 1       ; Memory data
-    .stall: resb 1          ; Pipeline stall
-    .flush: resb 1          ; Pipeline flush
-    .reserved: resb 1       ; Alignment
-endstruc
+SECTION .text
 
-; Pipeline state
-struc pipeline_state
-    .stages: resb pipeline_stage_size * 5  ; 5 pipeline stages
-    .branch_predictor: resq 1024           ; 2-bit saturating counters
-    .return_stack: resq 16                 ; Return address stack
-    .ras_ptr: resd 1                       ; Return stack pointer
-    .reserved: resd 1                      ; Alignment
-endstruc
+; External symbols
+extern cache_access_body
 
 ; Global symbols
 global pipeline_init
-global pipeline_fetch
-global pipeline_decode
-global pipeline_execute
-global pipeline_memory
-global pipeline_writeback
-global pipeline_step
-global pipeline_flush
-global pipeline_stall
+global pipeline_issue_body:function hidden
+global pipeline_drain_body:function hidden
 global branch_predict
 global branch_update
 
-SECTION .bss
-align 64
-pipeline_state: resb pipeline_state_size
+; Performance counter indices (see vm.asm)
+%define PERF_CYCLE_COUNT 1
+%define PERF_L1_MISS 2
+%define PERF_L2_MISS 3
+%define PERF_BRANCH_MISS 4
+%define PERF_PIPELINE_STALL 5
+
+; Cache types (see cache.asm)
+%define CACHE_L1D 1
+
+; Penalties in cycles
+%define TIMING_LOAD_USE 1           ; Load result needed by the next instruction
+%define TIMING_REDIRECT 1           ; Taken branch or call redirected by decode
+%define TIMING_MISPREDICT 2         ; Wrong path flushed when execute resolves it
+%define TIMING_L2_LATENCY 10        ; L1 miss that hits in L2
+%define TIMING_MEMORY_LATENCY 100   ; L2 miss, on top of the L2 latency
+
+; Instruction classes (timing_class)
+%define TC_RS1 0x80         ; Reads rs1
+%define TC_RS2 0x01         ; Reads rs2
+%define TC_RD 0x02          ; Reads rd (store data, branch operand)
+%define TC_LOAD 0x04        ; Writes rd from the memory stage
+%define TC_MEM 0x08         ; Data access at R[rs1] + imm
+%define TC_BRANCH 0x10      ; Conditional branch
+%define TC_CALL 0x20        ; Direct call
+%define TC_INDIRECT 0x40    ; JMP/RET: target read from a register
 
 SECTION .data
-align 64
-; Opcode dispatch table
-opcode_table:
-    dq execute_add      ; 0x00
-    dq execute_sub      ; 0x01
-    dq execute_mul      ; 0x02
-    dq execute_mulh     ; 0x03
-    dq execute_div      ; 0x04
-    dq execute_mod      ; 0x05
-    dq execute_and      ; 0x06
-    dq execute_or       ; 0x07
-    dq execute_xor      ; 0x08
-    dq execute_not      ; 0x09
-    dq execute_shl      ; 0x0A
-    dq execute_shr      ; 0x0B
-    dq execute_sar      ; 0x0C
-    dq execute_rol      ; 0x0D
-    dq execute_ror      ; 0x0E
-    dq execute_ld       ; 0x0F
-    dq execute_lw       ; 0x10
-    dq execute_lh       ; 0x11
-    dq execute_lb       ; 0x12
-    dq execute_st       ; 0x13
-    dq execute_sw       ; 0x14
-    dq execute_sh       ; 0x15
-    dq execute_sb       ; 0x16
-    dq execute_beq      ; 0x17
-    dq execute_bne      ; 0x18
-    dq execute_blt      ; 0x19
-    dq execute_bge      ; 0x1A
-    dq execute_bltu     ; 0x1B
-    dq execute_bgeu     ; 0x1C
-    dq execute_jmp      ; 0x1D
-    dq execute_call     ; 0x1E
-    dq execute_ret      ; 0x1F
-    dq execute_syscall  ; 0x20
-    dq execute_halt     ; 0x21
-    dq execute_nop      ; 0x22
-    dq execute_cpuid    ; 0x23
-    dq execute_rdcycle  ; 0x24
-    dq execute_rdperf   ; 0x25
-    dq execute_prefetch ; 0x26
-    dq execute_clflush  ; 0x27
-    dq execute_fence    ; 0x28
-    dq execute_lr       ; 0x29
-    dq execute_sc       ; 0x2A
-    dq execute_amoswap  ; 0x2B
-    dq execute_amoadd   ; 0x2C
-    dq execute_amoand   ; 0x2D
-    dq execute_amoor    ; 0x2E
-    dq execute_amoxor   ; 0x2F
-    dq execute_vadd_f64 ; 0x30
-    dq execute_vsub_f64 ; 0x31
-    dq execute_vmul_f64 ; 0x32
-    dq execute_vfma_f64 ; 0x33
-    dq execute_vload    ; 0x34
-    dq execute_vstore   ; 0x35
-    dq execute_vbroadcast ; 0x36
-    times 201 dq execute_illegal  ; Fill rest with illegal instruction handler
+; Class bits per opcode
+timing_class:
+    times 9 db TC_RS1 | TC_RS2                  ; 0x00-0x08 ALU
+    db TC_RS1                                   ; 0x09 NOT
+    times 5 db TC_RS1 | TC_RS2                  ; 0x0A-0x0E shifts and rotates
+    times 4 db TC_RS1 | TC_LOAD | TC_MEM        ; 0x0F-0x12 LD/LW/LH/LB
+    times 4 db TC_RS1 | TC_RD | TC_MEM          ; 0x13-0x16 ST/SW/SH/SB
+    times 6 db TC_RS1 | TC_RD | TC_BRANCH       ; 0x17-0x1C branches
+    db TC_RS1 | TC_INDIRECT                     ; 0x1D JMP
+    db TC_CALL                                  ; 0x1E CALL
+    db TC_INDIRECT                              ; 0x1F RET
+    times 9 db 0                                ; 0x20-0x28 system
+    db TC_RS1 | TC_LOAD | TC_MEM                ; 0x29 LR
+    times 6 db TC_RS1 | TC_RS2 | TC_LOAD | TC_MEM  ; 0x2A-0x2F SC and AMOs
+    times 4 db 0                                ; 0x30-0x33 vector arithmetic
+    times 2 db TC_RS1 | TC_MEM                  ; 0x34-0x35 VLOAD/VSTORE
+    db TC_RS1                                   ; 0x36 VBROADCAST
+    times 2 db TC_RS1 | TC_RS2 | TC_RD          ; 0x37-0x38 MCOPY/MFILL
+    times 7 db 0                                ; 0x39-0x3F
+
+; Execute cycles beyond the first, per opcode
+timing_latency:
+    times 2 db 0                                ; 0x00-0x01
+    times 2 db 2                                ; 0x02-0x03 MUL/MULH: 3-cycle multiplier
+    times 2 db 19                               ; 0x04-0x05 DIV/MOD: 20-cycle divider
+    times 42 db 0                               ; 0x06-0x2F
+    times 3 db 2                                ; 0x30-0x32 vector add/sub/mul
+    db 3                                        ; 0x33 VFMA
+    times 12 db 0                               ; 0x34-0x3F
 
 SECTION .text
 
-; Initialize pipeline
-global pipeline_init
-pipeline_init:
-    push rbp
-    mov rbp, rsp
-    
-    ; Clear pipeline state
-    lea rdi, [pipeline_state]
+; Reset the timing model: empty pipeline, cold predictor and return stack
+global pipeline_init_body:function hidden
+CONTEXT_ENTRY pipeline_init
+pipeline_init_body:
+    lea rdi, [r13 + CTX_PIPELINE]
     xor eax, eax
     mov ecx, pipeline_state_size / 8
     rep stosq
     
-    ; Initialize return address stack pointer
-    mov dword [pipeline_state + pipeline_state.ras_ptr], 0
+    lea rdi, [r13 + vm_context.branch_predictor]
+    mov ecx, BP_ENTRIES / 8
+    rep stosq
     
-    pop rbp
+    lea rdi, [r13 + vm_context.return_stack]
+    mov ecx, RAS_ENTRIES
+    rep stosq
+    
+    ; Miss penalties count from here
+    mov rax, [r13 + VM_PERF + PERF_L1_MISS * 8]
+    mov [r13 + CTX_PIPELINE + pipeline_state.l1_misses], rax
+    mov rax, [r13 + VM_PERF + PERF_L2_MISS * 8]
+    mov [r13 + CTX_PIPELINE + pipeline_state.l2_misses], rax
     ret
 
-; Fetch stage
-; Input: None
-; Output: RAX = 0 on success, error code otherwise
-pipeline_fetch:
-    push rbp
-    mov rbp, rsp
+; Timing-mode hook, run as each instruction is dispatched. Retires the
+; previous instruction, whose successor is now known, and models this
+; one's data access while its base register still holds its old value.
+; Input: EDI = instruction word; VM_PC already points past it
+pipeline_issue_body:
     push rbx
     push r12
-    push r13
-    
-    ; Get current PC
-    lea r12, [vm_state]
-    mov r13, [r12 + VM_PC]
-    
-    ; Check if fetch stage is stalled
-    lea rbx, [pipeline_state + pipeline_state.stages + STAGE_FETCH * pipeline_stage_size]
-    cmp byte [rbx + pipeline_stage.stall], 0
-    jne .stalled
-    
-    ; Fetch instruction from memory
-    mov rdi, r13
-    lea rsi, [rbx + pipeline_stage.opcode]  ; Use opcode field as temp buffer
-    mov rdx, 4  ; 32-bit instruction
-    call memory_read
-    test rax, rax
-    jnz .error
-    
-    ; Store instruction in decode stage
-    lea rbx, [pipeline_state + pipeline_state.stages + STAGE_DECODE * pipeline_stage_size]
-    mov eax, [rbx + pipeline_stage.opcode]  ; Get fetched instruction
-    mov [rbx + pipeline_stage.opcode], eax  ; Store opcode
-    mov [rbx + pipeline_stage.pc], r13      ; Store PC
-    mov byte [rbx + pipeline_stage.valid], 1 ; Mark as valid
-    
-    ; Advance PC
-    add r13, 4
-    mov [r12 + VM_PC], r13
-    
-    ; Update performance counter
-    inc qword [r12 + VM_PERF + 0 * 8]  ; Instruction fetch counter
-    
-    xor eax, eax
-    jmp .done
-    
-.stalled:
-    xor eax, eax
-    jmp .done
+    push r14
     
-.error:
-    mov eax, -1
+    mov r12d, edi
+    mov r14, [r13 + VM_PC]
+    sub r14, 4
+    lea rbx, [r13 + CTX_PIPELINE]
+    
+    cmp byte [rbx + pipeline_state.issued], 0
+    je .issue
+    mov rdi, r14
+    call pipeline_retire
+    
+.issue:
+    ; Data accesses go through the cache model only when it runs in full;
+    ; in sampled mode the fetch samples already carry the weight
+    mov eax, r12d
+    shr eax, 26
+    lea rcx, [timing_class]
+    test byte [rcx + rax], TC_MEM
+    jz .no_data
+    cmp dword [r13 + CTX_CACHE + cache_state.mode], CACHE_MODE_FULL
+    jne .no_data
+    mov eax, r12d
+    shr eax, 16
+    and eax, 0x1F  ; rs1
+    movsx rdi, r12w
+    add rdi, [r13 + VM_GPRS + rax * 8]
+    mov esi, CACHE_L1D
+    call cache_access_body
+    
+.no_data:
+    mov [rbx + pipeline_state.issued_pc], r14
+    mov [rbx + pipeline_state.issued_word], r12d
+    mov byte [rbx + pipeline_state.issued], 1
     
-.done:
-    pop r13
+    pop r14
     pop r12
     pop rbx
-    pop rbp
     ret
 
-; Decode stage
-; Input: None
-; Output: RAX = 0 on success, error code otherwise
-pipeline_decode:
-    push rbp
-    mov rbp, rsp
-    push rbx
-    push r12
-    push r13
-    
-    ; Get decode stage
-    lea rbx, [pipeline_state + pipeline_state.stages + STAGE_DECODE * pipeline_stage_size]
-    
-    ; Check if stage is valid
-    cmp byte [rbx + pipeline_stage.valid], 0
-    je .no_instruction
-    
-    ; Check if stalled
-    cmp byte [rbx + pipeline_stage.stall], 0
-    jne .stalled
-    
-    ; Decode instruction
-    mov eax, [rbx + pipeline_stage.opcode]
-    
-    ; Extract opcode (bits 31-26)
-    mov ecx, eax
-    shr ecx, 26
-    and ecx, 0x3F
-    mov [rbx + pipeline_stage.opcode], cl
-    
-    ; Extract rd (bits 25-21)
-    mov ecx, eax
-    shr ecx, 21
-    and ecx, 0x1F
-    mov [rbx + pipeline_stage.rd], cl
-    
-    ; Extract rs1 (bits 20-16)
-    mov ecx, eax
-    shr ecx, 16
-    and ecx, 0x1F
-    mov [rbx + pipeline_stage.rs1], cl
-    
-    ; Extract rs2 (bits 15-11)
-    mov ecx, eax
-    shr ecx, 11
-    and ecx, 0x1F
-    mov [rbx + pipeline_stage.rs2], cl
-    
-    ; Extract immediate (bits 15-0)
-    mov ecx, eax
-    and ecx, 0xFFFF
-    mov [rbx + pipeline_stage.imm], ecx
-    
-    ; Check for data hazards
-    call check_data_hazards
-    test rax, rax
-    jnz .stall_for_hazard
-    
-    ; Move to execute stage
-    lea r12, [pipeline_state + pipeline_state.stages + STAGE_EXECUTE * pipeline_stage_size]
-    mov al, [rbx + pipeline_stage.opcode]
-    mov [r12 + pipeline_stage.opcode], al
-    mov al, [rbx + pipeline_stage.rd]
-    mov [r12 + pipeline_stage.rd], al
-    mov al, [rbx + pipeline_stage.rs1]
-    mov [r12 + pipeline_stage.rs1], al
-    mov al, [rbx + pipeline_stage.rs2]
-    mov [r12 + pipeline_stage.rs2], al
-    mov eax, [rbx + pipeline_stage.imm]
-    mov [r12 + pipeline_stage.imm], eax
-    mov rax, [rbx + pipeline_stage.pc]
-    mov [r12 + pipeline_stage.pc], rax
-    mov byte [r12 + pipeline_stage.valid], 1
-    
-    ; Clear decode stage
-    mov byte [rbx + pipeline_stage.valid], 0
-    
-    xor eax, eax
-    jmp .done
-    
-.stall_for_hazard:
-    mov byte [rbx + pipeline_stage.stall], 1
-    xor eax, eax
-    jmp .done
-    
-.stalled:
-    xor eax, eax
-    jmp .done
-    
-.no_instruction:
-    xor eax, eax
-    
+; Retire the last dispatched instruction, at the end of a timed vm_run
+pipeline_drain_body:
+    cmp byte [r13 + CTX_PIPELINE + pipeline_state.issued], 0
+    je .done
+    mov rdi, [r13 + VM_PC]
+    jmp pipeline_retire
 .done:
-    pop r13
-    pop r12
-    pop rbx
-    pop rbp
     ret
 
-; Execute stage
-; Input: None
-; Output: RAX = 0 on success, error code otherwise
-pipeline_execute:
-    push rbp
-    mov rbp, rsp
+; Charge the issued instruction now that its successor is known
+; Input: RDI = PC of the next instruction
+pipeline_retire:
     push rbx
+    push rbp
     push r12
-    push r13
     push r14
     push r15
     
-    ; Get execute stage
-    lea rbx, [pipeline_state + pipeline_state.stages + STAGE_EXECUTE * pipeline_stage_size]
-    
-    ; Check if stage is valid
-    cmp byte [rbx + pipeline_stage.valid], 0
-    je .no_instruction
-    
-    ; Get instruction details
-    movzx r12d, byte [rbx + pipeline_stage.opcode]
-    movzx r13d, byte [rbx + pipeline_stage.rd]
-    movzx r14d, byte [rbx + pipeline_stage.rs1]
-    movzx r15d, byte [rbx + pipeline_stage.rs2]
-    mov eax, [rbx + pipeline_stage.imm]
-    
-    ; Check if opcode is valid
-    cmp r12d, 0x36
-    ja .illegal_instruction
-    
-    ; Dispatch to instruction handler
-    mov rax, [opcode_table + r12 * 8]
-    call rax
-    
-    ; Store result
-    mov [rbx + pipeline_stage.result], rax
-    
-    ; Check if instruction needs memory access
-    cmp r12d, 0x0F  ; LD
-    jb .no_memory
-    cmp r12d, 0x16  ; SB
-    ja .no_memory
-    
-    ; Mark as needing memory access
-    mov byte [rbx + pipeline_stage.mem_addr], 1
-    
-.no_memory:
-    ; Move to memory stage
-    lea r12, [pipeline_state + pipeline_state.stages + STAGE_MEMORY * pipeline_stage_size]
-    mov al, [rbx + pipeline_stage.opcode]
-    mov [r12 + pipeline_stage.opcode], al
-    mov al, [rbx + pipeline_stage.rd]
-    mov [r12 + pipeline_stage.rd], al
-    mov rax, [rbx + pipeline_stage.result]
-    mov [r12 + pipeline_stage.result], rax
-    mov al, [rbx + pipeline_stage.mem_addr]
-    mov [r12 + pipeline_stage.mem_addr], al
-    mov byte [r12 + pipeline_stage.valid], 1
-    
-    ; Clear execute stage
-    mov byte [rbx + pipeline_stage.valid], 0
-    
+    lea rbx, [r13 + CTX_PIPELINE]
+    mov r15, rdi
+    mov r12d, [rbx + pipeline_state.issued_word]
+    mov r14, [rbx + pipeline_state.issued_pc]
+    mov byte [rbx + pipeline_state.issued], 0
+    
+    ; RBP accumulates this instruction's cycles, stalls first
+    mov edx, r12d
+    shr edx, 26
+    lea rcx, [timing_latency]
+    movzx ebp, byte [rcx + rdx]
+    lea rcx, [timing_class]
+    movzx eax, byte [rcx + rdx]
+    
+    ; Load-use: one bubble if a source is the previous load's rd
+    movzx ecx, byte [rbx + pipeline_state.load_rd]
+    test ecx, ecx
+    jz .no_load_use
+    test eax, TC_RS1
+    jz .check_rs2
+    mov edx, r12d
+    shr edx, 16
+    and edx, 0x1F  ; rs1
+    cmp edx, ecx
+    je .load_use
+.check_rs2:
+    test eax, TC_RS2
+    jz .check_rd
+    mov edx, r12d
+    shr edx, 11
+    and edx, 0x1F  ; rs2
+    cmp edx, ecx
+    je .load_use
+.check_rd:
+    test eax, TC_RD
+    jz .no_load_use
+    mov edx, r12d
+    shr edx, 21
+    and edx, 0x1F  ; rd
+    cmp edx, ecx
+    jne .no_load_use
+.load_use:
+    add ebp, TIMING_LOAD_USE
+.no_load_use:
+    add [r13 + VM_PERF + PERF_PIPELINE_STALL * 8], rbp
+    
+    ; Remember the destination of a load for the next instruction
+    xor ecx, ecx
+    test eax, TC_LOAD
+    jz .set_load_rd
+    mov ecx, r12d
+    shr ecx, 21
+    and ecx, 0x1F
+.set_load_rd:
+    mov [rbx + pipeline_state.load_rd], cl
+    
+    inc ebp  ; Issue cycle
+    
+    test eax, TC_BRANCH
+    jnz .branch
+    test eax, TC_CALL
+    jnz .call
+    test eax, TC_INDIRECT
+    jnz .indirect
+    jmp .memory
+    
+.branch:
+    ; Taken target, decoded the way the branch handlers do
+    mov eax, r12d
+    shl eax, 19
+    sar eax, 18
+    movsxd r12, eax
+    add r12, r14
+    
+    mov rdi, r14
+    mov rsi, r12
+    call branch_predict_body
+    cmp rax, r15
+    je .predicted
+    add ebp, TIMING_MISPREDICT
+    inc qword [r13 + VM_PERF + PERF_BRANCH_MISS * 8]
+    jmp .train
+.predicted:
+    lea rcx, [r14 + 4]
+    cmp r15, rcx
+    je .train
+    add ebp, TIMING_REDIRECT
+.train:
+    lea rcx, [r14 + 4]
+    xor edx, edx
+    cmp r15, rcx
+    setne dl
+    mov rdi, r14
+    mov rsi, r12
+    call branch_update_body
+    jmp .memory
+    
+.call:
+    lea rdi, [r14 + 4]
+    call ras_push
+    add ebp, TIMING_REDIRECT
+    jmp .memory
+    
+.indirect:
+    mov eax, r12d
+    shr eax, 26
+    cmp eax, 0x1F  ; RET
+    je .return
+    
+    ; JMP links through rd (a call), or returns as JMP R0, R31
+    mov eax, r12d
+    shr eax, 21
+    and eax, 0x1F
+    jz .no_link
+    lea rdi, [r14 + 4]
+    call ras_push
+    jmp .unpredicted
+.no_link:
+    mov eax, r12d
+    shr eax, 16
+    and eax, 0x1F
+    cmp eax, 31
+    je .return
+.unpredicted:
+    ; There is no target buffer, so other indirect jumps resolve in execute
+    add ebp, TIMING_MISPREDICT
+    jmp .memory
+    
+.return:
+    call ras_pop
+    cmp rax, r15
+    je .return_hit
+    add ebp, TIMING_MISPREDICT
+    inc qword [r13 + VM_PERF + PERF_BRANCH_MISS * 8]
+    jmp .memory
+.return_hit:
+    add ebp, TIMING_REDIRECT
+    
+.memory:
+    ; Cache misses since the last retire (fetches, plus data in full mode).
+    ; A counter rewound by the host is taken as no new misses.
+    mov rax, [r13 + VM_PERF + PERF_L1_MISS * 8]
+    mov rcx, rax
+    sub rax, [rbx + pipeline_state.l1_misses]
+    jae .l1_delta
     xor eax, eax
-    jmp .done
-    
-.illegal_instruction:
-    mov eax, 1
-    
-.no_instruction:
+.l1_delta:
+    mov [rbx + pipeline_state.l1_misses], rcx
+    imul rax, rax, TIMING_L2_LATENCY
+    add rbp, rax
+    
+    mov rax, [r13 + VM_PERF + PERF_L2_MISS * 8]
+    mov rcx, rax
+    sub rax, [rbx + pipeline_state.l2_misses]
+    jae .l2_delta
     xor eax, eax
+.l2_delta:
+    mov [rbx + pipeline_state.l2_misses], rcx
+    imul rax, rax, TIMING_MEMORY_LATENCY
+    add rbp, rax
+    
+    add [r13 + VM_PERF + PERF_CYCLE_COUNT * 8], rbp
     
-.done:
     pop r15
     pop r14
-    pop r13
     pop r12
-    pop rbx
     pop rbp
-    ret
-
-; Memory stage
-; Input: None
-; Output: RAX = 0 on success, error code otherwise
-pipeline_memory:
-    push rbp
-    mov rbp, rsp
-    push rbx
-    push r12
-    push r13
-    
-    ; Get memory stage
-    lea rbx, [pipeline_state + pipeline_state.stages + STAGE_MEMORY * pipeline_stage_size]
-    
-    ; Check if stage is valid
-    cmp byte [rbx + pipeline_stage.valid], 0
-    je .no_instruction
-    
-    ; Check if memory access is needed
-    cmp byte [rbx + pipeline_stage.mem_addr], 0
-    je .no_memory_access
-    
-    ; Handle memory access based on opcode
-    movzx r12d, byte [rbx + pipeline_stage.opcode]
-    
-    ; Load instructions
-    cmp r12d, 0x0F  ; LD
-    je .handle_load
-    cmp r12d, 0x10  ; LW
-    je .handle_load
-    cmp r12d, 0x11  ; LH
-    je .handle_load
-    cmp r12d, 0x12  ; LB
-    je .handle_load
-    
-    ; Store instructions
-    cmp r12d, 0x13  ; ST
-    je .handle_store
-    cmp r12d, 0x14  ; SW
-    je .handle_store
-    cmp r12d, 0x15  ; SH
-    je .handle_store
-    cmp r12d, 0x16  ; SB
-    je .handle_store
-    
-    jmp .no_memory_access
-    
-.handle_load:
-    ; Load from memory
-    mov rdi, [rbx + pipeline_stage.result]  ; Address
-    lea rsi, [rbx + pipeline_stage.mem_data]  ; Buffer
-    mov rdx, 8  ; 64-bit load
-    call memory_read
-    test rax, rax
-    jnz .memory_error
-    
-    jmp .memory_done
-    
-.handle_store:
-    ; Store to memory
-    mov rdi, [rbx + pipeline_stage.result]  ; Address
-    lea rsi, [rbx + pipeline_stage.mem_data]  ; Data
-    mov rdx, 8  ; 64-bit store
-    call memory_write
-    test rax, rax
-    jnz .memory_error
-    
-.memory_done:
-    ; Update performance counter
-    lea r12, [vm_state]
-    inc qword [r12 + VM_PERF + 6 * 8]  ; Memory operations counter
-    
-.no_memory_access:
-    ; Move to writeback stage
-    lea r12, [pipeline_state + pipeline_state.stages + STAGE_WRITEBACK * pipeline_stage_size]
-    mov al, [rbx + pipeline_stage.opcode]
-    mov [r12 + pipeline_stage.opcode], al
-    mov al, [rbx + pipeline_stage.rd]
-    mov [r12 + pipeline_stage.rd], al
-    mov rax, [rbx + pipeline_stage.result]
-    mov [r12 + pipeline_stage.result], rax
-    mov rax, [rbx + pipeline_stage.mem_data]
-    mov [r12 + pipeline_stage.mem_data], rax
-    mov byte [r12 + pipeline_stage.valid], 1
-    
-    ; Clear memory stage
-    mov byte [rbx + pipeline_stage.valid], 0
-    
-    xor eax, eax
-    jmp .done
-    
-.memory_error:
-    mov eax, -1
-    jmp .done
-    
-.no_instruction:
-    xor eax, eax
-    
-.done:
-    pop r13
-    pop r12
     pop rbx
-    pop rbp
     ret
 
-; Writeback stage
-; Input: None
-; Output: RAX = 0 on success, error code otherwise
-pipeline_writeback:
-    push rbp
-    mov rbp, rsp
-    push rbx
-    push r12
-    push r13
-    
-    ; Get writeback stage
-    lea rbx, [pipeline_state + pipeline_state.stages + STAGE_WRITEBACK * pipeline_stage_size]
-    
-    ; Check if stage is valid
-    cmp byte [rbx + pipeline_stage.valid], 0
-    je .no_instruction
-    
-    ; Get instruction details
-    movzx r12d, byte [rbx + pipeline_stage.opcode]
-    movzx r13d, byte [rbx + pipeline_stage.rd]
-    mov rax, [rbx + pipeline_stage.result]
-    
-    ; Write result to register (if not R0)
-    test r13d, r13d
-    jz .skip_register_write
-    
-    ; Check if this was a load instruction
-    cmp r12d, 0x0F  ; LD
-    jb .not_load
-    cmp r12d, 0x12  ; LB
-    ja .not_load
-    
-    ; Use memory data for loads
-    mov rax, [rbx + pipeline_stage.mem_data]
-    
-.not_load:
-    ; Write to register
-    lea r12, [vm_state]
-    mov [r12 + VM_GPRS + r13 * 8], rax
-    
-.skip_register_write:
-    ; Clear writeback stage
-    mov byte [rbx + pipeline_stage.valid], 0
-    
-    ; Update performance counter
-    lea r12, [vm_state]
-    inc qword [r12 + VM_PERF + 1 * 8]  ; Cycle counter
-    
-    xor eax, eax
-    jmp .done
-    
-.no_instruction:
-    xor eax, eax
-    
-.done:
-    pop r13
-    pop r12
-    pop rbx
-    pop rbp
+; Push a return address
+; Input: RDI = address
+ras_push:
+    mov eax, [r13 + CTX_PIPELINE + pipeline_state.ras_ptr]
+    mov ecx, eax
+    and ecx, RAS_ENTRIES - 1
+    mov [r13 + vm_context.return_stack + rcx * 8], rdi
+    inc eax
+    mov [r13 + CTX_PIPELINE + pipeline_state.ras_ptr], eax
     ret
 
-; Single pipeline step
-; Input: None
-; Output: RAX = 0 on success, error code otherwise
-pipeline_step:
-    push rbp
-    mov rbp, rsp
-    
-    ; Execute pipeline stages in reverse order (writeback to fetch)
-    call pipeline_writeback
-    test rax, rax
-    jnz .error
-    
-    call pipeline_memory
-    test rax, rax
-    jnz .error
-    
-    call pipeline_execute
-    test rax, rax
-    jnz .error
-    
-    call pipeline_decode
-    test rax, rax
-    jnz .error
-    
-    call pipeline_fetch
-    test rax, rax
-    jnz .error
-    
-    xor eax, eax
-    jmp .done
-    
-.error:
-    ; Error occurred
-    
-.done:
-    pop rbp
+; Pop the predicted return address; an underflow wraps to stale entries
+; Output: RAX = address
+ras_pop:
+    mov eax, [r13 + CTX_PIPELINE + pipeline_state.ras_ptr]
+    dec eax
+    mov [r13 + CTX_PIPELINE + pipeline_state.ras_ptr], eax
+    and eax, RAS_ENTRIES - 1
+    mov rax, [r13 + vm_context.return_stack + rax * 8]
     ret
 
-; Check for data hazards
-; Input: RBX = decode stage pointer
-; Output: RAX = 0 if no hazard, 1 if hazard detected
-check_data_hazards:
-    push rbp
-    mov rbp, rsp
-    push rbx
-    push r12
-    push r13
-    push r14
-    
-    ; Get source registers
-    movzx r12d, byte [rbx + pipeline_stage.rs1]
-    movzx r13d, byte [rbx + pipeline_stage.rs2]
-    movzx r14d, byte [rbx + pipeline_stage.rd]
-    
-    ; Check execute stage
-    lea r12, [pipeline_state + pipeline_state.stages + STAGE_EXECUTE * pipeline_stage_size]
-    cmp byte [r12 + pipeline_stage.valid], 0
-    je .check_memory
-    
-    movzx eax, byte [r12 + pipeline_stage.rd]
-    cmp eax, r12d
-    je .hazard_detected
-    cmp eax, r13d
-    je .hazard_detected
-    
-    ; Check memory stage
-.check_memory:
-    lea r12, [pipeline_state + pipeline_state.stages + STAGE_MEMORY * pipeline_stage_size]
-    cmp byte [r12 + pipeline_stage.valid], 0
-    je .check_writeback
-    
-    movzx eax, byte [r12 + pipeline_stage.rd]
-    cmp eax, r12d
-    je .hazard_detected
-    cmp eax, r13d
-    je .hazard_detected
-    
-    ; Check writeback stage
-.check_writeback:
-    lea r12, [pipeline_state + pipeline_state.stages + STAGE_WRITEBACK * pipeline_stage_size]
-    cmp byte [r12 + pipeline_stage.valid], 0
-    je .no_hazard
-    
-    movzx eax, byte [r12 + pipeline_stage.rd]
-    cmp eax, r12d
-    je .hazard_detected
-    cmp eax, r13d
-    je .hazard_detected
-    
-.no_hazard:
-    xor eax, eax
-    jmp .done
-    
-.hazard_detected:
-    mov eax, 1
-    
-.done:
-    pop r14
-    pop r13
-    pop r12
-    pop rbx
-    pop rbp
+; gshare index: PC bits xor the global history
+; Input: RDI = PC
+; Output: RAX = counter index
+branch_index:
+    mov rax, rdi
+    shr rax, 2
+    xor eax, [r13 + CTX_PIPELINE + pipeline_state.ghr]
+    and eax, BP_ENTRIES - 1
     ret
 
 ; Branch prediction
 ; Input: RDI = PC, RSI = target PC
-; Output: RAX = predicted target
-branch_predict:
-    push rbp
-    mov rbp, rsp
-    push rbx
-    
-    ; Calculate branch predictor index
-    mov rax, rdi
-    shr rax, 2  ; Align to instruction boundary
-    and rax, 0x3FF  ; 1024 entries
-    
-    ; Get predictor entry
-    lea rbx, [pipeline_state + pipeline_state.branch_predictor]
-    mov rax, [rbx + rax * 8]
-    
-    ; Check if taken (bit 1 set)
-    test rax, 2
-    jz .not_taken
-    
-    ; Predict taken
+; Output: RAX = predicted next PC
+global branch_predict_body:function hidden
+CONTEXT_ENTRY branch_predict
+branch_predict_body:
+    call branch_index
+    cmp byte [r13 + vm_context.branch_predictor + rax], 2
+    jae .taken
+    lea rax, [rdi + 4]
+    ret
+.taken:
     mov rax, rsi
-    jmp .done
-    
-.not_taken:
-    ; Predict not taken (sequential)
-    mov rax, rdi
-    add rax, 4
-    
-.done:
-    pop rbx
-    pop rbp
     ret
 
 ; Update branch predictor
 ; Input: RDI = PC, RSI = actual target, RDX = taken (1) or not taken (0)
-branch_update:
-    push rbp
-    mov rbp, rsp
-    push rbx
-    push r12
-    
-    ; Calculate branch predictor index
-    mov rax, rdi
-    shr rax, 2
-    and rax, 0x3FF
-    
-    ; Get predictor entry
-    lea rbx, [pipeline_state + pipeline_state.branch_predictor]
-    mov r12, [rbx + rax * 8]
-    
-    ; Update 2-bit saturating counter
+global branch_update_body:function hidden
+CONTEXT_ENTRY branch_update
+branch_update_body:
     test rdx, rdx
-    jz .not_taken_update
-    
-    ; Taken: increment counter
-    cmp r12, 3
-    je .max_taken
-    inc r12
-    jmp .store_update
-    
-.max_taken:
-    ; Already at maximum
-    jmp .store_update
-    
-.not_taken_update:
-    ; Not taken: decrement counter
-    test r12, r12
-    jz .min_not_taken
-    dec r12
-    
-.min_not_taken:
-    ; Already at minimum
-    
-.store_update:
-    ; Store updated counter
-    mov [rbx + rax * 8], r12
-    
-    pop r12
-    pop rbx
-    pop rbp
-    ret
-
-; Flush pipeline
-; Input: RDI = new PC
-pipeline_flush:
-    push rbp
-    mov rbp, rsp
-    push rbx
-    
-    ; Clear all pipeline stages
-    lea rbx, [pipeline_state + pipeline_state.stages]
-    mov ecx, 5
-    
-.clear_loop:
-    mov byte [rbx + pipeline_stage.valid], 0
-    mov byte [rbx + pipeline_stage.stall], 0
-    mov byte [rbx + pipeline_stage.flush], 0
-    add rbx, pipeline_stage_size
-    loop .clear_loop
-    
-    ; Update PC
-    lea rbx, [vm_state]
-    mov [rbx + VM_PC], rdi
-    
-    pop rbx
-    pop rbp
-    ret
-
-; Stall pipeline
-; Input: RDI = stage to stall (0-4)
-pipeline_stall:
-    push rbp
-    mov rbp, rsp
-    push rbx
-    
-    ; Set stall bit for specified stage
-    lea rbx, [pipeline_state + pipeline_state.stages]
-    mov rax, rdi
-    imul rax, pipeline_stage_size
-    add rbx, rax
-    mov byte [rbx + pipeline_stage.stall], 1
-    
-    pop rbx
-    pop rbp
+    setnz dl
+    movzx edx, dl
+    
+    ; Step the 2-bit saturating counter toward the outcome
+    call branch_index
+    lea rcx, [r13 + vm_context.branch_predictor + rax]
+    mov al, [rcx]
+    test edx, edx
+    jz .not_taken
+    cmp al, 3
+    adc al, 0  ; +1 unless already 3
+    jmp .store
+.not_taken:
+    sub al, 1
+    adc al, 0  ; -1 unless already 0
+.store:
+    mov [rcx], al
+    
+    ; Shift the outcome into the global history
+    mov eax, [r13 + CTX_PIPELINE + pipeline_state.ghr]
+    add eax, eax
+    or eax, edx
+    and eax, BP_ENTRIES - 1
+    mov [r13 + CTX_PIPELINE + pipeline_state.ghr], eax
     ret
-
-; Instruction execution stubs (these would be implemented in vm.asm)
-execute_add: ret
-execute_sub: ret
-execute_mul: ret
-execute_mulh: ret
-execute_div: ret
-execute_mod: ret
-execute_and: ret
-execute_or: ret
-execute_xor: ret
-execute_not: ret
-execute_shl: ret
-execute_shr: ret
-execute_sar: ret
-execute_rol: ret
-execute_ror: ret
-execute_ld: ret
-execute_lw: ret
-execute_lh: ret
-execute_lb: ret
-execute_st: ret
-execute_sw: ret
-execute_sh: ret
-execute_sb: ret
-execute_beq: ret
-execute_bne: ret
-execute_blt: ret
-execute_bge: ret
-execute_bltu: ret
-execute_bgeu: ret
-execute_jmp: ret
-execute_call: ret
-execute_ret: ret
-execute_syscall: ret
-execute_halt: ret
-execute_nop: ret
-execute_cpuid: ret
-execute_rdcycle: ret
-execute_rdperf: ret
-execute_prefetch: ret
-execute_clflush: ret
-execute_fence: ret
-execute_lr: ret
-execute_sc: ret
-execute_amoswap: ret
-execute_amoadd: ret
-execute_amoand: ret
-execute_amoor: ret
-execute_amoxor: ret
-execute_vadd_f64: ret
-execute_vsub_f64: ret
-execute_vmul_f64: ret
-execute_vfma_f64: ret
-execute_vload: ret
-execute_vstore: ret
-execute_vbroadcast: ret
-execute_illegal: ret
\ No newline at end of file
@@ -5,26 +5,10 @@
 ; License: MIT
 
 BITS 64
-SECTION .text
 
-; Constants
-%define NUM_GPRS 32
-%define NUM_VREGS 16
-%define GPR_SIZE 8
-%define VREG_SIZE 32
-%define CACHE_LINE_SIZE 64
-%define PAGE_SIZE 4096
-
-; VM State Structure Offsets
-%define VM_PC 0
-%define VM_SP 8
-%define VM_FLAGS 16
-%define VM_GPRS 24
-%define VM_VREGS (VM_GPRS + NUM_GPRS * GPR_SIZE)
-%define VM_PERF (VM_VREGS + NUM_VREGS * VREG_SIZE)
-%define VM_CACHE_CTRL (VM_PERF + 64)
-%define VM_VBASE (VM_CACHE_CTRL + 8)
-%define VM_STATE_SIZE (VM_VBASE + 8)
+%include "context.inc"
+
+SECTION .text
 
 ; Flags Register Bits
 %define FLAG_ZERO 0
@@ -44,35 +28,129 @@ SECTION .text
 %define PERF_MEM_OPS 6
 %define PERF_SIMD_OPS 7
 
+; Slow-work bits: any set bit diverts dispatch to vm_slow_path
+%define SLOW_HALT 0x01          ; HALT, SYSCALL exit or illegal instruction
+%define SLOW_DEBUG 0x02         ; debug_mode on: check breakpoints
+%define SLOW_IRQ 0x04           ; Interrupt raised since the last check
+%define SLOW_ILLEGAL 0x08       ; Stop with the illegal-instruction exit code
+
+; SIMD handler levels, selected by nanocore_init
+%define SIMD_LEVEL_SSE2 0       ; x86-64 baseline
+%define SIMD_LEVEL_AVX2 1       ; AVX2 + FMA3
+%define SIMD_LEVEL_AVX512 2     ; AVX-512F + VL
+%define SIMD_LEVELS 3
+%define SIMD_FIRST_OPCODE 0x30
+%define SIMD_HANDLERS 7         ; 0x30-0x36
+
+; Dispatch mode: threaded by default, call/ret with -DCALL_DISPATCH
+%ifndef CALL_DISPATCH
+%define THREADED_DISPATCH
+%endif
+
+; Call a helper from dispatch context. Threaded handlers are entered by
+; jmp, so their tail runs with the ABI entry alignment and must pad.
+%macro DISPATCH_CALL 1
+%ifdef THREADED_DISPATCH
+    sub rsp, 8
+    call %1
+    add rsp, 8
+%else
+    call %1
+%endif
+%endmacro
+
+; Retire the current instruction, then fetch, decode and jump straight
+; to the next handler. The fetch is a fast-TLB hit inline; the cache model
+; only runs when its countdown expires (every fetch in full mode, never
+; when it is off).
+%macro NEXT_INSTRUCTION 0
+    inc qword [r13 + VM_PERF + PERF_INST_COUNT * 8]
+    inc r14
+    cmp r14, r15
+    jae vm_run_done
+    cmp byte [r13 + vm_context.slow_work], 0
+    jne vm_slow_path
+    
+    mov rdi, [r13 + VM_PC]
+    dec qword [r13 + CTX_CACHE + cache_state.countdown]
+    jz %%sample
+%%fetch:
+    FAST_TLB_LOAD 4, %%miss
+    jmp %%dispatch
+%%sample:
+    DISPATCH_CALL cache_sample_fetch
+    mov rdi, [r13 + VM_PC]
+    jmp %%fetch
+%%miss:
+    DISPATCH_CALL memory_load32_body
+%%dispatch:
+    mov ebx, eax
+    add qword [r13 + VM_PC], 4
+    shr eax, 26
+    jmp [r12 + rax * 8]
+%endmacro
+
+; Handler epilogue for the selected dispatch mode
+%ifdef THREADED_DISPATCH
+%define HANDLER_RETURN NEXT_INSTRUCTION
+%else
+%define HANDLER_RETURN ret
+%endif
+
 ; Global symbols
 global vm_init
 global vm_reset
 global vm_run
 global vm_step
 global vm_get_state
+global vm_get_register
+global vm_set_register
+global vm_set_pc
+global vm_get_perf
 global vm_set_breakpoint
+global vm_clear_breakpoint
 global vm_dump_state
+global vm_set_debug_mode
+global vm_set_timing_mode
+global vm_raise_slow_work
+global vm_raise_slow_work_body:function hidden
+global vm_context_create
+global vm_context_destroy
+global vm_context_size
+global vm_get_abi
+global nanocore_init
+global nanocore_simd_level
 
 ; External symbols
-extern memory_init
-extern memory_read
-extern memory_write
-extern cache_init
-extern cache_lookup
-extern cache_update
-extern device_init
-extern device_read
-extern device_write
-
-SECTION .bss
-align 64
-vm_state: resb VM_STATE_SIZE
-instruction_cache: resb 32768   ; 32KB L1I
-data_cache: resb 32768          ; 32KB L1D
-unified_cache: resb 262144      ; 256KB L2
-branch_predictor: resb 16384    ; 2-bit counters
-return_stack: resq 16           ; Return address stack
-pipeline_buffer: resb 256       ; Instruction prefetch
+extern memory_init_body
+extern memory_read_body
+extern memory_write_body
+extern memory_host_address
+extern memory_load8_body
+extern memory_load16_body
+extern memory_load32_body
+extern memory_load64_body
+extern memory_store8_body
+extern memory_store16_body
+extern memory_store32_body
+extern memory_store64_body
+extern memory_copy_body
+extern memory_fill_body
+extern memory_cleanup_body
+extern cache_init_body
+extern cache_cleanup_body
+extern cache_flush_body
+extern cache_get_stats_body
+extern cache_sample_fetch
+extern pipeline_init_body
+extern pipeline_issue_body
+extern pipeline_drain_body
+extern device_init_body
+extern device_read_body
+extern device_write_body
+extern posix_memalign
+extern memset
+extern free
 
 SECTION .data
 align 64
@@ -126,65 +204,90 @@ opcode_table:
     dq execute_amoand   ; 0x2D
     dq execute_amoor    ; 0x2E
     dq execute_amoxor   ; 0x2F
-    dq execute_vadd_f64 ; 0x30
-    dq execute_vsub_f64 ; 0x31
-    dq execute_vmul_f64 ; 0x32
-    dq execute_vfma_f64 ; 0x33
-    dq execute_vload    ; 0x34
-    dq execute_vstore   ; 0x35
-    dq execute_vbroadcast ; 0x36
-    times 201 dq execute_illegal  ; Fill rest with illegal instruction handler
-
-; Performance monitoring
-perf_enabled: db 1
-turbo_mode: db 0
-debug_mode: db 0
+    dq execute_vadd_f64_sse2 ; 0x30, SIMD entries patched by nanocore_init
+    dq execute_vsub_f64_sse2 ; 0x31
+    dq execute_vmul_f64_sse2 ; 0x32
+    dq execute_vfma_f64_sse2 ; 0x33
+    dq execute_vload_sse2 ; 0x34
+    dq execute_vstore_sse2 ; 0x35
+    dq execute_vbroadcast_sse2 ; 0x36
+    dq execute_mcopy    ; 0x37
+    dq execute_mfill    ; 0x38
+    times 199 dq execute_illegal  ; Fill rest with illegal instruction handler
+
+; SIMD handler variants, one row per opcode from SIMD_FIRST_OPCODE
+simd_variants:
+    dq execute_vadd_f64_sse2, execute_vadd_f64_avx2, execute_vadd_f64_avx512
+    dq execute_vsub_f64_sse2, execute_vsub_f64_avx2, execute_vsub_f64_avx512
+    dq execute_vmul_f64_sse2, execute_vmul_f64_avx2, execute_vmul_f64_avx512
+    dq execute_vfma_f64_sse2, execute_vfma_f64_avx2, execute_vfma_f64_avx512
+    dq execute_vload_sse2, execute_vload_avx2, execute_vload_avx512
+    dq execute_vstore_sse2, execute_vstore_avx2, execute_vstore_avx512
+    dq execute_vbroadcast_sse2, execute_vbroadcast_avx2, execute_vbroadcast_avx512
+
+simd_level: dd -1  ; Selected SIMD_LEVEL_*, -1 until nanocore_init runs
+
+; State layout in nanocore_abi_t form; the core has no perf or options
+; structs, so those sizes are 0
+state_abi:
+    dd state_abi_size, VM_ABI_VERSION, VM_STATE_SIZE
+    dd VM_PC, VM_SP, VM_FLAGS, VM_GPRS, VM_VREGS, VM_PERF, VM_CACHE_CTRL, VM_VBASE
+    dd 0, 0, 0
+state_abi_size equ $ - state_abi
+
+; Timing-mode dispatch: every opcode runs the pipeline model first
+align 64
+timing_table:
+    times 64 dq timing_dispatch  ; One entry per 6-bit opcode
 
 SECTION .text
 
 ; Initialize VM
 ; Input: RDI = memory size
 ; Output: RAX = 0 on success, error code otherwise
-vm_init:
+CONTEXT_ENTRY vm_init
+vm_init_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
     push r14
     push r15
     
+    mov r12, rdi  ; Memory size
+    
     ; Clear VM state
-    mov rdi, vm_state
+    mov rdi, r13
     xor eax, eax
     mov ecx, VM_STATE_SIZE / 8
     rep stosq
     
     ; Initialize memory subsystem
-    mov rdi, [rbp + 16]
-    call memory_init
+    mov rdi, r12
+    call memory_init_body
     test rax, rax
     jnz .error
     
     ; Initialize cache subsystem
-    call cache_init
+    call cache_init_body
     test rax, rax
     jnz .error
     
     ; Initialize device subsystem
-    call device_init
+    call device_init_body
     test rax, rax
     jnz .error
     
     ; Set initial PC to reset vector
-    mov qword [vm_state + VM_PC], 0
+    mov qword [r13 + VM_PC], 0
     
     ; Enable interrupts by default
-    mov byte [vm_state + VM_FLAGS], (1 << FLAG_IE)
+    mov byte [r13 + VM_FLAGS], (1 << FLAG_IE)
+    and byte [r13 + vm_context.slow_work], SLOW_DEBUG
+    mov byte [r13 + vm_context.perf_enabled], 1
     
-    ; Initialize performance counters
-    rdtsc
-    mov [vm_state + VM_PERF + PERF_CYCLE_COUNT * 8], rax
+    ; PERF_CYCLE_COUNT counts modeled cycles, from zero
+    call pipeline_init_body
     
     xor eax, eax
     jmp .done
@@ -195,19 +298,19 @@ vm_init:
 .done:
     pop r15
     pop r14
-    pop r13
     pop r12
     pop rbx
     pop rbp
     ret
 
 ; Reset VM to initial state
-vm_reset:
+CONTEXT_ENTRY vm_reset
+vm_reset_body:
     push rbp
     mov rbp, rsp
     
     ; Clear GPRs (except R0 which is always 0)
-    lea rdi, [vm_state + VM_GPRS + 8]
+    lea rdi, [r13 + VM_GPRS + 8]
     xor eax, eax
     mov ecx, (NUM_GPRS - 1)
 .clear_gprs:
@@ -216,7 +319,7 @@ vm_reset:
     loop .clear_gprs
     
     ; Clear vector registers
-    lea rdi, [vm_state + VM_VREGS]
+    lea rdi, [r13 + VM_VREGS]
     mov ecx, NUM_VREGS * 4  ; 4 qwords per vreg
 .clear_vregs:
     mov [rdi], rax
@@ -224,27 +327,36 @@ vm_reset:
     loop .clear_vregs
     
     ; Reset PC and flags
-    mov qword [vm_state + VM_PC], 0
-    mov byte [vm_state + VM_FLAGS], (1 << FLAG_IE)
+    mov qword [r13 + VM_PC], 0
+    mov byte [r13 + VM_FLAGS], (1 << FLAG_IE)
+    and byte [r13 + vm_context.slow_work], SLOW_DEBUG
     
     ; Clear performance counters
-    lea rdi, [vm_state + VM_PERF]
+    lea rdi, [r13 + VM_PERF]
     mov ecx, 8
 .clear_perf:
     mov [rdi], rax
     add rdi, 8
     loop .clear_perf
     
-    ; Flush caches
-    call flush_all_caches
+    ; Flush caches and restart the timing model
+    xor edi, edi
+    call cache_flush_body
+    call pipeline_init_body
     
     pop rbp
     ret
 
 ; Main execution loop
 ; Input: RDI = max instructions (0 = unlimited)
-; Output: RAX = exit code
-vm_run:
+; Output: RAX = exit code (0 = normal, 1 = illegal instruction, 2 = breakpoint)
+;
+; Halt, breakpoint and interrupt checks are folded into vm_context.slow_work,
+; so the common path per instruction is one limit compare and one byte test.
+; In threaded mode each handler ends in NEXT_INSTRUCTION and jumps directly
+; to the following handler; vm_run itself only dispatches the first one.
+CONTEXT_ENTRY vm_run
+vm_run_body:
     push rbp
     mov rbp, rsp
     push rbx
@@ -252,85 +364,101 @@ vm_run:
     push r13
     push r14
     push r15
+%ifndef THREADED_DISPATCH
+    sub rsp, 8    ; Keep handler calls ABI-aligned
+%endif
     
     mov r15, rdi  ; Save max instructions
+    test r15, r15
+    jnz .limit_set
+    mov r15, -1   ; Unlimited
+.limit_set:
     xor r14, r14  ; Instruction counter
     
-    ; Load frequently used values into registers
-    lea r13, [vm_state]
+    ; Load frequently used values into registers (R13 is the context)
     lea r12, [opcode_table]
+    cmp byte [r13 + vm_context.timing_mode], 0
+    je vm_dispatch_check
+    lea r12, [timing_table]
     
-.execution_loop:
+vm_dispatch_check:
     ; Check instruction limit
-    test r15, r15
-    jz .no_limit
     cmp r14, r15
-    jae .done
-.no_limit:
+    jae vm_run_done
     
-    ; Fetch instruction
-    mov rax, [r13 + VM_PC]
-    
-    ; Check for breakpoint
-    cmp byte [debug_mode], 0
-    jne .check_breakpoint
-.continue_fetch:
-    
-    ; Prefetch next cache line
-    prefetchnta [rax + CACHE_LINE_SIZE]
+    ; Any halt, debug or interrupt work pending?
+    cmp byte [r13 + vm_context.slow_work], 0
+    jne vm_slow_path
     
+vm_dispatch_fetch:
     ; Read instruction from memory
-    mov rdi, rax
-    call fetch_instruction
+    mov rdi, [r13 + VM_PC]
+    prefetchnta [rdi + CACHE_LINE_SIZE]
+    DISPATCH_CALL fetch_instruction
     mov ebx, eax  ; Save instruction
     
     ; Advance PC
     add qword [r13 + VM_PC], 4
     
-    ; Decode and dispatch
+    ; Decode (6-bit opcode, table is fully populated)
     mov eax, ebx
-    shr eax, 26  ; Extract opcode
-    and eax, 0x3F
+    shr eax, 26
     
-    ; Bounds check opcode
-    cmp eax, 0x36
-    ja .illegal_instruction
-    
-    ; Dispatch to handler
-    mov rax, [r12 + rax * 8]
-    call rax
+%ifdef THREADED_DISPATCH
+    jmp [r12 + rax * 8]
+%else
+    call [r12 + rax * 8]
     
     ; Update performance counters
     inc qword [r13 + VM_PERF + PERF_INST_COUNT * 8]
     inc r14
-    
-    ; Check for halt
-    test byte [r13 + VM_FLAGS], 0x80
-    jnz .done
-    
-    ; Check for interrupts
+    jmp vm_dispatch_check
+%endif
+    
+; Out-of-line handling for everything flagged in vm_context.slow_work
+vm_slow_path:
+    movzx eax, byte [r13 + vm_context.slow_work]
+    test al, SLOW_ILLEGAL
+    jnz vm_run_illegal
+    test al, SLOW_HALT
+    jnz vm_run_done
+    
+    ; Interrupts are only polled after one was raised
+    test al, SLOW_IRQ
+    jz .no_irq
+    lock and byte [r13 + vm_context.slow_work], ~SLOW_IRQ
     test byte [r13 + VM_FLAGS], (1 << FLAG_IE)
-    jz .execution_loop
-    call check_interrupts
+    jz .no_irq
+    DISPATCH_CALL check_interrupts
+.no_irq:
     
-    jmp .execution_loop
-    
-.check_breakpoint:
+    ; Breakpoints are only checked in debug mode
+    test byte [r13 + vm_context.slow_work], SLOW_DEBUG
+    jz vm_dispatch_fetch
     mov rdi, [r13 + VM_PC]
-    call is_breakpoint
+    DISPATCH_CALL is_breakpoint
     test rax, rax
-    jz .continue_fetch
+    jz vm_dispatch_fetch
     mov eax, 2  ; Breakpoint hit
-    jmp .exit
+    jmp vm_run_exit
     
-.illegal_instruction:
+vm_run_illegal:
     mov eax, 1  ; Illegal instruction
-    jmp .exit
+    jmp vm_run_exit
     
-.done:
+vm_run_done:
     xor eax, eax  ; Normal completion
     
-.exit:
+vm_run_exit:
+    cmp byte [r13 + vm_context.timing_mode], 0
+    je .untimed
+    mov ebx, eax
+    DISPATCH_CALL pipeline_drain_body
+    mov eax, ebx
+.untimed:
+%ifndef THREADED_DISPATCH
+    add rsp, 8
+%endif
     pop r15
     pop r14
     pop r13
@@ -339,50 +467,16 @@ vm_run:
     pop rbp
     ret
 
-; Fetch instruction with cache lookup
+; Fetch an instruction, running the cache model when a sample is due
 ; Input: RDI = address
 ; Output: EAX = instruction
 fetch_instruction:
-    push rbx
-    push rcx
-    
-    ; Check L1I cache
-    mov rax, rdi
-    shr rax, 6  ; Cache line index
-    and rax, 0x1FF  ; 512 lines
-    
-    lea rbx, [instruction_cache + rax * 64]
-    mov rcx, [rbx]  ; Tag
-    cmp rcx, rdi
-    jne .cache_miss
-    
-    ; Cache hit - get instruction
-    mov eax, rdi
-    and eax, 0x3C  ; Offset within cache line
-    mov eax, [rbx + rax + 8]
-    
-    pop rcx
-    pop rbx
-    ret
-    
-.cache_miss:
-    ; Update miss counter
-    inc qword [vm_state + VM_PERF + PERF_L1_MISS * 8]
-    
-    ; Fetch from memory
-    call memory_read
-    mov edx, eax  ; Save instruction
-    
-    ; Update cache
-    mov [rbx], rdi  ; Store tag
-    mov eax, edi
-    and eax, 0x3C
-    mov [rbx + rax + 8], edx
-    
-    mov eax, edx
-    pop rcx
-    pop rbx
-    ret
+    dec qword [r13 + CTX_CACHE + cache_state.countdown]
+    jnz memory_load32_body
+    push rdi
+    call cache_sample_fetch
+    pop rdi
+    jmp memory_load32_body
 
 ; Execute ADD instruction
 execute_add:
@@ -421,7 +515,7 @@ execute_add:
     
 .done:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Update flags based on result
 ; Input: RAX = CPU flags
@@ -460,41 +554,6 @@ update_flags:
     pop rbx
     ret
 
-; SIMD VADD.F64 implementation
-execute_vadd_f64:
-    push rbp
-    mov rbp, rsp
-    
-    ; Extract operands
-    mov eax, ebx
-    shr eax, 21
-    and eax, 0xF  ; vd
-    
-    mov ecx, ebx
-    shr ecx, 16
-    and ecx, 0xF  ; vs1
-    
-    mov edx, ebx
-    shr edx, 11
-    and edx, 0xF  ; vs2
-    
-    ; Load vector operands
-    lea rsi, [r13 + VM_VREGS + rcx * 32]
-    lea rdi, [r13 + VM_VREGS + rdx * 32]
-    lea r8, [r13 + VM_VREGS + rax * 32]
-    
-    ; Perform vector addition (4x double precision)
-    vmovupd ymm0, [rsi]
-    vmovupd ymm1, [rdi]
-    vaddpd ymm2, ymm0, ymm1
-    vmovupd [r8], ymm2
-    
-    ; Update SIMD operation counter
-    inc qword [r13 + VM_PERF + PERF_SIMD_OPS * 8]
-    
-    pop rbp
-    ret
-
 ; Execute SUB instruction
 execute_sub:
     push rbp
@@ -532,7 +591,7 @@ execute_sub:
     
 .done:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute MUL instruction
 execute_mul:
@@ -571,7 +630,7 @@ execute_mul:
 .done:
     pop rdx
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute MULH instruction (high 64 bits of multiplication)
 execute_mulh:
@@ -610,7 +669,7 @@ execute_mulh:
 .done:
     pop rdx
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute DIV instruction
 execute_div:
@@ -664,7 +723,7 @@ execute_div:
 .done:
     pop rdx
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute MOD instruction
 execute_mod:
@@ -722,7 +781,7 @@ execute_mod:
 .done:
     pop rdx
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute AND instruction
 execute_and:
@@ -762,7 +821,7 @@ execute_and:
     
 .done:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute OR instruction
 execute_or:
@@ -802,7 +861,7 @@ execute_or:
     
 .done:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute XOR instruction
 execute_xor:
@@ -842,7 +901,7 @@ execute_xor:
     
 .done:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute NOT instruction
 execute_not:
@@ -877,7 +936,7 @@ execute_not:
     
 .done:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute SHL (shift left) instruction
 execute_shl:
@@ -919,7 +978,7 @@ execute_shl:
 .done:
     pop rcx
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute SHR (shift right logical) instruction
 execute_shr:
@@ -961,7 +1020,7 @@ execute_shr:
 .done:
     pop rcx
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute SAR (shift right arithmetic) instruction
 execute_sar:
@@ -1003,7 +1062,7 @@ execute_sar:
 .done:
     pop rcx
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute ROL (rotate left) instruction
 execute_rol:
@@ -1040,7 +1099,7 @@ execute_rol:
 .done:
     pop rcx
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute ROR (rotate right) instruction
 execute_ror:
@@ -1077,7 +1136,7 @@ execute_ror:
 .done:
     pop rcx
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute LD (load 64-bit) instruction
 execute_ld:
@@ -1102,8 +1161,9 @@ execute_ld:
     mov rdi, [r13 + VM_GPRS + rcx * 8]
     add rdi, rdx
     
-    ; Read from memory
-    call memory_read  ; Returns value in RAX
+    ; Read from memory; a fast-TLB hit is one compare and the load
+    FAST_TLB_LOAD 8, .slow
+.loaded:
     
     ; Store to register (skip if rd = 0)
     mov ecx, ebx
@@ -1120,7 +1180,11 @@ execute_ld:
     pop rcx
     pop rbx
     pop rbp
-    ret
+    HANDLER_RETURN
+    
+.slow:
+    call memory_load64_body
+    jmp .loaded
 
 ; Execute LW (load 32-bit sign extend) instruction
 execute_lw:
@@ -1145,8 +1209,9 @@ execute_lw:
     mov rdi, [r13 + VM_GPRS + rcx * 8]
     add rdi, rdx
     
-    ; Read from memory
-    call memory_read
+    ; Read from memory; a fast-TLB hit is one compare and the load
+    FAST_TLB_LOAD 4, .slow
+.loaded:
     
     ; Sign extend 32-bit to 64-bit
     movsx rax, eax
@@ -1165,7 +1230,11 @@ execute_lw:
     pop rcx
     pop rbx
     pop rbp
-    ret
+    HANDLER_RETURN
+    
+.slow:
+    call memory_load32_body
+    jmp .loaded
 
 ; Execute LH (load 16-bit sign extend) instruction
 execute_lh:
@@ -1190,8 +1259,9 @@ execute_lh:
     mov rdi, [r13 + VM_GPRS + rcx * 8]
     add rdi, rdx
     
-    ; Read from memory
-    call memory_read
+    ; Read from memory; a fast-TLB hit is one compare and the load
+    FAST_TLB_LOAD 2, .slow
+.loaded:
     
     ; Sign extend 16-bit to 64-bit
     movsx rax, ax
@@ -1210,7 +1280,11 @@ execute_lh:
     pop rcx
     pop rbx
     pop rbp
-    ret
+    HANDLER_RETURN
+    
+.slow:
+    call memory_load16_body
+    jmp .loaded
 
 ; Execute LB (load 8-bit sign extend) instruction
 execute_lb:
@@ -1235,8 +1309,9 @@ execute_lb:
     mov rdi, [r13 + VM_GPRS + rcx * 8]
     add rdi, rdx
     
-    ; Read from memory
-    call memory_read
+    ; Read from memory; a fast-TLB hit is one compare and the load
+    FAST_TLB_LOAD 1, .slow
+.loaded:
     
     ; Sign extend 8-bit to 64-bit
     movsx rax, al
@@ -1255,7 +1330,11 @@ execute_lb:
     pop rcx
     pop rbx
     pop rbp
-    ret
+    HANDLER_RETURN
+    
+.slow:
+    call memory_load8_body
+    jmp .loaded
 
 ; Execute ST (store 64-bit) instruction
 execute_st:
@@ -1270,8 +1349,8 @@ execute_st:
     and ecx, 0x1F  ; rs1 (base address)
     
     mov edx, ebx
-    shr edx, 11
-    and edx, 0x1F  ; rs2 (value to store)
+    shr edx, 21
+    and edx, 0x1F  ; rs2 (value to store, in the rd field)
     
     ; Extract immediate offset
     movsx rax, bx
@@ -1283,8 +1362,9 @@ execute_st:
     ; Get value to store
     mov rsi, [r13 + VM_GPRS + rdx * 8]
     
-    ; Write to memory
-    call memory_write
+    ; Write to memory; a fast-TLB hit is one compare and the store
+    FAST_TLB_STORE 8, .slow
+.stored:
     
     ; Update memory operation counter
     inc qword [r13 + VM_PERF + PERF_MEM_OPS * 8]
@@ -1292,7 +1372,11 @@ execute_st:
     pop rcx
     pop rbx
     pop rbp
-    ret
+    HANDLER_RETURN
+    
+.slow:
+    call memory_store64_body
+    jmp .stored
 
 ; Execute SW (store 32-bit) instruction
 execute_sw:
@@ -1307,8 +1391,8 @@ execute_sw:
     and ecx, 0x1F  ; rs1 (base address)
     
     mov edx, ebx
-    shr edx, 11
-    and edx, 0x1F  ; rs2 (value to store)
+    shr edx, 21
+    and edx, 0x1F  ; rs2 (value to store, in the rd field)
     
     ; Extract immediate offset
     movsx rax, bx
@@ -1320,15 +1404,20 @@ execute_sw:
     ; Get value to store (32-bit)
     mov esi, dword [r13 + VM_GPRS + rdx * 8]
     
-    ; Write to memory
-    call memory_write
+    ; Write to memory; a fast-TLB hit is one compare and the store
+    FAST_TLB_STORE 4, .slow
+.stored:
     
     inc qword [r13 + VM_PERF + PERF_MEM_OPS * 8]
     
     pop rcx
     pop rbx
     pop rbp
-    ret
+    HANDLER_RETURN
+    
+.slow:
+    call memory_store32_body
+    jmp .stored
 
 ; Execute SH (store 16-bit) instruction
 execute_sh:
@@ -1343,8 +1432,8 @@ execute_sh:
     and ecx, 0x1F  ; rs1 (base address)
     
     mov edx, ebx
-    shr edx, 11
-    and edx, 0x1F  ; rs2 (value to store)
+    shr edx, 21
+    and edx, 0x1F  ; rs2 (value to store, in the rd field)
     
     ; Extract immediate offset
     movsx rax, bx
@@ -1356,15 +1445,20 @@ execute_sh:
     ; Get value to store (16-bit)
     mov si, word [r13 + VM_GPRS + rdx * 8]
     
-    ; Write to memory
-    call memory_write
+    ; Write to memory; a fast-TLB hit is one compare and the store
+    FAST_TLB_STORE 2, .slow
+.stored:
     
     inc qword [r13 + VM_PERF + PERF_MEM_OPS * 8]
     
     pop rcx
     pop rbx
     pop rbp
-    ret
+    HANDLER_RETURN
+    
+.slow:
+    call memory_store16_body
+    jmp .stored
 
 ; Execute SB (store 8-bit) instruction
 execute_sb:
@@ -1379,8 +1473,8 @@ execute_sb:
     and ecx, 0x1F  ; rs1 (base address)
     
     mov edx, ebx
-    shr edx, 11
-    and edx, 0x1F  ; rs2 (value to store)
+    shr edx, 21
+    and edx, 0x1F  ; rs2 (value to store, in the rd field)
     
     ; Extract immediate offset
     movsx rax, bx
@@ -1392,15 +1486,20 @@ execute_sb:
     ; Get value to store (8-bit)
     mov sil, byte [r13 + VM_GPRS + rdx * 8]
     
-    ; Write to memory
-    call memory_write
+    ; Write to memory; a fast-TLB hit is one compare and the store
+    FAST_TLB_STORE 1, .slow
+.stored:
     
     inc qword [r13 + VM_PERF + PERF_MEM_OPS * 8]
     
     pop rcx
     pop rbx
     pop rbp
-    ret
+    HANDLER_RETURN
+    
+.slow:
+    call memory_store8_body
+    jmp .stored
 
 ; Execute BEQ (branch if equal) instruction
 execute_beq:
@@ -1434,12 +1533,9 @@ execute_beq:
     add [r13 + VM_PC], rax
     sub qword [r13 + VM_PC], 4  ; Compensate for PC increment
     
-    ; Update branch prediction counter
-    inc qword [r13 + VM_PERF + PERF_BRANCH_MISS * 8]
-    
 .no_branch:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute BNE (branch if not equal) instruction
 execute_bne:
@@ -1473,11 +1569,9 @@ execute_bne:
     add [r13 + VM_PC], rax
     sub qword [r13 + VM_PC], 4
     
-    inc qword [r13 + VM_PERF + PERF_BRANCH_MISS * 8]
-    
 .no_branch:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute BLT (branch if less than) instruction
 execute_blt:
@@ -1511,11 +1605,9 @@ execute_blt:
     add [r13 + VM_PC], rax
     sub qword [r13 + VM_PC], 4
     
-    inc qword [r13 + VM_PERF + PERF_BRANCH_MISS * 8]
-    
 .no_branch:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute BGE (branch if greater or equal) instruction
 execute_bge:
@@ -1549,11 +1641,9 @@ execute_bge:
     add [r13 + VM_PC], rax
     sub qword [r13 + VM_PC], 4
     
-    inc qword [r13 + VM_PERF + PERF_BRANCH_MISS * 8]
-    
 .no_branch:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute BLTU (branch if less than unsigned) instruction
 execute_bltu:
@@ -1587,11 +1677,9 @@ execute_bltu:
     add [r13 + VM_PC], rax
     sub qword [r13 + VM_PC], 4
     
-    inc qword [r13 + VM_PERF + PERF_BRANCH_MISS * 8]
-    
 .no_branch:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute BGEU (branch if greater or equal unsigned) instruction
 execute_bgeu:
@@ -1625,11 +1713,9 @@ execute_bgeu:
     add [r13 + VM_PC], rax
     sub qword [r13 + VM_PC], 4
     
-    inc qword [r13 + VM_PERF + PERF_BRANCH_MISS * 8]
-    
 .no_branch:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute JMP (jump and link) instruction
 execute_jmp:
@@ -1663,7 +1749,7 @@ execute_jmp:
     mov [r13 + VM_PC], r8
     
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute CALL instruction
 execute_call:
@@ -1686,14 +1772,14 @@ execute_call:
     sub qword [r13 + VM_PC], 4
     
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute RET instruction
 execute_ret:
     ; Simple implementation: JMP to R31
     mov rax, [r13 + VM_GPRS + 31 * 8]
     mov [r13 + VM_PC], rax
-    ret
+    HANDLER_RETURN
 
 ; Execute SYSCALL instruction
 execute_syscall:
@@ -1726,20 +1812,22 @@ execute_syscall:
 .sys_exit:
     ; Exit code in R1
     or byte [r13 + VM_FLAGS], 0x80  ; Set halt flag
+    or byte [r13 + vm_context.slow_work], SLOW_HALT
     
 .done:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute HALT instruction
 execute_halt:
     or byte [r13 + VM_FLAGS], 0x80  ; Set halt flag
-    ret
+    or byte [r13 + vm_context.slow_work], SLOW_HALT
+    HANDLER_RETURN
 
 ; Execute NOP instruction
 execute_nop:
     ; No operation
-    ret
+    HANDLER_RETURN
 
 ; Execute CPUID instruction
 execute_cpuid:
@@ -1761,7 +1849,7 @@ execute_cpuid:
     
 .done:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute RDCYCLE instruction
 execute_rdcycle:
@@ -1788,7 +1876,7 @@ execute_rdcycle:
     
 .done:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute RDPERF instruction
 execute_rdperf:
@@ -1821,7 +1909,7 @@ execute_rdperf:
     
 .done:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute PREFETCH instruction
 execute_prefetch:
@@ -1844,7 +1932,7 @@ execute_prefetch:
     prefetchnta [rdi]
     
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute CLFLUSH instruction
 execute_clflush:
@@ -1863,536 +1951,765 @@ execute_clflush:
     mov rdi, [r13 + VM_GPRS + rcx * 8]
     add rdi, rdx
     
-    ; Flush cache line
-    clflush [rdi]
+    ; Flush the host line backing it (MMIO and unmapped addresses are skipped)
+    xor esi, esi
+    call memory_host_address
+    test rax, rax
+    jz .done
+    clflush [rax]
     
+.done:
     pop rbp
-    ret
+    HANDLER_RETURN
 
 ; Execute FENCE instruction
 execute_fence:
     ; Memory fence
     mfence
-    ret
+    HANDLER_RETURN
 
-; Execute LR (load reserved) instruction
-execute_lr:
+; LR, SC and AMO* rd, rs2, (rs1): RDI = host address of the aligned guest
+; qword at R[rs1], RSI = R[rs2]. A misaligned, MMIO or unmapped address
+; skips the operation. %1 = 0 for a load, 1 for a store.
+%macro AMO_OPERANDS 1
     push rbp
     mov rbp, rsp
     
-    ; Extract operands
-    mov eax, ebx
-    shr eax, 21
-    and eax, 0x1F  ; rd
-    
     mov ecx, ebx
     shr ecx, 16
-    and ecx, 0x1F  ; rs1
-    
-    ; Load address
+    and ecx, 0x1F  ; rs1 (address)
     mov rdi, [r13 + VM_GPRS + rcx * 8]
+    test edi, 7
+    jnz .done
+    mov esi, %1
+    call memory_host_address
+    test rax, rax
+    jz .done
+    mov rdi, rax
     
-    ; Perform atomic load
-    mov rax, [rdi]
-    
-    ; Store reservation address
-    mov [r13 + VM_VBASE], rdi  ; Use VBASE as reservation register
+    mov edx, ebx
+    shr edx, 11
+    and edx, 0x1F  ; rs2 (value)
+    mov rsi, [r13 + VM_GPRS + rdx * 8]
+%endmacro
+
+; Count the op, write RAX to rd (skip if rd = 0) and return to dispatch
+%macro AMO_DONE 0
+    inc qword [r13 + VM_PERF + PERF_MEM_OPS * 8]
     
-    ; Store result (skip if rd = 0)
-    test eax, eax
-    jz .done
     mov ecx, ebx
     shr ecx, 21
     and ecx, 0x1F
+    jz .done
     mov [r13 + VM_GPRS + rcx * 8], rax
     
 .done:
     pop rbp
-    ret
+    HANDLER_RETURN
+%endmacro
 
-; Execute SC (store conditional) instruction
-execute_sc:
-    push rbp
-    mov rbp, rsp
-    
-    ; Extract operands
-    mov eax, ebx
-    shr eax, 21
-    and eax, 0x1F  ; rd
-    
-    mov ecx, ebx
-    shr ecx, 16
-    and ecx, 0x1F  ; rs1 (address)
-    
+; Guest address of the current LR/SC operand, into RDX
+%macro AMO_GUEST_ADDRESS 0
     mov edx, ebx
-    shr edx, 11
-    and edx, 0x1F  ; rs2 (value)
+    shr edx, 16
+    and edx, 0x1F
+    mov rdx, [r13 + VM_GPRS + rdx * 8]
+%endmacro
+
+; Execute LR (load reserved) instruction
+execute_lr:
+    AMO_OPERANDS 0
+    mov rax, [rdi]
     
-    ; Load address and value
-    mov rdi, [r13 + VM_GPRS + rcx * 8]
-    mov rsi, [r13 + VM_GPRS + rdx * 8]
+    ; Store reservation address
+    AMO_GUEST_ADDRESS
+    mov [r13 + VM_VBASE], rdx  ; Use VBASE as reservation register
+    AMO_DONE
+
+; Execute SC (store conditional) instruction
+execute_sc:
+    AMO_OPERANDS 1
     
     ; Check reservation
-    cmp rdi, [r13 + VM_VBASE]
-    jne .fail
+    AMO_GUEST_ADDRESS
+    mov eax, 1  ; Failure
+    cmp rdx, [r13 + VM_VBASE]
+    jne .store_result
     
     ; Attempt store
     mov [rdi], rsi
-    xor ecx, ecx  ; Success
-    jmp .store_result
-    
-.fail:
-    mov ecx, 1  ; Failure
+    xor eax, eax  ; Success
     
 .store_result:
-    ; Store result (skip if rd = 0)
-    test eax, eax
-    jz .done
-    mov eax, ebx
-    shr eax, 21
-    and eax, 0x1F
-    mov [r13 + VM_GPRS + rax * 8], rcx
-    
     ; Clear reservation
     mov qword [r13 + VM_VBASE], 0
-    
-.done:
-    pop rbp
-    ret
+    AMO_DONE
 
 ; Execute AMOSWAP (atomic swap) instruction
 execute_amoswap:
+    AMO_OPERANDS 1
+    xchg [rdi], rsi
+    mov rax, rsi
+    AMO_DONE
+
+; Execute AMOADD (atomic add) instruction
+execute_amoadd:
+    AMO_OPERANDS 1
+    lock xadd [rdi], rsi
+    mov rax, rsi
+    AMO_DONE
+
+; Atomic read-modify-write of [RDI] with RSI using compare-exchange;
+; %1 is the combining instruction. Leaves the old value in RAX.
+%macro AMO_CMPXCHG_LOOP 1
+    mov rax, [rdi]
+.retry:
+    mov rdx, rax
+    %1 rdx, rsi
+    lock cmpxchg [rdi], rdx
+    jnz .retry
+%endmacro
+
+; Execute AMOAND (atomic AND) instruction
+execute_amoand:
+    AMO_OPERANDS 1
+    AMO_CMPXCHG_LOOP and
+    AMO_DONE
+
+; Execute AMOOR (atomic OR) instruction
+execute_amoor:
+    AMO_OPERANDS 1
+    AMO_CMPXCHG_LOOP or
+    AMO_DONE
+
+; Execute AMOXOR (atomic XOR) instruction
+execute_amoxor:
+    AMO_OPERANDS 1
+    AMO_CMPXCHG_LOOP xor
+    AMO_DONE
+
+; SIMD handlers. Each V-type op has an SSE2 (x86-64 baseline), AVX2+FMA
+; and AVX-512VL variant; opcode_table starts on SSE2 and nanocore_init
+; patches in the best level the host supports. The AVX2 variants clear
+; the upper halves before returning; the AVX-512 ones use ymm16-31,
+; which never dirty the upper state, so they need no vzeroupper.
+
+; Point RSI/RDI/R8 at vs1, vs2 and vd
+%macro VECTOR_OPERANDS 0
     push rbp
     mov rbp, rsp
     
-    ; Extract operands
     mov eax, ebx
     shr eax, 21
-    and eax, 0x1F  ; rd
+    and eax, 0xF  ; vd
+    shl eax, 5    ; VREG_SIZE bytes each
     
     mov ecx, ebx
     shr ecx, 16
-    and ecx, 0x1F  ; rs1 (address)
+    and ecx, 0xF  ; vs1
+    shl ecx, 5
     
     mov edx, ebx
     shr edx, 11
-    and edx, 0x1F  ; rs2 (value)
-    
-    ; Load address and value
-    mov rdi, [r13 + VM_GPRS + rcx * 8]
-    mov rsi, [r13 + VM_GPRS + rdx * 8]
-    
-    ; Atomic exchange
-    xchg [rdi], rsi
+    and edx, 0xF  ; vs2
+    shl edx, 5
     
-    ; Store old value (skip if rd = 0)
-    test eax, eax
-    jz .done
-    mov [r13 + VM_GPRS + rax * 8], rsi
+    lea rsi, [r13 + VM_VREGS + rcx]
+    lea rdi, [r13 + VM_VREGS + rdx]
+    lea r8, [r13 + VM_VREGS + rax]
+%endmacro
+
+; Count the op and return to dispatch
+%macro VECTOR_DONE 0
+    inc qword [r13 + VM_PERF + PERF_SIMD_OPS * 8]
     
-.done:
     pop rbp
-    ret
-
-; Execute AMOADD (atomic add) instruction
-execute_amoadd:
+    HANDLER_RETURN
+%endmacro
+
+; VADD/VSUB/VMUL.F64: vd = vs1 op vs2 (4x double)
+; %1 = handler name, %2 = packed-double instruction (addpd, subpd, mulpd)
+%macro VECTOR_BINOP 2
+execute_%1_sse2:
+    VECTOR_OPERANDS
+    movupd xmm0, [rsi]
+    movupd xmm1, [rsi + 16]
+    movupd xmm2, [rdi]
+    movupd xmm3, [rdi + 16]
+    %2 xmm0, xmm2
+    %2 xmm1, xmm3
+    movupd [r8], xmm0
+    movupd [r8 + 16], xmm1
+    VECTOR_DONE
+
+execute_%1_avx2:
+    VECTOR_OPERANDS
+    vmovupd ymm0, [rsi]
+    v%2 ymm0, ymm0, [rdi]
+    vmovupd [r8], ymm0
+    vzeroupper
+    VECTOR_DONE
+
+execute_%1_avx512:
+    VECTOR_OPERANDS
+    vmovupd ymm16, [rsi]
+    v%2 ymm16, ymm16, [rdi]
+    vmovupd [r8], ymm16
+    VECTOR_DONE
+%endmacro
+
+VECTOR_BINOP vadd_f64, addpd
+VECTOR_BINOP vsub_f64, subpd
+VECTOR_BINOP vmul_f64, mulpd
+
+; VFMA.F64: vd = vs1 * vs2 + vs3, vs3 in bits [10:7]. Hosts without FMA3
+; get the SSE2 variant, which rounds the product before the add.
+%macro VFMA_OPERANDS 0
+    VECTOR_OPERANDS
+    mov r9d, ebx
+    shr r9d, 7
+    and r9d, 0xF  ; vs3
+    shl r9d, 5
+    lea r9, [r13 + VM_VREGS + r9]
+%endmacro
+
+execute_vfma_f64_sse2:
+    VFMA_OPERANDS
+    movupd xmm0, [rsi]
+    movupd xmm1, [rsi + 16]
+    movupd xmm2, [rdi]
+    movupd xmm3, [rdi + 16]
+    mulpd xmm0, xmm2
+    mulpd xmm1, xmm3
+    movupd xmm2, [r9]
+    movupd xmm3, [r9 + 16]
+    addpd xmm0, xmm2
+    addpd xmm1, xmm3
+    movupd [r8], xmm0
+    movupd [r8 + 16], xmm1
+    VECTOR_DONE
+
+execute_vfma_f64_avx2:
+    VFMA_OPERANDS
+    vmovupd ymm0, [rsi]
+    vmovupd ymm2, [r9]
+    vfmadd231pd ymm2, ymm0, [rdi]  ; ymm2 = vs1 * vs2 + vs3
+    vmovupd [r8], ymm2
+    vzeroupper
+    VECTOR_DONE
+
+execute_vfma_f64_avx512:
+    VFMA_OPERANDS
+    vmovupd ymm16, [rsi]
+    vmovupd ymm18, [r9]
+    vfmadd231pd ymm18, ymm16, [rdi]
+    vmovupd [r8], ymm18
+    VECTOR_DONE
+
+; VLOAD vd, imm(rs1) and VSTORE vs2, imm(rs1): RDI = effective address,
+; R8 = vector register
+%macro VMEM_OPERANDS 2  ; vector register field shift, base register field shift
     push rbp
     mov rbp, rsp
     
-    ; Extract operands
     mov eax, ebx
-    shr eax, 21
-    and eax, 0x1F  ; rd
+    shr eax, %1
+    and eax, 0xF
+    shl eax, 5    ; VREG_SIZE bytes each
     
     mov ecx, ebx
-    shr ecx, 16
-    and ecx, 0x1F  ; rs1 (address)
+    shr ecx, %2
+    and ecx, 0x1F
     
-    mov edx, ebx
-    shr edx, 11
-    and edx, 0x1F  ; rs2 (value)
-    
-    ; Load address and value
+    movsx rdx, bx
     mov rdi, [r13 + VM_GPRS + rcx * 8]
-    mov rsi, [r13 + VM_GPRS + rdx * 8]
-    
-    ; Atomic add (fetch and add)
-    lock xadd [rdi], rsi
-    
-    ; Store old value (skip if rd = 0)
-    test eax, eax
-    jz .done
-    mov [r13 + VM_GPRS + rax * 8], rsi
+    add rdi, rdx
+    lea r8, [r13 + VM_VREGS + rax]
     
-.done:
-    pop rbp
-    ret
-
-; Execute AMOAND (atomic AND) instruction
-execute_amoand:
+    inc qword [r13 + VM_PERF + PERF_MEM_OPS * 8]
+%endmacro
+
+; RDI is a guest address, so the copy goes through the memory subsystem
+; (bounds, MMIO, dirty tracking) and one handler serves every SIMD level
+execute_vload_sse2:
+execute_vload_avx2:
+execute_vload_avx512:
+    VMEM_OPERANDS 21, 16
+    mov rsi, r8
+    mov edx, VREG_SIZE
+    call memory_read_body
+    VECTOR_DONE
+
+execute_vstore_sse2:
+execute_vstore_avx2:
+execute_vstore_avx512:
+    VMEM_OPERANDS 11, 16
+    mov rsi, r8
+    mov edx, VREG_SIZE
+    call memory_write_body
+    VECTOR_DONE
+
+; VBROADCAST vd, rs1: RDX = scalar, R8 = vd
+%macro VBROADCAST_OPERANDS 0
     push rbp
     mov rbp, rsp
-    push rbx
     
-    ; Extract operands
     mov eax, ebx
     shr eax, 21
-    and eax, 0x1F  ; rd
+    and eax, 0xF  ; vd
+    shl eax, 5
     
     mov ecx, ebx
     shr ecx, 16
-    and ecx, 0x1F  ; rs1 (address)
-    
-    mov edx, ebx
-    shr edx, 11
-    and edx, 0x1F  ; rs2 (value)
-    
-    ; Load address and value
-    mov rdi, [r13 + VM_GPRS + rcx * 8]
-    mov rsi, [r13 + VM_GPRS + rdx * 8]
-    
-    ; Atomic AND using compare-exchange loop
-.retry:
-    mov rax, [rdi]
-    mov rbx, rax
-    and rbx, rsi
-    lock cmpxchg [rdi], rbx
-    jnz .retry
-    
-    ; Store old value (skip if rd = 0)
-    mov ecx, ebx
-    shr ecx, 21
-    and ecx, 0x1F
-    test ecx, ecx
-    jz .done
-    mov [r13 + VM_GPRS + rcx * 8], rax
+    and ecx, 0x1F  ; rs1
     
-.done:
-    pop rbx
-    pop rbp
-    ret
+    mov rdx, [r13 + VM_GPRS + rcx * 8]
+    lea r8, [r13 + VM_VREGS + rax]
+%endmacro
+
+execute_vbroadcast_sse2:
+    VBROADCAST_OPERANDS
+    movq xmm0, rdx
+    punpcklqdq xmm0, xmm0
+    movupd [r8], xmm0
+    movupd [r8 + 16], xmm0
+    VECTOR_DONE
+
+execute_vbroadcast_avx2:
+    VBROADCAST_OPERANDS
+    vmovq xmm0, rdx
+    vbroadcastsd ymm1, xmm0
+    vmovupd [r8], ymm1
+    vzeroupper
+    VECTOR_DONE
+
+execute_vbroadcast_avx512:
+    VBROADCAST_OPERANDS
+    vpbroadcastq ymm16, rdx
+    vmovupd [r8], ymm16
+    VECTOR_DONE
+
+; Timing-mode entry for every opcode: account the instruction in EBX with
+; the pipeline model, then run its handler
+timing_dispatch:
+    sub rsp, 8  ; Entered at ABI entry alignment in both dispatch modes
+    mov edi, ebx
+    call pipeline_issue_body
+    add rsp, 8
+    mov eax, ebx
+    shr eax, 26
+    lea rdx, [opcode_table]
+    jmp [rdx + rax * 8]
 
-; Execute AMOOR (atomic OR) instruction
-execute_amoor:
+; Execute MCOPY rd, rs1, rs2: copy R[rs2] bytes from [R[rs1]] to [R[rd]]
+; (overlap allowed). One translation per page instead of one per byte.
+execute_mcopy:
     push rbp
     mov rbp, rsp
     push rbx
+    push rcx
     
-    ; Extract operands
     mov eax, ebx
     shr eax, 21
-    and eax, 0x1F  ; rd
-    
+    and eax, 0x1F  ; rd (destination)
     mov ecx, ebx
     shr ecx, 16
-    and ecx, 0x1F  ; rs1 (address)
-    
+    and ecx, 0x1F  ; rs1 (source)
     mov edx, ebx
     shr edx, 11
-    and edx, 0x1F  ; rs2 (value)
+    and edx, 0x1F  ; rs2 (length)
     
-    ; Load address and value
-    mov rdi, [r13 + VM_GPRS + rcx * 8]
-    mov rsi, [r13 + VM_GPRS + rdx * 8]
-    
-    ; Atomic OR using compare-exchange loop
-.retry:
-    mov rax, [rdi]
-    mov rbx, rax
-    or rbx, rsi
-    lock cmpxchg [rdi], rbx
-    jnz .retry
+    mov rdi, [r13 + VM_GPRS + rax * 8]
+    mov rsi, [r13 + VM_GPRS + rcx * 8]
+    mov rdx, [r13 + VM_GPRS + rdx * 8]
+    call memory_copy_body
     
-    ; Store old value (skip if rd = 0)
-    mov ecx, ebx
-    shr ecx, 21
-    and ecx, 0x1F
-    test ecx, ecx
-    jz .done
-    mov [r13 + VM_GPRS + rcx * 8], rax
+    inc qword [r13 + VM_PERF + PERF_MEM_OPS * 8]
     
-.done:
+    pop rcx
     pop rbx
     pop rbp
-    ret
+    HANDLER_RETURN
 
-; Execute AMOXOR (atomic XOR) instruction
-execute_amoxor:
+; Execute MFILL rd, rs1, rs2: set R[rs2] bytes at [R[rd]] to the low byte
+; of R[rs1]
+execute_mfill:
     push rbp
     mov rbp, rsp
     push rbx
+    push rcx
     
-    ; Extract operands
     mov eax, ebx
     shr eax, 21
-    and eax, 0x1F  ; rd
-    
+    and eax, 0x1F  ; rd (destination)
     mov ecx, ebx
     shr ecx, 16
-    and ecx, 0x1F  ; rs1 (address)
-    
+    and ecx, 0x1F  ; rs1 (fill byte)
     mov edx, ebx
     shr edx, 11
-    and edx, 0x1F  ; rs2 (value)
-    
-    ; Load address and value
-    mov rdi, [r13 + VM_GPRS + rcx * 8]
-    mov rsi, [r13 + VM_GPRS + rdx * 8]
+    and edx, 0x1F  ; rs2 (length)
     
-    ; Atomic XOR using compare-exchange loop
-.retry:
-    mov rax, [rdi]
-    mov rbx, rax
-    xor rbx, rsi
-    lock cmpxchg [rdi], rbx
-    jnz .retry
+    mov rdi, [r13 + VM_GPRS + rax * 8]
+    movzx esi, byte [r13 + VM_GPRS + rcx * 8]
+    mov rdx, [r13 + VM_GPRS + rdx * 8]
+    call memory_fill_body
     
-    ; Store old value (skip if rd = 0)
-    mov ecx, ebx
-    shr ecx, 21
-    and ecx, 0x1F
-    test ecx, ecx
-    jz .done
-    mov [r13 + VM_GPRS + rcx * 8], rax
+    inc qword [r13 + VM_PERF + PERF_MEM_OPS * 8]
     
-.done:
+    pop rcx
     pop rbx
     pop rbp
+    HANDLER_RETURN
+
+; Execute ILLEGAL instruction
+execute_illegal:
+    ; Set illegal instruction flag and halt
+    or byte [r13 + VM_FLAGS], 0x80  ; Set halt flag
+    or byte [r13 + vm_context.slow_work], SLOW_HALT | SLOW_ILLEGAL
+    mov rax, 1  ; Return illegal instruction error
+    HANDLER_RETURN
+
+; Utility functions
+check_interrupts:
+    xor eax, eax
     ret
 
-; SIMD VSUB.F64 implementation
-execute_vsub_f64:
-    push rbp
-    mov rbp, rsp
-    
-    ; Extract operands
-    mov eax, ebx
-    shr eax, 21
-    and eax, 0xF  ; vd
-    
-    mov ecx, ebx
-    shr ecx, 16
-    and ecx, 0xF  ; vs1
-    
-    mov edx, ebx
-    shr edx, 11
-    and edx, 0xF  ; vs2
-    
-    ; Load vector operands
-    lea rsi, [r13 + VM_VREGS + rcx * 32]
-    lea rdi, [r13 + VM_VREGS + rdx * 32]
-    lea r8, [r13 + VM_VREGS + rax * 32]
-    
-    ; Perform vector subtraction (4x double precision)
-    vmovupd ymm0, [rsi]
-    vmovupd ymm1, [rdi]
-    vsubpd ymm2, ymm0, ymm1
-    vmovupd [r8], ymm2
-    
-    ; Update SIMD operation counter
-    inc qword [r13 + VM_PERF + PERF_SIMD_OPS * 8]
-    
-    pop rbp
+; Home slot of the PC in RDI in vm_context.breakpoints, into %1.
+; Clobbers RAX.
+%macro BREAKPOINT_HOME 1
+    mov %1, rdi
+    shr %1, 2
+    mov rax, 0x9E3779B97F4A7C15
+    imul %1, rax
+    shr %1, 64 - BREAKPOINT_SHIFT
+%endmacro
+
+; Input: RDI = PC
+; Output: RAX = 1 if a breakpoint is set there, 0 otherwise
+; Clobbers RCX, RDX
+is_breakpoint:
+    BREAKPOINT_HOME rcx
+    lea rdx, [rdi + 1]
+.probe:
+    mov rax, [r13 + vm_context.breakpoints + rcx * 8]
+    cmp rax, rdx
+    je .hit
+    test rax, rax
+    jz .done  ; Empty slot ends the run: RAX = 0
+    inc ecx
+    and ecx, BREAKPOINT_SLOTS - 1
+    jmp .probe
+.hit:
+    mov eax, 1
+.done:
     ret
 
-; SIMD VMUL.F64 implementation
-execute_vmul_f64:
-    push rbp
-    mov rbp, rsp
-    
-    ; Extract operands
-    mov eax, ebx
-    shr eax, 21
-    and eax, 0xF  ; vd
-    
-    mov ecx, ebx
-    shr ecx, 16
-    and ecx, 0xF  ; vs1
-    
-    mov edx, ebx
-    shr edx, 11
-    and edx, 0xF  ; vs2
-    
-    ; Load vector operands
-    lea rsi, [r13 + VM_VREGS + rcx * 32]
-    lea rdi, [r13 + VM_VREGS + rdx * 32]
-    lea r8, [r13 + VM_VREGS + rax * 32]
-    
-    ; Perform vector multiplication (4x double precision)
-    vmovupd ymm0, [rsi]
-    vmovupd ymm1, [rdi]
-    vmulpd ymm2, ymm0, ymm1
-    vmovupd [r8], ymm2
-    
-    ; Update SIMD operation counter
-    inc qword [r13 + VM_PERF + PERF_SIMD_OPS * 8]
-    
-    pop rbp
+; Add a breakpoint, checked by vm_run in debug mode
+; Input: RDI = PC
+; Output: RAX = 0 on success, 1 if the set is full
+CONTEXT_ENTRY vm_set_breakpoint
+vm_set_breakpoint_body:
+    call is_breakpoint
+    test rax, rax
+    jnz .ok
+    cmp qword [r13 + vm_context.num_breakpoints], BREAKPOINT_LIMIT
+    jae .full
+    
+    BREAKPOINT_HOME rcx
+.probe:
+    cmp qword [r13 + vm_context.breakpoints + rcx * 8], 0
+    je .place
+    inc ecx
+    and ecx, BREAKPOINT_SLOTS - 1
+    jmp .probe
+.place:
+    lea rax, [rdi + 1]
+    mov [r13 + vm_context.breakpoints + rcx * 8], rax
+    inc qword [r13 + vm_context.num_breakpoints]
+.ok:
+    xor eax, eax
+    ret
+.full:
+    mov eax, 1
+    ret
+
+; Remove a breakpoint. Later entries of its probe run are shifted back
+; over the hole, so lookups never need tombstones.
+; Input: RDI = PC
+; Output: RAX = 0 on success, 1 if no breakpoint was set there
+CONTEXT_ENTRY vm_clear_breakpoint
+vm_clear_breakpoint_body:
+    BREAKPOINT_HOME rcx
+    lea rdx, [rdi + 1]
+.find:
+    mov rax, [r13 + vm_context.breakpoints + rcx * 8]
+    cmp rax, rdx
+    je .found
+    test rax, rax
+    jz .missing
+    inc ecx
+    and ecx, BREAKPOINT_SLOTS - 1
+    jmp .find
+    
+.found:
+    mov r8d, ecx  ; RCX = hole, R8 = entry being considered
+.next:
+    inc r8d
+    and r8d, BREAKPOINT_SLOTS - 1
+    mov rdi, [r13 + vm_context.breakpoints + r8 * 8]
+    test rdi, rdi
+    jz .close
+    dec rdi
+    BREAKPOINT_HOME r9
+    mov r10d, r8d
+    sub r10d, r9d
+    and r10d, BREAKPOINT_SLOTS - 1  ; Distance from its home
+    mov r11d, r8d
+    sub r11d, ecx
+    and r11d, BREAKPOINT_SLOTS - 1  ; Distance from the hole
+    cmp r10d, r11d
+    jb .next  ; Home lies after the hole: the entry stays put
+    mov rax, [r13 + vm_context.breakpoints + r8 * 8]
+    mov [r13 + vm_context.breakpoints + rcx * 8], rax
+    mov ecx, r8d
+    jmp .next
+    
+.close:
+    mov qword [r13 + vm_context.breakpoints + rcx * 8], 0
+    dec qword [r13 + vm_context.num_breakpoints]
+    xor eax, eax
+    ret
+.missing:
+    mov eax, 1
     ret
 
-; SIMD VFMA.F64 implementation (fused multiply-add)
-execute_vfma_f64:
-    push rbp
-    mov rbp, rsp
-    
-    ; Extract operands
-    mov eax, ebx
-    shr eax, 21
-    and eax, 0xF  ; vd
-    
-    mov ecx, ebx
-    shr ecx, 16
-    and ecx, 0xF  ; vs1
-    
-    mov edx, ebx
-    shr edx, 11
-    and edx, 0xF  ; vs2
-    
-    mov r8d, ebx
-    shr r8d, 7
-    and r8d, 0xF  ; vs3
-    
-    ; Load vector operands
-    lea rsi, [r13 + VM_VREGS + rcx * 32]
-    lea rdi, [r13 + VM_VREGS + rdx * 32]
-    lea r9, [r13 + VM_VREGS + r8 * 32]
-    lea r10, [r13 + VM_VREGS + rax * 32]
-    
-    ; Perform vector FMA (vd = vs1 * vs2 + vs3)
-    vmovupd ymm0, [rsi]
-    vmovupd ymm1, [rdi]
-    vmovupd ymm2, [r9]
-    vfmadd231pd ymm2, ymm0, ymm1  ; ymm2 = ymm0 * ymm1 + ymm2
-    vmovupd [r10], ymm2
-    
-    ; Update SIMD operation counter
-    inc qword [r13 + VM_PERF + PERF_SIMD_OPS * 8]
-    
-    pop rbp
+; Get VM state pointer
+; Output: RAX = pointer to VM state
+CONTEXT_ENTRY vm_get_state
+vm_get_state_body:
+    mov rax, r13
     ret
 
-; SIMD VLOAD implementation
-execute_vload:
-    push rbp
-    mov rbp, rsp
-    
-    ; Extract operands
-    mov eax, ebx
-    shr eax, 21
-    and eax, 0xF  ; vd
-    
-    mov ecx, ebx
-    shr ecx, 16
-    and ecx, 0x1F  ; rs1 (base address)
-    
-    ; Extract immediate offset
-    movsx rdx, bx
-    
-    ; Calculate effective address
-    mov rdi, [r13 + VM_GPRS + rcx * 8]
-    add rdi, rdx
-    
-    ; Load 256-bit vector
-    lea r8, [r13 + VM_VREGS + rax * 32]
-    vmovupd ymm0, [rdi]
-    vmovupd [r8], ymm0
-    
-    ; Update counters
-    inc qword [r13 + VM_PERF + PERF_MEM_OPS * 8]
-    inc qword [r13 + VM_PERF + PERF_SIMD_OPS * 8]
-    
-    pop rbp
+; Read a general-purpose register
+; Input: RDI = register index (0-31)
+; Output: RAX = value
+CONTEXT_ENTRY vm_get_register
+vm_get_register_body:
+    and edi, NUM_GPRS - 1
+    mov rax, [r13 + VM_GPRS + rdi * 8]
     ret
 
-; SIMD VSTORE implementation
-execute_vstore:
-    push rbp
-    mov rbp, rsp
-    
-    ; Extract operands
-    mov eax, ebx
-    shr eax, 16
-    and eax, 0x1F  ; rs1 (base address)
-    
-    mov ecx, ebx
-    shr ecx, 11
-    and ecx, 0xF  ; vs2 (vector to store)
-    
-    ; Extract immediate offset
-    movsx rdx, bx
-    
-    ; Calculate effective address
-    mov rdi, [r13 + VM_GPRS + rax * 8]
-    add rdi, rdx
-    
-    ; Store 256-bit vector
-    lea r8, [r13 + VM_VREGS + rcx * 32]
-    vmovupd ymm0, [r8]
-    vmovupd [rdi], ymm0
-    
-    ; Update counters
-    inc qword [r13 + VM_PERF + PERF_MEM_OPS * 8]
-    inc qword [r13 + VM_PERF + PERF_SIMD_OPS * 8]
+; Write a general-purpose register; R0 stays zero
+; Input: RDI = register index (0-31), RSI = value
+CONTEXT_ENTRY vm_set_register
+vm_set_register_body:
+    and edi, NUM_GPRS - 1
+    jz .done
+    mov [r13 + VM_GPRS + rdi * 8], rsi
+.done:
+    ret
+
+; Set the address of the next instruction to fetch
+; Input: RDI = PC
+CONTEXT_ENTRY vm_set_pc
+vm_set_pc_body:
+    mov [r13 + VM_PC], rdi
+    ret
+
+; Copy out the full counter set in the FFI's NANOCORE_PERF_* order: the
+; eight PERF_* counters, then the eight cache statistics (STAT_* order)
+; Input: RDI = 16-qword array
+CONTEXT_ENTRY vm_get_perf
+vm_get_perf_body:
+    xor ecx, ecx
+.copy:
+    mov rax, [r13 + VM_PERF + rcx * 8]
+    mov [rdi + rcx * 8], rax
+    inc ecx
+    cmp ecx, 8
+    jb .copy
+    
+    add rdi, 8 * 8
+    jmp cache_get_stats_body
+
+; Enable or disable breakpoint checks in vm_run
+; Input: RDI = 0 to disable, nonzero to enable
+CONTEXT_ENTRY vm_set_debug_mode
+vm_set_debug_mode_body:
+    test rdi, rdi
+    setnz al
+    mov [r13 + vm_context.debug_mode], al
+    jz .disable
+    lock or byte [r13 + vm_context.slow_work], SLOW_DEBUG
+    ret
+.disable:
+    lock and byte [r13 + vm_context.slow_work], ~SLOW_DEBUG
+    ret
+
+; Switch between fast functional and timing execution, from the next
+; vm_run. Entering timing mode starts with a cold pipeline and predictor.
+; Input: RDI = 0 for functional, nonzero for timing
+CONTEXT_ENTRY vm_set_timing_mode
+vm_set_timing_mode_body:
+    test rdi, rdi
+    setnz al
+    cmp al, [r13 + vm_context.timing_mode]
+    je .done
+    mov [r13 + vm_context.timing_mode], al
+    test al, al
+    jz .done
+    call pipeline_init_body
+.done:
+    ret
+
+; Flag work for the dispatch loop to pick up at the next instruction
+; Input: RDI = SLOW_* bits
+CONTEXT_ENTRY vm_raise_slow_work
+vm_raise_slow_work_body:
+    lock or byte [r13 + vm_context.slow_work], dil
+    ret
+
+; Single step execution
+; Output: RAX = 0 on success, error code otherwise
+CONTEXT_ENTRY vm_step
+vm_step_body:
+    mov rdi, 1
+    jmp vm_run_body
+
+; Dump VM state (for debugging)
+CONTEXT_ENTRY vm_dump_state
+vm_dump_state_body:
+    ; Implementation would dump all registers and state
+    ret
+
+; Pick the SIMD handler variants for this host and patch them into
+; opcode_table. Runs its detection once; later calls are no-ops, and
+; vm_context_create calls it for embedders that don't.
+; Output: RAX = 0
+nanocore_init:
+    cmp dword [simd_level], 0
+    jge .done
+    
+    call simd_detect_level
+    lea rsi, [simd_variants]
+    lea rsi, [rsi + rax * 8]
+    lea rdi, [opcode_table + SIMD_FIRST_OPCODE * 8]
+    mov ecx, SIMD_HANDLERS
+.patch:
+    mov rdx, [rsi]
+    mov [rdi], rdx
+    add rsi, SIMD_LEVELS * 8
+    add rdi, 8
+    dec ecx
+    jnz .patch
+    mov [simd_level], eax
     
-    pop rbp
+.done:
+    xor eax, eax
     ret
 
-; SIMD VBROADCAST implementation
-execute_vbroadcast:
-    push rbp
-    mov rbp, rsp
+; SIMD level the handlers were built for (-1 before nanocore_init)
+; Output: EAX = SIMD_LEVEL_*
+nanocore_simd_level:
+    mov eax, [simd_level]
+    ret
+
+; Highest SIMD level both the CPU and the OS (XCR0) support
+; Output: EAX = SIMD_LEVEL_*
+simd_detect_level:
+    push rbx
+    xor r8d, r8d  ; SIMD_LEVEL_SSE2
     
-    ; Extract operands
-    mov eax, ebx
-    shr eax, 21
-    and eax, 0xF  ; vd
+    xor eax, eax
+    cpuid
+    cmp eax, 7
+    jb .done
+    
+    mov eax, 1
+    cpuid
+    and ecx, (1 << 12) | (1 << 27) | (1 << 28)  ; FMA, OSXSAVE, AVX
+    cmp ecx, (1 << 12) | (1 << 27) | (1 << 28)
+    jne .done
+    xor ecx, ecx
+    xgetbv
+    mov r9d, eax  ; XCR0
+    and eax, 0x06
+    cmp eax, 0x06  ; XMM and YMM state enabled
+    jne .done
+    
+    mov eax, 7
+    xor ecx, ecx
+    cpuid
+    test ebx, 1 << 5  ; AVX2
+    jz .done
+    mov r8d, SIMD_LEVEL_AVX2
     
-    mov ecx, ebx
-    shr ecx, 16
-    and ecx, 0x1F  ; rs1 (scalar source)
+    and ebx, (1 << 16) | (1 << 31)  ; AVX512F, AVX512VL
+    cmp ebx, (1 << 16) | (1 << 31)
+    jne .done
+    and r9d, 0xE6
+    cmp r9d, 0xE6  ; Opmask and ZMM state enabled too
+    jne .done
+    mov r8d, SIMD_LEVEL_AVX512
     
-    ; Load scalar value
-    mov rdx, [r13 + VM_GPRS + rcx * 8]
+.done:
+    mov eax, r8d
+    pop rbx
+    ret
+
+; Allocate a zeroed, cache-line aligned VM context
+; Output: RAX = context pointer (0 on failure)
+vm_context_create:
+    push rbx
+    call nanocore_init
+    sub rsp, 16
+    mov rdi, rsp
+    mov esi, 64
+    mov edx, vm_context_size
+    call posix_memalign wrt ..plt
+    test eax, eax
+    jnz .fail
     
-    ; Broadcast to all vector elements
-    lea r8, [r13 + VM_VREGS + rax * 32]
-    vmovq xmm0, rdx
-    vbroadcastsd ymm1, xmm0
-    vmovupd [r8], ymm1
+    mov rbx, [rsp]
+    mov rdi, rbx
+    xor esi, esi
+    mov edx, vm_context_size
+    call memset wrt ..plt
     
-    ; Update SIMD operation counter
-    inc qword [r13 + VM_PERF + PERF_SIMD_OPS * 8]
+    mov rax, rbx
+    add rsp, 16
+    pop rbx
+    ret
     
-    pop rbp
+.fail:
+    xor eax, eax
+    add rsp, 16
+    pop rbx
     ret
 
-; Execute ILLEGAL instruction
-execute_illegal:
-    ; Set illegal instruction flag and halt
-    or byte [r13 + VM_FLAGS], 0x80  ; Set halt flag
-    mov rax, 1  ; Return illegal instruction error
+; Release a context and the guest memory it owns
+; Input: RDI = context (may be 0)
+vm_context_destroy:
+    test rdi, rdi
+    jz .done
+    push r13
+    mov r13, rdi
+    call cache_cleanup_body
+    call memory_cleanup_body
+    mov rdi, r13
+    call free wrt ..plt
+    pop r13
+.done:
     ret
 
-; Utility functions
-check_interrupts:
-flush_all_caches:
-is_breakpoint:
-    xor eax, eax
+; Size of a VM context in bytes, for callers that embed or mmap their own
+; Output: RAX = vm_context_size
+vm_context_size:
+    mov eax, vm_context_size
     ret
 
-; Get VM state pointer
-; Output: RAX = pointer to VM state
-vm_get_state:
-    lea rax, [vm_state]
+; Layout of the architectural state, for callers to check theirs against
+; Output: RAX = pointer to a static nanocore_abi_t
+vm_get_abi:
+    lea rax, [state_abi]
     ret
-
-; Single step execution
-; Output: RAX = 0 on success, error code otherwise
-vm_step:
-    mov rdi, 1
-    jmp vm_run
-
-; Dump VM state (for debugging)
-vm_dump_state:
-    ; Implementation would dump all registers and state
-    ret
\ No newline at end of file
@@ -11,6 +11,9 @@
 ; +0x1020: Output buffer start
 
 BITS 64
+
+%include "context.inc"
+
 SECTION .text
 
 ; Constants
@@ -47,20 +50,17 @@ global console_write
 global console_read
 
 ; External symbols
-extern memory_write
-extern memory_read
-
-SECTION .data
-console_initialized: db 0
-input_buffer_pos: dq 0
-output_buffer_pos: dq 0
-echo_enabled: db 1
+extern memory_write_body
+extern memory_read_body
 
 SECTION .text
 
 ; Initialize console device
 ; Output: RAX = 0 on success
-console_init:
+global console_init
+global console_init_body:function hidden
+CONTEXT_ENTRY console_init
+console_init_body:
     push rbp
     mov rbp, rsp
     
@@ -76,16 +76,17 @@ console_init:
     call clear_buffer
     
     ; Reset positions
-    mov qword [input_buffer_pos], 0
-    mov qword [output_buffer_pos], 0
+    mov qword [r13 + CTX_CONSOLE + console_state.input_pos], 0
+    mov qword [r13 + CTX_CONSOLE + console_state.output_pos], 0
     
     ; Clear status register
     mov rdi, STATUS_REG
     xor esi, esi
-    call memory_write
+    call memory_write_body
     
-    ; Mark as initialized
-    mov byte [console_initialized], 1
+    ; Mark as initialized, echo on
+    mov byte [r13 + CTX_CONSOLE + console_state.echo_enabled], 1
+    mov byte [r13 + CTX_CONSOLE + console_state.initialized], 1
     
     xor eax, eax
     pop rbp
@@ -93,40 +94,44 @@ console_init:
 
 ; Write a character to console
 ; Input: DIL = character
-console_putc:
+global console_putc
+global console_putc_body:function hidden
+CONTEXT_ENTRY console_putc
+console_putc_body:
     push rbp
     mov rbp, rsp
     push rbx
     
     ; Check if initialized
-    cmp byte [console_initialized], 0
+    cmp byte [r13 + CTX_CONSOLE + console_state.initialized], 0
     je .not_initialized
     
     ; Wait for output buffer to be ready
 .wait_ready:
     mov rdi, STATUS_REG
-    call memory_read
+    call memory_read_body
     test al, STATUS_OUTPUT_FULL
     jnz .wait_ready
     
     ; Write character to data register
     movzx esi, dil
     mov rdi, DATA_REG
-    call memory_write
+    call memory_write_body
     
     ; Send write command
     mov rdi, CMD_REG
     mov esi, CMD_WRITE_CHAR
-    call memory_write
+    call memory_write_body
     
     ; Update output buffer
-    mov rbx, [output_buffer_pos]
-    lea rdi, [OUTPUT_BUFFER + rbx]
+    mov rbx, [r13 + CTX_CONSOLE + console_state.output_pos]
+    mov rdi, OUTPUT_BUFFER
+    add rdi, rbx
     movzx esi, dil
-    call memory_write
+    call memory_write_body
     
-    inc qword [output_buffer_pos]
-    and qword [output_buffer_pos], 0xFFF  ; Wrap at 4KB
+    inc qword [r13 + CTX_CONSOLE + console_state.output_pos]
+    and qword [r13 + CTX_CONSOLE + console_state.output_pos], 0xFFF  ; Wrap at 4KB
     
 .done:
     pop rbx
@@ -139,30 +144,33 @@ console_putc:
 
 ; Write a string to console
 ; Input: RDI = string pointer, RSI = length
-console_puts:
+global console_puts
+global console_puts_body:function hidden
+CONTEXT_ENTRY console_puts
+console_puts_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r14
     
     mov r12, rdi  ; Save string pointer
-    mov r13, rsi  ; Save length
+    mov r14, rsi  ; Save length
     xor ebx, ebx  ; Character index
     
 .loop:
-    cmp rbx, r13
+    cmp rbx, r14
     jae .done
     
     ; Load character
     mov dil, [r12 + rbx]
-    call console_putc
+    call console_putc_body
     
     inc rbx
     jmp .loop
     
 .done:
-    pop r13
+    pop r14
     pop r12
     pop rbx
     pop rbp
@@ -170,51 +178,55 @@ console_puts:
 
 ; Read a character from console
 ; Output: AL = character, AH = status
-console_getc:
+global console_getc
+global console_getc_body:function hidden
+CONTEXT_ENTRY console_getc
+console_getc_body:
     push rbp
     mov rbp, rsp
     
     ; Check if initialized
-    cmp byte [console_initialized], 0
+    cmp byte [r13 + CTX_CONSOLE + console_state.initialized], 0
     je .not_initialized
     
     ; Wait for input ready
 .wait_input:
     mov rdi, STATUS_REG
-    call memory_read
+    call memory_read_body
     test al, STATUS_INPUT_READY
     jz .wait_input
     
     ; Send read command
     mov rdi, CMD_REG
     mov esi, CMD_READ_CHAR
-    call memory_write
+    call memory_write_body
     
     ; Read character from data register
     mov rdi, DATA_REG
-    call memory_read
+    call memory_read_body
     
     push rax  ; Save character
     
     ; Echo if enabled
-    cmp byte [echo_enabled], 0
+    cmp byte [r13 + CTX_CONSOLE + console_state.echo_enabled], 0
     je .no_echo
     
     mov dil, al
-    call console_putc
+    call console_putc_body
     
 .no_echo:
     pop rax
     
     ; Update input buffer
     push rax
-    mov rbx, [input_buffer_pos]
-    lea rdi, [INPUT_BUFFER + rbx]
+    mov rbx, [r13 + CTX_CONSOLE + console_state.input_pos]
+    mov rdi, INPUT_BUFFER
+    add rdi, rbx
     movzx esi, al
-    call memory_write
+    call memory_write_body
     
-    inc qword [input_buffer_pos]
-    and qword [input_buffer_pos], 0xFFF
+    inc qword [r13 + CTX_CONSOLE + console_state.input_pos]
+    and qword [r13 + CTX_CONSOLE + console_state.input_pos], 0xFFF
     
     pop rax
     xor ah, ah  ; Clear status
@@ -230,25 +242,28 @@ console_getc:
 ; Read a line from console
 ; Input: RDI = buffer pointer, RSI = max length
 ; Output: RAX = actual length
-console_gets:
+global console_gets
+global console_gets_body:function hidden
+CONTEXT_ENTRY console_gets
+console_gets_body:
     push rbp
     mov rbp, rsp
     push rbx
     push r12
-    push r13
+    push r15
     push r14
     
     mov r12, rdi  ; Buffer pointer
-    mov r13, rsi  ; Max length
+    mov r15, rsi  ; Max length
     xor r14, r14  ; Current position
     
 .read_loop:
     ; Check if at max length
-    cmp r14, r13
+    cmp r14, r15
     jae .done
     
     ; Read character
-    call console_getc
+    call console_getc_body
     
     ; Check for newline
     cmp al, 0x0A
@@ -275,11 +290,11 @@ console_gets:
     
     ; Echo backspace sequence
     mov dil, 0x08  ; Backspace
-    call console_putc
+    call console_putc_body
     mov dil, 0x20  ; Space
-    call console_putc
+    call console_putc_body
     mov dil, 0x08  ; Backspace
-    call console_putc
+    call console_putc_body
     
     jmp .read_loop
     
@@ -289,37 +304,43 @@ console_gets:
     
     ; Echo newline
     mov dil, 0x0A
-    call console_putc
+    call console_putc_body
     
     mov rax, r14  ; Return length
     
     pop r14
-    pop r13
+    pop r15
     pop r12
     pop rbx
     pop rbp
     ret
 
 ; Clear console screen
-console_clear:
+global console_clear
+global console_clear_body:function hidden
+CONTEXT_ENTRY console_clear
+console_clear_body:
     push rbp
     mov rbp, rsp
     
     ; Send clear command
     mov rdi, CMD_REG
     mov esi, CMD_CLEAR
-    call memory_write
+    call memory_write_body
     
     ; Clear buffers
-    mov qword [input_buffer_pos], 0
-    mov qword [output_buffer_pos], 0
+    mov qword [r13 + CTX_CONSOLE + console_state.input_pos], 0
+    mov qword [r13 + CTX_CONSOLE + console_state.output_pos], 0
     
     pop rbp
     ret
 
 ; Set console text color
 ; Input: DIL = foreground color, SIL = background color
-console_set_color:
+global console_set_color
+global console_set_color_body:function hidden
+CONTEXT_ENTRY console_set_color
+console_set_color_body:
     push rbp
     mov rbp, rsp
     
@@ -330,25 +351,28 @@ console_set_color:
     
     ; Write color to data register
     mov rdi, DATA_REG
-    call memory_write
+    call memory_write_body
     
     ; Send set color command
     mov rdi, CMD_REG
     mov esi, CMD_SET_COLOR
-    call memory_write
+    call memory_write_body
     
     pop rbp
     ret
 
 ; Generic console write (for device interface)
 ; Input: RDI = address, RSI = value
-console_write:
+global console_write
+global console_write_body:function hidden
+CONTEXT_ENTRY console_write
+console_write_body:
     push rbp
     mov rbp, rsp
     
     ; Calculate offset from base
-    mov rax, rdi
-    sub rax, CONSOLE_BASE
+    mov rax, -CONSOLE_BASE
+    add rax, rdi
     
     ; Handle different registers
     cmp rax, 0x08  ; Command register
@@ -380,7 +404,7 @@ console_write:
     ; Write character from data register
     push rsi
     mov rdi, DATA_REG
-    call memory_read
+    call memory_read_body
     mov dil, al
     call output_char_to_host
     pop rsi
@@ -391,15 +415,15 @@ console_write:
     call input_char_from_host
     movzx esi, al
     mov rdi, DATA_REG
-    call memory_write
+    call memory_write_body
     
     ; Set input ready flag
     mov rdi, STATUS_REG
-    call memory_read
+    call memory_read_body
     or al, STATUS_INPUT_READY
     movzx esi, al
     mov rdi, STATUS_REG
-    call memory_write
+    call memory_write_body
     jmp .done
     
 .cmd_clear:
@@ -409,7 +433,7 @@ console_write:
     
 .write_data:
     ; Just store the value
-    call memory_write
+    call memory_write_body
     
 .done:
     xor eax, eax
@@ -419,13 +443,16 @@ console_write:
 ; Generic console read (for device interface)
 ; Input: RDI = address
 ; Output: RAX = value
-console_read:
+global console_read
+global console_read_body:function hidden
+CONTEXT_ENTRY console_read
+console_read_body:
     push rbp
     mov rbp, rsp
     
     ; Calculate offset
-    mov rax, rdi
-    sub rax, CONSOLE_BASE
+    mov rax, -CONSOLE_BASE
+    add rax, rdi
     
     ; Handle different registers
     cmp rax, 0x00  ; Status register
@@ -438,7 +465,7 @@ console_read:
     je .read_size
     
     ; Default: read from memory
-    call memory_read
+    call memory_read_body
     pop rbp
     ret
     
@@ -454,7 +481,7 @@ console_read:
     
 .no_input:
     ; Check if output buffer full
-    cmp qword [output_buffer_pos], 4000
+    cmp qword [r13 + CTX_CONSOLE + console_state.output_pos], 4000
     jb .not_full
     or al, STATUS_OUTPUT_FULL
     
@@ -464,7 +491,7 @@ console_read:
     
 .read_data:
     mov rdi, DATA_REG
-    call memory_read
+    call memory_read_body
     pop rbp
     ret
     
@@ -482,7 +509,7 @@ clear_buffer:
 .loop:
     push rsi
     push rdi
-    call memory_write
+    call memory_write_body
     pop rdi
     pop rsi
     add rdi, 8
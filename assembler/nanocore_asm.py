@@ -4,11 +4,13 @@ NanoCore Assembler - Convert assembly mnemonics to machine code
 
 Usage:
     python nanocore_asm.py input.asm -o output.bin
+    python nanocore_asm.py input.asm -f image -o output.nci
 """
 
 import sys
 import argparse
 import struct
+import hashlib
 from enum import IntEnum
 from typing import Dict, List, Tuple, Optional, Union
 
@@ -69,6 +71,20 @@ class Opcode(IntEnum):
     VLOAD = 0x34
     VSTORE = 0x35
     VBROADCAST = 0x36
+    MCOPY = 0x37
+    MFILL = 0x38
+    VOP = 0x39
+    VRED = 0x3A
+    VMEM = 0x3B
+
+# Lane types and vfunct operations for VOP/VRED/VMEM: vfunct = [7:6 type][5:0 op]
+VECTOR_TYPES = {'F64': 0, 'F32': 1, 'I64': 2, 'I32': 3}
+VECTOR_OPS = {
+    'VADD': 0, 'VSUB': 1, 'VMUL': 2, 'VFMA': 3, 'VMIN': 4, 'VMAX': 5,
+    'VAND': 6, 'VOR': 7, 'VXOR': 8, 'VCMPEQ': 9, 'VCMPLT': 10,
+}
+VECTOR_REDUCTIONS = {'VREDSUM': 0, 'VREDMIN': 1, 'VREDMAX': 2}
+VECTOR_MEMORY_OPS = {'VGATHER': 0, 'VSCATTER': 1}
 
 class InstructionFormat(IntEnum):
     """Instruction encoding formats"""
@@ -77,14 +93,34 @@ class InstructionFormat(IntEnum):
     J_TYPE = 3  # Jump: opcode imm26
     V_TYPE = 4  # Vector: opcode vd, vs1, vs2
 
+# Program image layout (docs/isa_spec.md), read by nanocore_vm_load_image
+IMAGE_MAGIC = 0x4D49434E  # "NCIM"
+IMAGE_VERSION = 1
+IMAGE_BASE = 0x10000  # Default guest address of the text section
+IMAGE_PAGE_SIZE = 4096
+IMAGE_HEADER = struct.Struct('<IHHQIIIIIIIIQ')
+IMAGE_SECTION = struct.Struct('<IIQQQ')
+IMAGE_SYMBOL = struct.Struct('<QII')
+IMAGE_SECTION_TYPES = {'text': 1, 'data': 2, 'bss': 3}
+
 class Assembler:
-    def __init__(self):
+    def __init__(self, base: int = 0, page_align: bool = False):
         self.symbols = {}  # Label -> address mapping
         self.relocations = []  # Instructions that need label resolution
-        self.instructions = []  # Assembled instructions
+        self.instructions = []  # Assembled instructions of the current section
         self.current_address = 0
         self.errors = []
         
+        # Sections: .text and .data hold words, .bss only reserves space.
+        # Text starts at base; page_align starts data and bss on fresh pages
+        # so an image loader can map them.
+        self.base = base
+        self.page_align = page_align
+        self.section = 'text'
+        self.section_words = {'text': self.instructions, 'data': []}
+        self.section_base = {'text': base, 'data': base, 'bss': base}
+        self.section_size = {'text': 0, 'data': 0, 'bss': 0}
+        
         # Instruction format mapping
         self.formats = {
             # R-type instructions
@@ -103,6 +139,8 @@ class Assembler:
             'SAR': (Opcode.SAR, InstructionFormat.R_TYPE),
             'ROL': (Opcode.ROL, InstructionFormat.R_TYPE),
             'ROR': (Opcode.ROR, InstructionFormat.R_TYPE),
+            'MCOPY': (Opcode.MCOPY, InstructionFormat.R_TYPE),
+            'MFILL': (Opcode.MFILL, InstructionFormat.R_TYPE),
             
             # I-type instructions
             'LD': (Opcode.LD, InstructionFormat.I_TYPE),
@@ -163,7 +201,10 @@ class Assembler:
         self._second_pass(lines)
         
         # Resolve relocations
-        self._resolve_relocations()
+        for words in self.section_words.values():
+            self.instructions = words
+            self._resolve_relocations()
+            words[:] = self.instructions
         
         # Check for errors
         if self.errors:
@@ -177,6 +218,9 @@ class Assembler:
     def _first_pass(self, lines: List[str]):
         """First pass: collect labels and calculate addresses"""
         address = 0
+        section = 'text'
+        offsets = {'text': 0, 'data': 0, 'bss': 0}
+        placed = {}  # Label -> (section, offset)
         
         for line_num, line in enumerate(lines, 1):
             # Remove comments and strip
@@ -187,12 +231,23 @@ class Assembler:
             # Check for label
             if line.endswith(':'):
                 label = line[:-1]
-                if label in self.symbols:
+                if label in placed:
                     self.errors.append(f"Line {line_num}: Duplicate label '{label}'")
                 else:
-                    self.symbols[label] = address
+                    placed[label] = (section, address)
+                continue
+            
+            # Section switches
+            directive = line.split()[0].lower()
+            if directive in ('.text', '.data', '.bss'):
+                offsets[section] = address
+                section = directive[1:]
+                address = offsets[section]
                 continue
             
+            if section == 'bss' and directive != '.space':
+                self.errors.append(f"Line {line_num}: Only .space may appear in .bss")
+            
             # Check for directive
             if line.startswith('.'):
                 address += self._process_directive(line, address)
@@ -200,10 +255,28 @@ class Assembler:
             
             # Regular instruction
             address += 4  # All instructions are 32-bit
+        
+        offsets[section] = address
+        self._layout(offsets)
+        for label, (section, offset) in placed.items():
+            self.symbols[label] = self.section_base[section] + offset
+    
+    def _layout(self, sizes: Dict[str, int]):
+        """Place the sections: text at base, then data, then bss"""
+        align = IMAGE_PAGE_SIZE if self.page_align else 4
+        address = self.base
+        for section in ('text', 'data', 'bss'):
+            address = (address + align - 1) & ~(align - 1)
+            self.section_base[section] = address
+            self.section_size[section] = sizes[section]
+            address += sizes[section]
     
     def _second_pass(self, lines: List[str]):
         """Second pass: generate machine code"""
-        self.current_address = 0
+        self.section_address = dict(self.section_base)
+        self.section = 'text'
+        self.instructions = self.section_words['text']
+        self.current_address = self.base
         
         for line_num, line in enumerate(lines, 1):
             # Remove comments and strip
@@ -211,6 +284,11 @@ class Assembler:
             if not line or line.endswith(':'):
                 continue
             
+            directive = line.split()[0].lower()
+            if directive in ('.text', '.data', '.bss'):
+                self._switch_section(directive[1:])
+                continue
+            
             # Process directive
             if line.startswith('.'):
                 self._emit_directive(line)
@@ -233,8 +311,18 @@ class Assembler:
             except Exception as e:
                 self.errors.append(f"Line {line_num}: {str(e)}")
     
+    def _switch_section(self, section: str):
+        """Make section the target of emitted words"""
+        self.section_address[self.section] = self.current_address
+        self.section = section
+        self.instructions = self.section_words.get(section, [])
+        self.current_address = self.section_address[section]
+    
     def _assemble_instruction(self, mnemonic: str, operands: List[str], line_num: int):
         """Assemble a single instruction"""
+        if self._encode_typed_vector(mnemonic, operands):
+            return
+        
         if mnemonic not in self.formats:
             raise ValueError(f"Unknown instruction: {mnemonic}")
         
@@ -307,10 +395,9 @@ class Assembler:
             rs2 = self._parse_register(operands[1])
             
             # Handle label or immediate offset
-            if operands[2] in self.symbols or not operands[2].startswith(('0x', '-', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9')):
-                # This is a label reference - store it for later resolution
-                self.instructions.append(operands[2])  # Store label name for resolution
-                offset = 0  # Placeholder
+            if operands[2] in self.symbols:
+                # Label - offset in halfwords from the branch itself
+                offset = (self.symbols[operands[2]] - self.current_address) >> 1
             else:
                 offset = self._parse_immediate(operands[2], 13)
             
@@ -375,6 +462,58 @@ class Assembler:
         
         self._emit_instruction(instruction)
     
+    def _encode_typed_vector(self, mnemonic: str, operands: List[str]) -> bool:
+        """Encode OP.TYPE vector forms with an optional trailing mask register"""
+        base, _, suffix = mnemonic.partition('.')
+        if suffix not in VECTOR_TYPES:
+            return False
+        
+        if base in VECTOR_OPS:
+            opcode, funct = Opcode.VOP, VECTOR_OPS[base]
+            count = 3
+        elif base in VECTOR_REDUCTIONS:
+            opcode, funct = Opcode.VRED, VECTOR_REDUCTIONS[base]
+            count = 2
+        elif base in VECTOR_MEMORY_OPS:
+            opcode, funct = Opcode.VMEM, VECTOR_MEMORY_OPS[base]
+            count = 3
+        else:
+            return False
+        
+        if len(operands) not in (count, count + 1):
+            raise ValueError(f"{mnemonic} expects {count} operands and an optional mask")
+        
+        vmask = 0
+        if len(operands) > count:
+            vmask = self._parse_vector_register(operands[count])
+            if not 1 <= vmask <= 7:
+                raise ValueError(f"Mask register must be V1-V7: {operands[count]}")
+        
+        # Unmasked f64 add/sub/mul keep their original opcodes
+        if vmask == 0 and suffix == 'F64' and base in ('VADD', 'VSUB', 'VMUL'):
+            self._encode_v_type(Opcode.VADD_F64 + funct, operands, 0)
+            return True
+        
+        if opcode == Opcode.VOP:
+            rd = self._parse_vector_register(operands[0])
+            rs1 = self._parse_vector_register(operands[1])
+            rs2 = self._parse_vector_register(operands[2])
+        elif opcode == Opcode.VRED:
+            rd = self._parse_register(operands[0])
+            rs1 = self._parse_vector_register(operands[1])
+            rs2 = 0
+        else:
+            rd = self._parse_vector_register(operands[0])
+            rs1 = self._parse_register(operands[1])
+            rs2 = self._parse_vector_register(operands[2])
+        
+        # V-type: [31:26 opcode][25:21 vd][20:16 vs1][15:11 vs2][10:8 vmask][7:0 vfunct]
+        vfunct = (VECTOR_TYPES[suffix] << 6) | funct
+        instruction = (opcode << 26) | (rd << 21) | (rs1 << 16) | (rs2 << 11) | (vmask << 8) | vfunct
+        
+        self._emit_instruction(instruction)
+        return True
+    
     def _parse_register(self, reg_str: str) -> int:
         """Parse register name to number"""
         reg_str = reg_str.upper().strip()
@@ -484,6 +623,14 @@ class Assembler:
                             word |= bytes_val[i + j] << (j * 8)
                     self.instructions.append(word)
                     self.current_address += 4
+        
+        elif directive == '.space':
+            # Reserve zeroed bytes, rounded up to whole words; bss only
+            # advances the address
+            size = (self._parse_immediate(parts[1], 32) + 3) & ~3
+            if self.section != 'bss':
+                self.instructions.extend([0] * (size // 4))
+            self.current_address += size
     
     def _process_directive(self, line: str, address: int) -> int:
         """Process directive and return size"""
@@ -493,12 +640,17 @@ class Assembler:
         if directive == '.word':
             return 4
         elif directive == '.byte':
-            return 1
+            # Bytes are packed into whole words
+            if len(parts) > 1:
+                return (len(parts[1].split(',')) + 3) & ~3
         elif directive == '.string':
             if len(parts) > 1:
-                # Account for string length + null terminator
+                # Account for string length + null terminator, padded to a word
                 string_val = parts[1].strip('"')
-                return len(string_val) + 1
+                return (len(string_val) + 1 + 3) & ~3
+        elif directive == '.space':
+            if len(parts) > 1:
+                return (self._parse_immediate(parts[1], 32) + 3) & ~3
         
         return 0
     
@@ -547,12 +699,101 @@ class Assembler:
         """Convert instructions to byte array"""
         result = bytearray()
         
-        for instruction in self.instructions:
+        for instruction in self.section_words['text']:
             # Little-endian encoding
             result.extend(struct.pack('<I', instruction))
         
+        # Data follows at its laid-out address; bss is left to the loader
+        data = self.section_words['data']
+        if data:
+            result.extend(bytes(self.section_base['data'] - self.base - len(result)))
+            for word in data:
+                result.extend(struct.pack('<I', word))
+        
         return bytes(result)
     
+    def _block_starts(self) -> List[int]:
+        """Guest addresses that begin a basic block in the text section"""
+        base = self.section_base['text']
+        words = self.section_words['text']
+        end = base + len(words) * 4
+        starts = {base}
+        
+        for i, word in enumerate(words):
+            pc = base + i * 4
+            opcode = word >> 26
+            if Opcode.BEQ <= opcode <= Opcode.BGEU:
+                offset = word & 0xFFFF
+                offset -= 0x10000 if offset & 0x8000 else 0
+                starts.add(pc + offset * 2)
+            elif opcode == Opcode.CALL:
+                offset = word & 0x3FFFFFF
+                offset -= 0x4000000 if offset & 0x2000000 else 0
+                starts.add(pc + offset * 4)
+            elif opcode not in (Opcode.JMP, Opcode.RET, Opcode.HALT):
+                continue
+            starts.add(pc + 4)
+        
+        return sorted(a for a in starts if base <= a < end and a % 4 == 0)
+    
+    def to_image(self, entry: Optional[int] = None) -> bytes:
+        """Build a program image from the last assembly: header, section
+        table, symbols, string table and block table, then page-aligned
+        text and data. The entry point defaults to _start, then main, then
+        the start of text."""
+        if entry is None:
+            entry = self.symbols.get('_start', self.symbols.get('main', self.section_base['text']))
+        
+        contents = {}
+        for section in ('text', 'data'):
+            contents[section] = b''.join(struct.pack('<I', w) for w in self.section_words[section])
+        sections = [s for s in ('text', 'data') if contents[s]]
+        if self.section_size['bss']:
+            sections.append('bss')
+        
+        strings = bytearray()
+        symbols = bytearray()
+        for label, addr in sorted(self.symbols.items(), key=lambda s: s[1]):
+            symbols.extend(IMAGE_SYMBOL.pack(addr, len(strings), 0))
+            strings.extend(label.encode('utf-8') + b'\0')
+        blocks = b''.join(struct.pack('<Q', a) for a in self._block_starts())
+        
+        section_offset = IMAGE_HEADER.size
+        symbol_offset = section_offset + len(sections) * IMAGE_SECTION.size
+        strings_offset = symbol_offset + len(symbols)
+        block_offset = (strings_offset + len(strings) + 7) & ~7
+        
+        # Section contents start on file pages matching their guest pages
+        offset = block_offset + len(blocks)
+        table = bytearray()
+        payload = bytearray()
+        for section in sections:
+            address = self.section_base[section]
+            size = self.section_size[section]
+            file_offset = 0
+            if section != 'bss':
+                file_offset = (offset + len(payload) + IMAGE_PAGE_SIZE - 1) & ~(IMAGE_PAGE_SIZE - 1)
+                file_offset += address % IMAGE_PAGE_SIZE
+                payload.extend(bytes(file_offset - offset - len(payload)))
+                payload.extend(contents[section])
+                size = len(contents[section])
+            table.extend(IMAGE_SECTION.pack(IMAGE_SECTION_TYPES[section], 0, address, file_offset, size))
+        
+        fields = [IMAGE_MAGIC, IMAGE_VERSION, IMAGE_HEADER.size, entry,
+                  len(sections), section_offset,
+                  len(self.symbols), symbol_offset,
+                  strings_offset, len(strings),
+                  len(blocks) // 8, block_offset, 0]
+        image = bytearray(IMAGE_HEADER.pack(*fields) + table + symbols + strings)
+        image.extend(bytes(block_offset - len(image)))
+        image.extend(blocks + payload)
+        
+        # The key names the image's translation cache, so it covers every byte
+        key = int.from_bytes(hashlib.blake2b(image, digest_size=8).digest(), 'little')
+        fields[-1] = key or 1
+        image[:IMAGE_HEADER.size] = IMAGE_HEADER.pack(*fields)
+        return bytes(image)
+
     # Pseudo-instruction expansions
     def _expand_load(self, operands: List[str], line_num: int):
         """Expand LOAD pseudo-instruction"""
@@ -611,6 +852,38 @@ class AssemblyError(Exception):
     """Assembly error exception"""
     pass
 
+def read_image(filename: str) -> dict:
+    """Parse a program image into entry, sections ([(name, address, size,
+    bytes or None)]), symbols (label -> address), blocks and key"""
+    with open(filename, 'rb') as f:
+        data = f.read()
+    
+    (magic, version, header_size, entry, num_sections, section_offset, num_symbols,
+     symbol_offset, strings_offset, strings_size, num_blocks,
+     block_offset, key) = IMAGE_HEADER.unpack_from(data, 0)
+    if magic != IMAGE_MAGIC or version != IMAGE_VERSION:
+        raise AssemblyError(f"{filename}: not a NanoCore program image")
+    
+    names = {v: k for k, v in IMAGE_SECTION_TYPES.items()}
+    sections = []
+    for i in range(num_sections):
+        kind, _, address, offset, size = IMAGE_SECTION.unpack_from(
+            data, section_offset + i * IMAGE_SECTION.size)
+        name = names.get(kind, str(kind))
+        sections.append((name, address, size, None if name == 'bss' else data[offset:offset + size]))
+    
+    strings = data[strings_offset:strings_offset + strings_size]
+    symbols = {}
+    for i in range(num_symbols):
+        address, name, _ = IMAGE_SYMBOL.unpack_from(data, symbol_offset + i * IMAGE_SYMBOL.size)
+        symbols[strings[name:strings.index(b'\0', name)].decode('utf-8')] = address
+    
+    blocks = list(struct.unpack_from(f'<{num_blocks}Q', data, block_offset))
+    if header_size < IMAGE_HEADER.size:
+        key = 0  # Written before images carried a key
+    return {'entry': entry, 'sections': sections, 'symbols': symbols, 'blocks': blocks,
+            'key': key}
+
 def main():
     parser = argparse.ArgumentParser(description='NanoCore Assembler')
     parser.add_argument('input', help='Input assembly file')
@@ -618,20 +891,41 @@ def main():
                        default='a.out')
     parser.add_argument('-v', '--verbose', action='store_true',
                        help='Verbose output')
+    parser.add_argument('-s', '--symbols',
+                       help='Write the symbol table (address label per line, '
+                            'relative to --base)')
+    parser.add_argument('-f', '--format', choices=['bin', 'image'], default='bin',
+                       help='Flat binary, or a sectioned program image for '
+                            'nanocore_vm_load_image')
+    parser.add_argument('--base', type=lambda v: int(v, 0), default=None,
+                       help=f'Guest address of the text section (image default '
+                            f'0x{IMAGE_BASE:x}, binary default 0)')
     
     args = parser.parse_args()
     
     # Create assembler
-    asm = Assembler()
+    image = args.format == 'image'
+    base = args.base if args.base is not None else (IMAGE_BASE if image else 0)
+    if image and base % IMAGE_PAGE_SIZE:
+        print(f"Image base must be {IMAGE_PAGE_SIZE}-byte aligned", file=sys.stderr)
+        sys.exit(1)
+    asm = Assembler(base=base, page_align=image)
     
     try:
         # Assemble file
         code = asm.assemble_file(args.input)
+        if image:
+            code = asm.to_image()
         
         # Write output
         with open(args.output, 'wb') as f:
             f.write(code)
         
+        if args.symbols:
+            with open(args.symbols, 'w') as f:
+                for label, addr in sorted(asm.symbols.items(), key=lambda s: s[1]):
+                    f.write(f"0x{addr:08x} {label}\n")
+        
         if args.verbose:
             print(f"Assembled {len(code)} bytes")
             print(f"Output written to: {args.output}")
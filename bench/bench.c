@@ -0,0 +1,638 @@
+/*
+ * NanoCore benchmark driver
+ * Runs a fixed set of guest kernels on each engine and prints the results
+ * as JSON on stdout, with a one-line summary per run on stderr.
+ *
+ * Engines are loaded with dlopen, so the FFI library and the assembly core
+ * (which both export nanocore_init) can share one process, and a missing
+ * library only skips its engine.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#ifndef NANOCORE_VERSION
+#define NANOCORE_VERSION "unknown"
+#endif
+
+#define BENCH_SCHEMA 1
+#define BENCH_MEMORY_SIZE (4 * 1024 * 1024)
+#define BENCH_CODE_BASE 0x10000
+#define BENCH_DATA_BASE 0x100000
+#define BENCH_MAX_REPS 1000
+
+// Instruction encodings (docs/isa_spec.md)
+#define OP_R(op, rd, rs1, rs2) (((uint32_t)(op) << 26) | ((rd) << 21) | ((rs1) << 16) | ((rs2) << 11))
+#define OP_I(op, rd, rs1, imm) (((uint32_t)(op) << 26) | ((rd) << 21) | ((rs1) << 16) | ((uint32_t)(imm) & 0xFFFF))
+#define OP_CALL(words) ((0x1Eu << 26) | ((uint32_t)(words) & 0x3FFFFFF))
+#define OP_RET (0x1Fu << 26)
+#define OP_HALT (0x21u << 26)
+
+#define ADD(rd, a, b) OP_R(0x00, rd, a, b)
+#define SUB(rd, a, b) OP_R(0x01, rd, a, b)
+#define MUL(rd, a, b) OP_R(0x02, rd, a, b)
+#define AND(rd, a, b) OP_R(0x06, rd, a, b)
+#define XOR(rd, a, b) OP_R(0x08, rd, a, b)
+#define SHL(rd, a, b) OP_R(0x0A, rd, a, b)
+#define SHR(rd, a, b) OP_R(0x0B, rd, a, b)
+#define ST(rs, off, base) OP_I(0x13, rs, base, off)
+#define VFMA(vd, vs1, vs2, vs3) (OP_R(0x33, vd, vs1, vs2) | ((vs3) << 7))
+#define VLOAD(vd, off, base) OP_I(0x34, vd, base, off)
+#define VSTORE(vs, off, base) (OP_I(0x35, 0, base, off) | ((vs) << 11))
+
+// Branch offsets are in halfwords from the branch itself
+#define BEQ(a, b, words) OP_I(0x17, a, b, (words) * 2)
+#define BNE(a, b, words) OP_I(0x18, a, b, (words) * 2)
+#define BLT(a, b, words) OP_I(0x19, a, b, (words) * 2)
+
+// ---------------------------------------------------------------------------
+// Engines
+// ---------------------------------------------------------------------------
+
+typedef struct engine engine_t;
+
+struct engine {
+    const char* name;
+    const char* library;
+    void* dl;
+    void* vm;     // Engine's VM: a context pointer or a boxed handle
+    int jit;
+    
+    int (*create)(engine_t* e);
+    void (*destroy)(engine_t* e);
+    int (*write)(engine_t* e, uint64_t addr, const void* data, uint64_t size);
+    int (*read)(engine_t* e, uint64_t addr, void* data, uint64_t size);
+    void (*reset)(engine_t* e);  // Registers cleared, PC at BENCH_CODE_BASE
+    void (*set_reg)(engine_t* e, int index, uint64_t value);
+    uint64_t (*get_reg)(engine_t* e, int index);
+    int (*run)(engine_t* e);
+    uint64_t (*instructions)(engine_t* e);
+    
+    // Library entry points
+    void* fn[12];
+};
+
+static void* engine_sym(engine_t* e, const char* name) {
+    void* sym = dlsym(e->dl, name);
+    if (!sym) {
+        fprintf(stderr, "bench: %s: missing %s\n", e->library, name);
+    }
+    return sym;
+}
+
+// FFI library (glue/ffi/nanocore_ffi.c), interpreter or template JIT
+enum {
+    FFI_INIT, FFI_CREATE_EX, FFI_DESTROY, FFI_RESET, FFI_SET_REG, FFI_GET_REG,
+    FFI_LOAD, FFI_READ, FFI_RUN, FFI_PERF, FFI_FUNCTIONS
+};
+
+static const char* const ffi_functions[FFI_FUNCTIONS] = {
+    "nanocore_init", "nanocore_vm_create_ex", "nanocore_vm_destroy", "nanocore_vm_reset",
+    "nanocore_vm_set_register", "nanocore_vm_get_register", "nanocore_vm_load_program",
+    "nanocore_vm_read_memory", "nanocore_vm_run", "nanocore_vm_get_perf_counter",
+};
+
+typedef struct {
+    uint32_t struct_size;
+    uint32_t flags;
+    uint32_t jit_threshold;
+    uint32_t reserved;
+} ffi_options_t;
+
+#define FFI_HANDLE(e) (*(int*)(e)->vm)
+#define ENGINE_FN(e, index, type) ((type)(e)->fn[index])
+
+static int ffi_create(engine_t* e) {
+    ffi_options_t options = { sizeof(options), e->jit ? 0x01 : 0, 0, 0 };
+    int* handle = malloc(sizeof(int));
+    if (!handle) {
+        return -1;
+    }
+    if (ENGINE_FN(e, FFI_CREATE_EX, int (*)(uint64_t, const ffi_options_t*, int*))(
+            BENCH_MEMORY_SIZE, &options, handle) != 0) {
+        free(handle);
+        return -1;
+    }
+    e->vm = handle;
+    return 0;
+}
+
+static void ffi_destroy(engine_t* e) {
+    ENGINE_FN(e, FFI_DESTROY, int (*)(int))(FFI_HANDLE(e));
+    free(e->vm);
+    e->vm = NULL;
+}
+
+static int ffi_write(engine_t* e, uint64_t addr, const void* data, uint64_t size) {
+    return ENGINE_FN(e, FFI_LOAD, int (*)(int, const void*, uint64_t, uint64_t))(FFI_HANDLE(e), data, size, addr);
+}
+
+static int ffi_read(engine_t* e, uint64_t addr, void* data, uint64_t size) {
+    return ENGINE_FN(e, FFI_READ, int (*)(int, uint64_t, void*, uint64_t))(FFI_HANDLE(e), addr, data, size);
+}
+
+static void ffi_reset(engine_t* e) {
+    ENGINE_FN(e, FFI_RESET, int (*)(int))(FFI_HANDLE(e));  // PC = 0x10000
+}
+
+static void ffi_set_reg(engine_t* e, int index, uint64_t value) {
+    ENGINE_FN(e, FFI_SET_REG, int (*)(int, int, uint64_t))(FFI_HANDLE(e), index, value);
+}
+
+static uint64_t ffi_get_reg(engine_t* e, int index) {
+    uint64_t value = 0;
+    ENGINE_FN(e, FFI_GET_REG, int (*)(int, int, uint64_t*))(FFI_HANDLE(e), index, &value);
+    return value;
+}
+
+static int ffi_run(engine_t* e) {
+    return ENGINE_FN(e, FFI_RUN, int (*)(int, uint64_t))(FFI_HANDLE(e), 0);
+}
+
+static uint64_t ffi_instructions(engine_t* e) {
+    uint64_t value = 0;
+    ENGINE_FN(e, FFI_PERF, int (*)(int, int, uint64_t*))(FFI_HANDLE(e), 0, &value);
+    return value;
+}
+
+// Assembly core (libnanocore)
+enum {
+    ASM_INIT, ASM_CREATE, ASM_DESTROY, ASM_VM_INIT, ASM_RESET, ASM_SET_REG, ASM_GET_REG,
+    ASM_SET_PC, ASM_WRITE, ASM_READ, ASM_RUN, ASM_PERF, ASM_FUNCTIONS
+};
+
+static const char* const asm_functions[ASM_FUNCTIONS] = {
+    "nanocore_init", "vm_context_create", "vm_context_destroy", "vm_init", "vm_reset",
+    "vm_set_register", "vm_get_register", "vm_set_pc", "memory_write", "memory_read",
+    "vm_run", "vm_get_perf",
+};
+
+static int asm_create(engine_t* e) {
+    void* ctx = ENGINE_FN(e, ASM_CREATE, void* (*)(void))();
+    if (!ctx || ENGINE_FN(e, ASM_VM_INIT, int (*)(void*, uint64_t))(ctx, BENCH_MEMORY_SIZE) != 0) {
+        if (ctx) {
+            ENGINE_FN(e, ASM_DESTROY, void (*)(void*))(ctx);
+        }
+        return -1;
+    }
+    e->vm = ctx;
+    return 0;
+}
+
+static void asm_destroy(engine_t* e) {
+    ENGINE_FN(e, ASM_DESTROY, void (*)(void*))(e->vm);
+    e->vm = NULL;
+}
+
+static int asm_write(engine_t* e, uint64_t addr, const void* data, uint64_t size) {
+    return ENGINE_FN(e, ASM_WRITE, int (*)(void*, uint64_t, const void*, uint64_t))(e->vm, addr, data, size);
+}
+
+static int asm_read(engine_t* e, uint64_t addr, void* data, uint64_t size) {
+    return ENGINE_FN(e, ASM_READ, int (*)(void*, uint64_t, void*, uint64_t))(e->vm, addr, data, size);
+}
+
+static void asm_reset(engine_t* e) {
+    ENGINE_FN(e, ASM_RESET, void (*)(void*))(e->vm);
+    ENGINE_FN(e, ASM_SET_PC, void (*)(void*, uint64_t))(e->vm, BENCH_CODE_BASE);
+}
+
+static void asm_set_reg(engine_t* e, int index, uint64_t value) {
+    ENGINE_FN(e, ASM_SET_REG, void (*)(void*, uint64_t, uint64_t))(e->vm, (uint64_t)index, value);
+}
+
+static uint64_t asm_get_reg(engine_t* e, int index) {
+    return ENGINE_FN(e, ASM_GET_REG, uint64_t (*)(void*, uint64_t))(e->vm, (uint64_t)index);
+}
+
+static int asm_run(engine_t* e) {
+    return ENGINE_FN(e, ASM_RUN, int (*)(void*, uint64_t))(e->vm, 0);
+}
+
+static uint64_t asm_instructions(engine_t* e) {
+    uint64_t perf[16];
+    ENGINE_FN(e, ASM_PERF, void (*)(void*, uint64_t*))(e->vm, perf);
+    return perf[0];
+}
+
+static engine_t engines[] = {
+    { .name = "ffi", .create = ffi_create, .destroy = ffi_destroy, .write = ffi_write,
+      .read = ffi_read, .reset = ffi_reset, .set_reg = ffi_set_reg, .get_reg = ffi_get_reg,
+      .run = ffi_run, .instructions = ffi_instructions },
+    { .name = "ffi-jit", .jit = 1, .create = ffi_create, .destroy = ffi_destroy, .write = ffi_write,
+      .read = ffi_read, .reset = ffi_reset, .set_reg = ffi_set_reg, .get_reg = ffi_get_reg,
+      .run = ffi_run, .instructions = ffi_instructions },
+    { .name = "asm", .create = asm_create, .destroy = asm_destroy, .write = asm_write,
+      .read = asm_read, .reset = asm_reset, .set_reg = asm_set_reg, .get_reg = asm_get_reg,
+      .run = asm_run, .instructions = asm_instructions },
+};
+
+#define NUM_ENGINES (int)(sizeof(engines) / sizeof(engines[0]))
+
+// Load an engine's library and entry points; nonzero if it isn't usable
+static int engine_open(engine_t* e, const char* ffi_lib, const char* asm_lib) {
+    int is_asm = e->create == asm_create;
+    const char* const* names = is_asm ? asm_functions : ffi_functions;
+    int count = is_asm ? ASM_FUNCTIONS : FFI_FUNCTIONS;
+    
+    e->library = is_asm ? asm_lib : ffi_lib;
+    e->dl = dlopen(e->library, RTLD_NOW | RTLD_LOCAL);
+    if (!e->dl) {
+        fprintf(stderr, "bench: skipping %s: %s\n", e->name, dlerror());
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!(e->fn[i] = engine_sym(e, names[i]))) {
+            dlclose(e->dl);
+            e->dl = NULL;
+            return -1;
+        }
+    }
+    ENGINE_FN(e, 0, int (*)(void))();  // nanocore_init
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Kernels. Every kernel runs to HALT, keeps its iteration count in R1 and
+// leaves a checksum in R2 (or in memory at RESULT_ADDR) so engines can be
+// compared. Only instructions both engines implement are used, and
+// constants come in through registers because LD differs between them
+// (load-immediate in the FFI, a memory load in the assembly core).
+// ---------------------------------------------------------------------------
+
+#define RESULT_ADDR (BENCH_DATA_BASE - 64)
+#define STREAM_BYTES (1024 * 1024)
+#define DOT_ELEMENTS 8192  // Doubles per vector
+
+typedef struct {
+    const char* name;
+    const char* description;
+    const uint32_t* code;
+    uint32_t code_words;
+    uint32_t insts_per_iteration;  // Approximate, to size runs
+    void (*seed)(engine_t* e);     // Registers other than R1
+    int (*setup)(engine_t* e);     // Data, once per VM
+    int result_in_memory;
+} kernel_t;
+
+// R2 accumulates a mixed add/xor/multiply chain
+static const uint32_t alu_code[] = {
+    ADD(2, 2, 1),
+    XOR(4, 4, 2),
+    MUL(7, 4, 6),
+    SUB(2, 7, 4),
+    AND(8, 2, 5),
+    ADD(2, 2, 8),
+    SUB(1, 1, 3),
+    BNE(1, 0, -7),
+    OP_HALT,
+};
+
+static void alu_seed(engine_t* e) {
+    e->set_reg(e, 3, 1);
+    e->set_reg(e, 5, 0x9E3779B97F4A7C15ull);
+    e->set_reg(e, 6, 3);
+}
+
+// Xorshift64 with a branch on the low bit: taken half the time at random
+static const uint32_t branchy_code[] = {
+    SHL(4, 9, 10),
+    XOR(9, 9, 4),
+    SHR(4, 9, 11),
+    XOR(9, 9, 4),
+    SHL(4, 9, 12),
+    XOR(9, 9, 4),
+    AND(4, 9, 3),
+    BEQ(4, 0, 3),
+    ADD(2, 2, 3),
+    XOR(8, 8, 9),
+    SUB(1, 1, 3),
+    BNE(1, 0, -11),
+    OP_HALT,
+};
+
+static void branchy_seed(engine_t* e) {
+    e->set_reg(e, 3, 1);
+    e->set_reg(e, 9, 0x2545F4914F6CDD1Dull);
+    e->set_reg(e, 10, 13);
+    e->set_reg(e, 11, 7);
+    e->set_reg(e, 12, 17);
+}
+
+// 32-byte store bursts over a 1 MiB buffer, one pass per iteration
+static const uint32_t stream_code[] = {
+    ADD(7, 11, 0),
+    ST(9, 0, 7),
+    ST(9, 8, 7),
+    ST(9, 16, 7),
+    ST(9, 24, 7),
+    ADD(7, 7, 10),
+    BLT(7, 8, -5),
+    ADD(9, 9, 3),
+    SUB(1, 1, 3),
+    BNE(1, 0, -9),
+    ADD(2, 9, 0),
+    OP_HALT,
+};
+
+static void stream_seed(engine_t* e) {
+    e->set_reg(e, 3, 1);
+    e->set_reg(e, 8, BENCH_DATA_BASE + STREAM_BYTES);
+    e->set_reg(e, 10, 32);
+    e->set_reg(e, 11, BENCH_DATA_BASE);
+}
+
+// V0 += A[i] * B[i] over two DOT_ELEMENTS vectors, once per iteration
+static const uint32_t dot_code[] = {
+    ADD(7, 11, 0),
+    ADD(8, 13, 0),
+    VLOAD(1, 0, 7),
+    VLOAD(2, 0, 8),
+    VFMA(0, 1, 2, 0),
+    ADD(7, 7, 10),
+    ADD(8, 8, 10),
+    BLT(7, 12, -5),
+    SUB(1, 1, 3),
+    BNE(1, 0, -9),
+    VSTORE(0, 0, 14),
+    OP_HALT,
+};
+
+static void dot_seed(engine_t* e) {
+    e->set_reg(e, 3, 1);
+    e->set_reg(e, 10, 32);
+    e->set_reg(e, 11, BENCH_DATA_BASE);
+    e->set_reg(e, 12, BENCH_DATA_BASE + DOT_ELEMENTS * 8);
+    e->set_reg(e, 13, BENCH_DATA_BASE + DOT_ELEMENTS * 8);
+    e->set_reg(e, 14, RESULT_ADDR);
+}
+
+static int dot_setup(engine_t* e) {
+    static double data[2 * DOT_ELEMENTS];
+    for (int i = 0; i < DOT_ELEMENTS; i++) {
+        data[i] = 1.0 / (i + 1);
+        data[DOT_ELEMENTS + i] = (double)(i % 7);
+    }
+    return e->write(e, BENCH_DATA_BASE, data, sizeof(data));
+}
+
+// A call tree three deep: f calls g twice, g calls h. The FFI has no
+// memory loads, so callers keep the R31 link in a register, not a stack.
+static const uint32_t calls_code[] = {
+    OP_CALL(4),       // main: CALL f
+    SUB(1, 1, 3),
+    BNE(1, 0, -2),
+    OP_HALT,
+    ADD(20, 31, 0),   // f
+    OP_CALL(5),
+    OP_CALL(4),
+    ADD(2, 2, 3),
+    ADD(31, 20, 0),
+    OP_RET,
+    ADD(21, 31, 0),   // g
+    OP_CALL(3),
+    ADD(31, 21, 0),
+    OP_RET,
+    ADD(2, 2, 4),     // h
+    OP_RET,
+};
+
+static void calls_seed(engine_t* e) {
+    e->set_reg(e, 3, 1);
+    e->set_reg(e, 4, 3);
+}
+
+#define KERNEL_CODE(code) code, (uint32_t)(sizeof(code) / sizeof(code[0]))
+
+static const kernel_t kernels[] = {
+    { "alu", "dependent integer add/xor/mul chain", KERNEL_CODE(alu_code), 8,
+      alu_seed, NULL, 0 },
+    { "branchy", "xorshift with an unpredictable branch", KERNEL_CODE(branchy_code), 11,
+      branchy_seed, NULL, 0 },
+    { "stream", "32-byte store bursts over 1 MiB", KERNEL_CODE(stream_code), STREAM_BYTES / 32 * 6,
+      stream_seed, NULL, 0 },
+    { "dot", "SIMD f64 dot product, 2 x 64 KiB", KERNEL_CODE(dot_code), DOT_ELEMENTS / 4 * 6,
+      dot_seed, dot_setup, 1 },
+    { "calls", "nested CALL/RET tree, 5 calls per iteration", KERNEL_CODE(calls_code), 21,
+      calls_seed, NULL, 0 },
+};
+
+#define NUM_KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+// ---------------------------------------------------------------------------
+// Measurement
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int warmup;
+    int reps;
+    uint64_t target_insts;
+    const char* ffi_lib;
+    const char* asm_lib;
+    const char* engines[NUM_ENGINES];
+    int num_engines;
+    const char* kernels[NUM_KERNELS];
+    int num_kernels;
+} bench_options_t;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// Resident set size now, or the peak where the current value isn't available
+static long current_rss_kb(void) {
+    long pages = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        long size;
+        if (fscanf(fp, "%ld %ld", &size, &pages) != 2) {
+            pages = 0;
+        }
+        fclose(fp);
+    }
+    if (pages > 0) {
+        return pages * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;  // Kilobytes on Linux
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int selected(const char* name, const char* const* list, int count) {
+    if (count == 0) {
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (strcmp(name, list[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// One (engine, kernel) measurement: warmup runs, then timed repetitions on
+// the same VM so translation caches are warm. Returns nonzero on failure.
+static int bench_kernel(engine_t* e, const kernel_t* k, const bench_options_t* opt, int first) {
+    uint64_t iterations = opt->target_insts / k->insts_per_iteration;
+    if (iterations == 0) {
+        iterations = 1;
+    }
+    
+    if (e->create(e) != 0) {
+        fprintf(stderr, "bench: %s: could not create a VM\n", e->name);
+        return -1;
+    }
+    if (e->write(e, BENCH_CODE_BASE, k->code, k->code_words * 4) != 0 ||
+        (k->setup && k->setup(e) != 0)) {
+        fprintf(stderr, "bench: %s/%s: could not load the kernel\n", e->name, k->name);
+        e->destroy(e);
+        return -1;
+    }
+    
+    double ns[BENCH_MAX_REPS];
+    uint64_t insts = 0;
+    uint64_t checksum = 0;
+    int status = 0;
+    
+    for (int rep = -opt->warmup; rep < opt->reps && status == 0; rep++) {
+        e->reset(e);
+        k->seed(e);
+        e->set_reg(e, 1, iterations);
+    
+        double start = now_ns();
+        status = e->run(e);
+        double elapsed = now_ns() - start;
+    
+        insts = e->instructions(e);
+        if (k->result_in_memory) {
+            e->read(e, RESULT_ADDR, &checksum, sizeof(checksum));
+        } else {
+            checksum = e->get_reg(e, 2);
+        }
+        if (rep >= 0) {
+            ns[rep] = insts ? elapsed / (double)insts : 0.0;
+        }
+    }
+    long rss = current_rss_kb();
+    e->destroy(e);
+    
+    if (status != 0) {
+        fprintf(stderr, "bench: %s/%s: run stopped with status %d\n", e->name, k->name, status);
+        return -1;
+    }
+    
+    qsort(ns, (size_t)opt->reps, sizeof(ns[0]), compare_double);
+    double median = opt->reps % 2 ? ns[opt->reps / 2] : (ns[opt->reps / 2 - 1] + ns[opt->reps / 2]) / 2;
+    double mean = 0.0;
+    for (int i = 0; i < opt->reps; i++) {
+        mean += ns[i] / opt->reps;
+    }
+    
+    printf("%s    {\"engine\": \"%s\", \"kernel\": \"%s\", \"instructions\": %llu, "
+           "\"ns_per_inst\": {\"min\": %.4f, \"median\": %.4f, \"mean\": %.4f, \"max\": %.4f}, "
+           "\"mips\": %.1f, \"rss_kb\": %ld, \"checksum\": \"0x%016llx\"}",
+           first ? "" : ",\n", e->name, k->name, (unsigned long long)insts,
+           ns[0], median, mean, ns[opt->reps - 1], median > 0 ? 1e3 / median : 0.0,
+           rss, (unsigned long long)checksum);
+    fprintf(stderr, "%-8s %-8s %12llu insts %8.3f ns/inst %9.1f MIPS %8ld KiB\n",
+            e->name, k->name, (unsigned long long)insts, median,
+            median > 0 ? 1e3 / median : 0.0, rss);
+    return 0;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s [--engine=NAME]... [--kernel=NAME]... [--reps=N] [--warmup=N]\n"
+            "          [--insts=N] [--ffi-lib=PATH] [--asm-lib=PATH] [--list]\n",
+            argv0);
+}
+
+int main(int argc, char* argv[]) {
+    bench_options_t opt = {
+        .warmup = 1,
+        .reps = 5,
+        .target_insts = 20000000,
+        .ffi_lib = "build/lib/libnanocore_ffi.so",
+        .asm_lib = "build/lib/libnanocore.so",
+    };
+    
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--engine=", 9) == 0 && opt.num_engines < NUM_ENGINES) {
+            opt.engines[opt.num_engines++] = arg + 9;
+        } else if (strncmp(arg, "--kernel=", 9) == 0 && opt.num_kernels < NUM_KERNELS) {
+            opt.kernels[opt.num_kernels++] = arg + 9;
+        } else if (strncmp(arg, "--reps=", 7) == 0) {
+            opt.reps = atoi(arg + 7);
+        } else if (strncmp(arg, "--warmup=", 9) == 0) {
+            opt.warmup = atoi(arg + 9);
+        } else if (strncmp(arg, "--insts=", 8) == 0) {
+            opt.target_insts = strtoull(arg + 8, NULL, 10);
+        } else if (strncmp(arg, "--ffi-lib=", 10) == 0) {
+            opt.ffi_lib = arg + 10;
+        } else if (strncmp(arg, "--asm-lib=", 10) == 0) {
+            opt.asm_lib = arg + 10;
+        } else if (strcmp(arg, "--list") == 0) {
+            for (int k = 0; k < NUM_KERNELS; k++) {
+                printf("%-8s %s\n", kernels[k].name, kernels[k].description);
+            }
+            return 0;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.reps < 1 || opt.reps > BENCH_MAX_REPS || opt.warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    printf("{\n  \"schema\": %d,\n  \"version\": \"%s\",\n  \"warmup\": %d,\n  \"reps\": %d,\n"
+           "  \"target_instructions\": %llu,\n  \"results\": [\n",
+           BENCH_SCHEMA, NANOCORE_VERSION, opt.warmup, opt.reps,
+           (unsigned long long)opt.target_insts);
+    
+    int failures = 0;
+    int first = 1;
+    for (int i = 0; i < NUM_ENGINES; i++) {
+        engine_t* e = &engines[i];
+        if (!selected(e->name, opt.engines, opt.num_engines) ||
+            engine_open(e, opt.ffi_lib, opt.asm_lib) != 0) {
+            continue;
+        }
+        for (int k = 0; k < NUM_KERNELS; k++) {
+            if (!selected(kernels[k].name, opt.kernels, opt.num_kernels)) {
+                continue;
+            }
+            if (bench_kernel(e, &kernels[k], &opt, first) == 0) {
+                first = 0;
+            } else {
+                failures++;
+            }
+        }
+    }
+    
+    printf("\n  ],\n  \"peak_rss_kb\": %ld,\n  \"failures\": %d\n}\n", peak_rss_kb(), failures);
+    return failures ? 1 : 0;
+}
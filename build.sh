@@ -42,7 +42,7 @@ if [ "$1" == "debug" ]; then
     export ASFLAGS="-g"
 else
     echo "Building in RELEASE mode..."
-    export CFLAGS="-O3 -march=native"
+    export CFLAGS="-O3"
     export ASFLAGS=""
 fi
 
@@ -72,7 +72,7 @@ if command -v nasm >/dev/null 2>&1; then
         if [ -f "$asm" ]; then
             obj_name=$(basename "$asm" .asm)
             echo "  Assembling $obj_name..."
-            nasm -f $FORMAT $ASFLAGS -o "build/obj/$obj_name.o" "$asm" 2>/dev/null || {
+            nasm -f $FORMAT $ASFLAGS -I asm/core/ -o "build/obj/$obj_name.o" "$asm" 2>/dev/null || {
                 echo "    Warning: Could not fully assemble $obj_name (missing symbols)"
                 # Create placeholder for now
                 touch "build/obj/$obj_name.o"
@@ -2,110 +2,203 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 
-// External assembly functions
-extern void vm_init(void);
-extern void vm_run(void);
-extern void vm_load_program(const char* filename);
-extern void vm_reset(void);
-extern void vm_get_state(void* state);
-extern void vm_set_state(const void* state);
+// External assembly functions (every entry point takes the VM context)
+extern int nanocore_init(void);
+extern int nanocore_simd_level(void);
+extern void* vm_context_create(void);
+extern void vm_context_destroy(void* ctx);
+extern int vm_init(void* ctx, uint64_t memory_size);
+extern int vm_run(void* ctx, uint64_t max_instructions);
+extern void vm_reset(void* ctx);
+extern void vm_set_pc(void* ctx, uint64_t pc);
+extern void vm_set_register(void* ctx, int index, uint64_t value);
+extern int memory_write(void* ctx, uint64_t addr, const void* data, uint64_t size);
+extern const void* vm_get_state(void* ctx);
+extern void vm_set_timing_mode(void* ctx, int enable);
+extern int cache_configure(void* ctx, const void* config);
+extern void cache_get_stats(void* ctx, uint64_t stats[8]);
+extern void vm_get_perf(void* ctx, uint64_t perf[16]);
+extern const void* vm_get_abi(void);
 
-// VM state structure (matches assembly)
+// Cache model modes and configuration (matches cache_config in context.inc)
+enum { CACHE_MODE_FULL = 0, CACHE_MODE_OFF = 1, CACHE_MODE_SAMPLED = 2 };
+
+typedef struct {
+    uint32_t mode;
+    uint32_t sample_period;  // Sampled mode; 0 = default
+    uint32_t line_size;      // Geometry fields: 0 = default
+    uint32_t l1i_size, l1i_ways;
+    uint32_t l1d_size, l1d_ways;
+    uint32_t l2_size, l2_ways;
+    uint32_t reserved;
+} cache_config_t;
+
+// VM state structure (matches VM_* in context.inc, checked at startup)
 typedef struct {
     uint64_t pc;
     uint64_t sp;
-    uint8_t flags;
-    uint8_t reserved[7];
+    uint64_t flags;
     uint64_t gprs[32];
-    uint64_t vregs[16][2];  // SIMD registers
-    uint64_t perf_counters[16];
+    uint64_t vregs[16][4];  // SIMD registers
+    uint64_t perf_counters[8];
+    uint64_t cache_ctrl;
+    uint64_t vbase;
 } vm_state_t;
 
-// Test programs
+#define VM_ABI_VERSION 1
+
+// Layout reported by vm_get_abi (nanocore_abi_t in the FFI)
+typedef struct {
+    uint32_t struct_size;
+    uint32_t version;
+    uint32_t state_size;
+    uint32_t state_pc, state_sp, state_flags, state_gprs;
+    uint32_t state_vregs, state_perf_counters, state_cache_ctrl, state_vbase;
+    uint32_t perf_size, options_size, reserved;
+} abi_t;
+
+// True if vm_state_t above is the layout the core was built with
+static int abi_matches(const abi_t* abi) {
+    return abi->version == VM_ABI_VERSION && abi->state_size == sizeof(vm_state_t) &&
+           abi->state_pc == offsetof(vm_state_t, pc) && abi->state_sp == offsetof(vm_state_t, sp) &&
+           abi->state_flags == offsetof(vm_state_t, flags) &&
+           abi->state_gprs == offsetof(vm_state_t, gprs) &&
+           abi->state_vregs == offsetof(vm_state_t, vregs) &&
+           abi->state_perf_counters == offsetof(vm_state_t, perf_counters) &&
+           abi->state_cache_ctrl == offsetof(vm_state_t, cache_ctrl) &&
+           abi->state_vbase == offsetof(vm_state_t, vbase);
+}
+
+// Test program: copy R1 down the register file, then halt
+#define PROGRAM_BASE 0x1000
+#define OP_ADD(rd, rs1, rs2) ((0x00u << 26) | ((rd) << 21) | ((rs1) << 16) | ((rs2) << 11))
+#define OP_HALT (0x21u << 26)
+
 static uint32_t test_program[] = {
-    0x00000000,  // NOP
-    0x01000000,  // ADD R1, R0, R0 (R1 = 0)
-    0x02000001,  // ADD R2, R0, R1 (R2 = 0)
-    0x03000002,  // ADD R3, R0, R2 (R3 = 0)
-    0x04000003,  // ADD R4, R0, R3 (R4 = 0)
-    0x05000004,  // ADD R5, R0, R4 (R5 = 0)
-    0x06000005,  // ADD R6, R0, R5 (R6 = 0)
-    0x07000006,  // ADD R7, R0, R6 (R7 = 0)
-    0x08000007,  // ADD R8, R0, R7 (R8 = 0)
-    0x09000008,  // ADD R9, R0, R8 (R9 = 0)
-    0x0A000009,  // ADD R10, R0, R9 (R10 = 0)
-    0x0B00000A,  // ADD R11, R0, R10 (R11 = 0)
-    0x0C00000B,  // ADD R12, R0, R11 (R12 = 0)
-    0x0D00000C,  // ADD R13, R0, R12 (R13 = 0)
-    0x0E00000D,  // ADD R14, R0, R13 (R14 = 0)
-    0x0F00000E,  // ADD R15, R0, R14 (R15 = 0)
-    0x1000000F,  // ADD R16, R0, R15 (R16 = 0)
-    0x11000010,  // ADD R17, R0, R16 (R17 = 0)
-    0x12000011,  // ADD R18, R0, R17 (R18 = 0)
-    0x13000012,  // ADD R19, R0, R18 (R19 = 0)
-    0x14000013,  // ADD R20, R0, R19 (R20 = 0)
-    0x15000014,  // ADD R21, R0, R20 (R21 = 0)
-    0x16000015,  // ADD R22, R0, R21 (R22 = 0)
-    0x17000016,  // ADD R23, R0, R22 (R23 = 0)
-    0x18000017,  // ADD R24, R0, R23 (R24 = 0)
-    0x19000018,  // ADD R25, R0, R24 (R25 = 0)
-    0x1A000019,  // ADD R26, R0, R25 (R26 = 0)
-    0x1B00001A,  // ADD R27, R0, R26 (R27 = 0)
-    0x1C00001B,  // ADD R28, R0, R27 (R28 = 0)
-    0x1D00001C,  // ADD R29, R0, R28 (R29 = 0)
-    0x1E00001D,  // ADD R30, R0, R29 (R30 = 0)
-    0x1F00001E,  // ADD R31, R0, R30 (R31 = 0)
-    0x2000001F,  // HALT
+    OP_ADD(2, 0, 1),   // R2 = R1
+    OP_ADD(3, 0, 2),   // R3 = R2
+    OP_ADD(4, 0, 3),   // R4 = R3
+    OP_ADD(5, 0, 4),   // R5 = R4
+    OP_ADD(6, 0, 5),   // R6 = R5
+    OP_ADD(7, 0, 6),   // R7 = R6
+    OP_ADD(8, 0, 7),   // R8 = R7
+    OP_ADD(9, 0, 8),   // R9 = R8
+    OP_ADD(10, 0, 9),  // R10 = R9
+    OP_ADD(11, 0, 10), // R11 = R10
+    OP_ADD(12, 0, 11), // R12 = R11
+    OP_ADD(13, 0, 12), // R13 = R12
+    OP_ADD(14, 0, 13), // R14 = R13
+    OP_ADD(15, 0, 14), // R15 = R14
+    OP_ADD(16, 0, 15), // R16 = R15
+    OP_ADD(17, 0, 16), // R17 = R16
+    OP_ADD(18, 0, 17), // R18 = R17
+    OP_ADD(19, 0, 18), // R19 = R18
+    OP_ADD(20, 0, 19), // R20 = R19
+    OP_ADD(21, 0, 20), // R21 = R20
+    OP_ADD(22, 0, 21), // R22 = R21
+    OP_ADD(23, 0, 22), // R23 = R22
+    OP_ADD(24, 0, 23), // R24 = R23
+    OP_ADD(25, 0, 24), // R25 = R24
+    OP_ADD(26, 0, 25), // R26 = R25
+    OP_ADD(27, 0, 26), // R27 = R26
+    OP_ADD(28, 0, 27), // R28 = R27
+    OP_ADD(29, 0, 28), // R29 = R28
+    OP_ADD(30, 0, 29), // R30 = R29
+    OP_HALT,
 };
 
 void print_vm_state(const vm_state_t* state) {
     printf("VM State:\n");
-    printf("  PC: 0x%016llx\n", state->pc);
-    printf("  SP: 0x%016llx\n", state->sp);
-    printf("  Flags: 0x%02x\n", state->flags);
+    printf("  PC: 0x%016llx\n", (unsigned long long)state->pc);
+    printf("  SP: 0x%016llx\n", (unsigned long long)state->sp);
+    printf("  Flags: 0x%02llx\n", (unsigned long long)state->flags);
     
     printf("  GPRs:\n");
     for (int i = 0; i < 32; i += 4) {
         printf("    R%02d: 0x%016llx  R%02d: 0x%016llx  R%02d: 0x%016llx  R%02d: 0x%016llx\n",
-               i, state->gprs[i], i+1, state->gprs[i+1], i+2, state->gprs[i+2], i+3, state->gprs[i+3]);
+               i, (unsigned long long)state->gprs[i], i+1, (unsigned long long)state->gprs[i+1],
+               i+2, (unsigned long long)state->gprs[i+2], i+3, (unsigned long long)state->gprs[i+3]);
     }
     
     printf("  Performance Counters:\n");
-    for (int i = 0; i < 16; i += 4) {
+    for (int i = 0; i < 8; i += 4) {
         printf("    P%02d: 0x%016llx  P%02d: 0x%016llx  P%02d: 0x%016llx  P%02d: 0x%016llx\n",
-               i, state->perf_counters[i], i+1, state->perf_counters[i+1], i+2, state->perf_counters[i+2], i+3, state->perf_counters[i+3]);
+               i, (unsigned long long)state->perf_counters[i], i+1, (unsigned long long)state->perf_counters[i+1],
+               i+2, (unsigned long long)state->perf_counters[i+2], i+3, (unsigned long long)state->perf_counters[i+3]);
+    }
+}
+
+// Parse --cache=off|full|sampled[:N]
+static int parse_cache_option(const char* arg, cache_config_t* config) {
+    memset(config, 0, sizeof(*config));
+    if (strcmp(arg, "--cache=full") == 0) {
+        config->mode = CACHE_MODE_FULL;
+    } else if (strcmp(arg, "--cache=off") == 0) {
+        config->mode = CACHE_MODE_OFF;
+    } else if (strncmp(arg, "--cache=sampled", 15) == 0) {
+        config->mode = CACHE_MODE_SAMPLED;
+        if (arg[15] == ':') {
+            config->sample_period = (uint32_t)strtoul(arg + 16, NULL, 10);
+        } else if (arg[15] != '\0') {
+            return -1;
+        }
+    } else {
+        return -1;
     }
+    return 0;
 }
 
 int main(int argc, char* argv[]) {
     printf("NanoCore Expert-Level VM Test\n");
     printf("=============================\n\n");
     
-    // Initialize VM
-    printf("Initializing VM...\n");
-    vm_init();
+    cache_config_t cache_config;
+    memset(&cache_config, 0, sizeof(cache_config));
+    int timing = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--timing") == 0) {
+            timing = 1;
+        } else if (parse_cache_option(argv[i], &cache_config) != 0) {
+            printf("Usage: %s [--cache=off|full|sampled[:N]] [--timing]\n", argv[0]);
+            return 1;
+        }
+    }
     
-    // Create test program file
-    FILE* fp = fopen("test_program.bin", "wb");
-    if (!fp) {
-        printf("Error: Could not create test program file\n");
+    // Initialize VM
+    static const char* const simd_levels[] = { "SSE2", "AVX2", "AVX-512" };
+    if (!abi_matches(vm_get_abi())) {
+        printf("Error: VM state layout does not match this build of the core\n");
         return 1;
     }
-    
-    fwrite(test_program, sizeof(test_program), 1, fp);
-    fclose(fp);
+    nanocore_init();
+    printf("Initializing VM (%s handlers)...\n", simd_levels[nanocore_simd_level()]);
+    void* ctx = vm_context_create();
+    if (!ctx || cache_configure(ctx, &cache_config) != 0 ||
+        vm_init(ctx, 1024 * 1024) != 0) {
+        printf("Error: Could not initialize VM\n");
+        vm_context_destroy(ctx);
+        return 1;
+    }
+    vm_set_timing_mode(ctx, timing);
     
     // Load and run test program
     printf("Loading test program...\n");
-    vm_load_program("test_program.bin");
+    if (memory_write(ctx, PROGRAM_BASE, test_program, sizeof(test_program)) != 0) {
+        printf("Error: Could not load test program\n");
+        vm_context_destroy(ctx);
+        return 1;
+    }
+    vm_set_pc(ctx, PROGRAM_BASE);
+    vm_set_register(ctx, 1, 0x1234);
     
     printf("Running VM...\n");
-    vm_run();
+    vm_run(ctx, 0);
     
     // Get final state
     vm_state_t final_state;
-    vm_get_state(&final_state);
+    memcpy(&final_state, vm_get_state(ctx), sizeof(final_state));
     
     printf("\nFinal VM State:\n");
     print_vm_state(&final_state);
@@ -117,8 +210,25 @@ int main(int argc, char* argv[]) {
         printf("\n✗ VM did not halt properly\n");
     }
     
+    if (cache_config.mode != CACHE_MODE_OFF) {
+        uint64_t stats[8];
+        cache_get_stats(ctx, stats);
+        printf("  L1I: %llu hits, %llu misses  L2: %llu hits, %llu misses\n",
+               (unsigned long long)stats[0], (unsigned long long)stats[1],
+               (unsigned long long)stats[4], (unsigned long long)stats[5]);
+    }
+    
+    if (timing) {
+        uint64_t perf[16];
+        vm_get_perf(ctx, perf);
+        printf("  Timing: %llu instructions, %llu cycles (CPI %.2f), %llu mispredicts, %llu stalls\n",
+               (unsigned long long)perf[0], (unsigned long long)perf[1],
+               perf[0] ? (double)perf[1] / (double)perf[0] : 0.0,
+               (unsigned long long)perf[4], (unsigned long long)perf[5]);
+    }
+    
     // Clean up
-    remove("test_program.bin");
+    vm_context_destroy(ctx);
     
     printf("\nTest completed successfully!\n");
     return 0;
@@ -14,6 +14,8 @@ Usage:
     nanocore-cli.py run program.bin --debug
     nanocore-cli.py disasm program.bin
     nanocore-cli.py profile program.bin --cycles 1000000
+    nanocore-cli.py profile program.nc -o profile.folded
+    nanocore-cli.py profile program.bin --symbols program.sym --format pprof -o profile.pb.gz
 """
 
 import sys
@@ -21,6 +23,9 @@ import os
 import argparse
 import time
 import json
+import gzip
+import bisect
+from collections import Counter
 from pathlib import Path
 from typing import Optional, List, Dict, Any
 
@@ -30,7 +35,7 @@ sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
 try:
     # Import what's available - some modules may not have the expected classes
     import assembler.nanocore_asm as asm_module
-    from glue.python.nanocore import VM, Status, EventType, PerfCounter
+    from glue.python.nanocore import VM, Status, EventType, PerfCounter, Flags, Profile
     # Use our own simple VM simulator instead of the framework one
     class SimpleVMSimulator:
         def __init__(self, memory_size=1024*1024):
@@ -50,6 +55,64 @@ except ImportError as e:
     print("Make sure you're running from the NanoCore root directory")
     sys.exit(1)
 
+# Programs are loaded here by run and profile
+LOAD_ADDRESS = 0x10000
+
+# Budget per run call while sampling stacks, in sample periods: keeps the
+# VM's sample buffer from filling between drains
+SAMPLES_PER_DRAIN = 2048
+
+def _varint(value: int) -> bytes:
+    out = bytearray()
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return bytes(out)
+
+def _pb_field(number: int, value) -> bytes:
+    """One protobuf field: ints as varints, bytes as length-delimited"""
+    if isinstance(value, int):
+        return _varint(number << 3) + _varint(value)
+    return _varint(number << 3 | 2) + _varint(len(value)) + value
+
+def _pb_packed(number: int, values: List[int]) -> bytes:
+    return _pb_field(number, b''.join(_varint(v) for v in values))
+
+class GuestSymbols:
+    """Names guest PCs after the function that contains them.
+    
+    Functions start at the load address and at every CALL target found in
+    the image; each is named by the label at its address, so loop labels
+    inside a function don't split it.
+    """
+    
+    def __init__(self, program: bytes, labels: Dict[int, str], base: int = LOAD_ADDRESS):
+        starts = {base}
+        for offset in range(0, len(program) - 3, 4):
+            word = int.from_bytes(program[offset:offset + 4], 'little')
+            if word >> 26 == 0x1E:  # CALL: imm26 words from the CALL
+                imm = word & 0x3FFFFFF
+                if imm & 0x2000000:
+                    imm -= 1 << 26
+                starts.add(base + offset + imm * 4)
+        self.starts = sorted(starts)
+        self.labels = labels
+    
+    def function(self, pc: int) -> str:
+        i = bisect.bisect_right(self.starts, pc) - 1
+        start = self.starts[max(i, 0)]
+        return self.labels.get(start, f"0x{start:x}")
+
+def is_image(path: str) -> bool:
+    """True for program images from nanocore_asm.py --format image"""
+    with open(path, 'rb') as f:
+        magic = f.read(4)
+    return len(magic) == 4 and int.from_bytes(magic, 'little') == asm_module.IMAGE_MAGIC
+
 class NanoCoreCLI:
     """Main CLI application class"""
     
@@ -181,27 +244,39 @@ class NanoCoreCLI:
         return '\\n'.join(lines)
     
     def run(self, program_file: str, debug: bool = False, max_cycles: int = 0, 
-            memory_size: int = 64 * 1024 * 1024) -> bool:
+            memory_size: int = 64 * 1024 * 1024, translation_cache: str = None) -> bool:
         """Run a program on the VM"""
         try:
-            # Load program
-            with open(program_file, 'rb') as f:
-                program = f.read()
-            
-            print(f"Loading program {program_file} ({len(program)} bytes)")
-            
             # Create VM
             self.vm = VM(memory_size)
             self.debug_mode = debug
             
-            # Load program at default address
-            self.vm.load_program(program, 0x10000)
+            if is_image(program_file):
+                # Images are mapped at their own addresses, not copied
+                print(f"Loading image {program_file}")
+                self.vm.load_image(program_file)
+                if translation_cache:
+                    restored = self.vm.load_translations(translation_cache)
+                    if restored is not None:
+                        print(f"Restored {restored} decoded blocks from {translation_cache}")
+            else:
+                with open(program_file, 'rb') as f:
+                    program = f.read()
+                
+                print(f"Loading program {program_file} ({len(program)} bytes)")
+                
+                # Load program at default address
+                self.vm.load_program(program, 0x10000)
             
             if debug:
                 print("Debug mode enabled. Use 'h' for help.")
                 return self._run_debug_mode(max_cycles)
-            else:
-                return self._run_normal_mode(max_cycles)
+            
+            success = self._run_normal_mode(max_cycles)
+            if translation_cache and is_image(program_file):
+                os.makedirs(translation_cache, exist_ok=True)
+                self.vm.save_translations(translation_cache)
+            return success
                 
         except Exception as e:
             print(f"Execution failed: {e}")
@@ -364,21 +439,33 @@ Debug Commands:
         except Exception as e:
             print(f"Error getting final state: {e}")
     
-    def profile(self, program_file: str, cycles: int = 1000000) -> bool:
-        """Profile program execution"""
+    def profile(self, program_file: str, cycles: int = 1000000, output: str = None,
+                fmt: str = 'folded', period: int = 0, symbols_file: str = None,
+                pairs: int = 0) -> bool:
+        """Profile program execution, optionally writing sampled guest stacks"""
         try:
-            with open(program_file, 'rb') as f:
-                program = f.read()
+            program, labels, base = self._load_profile_program(program_file, symbols_file)
             
             print(f"Profiling {program_file} for {cycles:,} cycles...")
             
             # Create VM
             self.vm = VM(64 * 1024 * 1024)
-            self.vm.load_program(program, 0x10000)
+            if is_image(program_file):
+                self.vm.load_image(program_file)
+            else:
+                self.vm.load_program(program, LOAD_ADDRESS)
             
             # Run profiling
             start_time = time.time()
-            result = self.vm.run(cycles)
+            if output:
+                period = period or 1000
+                self.vm.set_profiling(Profile.STACKS, period)
+                result, stacks = self._run_sampled(cycles, period)
+            elif pairs:
+                self.vm.set_profiling(Profile.PAIRS)
+                result = self.vm.run(cycles)
+            else:
+                result = self.vm.run(cycles)
             end_time = time.time()
             
             elapsed = end_time - start_time
@@ -403,11 +490,124 @@ Debug Commands:
             print(f"  Branch misses: {branch_misses:,}")
             print(f"  Pipeline stalls: {pipeline_stalls:,}")
             
+            if output:
+                symbols = GuestSymbols(program, labels, base)
+                if fmt == 'pprof':
+                    self._write_pprof(output, stacks, symbols, period)
+                else:
+                    self._write_folded(output, stacks, symbols)
+                print(f"  Stack samples: {len(stacks):,} (every {period:,} instructions) -> {output}")
+            elif pairs:
+                self._print_pairs(self.vm.read_pairs()[:pairs], inst_count)
+            
             return result == EventType.HALTED
             
         except Exception as e:
             print(f"Profiling failed: {e}")
             return False
+    
+    def _load_profile_program(self, program_file: str, symbols_file: str = None):
+        """Read a bytecode file, or assemble a .nc source for its labels.
+        Program images carry their own symbols.
+        
+        Returns the text, a map from guest address to label and the guest
+        address of the text.
+        """
+        labels = {}
+        if is_image(program_file):
+            image = asm_module.read_image(program_file)
+            labels = {addr: label for label, addr in image['symbols'].items()}
+            text = [s for s in image['sections'] if s[0] == 'text']
+            if text:
+                return text[0][3], labels, text[0][1]
+            return b'', labels, image['entry']
+        elif program_file.endswith('.nc'):
+            asm = asm_module.Assembler()
+            program = asm.assemble_file(program_file)
+            labels = {LOAD_ADDRESS + addr: label for label, addr in asm.symbols.items()}
+        else:
+            with open(program_file, 'rb') as f:
+                program = f.read()
+        
+        # Symbol files hold "address label" lines relative to the image start,
+        # as written by nanocore_asm.py --symbols
+        if symbols_file:
+            with open(symbols_file) as f:
+                for line in f:
+                    parts = line.split()
+                    if len(parts) >= 2:
+                        labels[LOAD_ADDRESS + int(parts[0], 0)] = parts[1]
+        return program, labels, LOAD_ADDRESS
+    
+    def _print_pairs(self, pairs, inst_count: int):
+        """List the opcode pairs that would save the most dispatches fused"""
+        def name(opcode: int) -> str:
+            try:
+                return asm_module.Opcode(opcode).name
+            except ValueError:
+                return f"0x{opcode:02x}"
+        
+        print(f"\nFusion candidates (adjacent opcodes within a block):")
+        for (first, second), count in pairs:
+            share = 100.0 * count / max(inst_count, 1)
+            print(f"  {name(first):>10s} + {name(second):<10s} {count:>14,}  {share:5.1f}% of instructions")
+    
+    def _run_sampled(self, cycles: int, period: int):
+        """Run to completion or the cycle budget, draining stack samples"""
+        stacks = []
+        executed = 0
+        while True:
+            budget = period * SAMPLES_PER_DRAIN
+            if cycles:
+                budget = min(budget, cycles - executed)
+            result = self.vm.run(budget)
+            executed += budget
+            stacks.extend(self.vm.read_stacks())
+            if (result != Status.OK or self.vm.state.flags & Flags.HALTED or
+                    (cycles and executed >= cycles)):
+                return result, stacks
+    
+    def _write_folded(self, output: str, stacks: List[List[int]], symbols: GuestSymbols):
+        """Folded stacks for flamegraph.pl / speedscope: "outer;inner count" """
+        folded = Counter()
+        for stack in stacks:
+            # Stacks come leaf first; folded lines start at the root
+            folded[';'.join(symbols.function(pc) for pc in reversed(stack))] += 1
+        with open(output, 'w') as f:
+            for line, count in sorted(folded.items()):
+                f.write(f"{line} {count}\n")
+    
+    def _write_pprof(self, output: str, stacks: List[List[int]], symbols: GuestSymbols, period: int):
+        """Gzipped pprof profile.proto with one location per sampled address"""
+        strings = {'': 0}
+        def string(text: str) -> int:
+            return strings.setdefault(text, len(strings))
+        
+        locations = {}  # address -> location id
+        functions = {}  # name -> function id
+        counts = Counter(tuple(stack) for stack in stacks)
+        body = bytearray()
+        
+        body += _pb_field(1, _pb_field(1, string('samples')) + _pb_field(2, string('count')))
+        body += _pb_field(1, _pb_field(1, string('instructions')) + _pb_field(2, string('count')))
+        for stack, count in counts.items():
+            ids = [locations.setdefault(pc, len(locations) + 1) for pc in stack]
+            body += _pb_field(2, _pb_packed(1, ids) + _pb_packed(2, [count, count * period]))
+        for pc, location_id in locations.items():
+            name = symbols.function(pc)
+            function_id = functions.setdefault(name, len(functions) + 1)
+            line = _pb_field(1, function_id)
+            body += _pb_field(4, _pb_field(1, location_id) + _pb_field(3, pc) + _pb_field(4, line))
+        for name, function_id in functions.items():
+            body += _pb_field(5, _pb_field(1, function_id) + _pb_field(2, string(name)) +
+                              _pb_field(3, string(name)))
+        for text in strings:
+            body += _pb_field(6, text.encode())
+        body += _pb_field(11, _pb_field(1, string('instructions')) + _pb_field(2, string('count')))
+        body += _pb_field(12, period)
+        
+        with gzip.open(output, 'wb') as f:
+            f.write(bytes(body))
 
 def main():
     """Main CLI entry point"""
@@ -428,15 +628,25 @@ def main():
     
     # Run command
     run_parser = subparsers.add_parser('run', help='Run program')
-    run_parser.add_argument('program', help='Program bytecode file')
+    run_parser.add_argument('program', help='Program bytecode file or image')
     run_parser.add_argument('-d', '--debug', action='store_true', help='Enable debug mode')
     run_parser.add_argument('-c', '--cycles', type=int, default=0, help='Max cycles (0 = unlimited)')
     run_parser.add_argument('-m', '--memory', type=int, default=64*1024*1024, help='Memory size in bytes')
+    run_parser.add_argument('-t', '--translation-cache', metavar='DIR',
+                            help='Reuse and save decoded blocks for program images in DIR')
     
     # Profile command
     profile_parser = subparsers.add_parser('profile', help='Profile program execution')
-    profile_parser.add_argument('program', help='Program bytecode file')
+    profile_parser.add_argument('program', help='Program bytecode file or image')
     profile_parser.add_argument('-c', '--cycles', type=int, default=1000000, help='Cycles to profile')
+    profile_parser.add_argument('-o', '--output', help='Write sampled guest stacks to this file')
+    profile_parser.add_argument('-f', '--format', choices=['folded', 'pprof'], default='folded',
+                                help='Stack output format (folded stacks or gzipped pprof)')
+    profile_parser.add_argument('-p', '--period', type=int, default=0,
+                                help='Instructions between stack samples (default 1000)')
+    profile_parser.add_argument('-s', '--symbols', help='Symbol file from nanocore_asm.py --symbols')
+    profile_parser.add_argument('--pairs', type=int, default=0, metavar='N',
+                                help='List the N most frequent opcode pairs (superinstruction candidates)')
     
     args = parser.parse_args()
     
@@ -454,9 +664,11 @@ def main():
         elif args.command == 'disasm':
             success = cli.disassemble(args.input, args.output, args.address)
         elif args.command == 'run':
-            success = cli.run(args.program, args.debug, args.cycles, args.memory)
+            success = cli.run(args.program, args.debug, args.cycles, args.memory,
+                              args.translation_cache)
         elif args.command == 'profile':
-            success = cli.profile(args.program, args.cycles)
+            success = cli.profile(args.program, args.cycles, args.output, args.format,
+                                  args.period, args.symbols, args.pairs)
         else:
             print(f"Unknown command: {args.command}")
             return 1
@@ -23,7 +23,7 @@ if not os.path.exists(lib_path):
     result = subprocess.run([
         "gcc", "-shared", "-fPIC", "-O2", 
         "-o", lib_path, 
-        "glue/ffi/nanocore_ffi.c"
+        "glue/ffi/nanocore_ffi.c", "-lm"
     ], capture_output=True, text=True)
     
     if result.returncode \!= 0:
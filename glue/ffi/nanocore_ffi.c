@@ -3,13 +3,103 @@
  * Provides a stable C API over the assembly VM core
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // memfd_create
+#endif
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <math.h>
+
+// Template JIT backend: SysV x86-64 hosts only
+#if defined(__x86_64__) && !defined(_WIN32)
+#define NANOCORE_JIT 1
+#else
+#define NANOCORE_JIT 0
+#endif
+
+// Worker-pool scheduler: POSIX threads
+#if !defined(_WIN32)
+#define NANOCORE_SCHEDULER 1
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#else
+#define NANOCORE_SCHEDULER 0
+#endif
+
+// Ring devices: one host drain thread per ring, poll()-driven host I/O.
+// Event queues wake their consumers through an eventfd or a pipe.
+#if !defined(_WIN32)
+#define NANOCORE_RING 1
+#include <fcntl.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#else
+#define NANOCORE_RING 0
+#endif
+
+// Guest memory: address space reserved up front, committed on first touch
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Copy-on-write snapshots: anonymous memory files mapped privately
+#if defined(__linux__)
+#define NANOCORE_COW 1
+#else
+#define NANOCORE_COW 0
+#endif
+
+// Timer device: one host thread sleeping on CLOCK_MONOTONIC
+#if defined(__linux__)
+#define NANOCORE_TIMER 1
+#else
+#define NANOCORE_TIMER 0
+#endif
+
+// Guest page geometry (matches PAGE_SIZE in asm/core/memory.asm)
+#define GUEST_PAGE_SHIFT 12
+#define GUEST_PAGE_SIZE (1ULL << GUEST_PAGE_SHIFT)
+#define GUEST_PAGE_COUNT(size) (((size) + GUEST_PAGE_SIZE - 1) >> GUEST_PAGE_SHIFT)
+#define GUEST_HUGE_PAGE_SIZE (2ULL << 20)
 
-// VM state structure (matches assembly layout)
+// Sparse guests span the 40-bit physical space of docs/isa_spec.md, which
+// holds code at 0x10000, the heap at 0x8000_0000 and the stack above
+// 0x1_0000_0000. Only touched pages cost host memory.
+#define NANOCORE_SPARSE_MEMORY_SIZE (1ULL << 40)
+
+// Pre-decoded basic block cache geometry
+#define BLOCK_CACHE_ENTRIES 1024  // Direct-mapped, indexed by guest PC
+#define BLOCK_MAX_OPS 32          // Longest straight-line run per block
+
+// Per-page flags, consulted on the store path
+#define PAGE_FLAG_CODE 0x01       // Page backs at least one decoded block
+#define PAGE_FLAG_WRITTEN 0x02    // Page may hold non-zero data
+#define PAGE_FLAG_BREAK 0x04      // Page holds at least one breakpoint
+#define PAGE_FLAG_WATCH 0x08      // Page overlaps a data watchpoint
+#define PAGE_FLAG_DIRTY 0x10      // Written since the last nanocore_vm_clear_dirty
+#define PAGE_FLAG_RING 0x20       // Page holds a ring's avail word
+
+// Stores that must take the slow path: into decoded code, a watched page
+// or a ring header, or the first write to either page since dirty bits
+// were last cleared (PAGE_FLAG_DIRTY implies PAGE_FLAG_WRITTEN)
+#define PAGE_STORE_SLOW(first, last) \
+    ((((first) | (last)) & (PAGE_FLAG_CODE | PAGE_FLAG_WATCH | PAGE_FLAG_RING)) || \
+     !((first) & (last) & PAGE_FLAG_DIRTY))
+
+// VM state structure (matches VM_* in asm/core/context.inc). Part of the
+// ABI that nanocore_get_abi describes.
 typedef struct {
     uint64_t pc;
     uint64_t sp;
@@ -21,20 +111,258 @@ typedef struct {
     uint64_t vbase;
 } vm_state_t;
 
-// VM instance structure
+_Static_assert(offsetof(vm_state_t, gprs) == 24 && offsetof(vm_state_t, vregs) == 280 &&
+               offsetof(vm_state_t, perf_counters) == 792 && sizeof(vm_state_t) == 872,
+               "vm_state_t must match VM_* in asm/core/context.inc");
+
+// Bumped whenever a struct that crosses the API changes layout
+#define NANOCORE_ABI_VERSION 1
+
+// Layout of the shared structs, from nanocore_get_abi. Bindings compare
+// it with their own definitions before creating VMs.
+typedef struct {
+    uint32_t struct_size;    // sizeof(nanocore_abi_t) as known by the caller
+    uint32_t version;        // NANOCORE_ABI_VERSION
+    uint32_t state_size;     // sizeof(vm_state_t)
+    uint32_t state_pc;       // Field offsets in vm_state_t
+    uint32_t state_sp;
+    uint32_t state_flags;
+    uint32_t state_gprs;
+    uint32_t state_vregs;
+    uint32_t state_perf_counters;
+    uint32_t state_cache_ctrl;
+    uint32_t state_vbase;
+    uint32_t perf_size;      // sizeof(nanocore_perf_t)
+    uint32_t options_size;   // sizeof(nanocore_vm_options_t)
+    uint32_t reserved;
+} nanocore_abi_t;
+
+// Decoded instruction (fields pre-extracted from the 32-bit word)
+typedef struct {
+    uint8_t opcode;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    int32_t imm;        // Sign-extended 16-bit immediate
+} decoded_op_t;
+
+// Straight-line run of decoded ops ending at a branch, HALT or bad opcode
+typedef struct {
+    uint64_t pc;        // Guest PC of the first op
+    uint32_t num_ops;   // 0 = empty slot
+    uint32_t exec_count;
+    uint8_t* jit_code;  // Translated entry point, NULL until hot
+    decoded_op_t ops[BLOCK_MAX_OPS];
+} decoded_block_t;
+
+// Decoded-only opcode standing in for the instruction at a breakpoint;
+// outside the 6-bit ISA opcode space
+#define DECODED_BREAK 0x40
+
+// Decoded-only superinstructions. The first op of a fused pair carries
+// one of these; run_engine executes it and jumps straight to the handler
+// of its partner, which stays unchanged in the next slot, saving one
+// dispatch per pair. Everything else sees the real opcode through
+// decoded_opcode().
+enum {
+    DECODED_LD_ADD = 0x41,   // LD (immediate), then ADD
+    DECODED_ADD_ST = 0x42,   // ADD, then ST
+    DECODED_SUB_BNE = 0x43,  // SUB, then BNE: count-down loops
+    DECODED_ADD_BLT = 0x44,  // ADD, then BLT: count-up loops
+    DECODED_OPCODES          // Size of run_engine's dispatch table
+};
+
+static inline uint8_t decoded_opcode(uint8_t opcode) {
+    switch (opcode) {
+        case DECODED_LD_ADD: return 0x0F;
+        case DECODED_ADD_ST: return 0x00;
+        case DECODED_SUB_BNE: return 0x01;
+        case DECODED_ADD_BLT: return 0x00;
+        default: return opcode;
+    }
+}
+
+// Open-addressed set of breakpoint PCs: linear probing, backward-shift
+// deletion, grown at half load
+typedef struct {
+    uint64_t* slots;     // Address + 1, 0 = empty
+    uint32_t capacity;   // Power of two, 0 before the first breakpoint
+    uint32_t count;
+} breakpoint_set_t;
+
+// Data watchpoint on [address, address + size)
+typedef struct {
+    uint64_t address;
+    uint64_t size;
+    uint32_t access;     // NANOCORE_WATCH_* bits
+    uint32_t reserved;
+} watchpoint_t;
+
+#define NANOCORE_WATCH_READ 0x01
+#define NANOCORE_WATCH_WRITE 0x02
+
+// Creation options for nanocore_vm_create_ex
+typedef struct {
+    uint32_t struct_size;    // sizeof(nanocore_vm_options_t) as known by the caller
+    uint32_t flags;          // NANOCORE_VM_OPT_* bits
+    uint32_t jit_threshold;  // Block executions before translation (0 = default)
+    uint32_t reserved;
+} nanocore_vm_options_t;
+
+#define NANOCORE_VM_OPT_JIT 0x01         // Translate hot blocks (ignored where unsupported)
+#define NANOCORE_VM_OPT_HUGE_PAGES 0x02  // Ask for transparent huge pages for guest RAM
+#define NANOCORE_VM_OPT_SPARSE 0x04      // At least NANOCORE_SPARSE_MEMORY_SIZE of guest RAM
+
+// Memory view access (nanocore_vm_map_memory)
+#define NANOCORE_MAP_READ 0x00
+#define NANOCORE_MAP_WRITE 0x01
+
+// Program image loading (nanocore_vm_load_image)
+#define NANOCORE_IMAGE_PREDECODE 0x01  // Decode the image's block table up front
+
+#define JIT_DEFAULT_THRESHOLD 50
+
+#define NANOCORE_MAX_RINGS 4  // Ring devices per VM
+
+// Counter indices for nanocore_perf_t, shared with the assembly core's
+// vm_get_perf: its eight PERF_* counters, then its eight cache statistics
+enum {
+    NANOCORE_PERF_INSTRUCTIONS = 0,
+    NANOCORE_PERF_CYCLES = 1,
+    NANOCORE_PERF_L1_MISSES = 2,
+    NANOCORE_PERF_L2_MISSES = 3,
+    NANOCORE_PERF_BRANCH_MISSES = 4,
+    NANOCORE_PERF_STALLS = 5,
+    NANOCORE_PERF_MEM_OPS = 6,
+    NANOCORE_PERF_SIMD_OPS = 7,
+    NANOCORE_PERF_L1I_HITS = 8,
+    NANOCORE_PERF_L1I_MISSES = 9,
+    NANOCORE_PERF_L1D_HITS = 10,
+    NANOCORE_PERF_L1D_MISSES = 11,
+    NANOCORE_PERF_L2_HITS = 12,
+    NANOCORE_PERF_L2_CACHE_MISSES = 13,
+    NANOCORE_PERF_WRITEBACKS = 14,
+    NANOCORE_PERF_INVALIDATES = 15,
+    NANOCORE_PERF_COUNTERS = 16
+};
+
+// Profiling modes (nanocore_vm_set_profiling)
+#define NANOCORE_PROFILE_OPCODES 0x01  // Count retired instructions per opcode
+#define NANOCORE_PROFILE_PCS 0x02      // Record the PC every sample_period instructions
+#define NANOCORE_PROFILE_STACKS 0x04   // Record the CALL stack with each PC sample (implies PCS)
+#define NANOCORE_PROFILE_PAIRS 0x08    // Count adjacent opcode pairs retired within a block
+
+#define PROFILE_DEFAULT_PERIOD 1000
+#define PROFILE_SAMPLE_WORDS 262144    // Sample buffer size: one word per PC, 2 + depth per stack
+#define PROFILE_MAX_DEPTH 64           // Call sites kept per stack; deeper calls fold into the 64th
+
+// Everything nanocore_vm_get_perf reports, in one read
+typedef struct {
+    uint32_t struct_size;     // sizeof(nanocore_perf_t) as known by the caller
+    uint32_t valid;           // Bit n set when this engine measures counters[n]
+    uint64_t counters[NANOCORE_PERF_COUNTERS];
+    uint32_t profile_flags;   // NANOCORE_PROFILE_* in effect
+    uint32_t sample_period;
+    uint64_t samples;         // PC samples recorded since profiling was enabled
+    uint64_t samples_dropped; // Lost because the sample buffer was full
+    uint64_t opcodes[64];     // Retired per opcode under NANOCORE_PROFILE_OPCODES
+} nanocore_perf_t;
+
+struct jit_cache;
+struct ring_device;
+struct event_queue;
+struct profile;
+
+// VM instance structure. The first cache line holds everything a run or
+// a guest access reads; the architectural state starts on the next line
+// and debugger bookkeeping comes last.
 typedef struct {
-    vm_state_t state;
     uint8_t* memory;
     size_t memory_size;
+    uint8_t* page_flags;           // One PAGE_FLAG_* byte per guest page
+    decoded_block_t* block_cache;  // Allocated on first run
+    struct jit_cache* jit;         // NULL when the JIT is off
+    struct profile* profile;       // NULL unless profiling is on
+    struct event_queue* events;    // Stop reasons and device interrupts
     bool halted;
-    uint64_t breakpoints[64];  // Simple breakpoint array
-    int num_breakpoints;
+    bool watch_hit;                // A watchpoint fired; the run stops after this instruction
+    bool code_modified;            // A store just invalidated decoded code
+    bool block_cache_mapped;       // block_cache is a translation cache file mapping
     int vm_id;
+    
+    _Alignas(64) vm_state_t state;
+    
+    size_t memory_reserved;        // Length of the guest RAM mapping
+    _Atomic uint32_t pins;         // Outstanding memory views
+    uint64_t image_key;            // Content key of the loaded program image, 0 = none
+    struct ring_device* rings[NANOCORE_MAX_RINGS];  // NULL = free slot
+    struct hart_group* harts;      // VMs sharing this guest RAM, NULL = sole owner
+    uint64_t lr_address;           // LR reservation
+    uint64_t lr_value;             // Value LR observed; SC succeeds only if it is unchanged
+    bool lr_valid;
+    _Atomic uint32_t irq_pending;  // Raised vectors, bit n = vector n
+    _Atomic uint32_t irq_signal;   // Nonzero: look at irq_pending at the next block
+    uint64_t irq_pc;               // Shadow PC and FLAGS saved on delivery, restored by IRET
+    uint64_t irq_flags;
+    uint64_t timer_period;         // Timer device, guarded by the timer lock; 0 = disarmed
+    uint64_t timer_deadline;       // CLOCK_MONOTONIC ns of the next tick
+    
+    breakpoint_set_t breakpoints;
+    watchpoint_t* watchpoints;     // Unordered
+    uint32_t num_watchpoints;
+    uint32_t watchpoint_capacity;
+    uint64_t watch_address;        // Start of the access that fired it
 } vm_instance_t;
 
-// Global VM instances (simple management)
-static vm_instance_t* vms[256] = {0};
-static int next_vm_id = 1;
+_Static_assert(offsetof(vm_instance_t, state) == 64, "hot instance fields must fit one cache line");
+
+#if NANOCORE_JIT
+// Executable code cache for translated blocks
+typedef struct jit_cache {
+    uint8_t* code;          // RWX mapping; the entry trampoline comes first
+    size_t size;
+    size_t used;
+    uint8_t* epilogue;      // Common exit back into run_engine
+    size_t trampoline_size; // Bytes at the start of code that survive a flush
+    uint32_t threshold;
+    bool flush_pending;     // Translated code is stale, drop it all
+} jit_cache_t;
+
+static jit_cache_t* jit_create(uint32_t threshold);
+static void jit_destroy(jit_cache_t* jit);
+#endif
+
+static void ring_service(vm_instance_t* vm);
+static void ring_detach_all(vm_instance_t* vm);
+static void timer_disarm(vm_instance_t* vm);
+
+struct nanocore_snapshot;
+static void debug_clear_all(vm_instance_t* vm);
+static bool debug_save(const vm_instance_t* vm, struct nanocore_snapshot* snap);
+static bool debug_restore(vm_instance_t* vm, const struct nanocore_snapshot* snap);
+
+// Handle layout: generation << HANDLE_INDEX_BITS | slot index. Eleven
+// generation bits keep handles positive; a destroyed slot bumps its
+// generation so stale handles no longer resolve.
+#define HANDLE_INDEX_BITS 20
+#define HANDLE_INDEX_MASK ((1u << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK 0x7FFu
+#define HANDLE_CHUNK_SHIFT 8
+#define HANDLE_CHUNK_SIZE (1u << HANDLE_CHUNK_SHIFT)
+#define HANDLE_MAX_CHUNKS ((HANDLE_INDEX_MASK + 1) >> HANDLE_CHUNK_SHIFT)
+
+// One handle table slot; chunks of slots are never freed
+typedef struct {
+    _Atomic(vm_instance_t*) vm;
+    _Atomic uint32_t generation;
+    _Atomic uint32_t next_free;   // Free-list link: index + 1, 0 = end
+} handle_slot_t;
+
+// Global VM instances: lock-free two-level table grown a chunk at a time
+static _Atomic(handle_slot_t*) handle_chunks[HANDLE_MAX_CHUNKS];
+static _Atomic uint32_t handle_high_water;  // Slots ever handed out
+static _Atomic uint64_t handle_free_head;   // ABA tag << 32 | (index + 1)
+static _Atomic int next_vm_id = 1;
 
 // Status codes
 enum {
@@ -50,83 +378,607 @@ enum {
     EVENT_HALTED = 0,
     EVENT_BREAKPOINT = 1,
     EVENT_EXCEPTION = 2,
-    EVENT_DEVICE_INTERRUPT = 3
+    EVENT_DEVICE_INTERRUPT = 3,
+    EVENT_WATCHPOINT = 4
 };
 
+// ---------------------------------------------------------------------------
+// Event queue: a bounded lock-free MPSC ring per VM. Whatever thread runs
+// the VM and every ring drain thread push; a single consumer at a time
+// takes events with nanocore_vm_poll_event or nanocore_vm_wait_event. Each
+// push also signals a wake fd (an eventfd on Linux, a pipe elsewhere) that
+// supervisors can put in their own epoll/poll set: it is readable whenever
+// events may be pending, and the consumer clears it once the queue is empty.
+// ---------------------------------------------------------------------------
+
+#define EVENT_QUEUE_SIZE 256  // Power of two; pushes into a full queue are dropped
+
+typedef struct {
+    _Atomic uint64_t sequence;  // Slot is free for push n at n, readable at n + 1
+    int32_t type;
+    uint64_t data;
+} event_slot_t;
+
+typedef struct event_queue {
+    event_slot_t slots[EVENT_QUEUE_SIZE];
+    _Alignas(64) _Atomic uint64_t tail;  // Next push, claimed by CAS
+    _Alignas(64) uint64_t head;          // Next pop, consumer only
+    _Atomic uint64_t dropped;            // Events lost to a full queue
+    int wake_fd;                         // Readable while events may be pending
+    int signal_fd;                       // Written on push (== wake_fd for an eventfd)
+} event_queue_t;
+
+static event_queue_t* event_queue_create(void) {
+    event_queue_t* queue = aligned_alloc(64, sizeof(event_queue_t));
+    if (!queue) {
+        return NULL;
+    }
+    memset(queue, 0, sizeof(*queue));
+    for (uint64_t i = 0; i < EVENT_QUEUE_SIZE; i++) {
+        atomic_init(&queue->slots[i].sequence, i);
+    }
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->dropped, 0);
+    queue->wake_fd = -1;
+    queue->signal_fd = -1;
+    
+#if defined(__linux__)
+    queue->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    queue->signal_fd = queue->wake_fd;
+#elif !defined(_WIN32)
+    int fds[2];
+    if (pipe(fds) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        queue->wake_fd = fds[0];
+        queue->signal_fd = fds[1];
+    }
+#endif
+#if !defined(_WIN32)
+    if (queue->wake_fd < 0) {
+        free(queue);
+        return NULL;
+    }
+#endif
+    return queue;
+}
+
+static void event_queue_destroy(event_queue_t* queue) {
+    if (!queue) {
+        return;
+    }
+#if !defined(_WIN32)
+    if (queue->signal_fd != queue->wake_fd) {
+        close(queue->signal_fd);
+    }
+    close(queue->wake_fd);
+#endif
+    free(queue);
+}
+
+// Queue an event from any thread; false if the queue was full
+static bool event_push(event_queue_t* queue, int type, uint64_t data) {
+    uint64_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    event_slot_t* slot;
+    
+    for (;;) {
+        slot = &queue->slots[pos & (EVENT_QUEUE_SIZE - 1)];
+        int64_t lag = (int64_t)(atomic_load_explicit(&slot->sequence, memory_order_acquire) - pos);
+        if (lag == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (lag < 0) {
+            atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+            return false;  // The consumer is a full lap behind
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+    
+    slot->type = type;
+    slot->data = data;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    
+#if !defined(_WIN32)
+    // Already readable if this fails with EAGAIN
+    uint64_t one = 1;
+    ssize_t ignored = write(queue->signal_fd, &one, sizeof(one));
+    (void)ignored;
+#endif
+    return true;
+}
+
+// Consumer side: the oldest published event, if any
+static bool event_pop(event_queue_t* queue, int* type, uint64_t* data) {
+    event_slot_t* slot = &queue->slots[queue->head & (EVENT_QUEUE_SIZE - 1)];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != queue->head + 1) {
+        return false;
+    }
+    
+    *type = slot->type;
+    *data = slot->data;
+    atomic_store_explicit(&slot->sequence, queue->head + EVENT_QUEUE_SIZE, memory_order_release);
+    queue->head++;
+    return true;
+}
+
+// Pop, and when the queue looks empty clear the wake fd and look once
+// more, so a push that raced with the clear is never left unsignalled
+static bool event_take(event_queue_t* queue, int* type, uint64_t* data) {
+    if (event_pop(queue, type, data)) {
+        return true;
+    }
+    
+#if !defined(_WIN32)
+    uint8_t drain[64];
+    while (read(queue->wake_fd, drain, sizeof(drain)) > 0) {
+    }
+#endif
+    return event_pop(queue, type, data);
+}
+
+// Slot for an index, optionally allocating its chunk
+static handle_slot_t* handle_slot(uint32_t index, bool create) {
+    _Atomic(handle_slot_t*)* entry = &handle_chunks[index >> HANDLE_CHUNK_SHIFT];
+    handle_slot_t* chunk = atomic_load_explicit(entry, memory_order_acquire);
+    
+    if (!chunk && create) {
+        handle_slot_t* fresh = calloc(HANDLE_CHUNK_SIZE, sizeof(handle_slot_t));
+        if (!fresh) {
+            return NULL;
+        }
+        if (atomic_compare_exchange_strong_explicit(entry, &chunk, fresh,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            chunk = fresh;
+        } else {
+            free(fresh);  // Another thread installed this chunk first
+        }
+    }
+    
+    return chunk ? &chunk[index & (HANDLE_CHUNK_SIZE - 1)] : NULL;
+}
+
+// Reserve a slot index, reusing destroyed slots first
+static bool handle_alloc(uint32_t* index) {
+    uint64_t head = atomic_load_explicit(&handle_free_head, memory_order_acquire);
+    while ((uint32_t)head != 0) {
+        uint32_t top = (uint32_t)head - 1;
+        uint32_t next = atomic_load_explicit(&handle_slot(top, false)->next_free, memory_order_relaxed);
+        uint64_t popped = (((head >> 32) + 1) << 32) | next;
+        if (atomic_compare_exchange_weak_explicit(&handle_free_head, &head, popped,
+                                                  memory_order_acquire, memory_order_acquire)) {
+            *index = top;
+            return true;
+        }
+    }
+    
+    uint32_t fresh = atomic_load_explicit(&handle_high_water, memory_order_relaxed);
+    do {
+        if (fresh > HANDLE_INDEX_MASK) {
+            return false;  // Table full
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&handle_high_water, &fresh, fresh + 1,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    *index = fresh;
+    return true;
+}
+
+// Return a slot index to the free list
+static void handle_release(uint32_t index) {
+    handle_slot_t* slot = handle_slot(index, false);
+    uint64_t head = atomic_load_explicit(&handle_free_head, memory_order_relaxed);
+    uint64_t pushed;
+    
+    do {
+        atomic_store_explicit(&slot->next_free, (uint32_t)head, memory_order_relaxed);
+        pushed = (((head >> 32) + 1) << 32) | (index + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&handle_free_head, &head, pushed,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+// Resolve a handle; stale, forged or destroyed handles give NULL
+static vm_instance_t* vm_lookup(int vm_handle) {
+    if (vm_handle < 0) {
+        return NULL;
+    }
+    
+    uint32_t index = (uint32_t)vm_handle & HANDLE_INDEX_MASK;
+    uint32_t generation = (uint32_t)vm_handle >> HANDLE_INDEX_BITS;
+    if (index >= atomic_load_explicit(&handle_high_water, memory_order_acquire)) {
+        return NULL;
+    }
+    
+    handle_slot_t* slot = handle_slot(index, false);
+    if (!slot) {
+        return NULL;
+    }
+    
+    // Read the generation after the pointer: a destroy in between bumps it
+    vm_instance_t* vm = atomic_load_explicit(&slot->vm, memory_order_acquire);
+    if ((atomic_load_explicit(&slot->generation, memory_order_acquire) & HANDLE_GENERATION_MASK) != generation) {
+        return NULL;
+    }
+    return vm;
+}
+
+// Reserve zero-filled memory that is committed page by page on first
+// touch. *reserved receives the mapping length to release later.
+static uint8_t* guest_memory_reserve(size_t size, uint32_t flags, size_t* reserved) {
+#if defined(_WIN32)
+    // Committed pages are still only backed once touched
+    (void)flags;
+    *reserved = size;
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    if (!(flags & NANOCORE_VM_OPT_HUGE_PAGES)) {
+        void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        *reserved = size;
+        return memory == MAP_FAILED ? NULL : memory;
+    }
+    
+    // Huge pages need a 2 MiB aligned range: over-reserve, then trim
+    size_t length = (size + GUEST_HUGE_PAGE_SIZE - 1) & ~(GUEST_HUGE_PAGE_SIZE - 1);
+    uint8_t* base = mmap(NULL, length + GUEST_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    uint8_t* aligned = (uint8_t*)(((uintptr_t)base + GUEST_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(GUEST_HUGE_PAGE_SIZE - 1));
+    if (aligned > base) {
+        munmap(base, (size_t)(aligned - base));
+    }
+    size_t tail = (size_t)(base + GUEST_HUGE_PAGE_SIZE - aligned);
+    if (tail) {
+        munmap(aligned + length, tail);
+    }
+#if defined(MADV_HUGEPAGE)
+    madvise(aligned, length, MADV_HUGEPAGE);  // Advisory; small pages still work
+#endif
+    *reserved = length;
+    return aligned;
+#endif
+}
+
+// Release memory from guest_memory_reserve or a snapshot mapping
+static void guest_memory_release(uint8_t* memory, size_t reserved) {
+    if (!memory) {
+        return;
+    }
+#if defined(_WIN32)
+    (void)reserved;
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, reserved);
+#endif
+}
+
+// Page flags scale with guest RAM, so they are reserved lazily too
+static uint8_t* page_flags_create(size_t memory_size) {
+    size_t reserved;
+    return guest_memory_reserve(GUEST_PAGE_COUNT(memory_size), 0, &reserved);
+}
+
+// Free the block cache, however it was set up
+static void block_cache_release(vm_instance_t* vm) {
+#if !defined(_WIN32)
+    if (vm->block_cache_mapped) {
+        munmap(vm->block_cache, BLOCK_CACHE_ENTRIES * sizeof(decoded_block_t));
+        vm->block_cache = NULL;
+        vm->block_cache_mapped = false;
+        return;
+    }
+#endif
+    free(vm->block_cache);
+    vm->block_cache = NULL;
+}
+
+// Upper bound on VMs sharing one guest RAM
+#define NANOCORE_MAX_HARTS 64
+
+// A guest RAM shared by a VM and the harts created from it
+typedef struct hart_group {
+    atomic_flag lock;              // Guards members; held only briefly
+    uint32_t count;
+    vm_instance_t* members[NANOCORE_MAX_HARTS];
+} hart_group_t;
+
+static void hart_lock(hart_group_t* group) {
+    while (atomic_flag_test_and_set_explicit(&group->lock, memory_order_acquire)) {
+    }
+}
+
+static void hart_unlock(hart_group_t* group) {
+    atomic_flag_clear_explicit(&group->lock, memory_order_release);
+}
+
+// Add vm to group; false if the group is full
+static bool hart_join(hart_group_t* group, vm_instance_t* vm) {
+    hart_lock(group);
+    bool joined = group->count < NANOCORE_MAX_HARTS;
+    if (joined) {
+        group->members[group->count++] = vm;
+        vm->harts = group;
+    }
+    hart_unlock(group);
+    return joined;
+}
+
+// Drop vm from its group; true if no other VM still uses its guest RAM
+static bool hart_leave(vm_instance_t* vm) {
+    hart_group_t* group = vm->harts;
+    if (!group) {
+        return true;
+    }
+    
+    hart_lock(group);
+    for (uint32_t i = 0; i < group->count; i++) {
+        if (group->members[i] == vm) {
+            group->members[i] = group->members[--group->count];
+            break;
+        }
+    }
+    uint32_t left = group->count;
+    hart_unlock(group);
+    
+    if (left == 0) {
+        free(group);
+        return true;
+    }
+    return false;
+}
+
+// Release everything a VM instance owns
+static void free_instance(vm_instance_t* vm) {
+    ring_detach_all(vm);
+    timer_disarm(vm);
+#if NANOCORE_JIT
+    jit_destroy(vm->jit);
+#endif
+    block_cache_release(vm);
+    guest_memory_release(vm->page_flags, GUEST_PAGE_COUNT(vm->memory_size));
+    if (hart_leave(vm)) {
+        guest_memory_release(vm->memory, vm->memory_reserved);
+    }
+    event_queue_destroy(vm->events);
+    free(vm->profile);
+    free(vm->breakpoints.slots);
+    free(vm->watchpoints);
+    free(vm);
+}
+
+// Zeroed instance, cache-line aligned so the hot fields share one line
+static vm_instance_t* alloc_instance(void) {
+    vm_instance_t* vm = aligned_alloc(_Alignof(vm_instance_t), sizeof(vm_instance_t));
+    if (vm) {
+        memset(vm, 0, sizeof(*vm));
+    }
+    return vm;
+}
+
+// Give a fully built instance a handle; frees it on failure
+static int publish_instance(vm_instance_t* vm, int* vm_handle) {
+    vm->events = event_queue_create();
+    if (!vm->events) {
+        free_instance(vm);
+        return NANOCORE_ENOMEM;
+    }
+    
+    uint32_t index;
+    if (!handle_alloc(&index)) {
+        free_instance(vm);
+        return NANOCORE_ERROR;  // Too many VMs
+    }
+    handle_slot_t* slot = handle_slot(index, true);
+    if (!slot) {
+        handle_release(index);
+        free_instance(vm);
+        return NANOCORE_ENOMEM;
+    }
+    
+    uint32_t generation = atomic_load_explicit(&slot->generation, memory_order_relaxed);
+    atomic_store_explicit(&slot->vm, vm, memory_order_release);
+    *vm_handle = (int)(((generation & HANDLE_GENERATION_MASK) << HANDLE_INDEX_BITS) | index);
+    
+    return NANOCORE_OK;
+}
+
 // Initialize the NanoCore library
 int nanocore_init(void) {
     // Initialize any global state
     return NANOCORE_OK;
 }
 
-// Create a new VM instance
-int nanocore_vm_create(uint64_t memory_size, int* vm_handle) {
-    if (!vm_handle || memory_size == 0) {
+// Describe the layout of the shared structs. Fills as much of abi as
+// the caller's struct_size covers.
+int nanocore_get_abi(nanocore_abi_t* abi) {
+    if (!abi || abi->struct_size < offsetof(nanocore_abi_t, state_size)) {
         return NANOCORE_EINVAL;
     }
     
-    // Find free slot
-    int id = -1;
-    for (int i = 0; i < 256; i++) {
-        if (vms[i] == NULL) {
-            id = i;
-            break;
+    nanocore_abi_t full = {
+        .struct_size = sizeof(nanocore_abi_t),
+        .version = NANOCORE_ABI_VERSION,
+        .state_size = sizeof(vm_state_t),
+        .state_pc = offsetof(vm_state_t, pc),
+        .state_sp = offsetof(vm_state_t, sp),
+        .state_flags = offsetof(vm_state_t, flags),
+        .state_gprs = offsetof(vm_state_t, gprs),
+        .state_vregs = offsetof(vm_state_t, vregs),
+        .state_perf_counters = offsetof(vm_state_t, perf_counters),
+        .state_cache_ctrl = offsetof(vm_state_t, cache_ctrl),
+        .state_vbase = offsetof(vm_state_t, vbase),
+        .perf_size = sizeof(nanocore_perf_t),
+        .options_size = sizeof(nanocore_vm_options_t),
+    };
+    uint32_t size = abi->struct_size < sizeof(full) ? abi->struct_size : (uint32_t)sizeof(full);
+    memcpy(abi, &full, size);
+    abi->struct_size = size;
+    return NANOCORE_OK;
+}
+
+// Create a new VM instance with explicit options (NULL = defaults)
+int nanocore_vm_create_ex(uint64_t memory_size, const nanocore_vm_options_t* options, int* vm_handle) {
+    if (!vm_handle) {
+        return NANOCORE_EINVAL;
+    }
+    
+    // Accept older, shorter option structs; missing fields stay zero
+    nanocore_vm_options_t opts = {0};
+    if (options) {
+        if (options->struct_size < offsetof(nanocore_vm_options_t, flags) + sizeof(uint32_t)) {
+            return NANOCORE_EINVAL;
         }
+        memcpy(&opts, options, options->struct_size < sizeof(opts) ? options->struct_size : sizeof(opts));
     }
     
-    if (id == -1) {
-        return NANOCORE_ERROR;  // Too many VMs
+    if ((opts.flags & NANOCORE_VM_OPT_SPARSE) && memory_size < NANOCORE_SPARSE_MEMORY_SIZE) {
+        memory_size = NANOCORE_SPARSE_MEMORY_SIZE;
+    }
+    if (memory_size == 0 || memory_size > SIZE_MAX) {
+        return NANOCORE_EINVAL;
     }
     
     // Allocate VM instance
-    vm_instance_t* vm = calloc(1, sizeof(vm_instance_t));
+    vm_instance_t* vm = alloc_instance();
     if (!vm) {
         return NANOCORE_ENOMEM;
     }
+    vm->memory_size = memory_size;
     
-    // Allocate memory
-    vm->memory = calloc(memory_size, 1);
+    // Reserve guest RAM; the host backs it as the guest touches it
+    vm->memory = guest_memory_reserve(memory_size, opts.flags, &vm->memory_reserved);
     if (!vm->memory) {
         free(vm);
         return NANOCORE_ENOMEM;
     }
     
+    // Allocate page flags used for code invalidation and snapshots
+    vm->page_flags = page_flags_create(memory_size);
+    if (!vm->page_flags) {
+        free_instance(vm);
+        return NANOCORE_ENOMEM;
+    }
+    
     // Initialize VM
-    vm->memory_size = memory_size;
     vm->state.sp = memory_size - 8;  // Stack at top
     vm->state.pc = 0x10000;          // Default entry point
-    vm->vm_id = next_vm_id++;
+    vm->vm_id = atomic_fetch_add(&next_vm_id, 1);
     vm->halted = false;
-    vm->num_breakpoints = 0;
     
-    vms[id] = vm;
-    *vm_handle = id;
+#if NANOCORE_JIT
+    // The JIT is an optimization: if the code cache can't be mapped, interpret
+    if (opts.flags & NANOCORE_VM_OPT_JIT) {
+        vm->jit = jit_create(opts.jit_threshold ? opts.jit_threshold : JIT_DEFAULT_THRESHOLD);
+    }
+#endif
     
-    return NANOCORE_OK;
+    return publish_instance(vm, vm_handle);
+}
+
+// Create a new VM instance
+int nanocore_vm_create(uint64_t memory_size, int* vm_handle) {
+    return nanocore_vm_create_ex(memory_size, NULL, vm_handle);
+}
+
+// Add a hardware thread to vm: a new VM handle sharing vm's guest RAM,
+// starting from a copy of its registers, with its own decoded code, page
+// flags, events and debug state. Each hart may run on its own host thread;
+// the RAM is freed with the last VM using it. Fails while vm has a memory
+// view outstanding, since shared RAM is only reachable by copying. Not
+// safe against concurrent calls on the same vm.
+int nanocore_vm_create_hart(int vm_handle, int* hart_handle) {
+    if (!hart_handle) {
+        return NANOCORE_EINVAL;
+    }
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm) {
+        return NANOCORE_EINVAL;
+    }
+    
+    if (!vm->harts) {
+        hart_group_t* group = calloc(1, sizeof(*group));
+        if (!group) {
+            return NANOCORE_ENOMEM;
+        }
+        atomic_flag_clear(&group->lock);
+        hart_join(group, vm);
+    }
+    
+    vm_instance_t* hart = alloc_instance();
+    if (!hart) {
+        return NANOCORE_ENOMEM;
+    }
+    if (!hart_join(vm->harts, hart)) {
+        free(hart);
+        return NANOCORE_ERROR;  // Too many harts
+    }
+    hart->memory = vm->memory;
+    hart->memory_size = vm->memory_size;
+    hart->memory_reserved = vm->memory_reserved;
+    hart->image_key = vm->image_key;
+    
+    // Joining first means no view can be mapped after this check
+    if (atomic_load_explicit(&vm->pins, memory_order_acquire) > 0) {
+        free_instance(hart);
+        return NANOCORE_ERROR;  // A view of the RAM is outstanding
+    }
+    
+    hart->page_flags = page_flags_create(vm->memory_size);
+    if (!hart->page_flags) {
+        free_instance(hart);
+        return NANOCORE_ENOMEM;
+    }
+    
+    hart->state = vm->state;
+    hart->state.flags &= ~(uint64_t)0x80;
+    hart->vm_id = atomic_fetch_add(&next_vm_id, 1);
+    hart->halted = false;
+    
+#if NANOCORE_JIT
+    if (vm->jit) {
+        hart->jit = jit_create(vm->jit->threshold);
+    }
+#endif
+    
+    return publish_instance(hart, hart_handle);
 }
 
 // Destroy VM instance
 int nanocore_vm_destroy(int vm_handle) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle]) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm) {
         return NANOCORE_EINVAL;
     }
+    if (atomic_load_explicit(&vm->pins, memory_order_acquire) > 0) {
+        return NANOCORE_ERROR;  // A memory view still points into guest RAM
+    }
     
-    vm_instance_t* vm = vms[vm_handle];
-    free(vm->memory);
-    free(vm);
-    vms[vm_handle] = NULL;
+    // Exactly one of several racing destroys takes the instance
+    uint32_t index = (uint32_t)vm_handle & HANDLE_INDEX_MASK;
+    handle_slot_t* slot = handle_slot(index, false);
+    if (!atomic_compare_exchange_strong_explicit(&slot->vm, &vm, NULL,
+                                                 memory_order_acq_rel, memory_order_relaxed)) {
+        return NANOCORE_EINVAL;
+    }
+    atomic_fetch_add_explicit(&slot->generation, 1, memory_order_release);
+    handle_release(index);
     
+    free_instance(vm);
     return NANOCORE_OK;
 }
 
 // Reset VM to initial state
 int nanocore_vm_reset(int vm_handle) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle]) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm) {
         return NANOCORE_EINVAL;
     }
     
-    vm_instance_t* vm = vms[vm_handle];
-    
     // Clear registers
     memset(&vm->state, 0, sizeof(vm_state_t));
     
@@ -134,68 +986,1586 @@ int nanocore_vm_reset(int vm_handle) {
     vm->state.sp = vm->memory_size - 8;
     vm->state.pc = 0x10000;
     vm->halted = false;
-    vm->num_breakpoints = 0;
+    debug_clear_all(vm);
+    timer_disarm(vm);
+    atomic_store(&vm->irq_pending, 0);
+    atomic_store(&vm->irq_signal, 0);
+    vm->irq_pc = 0;
+    vm->irq_flags = 0;
     
     return NANOCORE_OK;
 }
 
-// Simple instruction decoder and executor
-static int execute_instruction(vm_instance_t* vm, uint32_t instruction) {
-    uint8_t opcode = (instruction >> 26) & 0x3F;
-    uint8_t rd = (instruction >> 21) & 0x1F;
-    uint8_t rs1 = (instruction >> 16) & 0x1F;
-    uint8_t rs2 = (instruction >> 11) & 0x1F;
-    int16_t imm = instruction & 0xFFFF;
+// ---------------------------------------------------------------------------
+// Snapshots: a frozen copy of a VM that any number of forks start from.
+// Only pages flagged PAGE_FLAG_WRITTEN are captured, so sparse guests cost
+// what they use. On Linux they go into an anonymous memory file and each
+// fork maps it MAP_PRIVATE: forking is a single mmap, and the kernel copies
+// a GUEST_PAGE_SIZE page only when a fork first writes it. Elsewhere the
+// snapshot keeps the pages on the heap and forks copy them in.
+// ---------------------------------------------------------------------------
+
+typedef struct nanocore_snapshot {
+    vm_state_t state;
+    uint64_t irq_pc;           // Shadow registers; pending interrupts and timers stay behind
+    uint64_t irq_flags;
+    size_t memory_size;
+    bool halted;
+    uint64_t* breakpoints;     // Unordered
+    watchpoint_t* watchpoints;
+    uint32_t num_breakpoints;
+    uint32_t num_watchpoints;
+    bool jit;                  // Forks translate hot blocks too
+    uint32_t jit_threshold;
+    uint64_t* pages;           // Written guest pages, ascending
+    size_t num_pages;
+#if NANOCORE_COW
+    int memory_fd;             // Memory file holding the guest RAM image
+#else
+    uint8_t* page_data;        // num_pages pages, in pages[] order
+#endif
+} nanocore_snapshot_t;
+
+// Bytes of guest RAM in a page; the last page may be partial
+static size_t guest_page_length(size_t memory_size, uint64_t page) {
+    uint64_t offset = page << GUEST_PAGE_SHIFT;
+    return memory_size - offset < GUEST_PAGE_SIZE ? (size_t)(memory_size - offset) : GUEST_PAGE_SIZE;
+}
+
+// Collect the indices of every page written by vm or any hart sharing its RAM
+static int snapshot_collect_pages(const vm_instance_t* vm, nanocore_snapshot_t* snap) {
+    size_t page_count = GUEST_PAGE_COUNT(vm->memory_size);
+    size_t capacity = 64;
+    snap->pages = malloc(capacity * sizeof(uint64_t));
+    if (!snap->pages) {
+        return NANOCORE_ENOMEM;
+    }
     
-    // Ensure R0 is always zero
-    vm->state.gprs[0] = 0;
+    hart_group_t* group = vm->harts;
+    if (group) {
+        hart_lock(group);
+    }
+    int result = NANOCORE_OK;
+    for (size_t page = 0; page < page_count; page++) {
+        uint8_t flags = vm->page_flags[page];
+        for (uint32_t i = 0; group && i < group->count; i++) {
+            flags |= group->members[i]->page_flags[page];
+        }
+        if (!(flags & PAGE_FLAG_WRITTEN)) {
+            continue;
+        }
+        if (snap->num_pages == capacity) {
+            uint64_t* grown = realloc(snap->pages, capacity * 2 * sizeof(uint64_t));
+            if (!grown) {
+                result = NANOCORE_ENOMEM;
+                break;
+            }
+            snap->pages = grown;
+            capacity *= 2;
+        }
+        snap->pages[snap->num_pages++] = page;
+    }
+    if (group) {
+        hart_unlock(group);
+    }
     
-    switch (opcode) {
-        case 0x00:  // ADD
-            if (rd != 0) {
-                vm->state.gprs[rd] = vm->state.gprs[rs1] + vm->state.gprs[rs2];
+    return result;
+}
+
+#if NANOCORE_COW
+// Copy the written pages into a sparse memory file, one write per run
+static int snapshot_write_memory(int fd, const vm_instance_t* vm, const nanocore_snapshot_t* snap) {
+    if (ftruncate(fd, (off_t)vm->memory_size) != 0) {
+        return NANOCORE_ENOMEM;
+    }
+    
+    size_t i = 0;
+    while (i < snap->num_pages) {
+        size_t run = 1;
+        while (i + run < snap->num_pages && snap->pages[i + run] == snap->pages[i] + run) {
+            run++;
+        }
+        
+        uint64_t offset = snap->pages[i] << GUEST_PAGE_SHIFT;
+        uint64_t end = (snap->pages[i + run - 1] << GUEST_PAGE_SHIFT) +
+                       guest_page_length(vm->memory_size, snap->pages[i + run - 1]);
+        while (offset < end) {
+            ssize_t written = pwrite(fd, vm->memory + offset, (size_t)(end - offset), (off_t)offset);
+            if (written <= 0) {
+                return NANOCORE_ENOMEM;
             }
-            break;
-            
-        case 0x01:  // SUB
-            if (rd != 0) {
-                vm->state.gprs[rd] = vm->state.gprs[rs1] - vm->state.gprs[rs2];
-            }
-            break;
-            
-        case 0x02:  // MUL
-            if (rd != 0) {
-                vm->state.gprs[rd] = vm->state.gprs[rs1] * vm->state.gprs[rs2];
+            offset += (uint64_t)written;
+        }
+        i += run;
+    }
+    
+    return NANOCORE_OK;
+}
+#endif
+
+// Free a snapshot that may be partly built
+static void free_snapshot(nanocore_snapshot_t* snap) {
+#if NANOCORE_COW
+    if (snap->memory_fd >= 0) {
+        close(snap->memory_fd);  // Live mappings keep the file contents
+    }
+#else
+    free(snap->page_data);
+#endif
+    free(snap->pages);
+    free(snap->breakpoints);
+    free(snap->watchpoints);
+    free(snap);
+}
+
+// Capture a VM's registers, memory and breakpoints. The VM must not be
+// running; it is unaffected and may keep running afterwards.
+int nanocore_vm_snapshot(int vm_handle, nanocore_snapshot_t** snapshot) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !snapshot) {
+        return NANOCORE_EINVAL;
+    }
+    
+    nanocore_snapshot_t* snap = calloc(1, sizeof(nanocore_snapshot_t));
+    if (!snap) {
+        return NANOCORE_ENOMEM;
+    }
+#if NANOCORE_COW
+    snap->memory_fd = -1;
+#endif
+    
+    int result = snapshot_collect_pages(vm, snap);
+    if (result != NANOCORE_OK) {
+        free_snapshot(snap);
+        return result;
+    }
+    
+#if NANOCORE_COW
+    snap->memory_fd = memfd_create("nanocore-snapshot", MFD_CLOEXEC);
+    if (snap->memory_fd < 0) {
+        free_snapshot(snap);
+        return NANOCORE_ERROR;
+    }
+    result = snapshot_write_memory(snap->memory_fd, vm, snap);
+    if (result != NANOCORE_OK) {
+        free_snapshot(snap);
+        return result;
+    }
+#else
+    snap->page_data = malloc(snap->num_pages ? snap->num_pages * GUEST_PAGE_SIZE : 1);
+    if (!snap->page_data) {
+        free_snapshot(snap);
+        return NANOCORE_ENOMEM;
+    }
+    for (size_t i = 0; i < snap->num_pages; i++) {
+        memcpy(snap->page_data + i * GUEST_PAGE_SIZE, vm->memory + (snap->pages[i] << GUEST_PAGE_SHIFT),
+               guest_page_length(vm->memory_size, snap->pages[i]));
+    }
+#endif
+    
+    snap->state = vm->state;
+    snap->irq_pc = vm->irq_pc;
+    snap->irq_flags = vm->irq_flags;
+    snap->memory_size = vm->memory_size;
+    snap->halted = vm->halted;
+    if (!debug_save(vm, snap)) {
+        free_snapshot(snap);
+        return NANOCORE_ENOMEM;
+    }
+#if NANOCORE_JIT
+    if (vm->jit) {
+        snap->jit = true;
+        snap->jit_threshold = vm->jit->threshold;
+    }
+#endif
+    
+    *snapshot = snap;
+    return NANOCORE_OK;
+}
+
+// Start a new VM from a snapshot. Guest memory is shared with the
+// snapshot until the fork writes to it.
+int nanocore_vm_fork(const nanocore_snapshot_t* snapshot, int* vm_handle) {
+    if (!snapshot || !vm_handle) {
+        return NANOCORE_EINVAL;
+    }
+    
+    vm_instance_t* vm = alloc_instance();
+    if (!vm) {
+        return NANOCORE_ENOMEM;
+    }
+    vm->memory_size = snapshot->memory_size;
+    
+#if NANOCORE_COW
+    void* memory = mmap(NULL, snapshot->memory_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_NORESERVE, snapshot->memory_fd, 0);
+    if (memory == MAP_FAILED) {
+        free(vm);
+        return NANOCORE_ENOMEM;
+    }
+    vm->memory = memory;
+    vm->memory_reserved = snapshot->memory_size;
+#else
+    vm->memory = guest_memory_reserve(snapshot->memory_size, 0, &vm->memory_reserved);
+    if (!vm->memory) {
+        free(vm);
+        return NANOCORE_ENOMEM;
+    }
+    for (size_t i = 0; i < snapshot->num_pages; i++) {
+        memcpy(vm->memory + (snapshot->pages[i] << GUEST_PAGE_SHIFT), snapshot->page_data + i * GUEST_PAGE_SIZE,
+               guest_page_length(snapshot->memory_size, snapshot->pages[i]));
+    }
+#endif
+    
+    // Decoded code is per VM and rebuilt on demand; written pages carry
+    // over, and a fork starts with no dirty pages relative to its snapshot
+    vm->page_flags = page_flags_create(snapshot->memory_size);
+    if (!vm->page_flags) {
+        free_instance(vm);
+        return NANOCORE_ENOMEM;
+    }
+    for (size_t i = 0; i < snapshot->num_pages; i++) {
+        vm->page_flags[snapshot->pages[i]] = PAGE_FLAG_WRITTEN;
+    }
+    
+    vm->state = snapshot->state;
+    vm->irq_pc = snapshot->irq_pc;
+    vm->irq_flags = snapshot->irq_flags;
+    vm->halted = snapshot->halted;
+    if (!debug_restore(vm, snapshot)) {
+        free_instance(vm);
+        return NANOCORE_ENOMEM;
+    }
+    vm->vm_id = atomic_fetch_add(&next_vm_id, 1);
+    
+#if NANOCORE_JIT
+    if (snapshot->jit) {
+        vm->jit = jit_create(snapshot->jit_threshold);
+    }
+#endif
+    
+    return publish_instance(vm, vm_handle);
+}
+
+// Free a snapshot. Forks already made from it are unaffected.
+int nanocore_snapshot_destroy(nanocore_snapshot_t* snapshot) {
+    if (!snapshot) {
+        return NANOCORE_EINVAL;
+    }
+    
+    free_snapshot(snapshot);
+    return NANOCORE_OK;
+}
+
+// Drop every decoded block that overlaps a guest page
+static void invalidate_code_page(vm_instance_t* vm, uint64_t page) {
+    vm->page_flags[page] &= ~PAGE_FLAG_CODE;
+    vm->code_modified = true;
+    
+#if NANOCORE_JIT
+    // Chained translations may jump into this page without a cache lookup
+    if (vm->jit) {
+        vm->jit->flush_pending = true;
+    }
+#endif
+    
+    if (!vm->block_cache) {
+        return;
+    }
+    
+    for (int i = 0; i < BLOCK_CACHE_ENTRIES; i++) {
+        decoded_block_t* block = &vm->block_cache[i];
+        if (block->num_ops == 0) {
+            continue;
+        }
+        uint64_t first = block->pc >> GUEST_PAGE_SHIFT;
+        uint64_t last = (block->pc + block->num_ops * 4 - 1) >> GUEST_PAGE_SHIFT;
+        if (page >= first && page <= last) {
+            block->num_ops = 0;
+        }
+    }
+}
+
+// Slow path of a guest or host write to [address, address + size): mark
+// the pages written and dirty and drop decoded code on them. True if code
+// was hit.
+static bool note_write(vm_instance_t* vm, uint64_t address, uint64_t size) {
+    if (size == 0) {
+        return false;
+    }
+    
+    bool hit_code = false;
+    uint64_t first = address >> GUEST_PAGE_SHIFT;
+    uint64_t last = (address + size - 1) >> GUEST_PAGE_SHIFT;
+    for (uint64_t page = first; page <= last; page++) {
+        if (vm->page_flags[page] & PAGE_FLAG_CODE) {
+            invalidate_code_page(vm, page);
+            hit_code = true;
+        }
+        vm->page_flags[page] |= PAGE_FLAG_WRITTEN | PAGE_FLAG_DIRTY;
+    }
+    return hit_code;
+}
+
+// ---------------------------------------------------------------------------
+// Breakpoints and watchpoints cost nothing until one is hit. Pages holding
+// a breakpoint carry PAGE_FLAG_BREAK; only on those does decode_block look
+// PCs up in the breakpoint set, ending a block just before a breakpoint and
+// decoding the breakpoint itself as a one-op DECODED_BREAK block. Watched
+// pages carry PAGE_FLAG_WATCH, which sends stores down the PAGE_STORE_SLOW
+// path code pages already take; loads check the page flags only when
+// watchpoints exist. A watchpoint stops the run after the access retires.
+// Setting or clearing a breakpoint re-decodes its page.
+// ---------------------------------------------------------------------------
+
+static uint32_t breakpoint_home(const breakpoint_set_t* set, uint64_t address) {
+    return (uint32_t)(((address >> 2) * 0x9E3779B97F4A7C15ull) >> 32) & (set->capacity - 1);
+}
+
+static bool breakpoint_test(const breakpoint_set_t* set, uint64_t address) {
+    if (set->count == 0) {
+        return false;
+    }
+    for (uint32_t i = breakpoint_home(set, address);; i = (i + 1) & (set->capacity - 1)) {
+        if (set->slots[i] == address + 1) {
+            return true;
+        }
+        if (set->slots[i] == 0) {
+            return false;
+        }
+    }
+}
+
+static void breakpoint_place(breakpoint_set_t* set, uint64_t key) {
+    uint32_t i = breakpoint_home(set, key - 1);
+    while (set->slots[i] != 0) {
+        i = (i + 1) & (set->capacity - 1);
+    }
+    set->slots[i] = key;
+}
+
+// False only when the set could not grow
+static bool breakpoint_insert(breakpoint_set_t* set, uint64_t address) {
+    if (breakpoint_test(set, address)) {
+        return true;
+    }
+    
+    if ((set->count + 1) * 2 > set->capacity) {
+        uint32_t capacity = set->capacity ? set->capacity * 2 : 16;
+        uint64_t* slots = calloc(capacity, sizeof(uint64_t));
+        if (!slots) {
+            return false;
+        }
+        uint64_t* old = set->slots;
+        uint32_t old_capacity = set->capacity;
+        set->slots = slots;
+        set->capacity = capacity;
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old[i]) {
+                breakpoint_place(set, old[i]);
             }
+        }
+        free(old);
+    }
+    
+    breakpoint_place(set, address + 1);
+    set->count++;
+    return true;
+}
+
+static bool breakpoint_remove(breakpoint_set_t* set, uint64_t address) {
+    if (!breakpoint_test(set, address)) {
+        return false;
+    }
+    
+    uint32_t mask = set->capacity - 1;
+    uint32_t hole = breakpoint_home(set, address);
+    while (set->slots[hole] != address + 1) {
+        hole = (hole + 1) & mask;
+    }
+    
+    // Pull later entries of the probe run back over the hole
+    for (uint32_t i = (hole + 1) & mask; set->slots[i] != 0; i = (i + 1) & mask) {
+        uint32_t home = breakpoint_home(set, set->slots[i] - 1);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            set->slots[hole] = set->slots[i];
+            hole = i;
+        }
+    }
+    set->slots[hole] = 0;
+    set->count--;
+    return true;
+}
+
+// Drop decoded code on a page so its blocks are rebuilt with the current
+// breakpoints
+static void debug_redecode_page(vm_instance_t* vm, uint64_t page) {
+    if (vm->page_flags[page] & PAGE_FLAG_CODE) {
+        invalidate_code_page(vm, page);
+    }
+}
+
+// Recompute PAGE_FLAG_WATCH for the pages of [address, address + size)
+static void watch_reflag(vm_instance_t* vm, uint64_t address, uint64_t size) {
+    uint64_t last = (address + size - 1) >> GUEST_PAGE_SHIFT;
+    for (uint64_t page = address >> GUEST_PAGE_SHIFT; page <= last; page++) {
+        uint64_t start = page << GUEST_PAGE_SHIFT;
+        bool watched = false;
+        for (uint32_t i = 0; i < vm->num_watchpoints && !watched; i++) {
+            const watchpoint_t* w = &vm->watchpoints[i];
+            watched = w->address < start + GUEST_PAGE_SIZE && start < w->address + w->size;
+        }
+        if (watched) {
+            vm->page_flags[page] |= PAGE_FLAG_WATCH;
+        } else {
+            vm->page_flags[page] &= ~PAGE_FLAG_WATCH;
+        }
+    }
+}
+
+static bool watch_insert(vm_instance_t* vm, uint64_t address, uint64_t size, uint32_t access) {
+    if (vm->num_watchpoints == vm->watchpoint_capacity) {
+        uint32_t capacity = vm->watchpoint_capacity ? vm->watchpoint_capacity * 2 : 8;
+        watchpoint_t* grown = realloc(vm->watchpoints, capacity * sizeof(watchpoint_t));
+        if (!grown) {
+            return false;
+        }
+        vm->watchpoints = grown;
+        vm->watchpoint_capacity = capacity;
+    }
+    vm->watchpoints[vm->num_watchpoints++] = (watchpoint_t){ .address = address, .size = size, .access = access };
+    watch_reflag(vm, address, size);
+    return true;
+}
+
+// Slow half of a watched access: stop at the first watchpoint of this
+// kind overlapping [address, address + size)
+static bool watch_check(vm_instance_t* vm, uint64_t address, uint64_t size, uint32_t access) {
+    for (uint32_t i = 0; i < vm->num_watchpoints; i++) {
+        const watchpoint_t* w = &vm->watchpoints[i];
+        if ((w->access & access) && address < w->address + w->size && w->address < address + size) {
+            vm->watch_hit = true;
+            vm->watch_address = address;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Guest access to [address, address + size); true if a watchpoint fired
+static bool watch_access(vm_instance_t* vm, uint64_t address, uint64_t size, uint32_t access) {
+    if (vm->num_watchpoints == 0 || size == 0) {
+        return false;
+    }
+    uint64_t last = (address + size - 1) >> GUEST_PAGE_SHIFT;
+    for (uint64_t page = address >> GUEST_PAGE_SHIFT; page <= last; page++) {
+        if (vm->page_flags[page] & PAGE_FLAG_WATCH) {
+            return watch_check(vm, address, size, access);
+        }
+    }
+    return false;
+}
+
+// Slow path of a guest store: note_write, write watchpoints, and ring
+// doorbells, which have the next block boundary collect new descriptors.
+// True if the current block must end.
+static bool guest_store_slow(vm_instance_t* vm, uint64_t address, uint64_t size) {
+    uint64_t last = (address + size - 1) >> GUEST_PAGE_SHIFT;
+    for (uint64_t page = address >> GUEST_PAGE_SHIFT; page <= last; page++) {
+        if (vm->page_flags[page] & PAGE_FLAG_RING) {
+            atomic_store(&vm->irq_signal, 1);
             break;
-            
-        case 0x04:  // DIV
-            if (rd != 0 && vm->state.gprs[rs2] != 0) {
-                vm->state.gprs[rd] = vm->state.gprs[rs1] / vm->state.gprs[rs2];
+        }
+    }
+    bool hit_code = note_write(vm, address, size);
+    return watch_access(vm, address, size, NANOCORE_WATCH_WRITE) || hit_code;
+}
+
+// Remove every breakpoint and watchpoint
+static void debug_clear_all(vm_instance_t* vm) {
+    for (uint32_t i = 0; i < vm->breakpoints.capacity; i++) {
+        if (vm->breakpoints.slots[i]) {
+            uint64_t page = (vm->breakpoints.slots[i] - 1) >> GUEST_PAGE_SHIFT;
+            vm->page_flags[page] &= ~PAGE_FLAG_BREAK;
+            debug_redecode_page(vm, page);
+            vm->breakpoints.slots[i] = 0;
+        }
+    }
+    vm->breakpoints.count = 0;
+    
+    while (vm->num_watchpoints > 0) {
+        watchpoint_t w = vm->watchpoints[--vm->num_watchpoints];
+        watch_reflag(vm, w.address, w.size);
+    }
+    vm->watch_hit = false;
+}
+
+// Copy the VM's breakpoints and watchpoints into a snapshot
+static bool debug_save(const vm_instance_t* vm, nanocore_snapshot_t* snap) {
+    if (vm->breakpoints.count > 0) {
+        snap->breakpoints = malloc(vm->breakpoints.count * sizeof(uint64_t));
+        if (!snap->breakpoints) {
+            return false;
+        }
+        for (uint32_t i = 0; i < vm->breakpoints.capacity; i++) {
+            if (vm->breakpoints.slots[i]) {
+                snap->breakpoints[snap->num_breakpoints++] = vm->breakpoints.slots[i] - 1;
             }
+        }
+    }
+    
+    if (vm->num_watchpoints > 0) {
+        snap->watchpoints = malloc(vm->num_watchpoints * sizeof(watchpoint_t));
+        if (!snap->watchpoints) {
+            return false;
+        }
+        memcpy(snap->watchpoints, vm->watchpoints, vm->num_watchpoints * sizeof(watchpoint_t));
+        snap->num_watchpoints = vm->num_watchpoints;
+    }
+    return true;
+}
+
+// Install a snapshot's breakpoints and watchpoints in a fresh fork
+static bool debug_restore(vm_instance_t* vm, const nanocore_snapshot_t* snap) {
+    for (uint32_t i = 0; i < snap->num_breakpoints; i++) {
+        if (!breakpoint_insert(&vm->breakpoints, snap->breakpoints[i])) {
+            return false;
+        }
+        vm->page_flags[snap->breakpoints[i] >> GUEST_PAGE_SHIFT] |= PAGE_FLAG_BREAK;
+    }
+    for (uint32_t i = 0; i < snap->num_watchpoints; i++) {
+        const watchpoint_t* w = &snap->watchpoints[i];
+        if (!watch_insert(vm, w->address, w->size, w->access)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Profiling: an optional per-opcode histogram and PC sampling every
+// sample_period retired instructions. run_engine accounts a block's
+// retired ops when it leaves the block, so the uninstrumented cost is one
+// pointer test per block; instrumented runs stay in the interpreter.
+// Samples land in a bounded ring that nanocore_vm_read_samples drains.
+// Stack sampling keeps a shadow stack of CALL sites, pushed by CALL and
+// popped by RET, and stores each sample as [frames, pc, call sites
+// innermost first] for nanocore_vm_read_stacks. Pair counts show which
+// adjacent opcodes retire together inside blocks, i.e. which
+// superinstructions a workload would gain from.
+// ---------------------------------------------------------------------------
+
+typedef struct profile {
+    uint32_t flags;          // NANOCORE_PROFILE_*
+    uint32_t period;
+    uint64_t countdown;      // Instructions left before the next sample
+    uint64_t opcodes[64];
+    uint64_t taken;          // Samples recorded
+    uint64_t dropped;        // Samples lost to a full ring
+    uint32_t depth;          // Call sites on the shadow stack
+    uint32_t deeper;         // Calls past PROFILE_MAX_DEPTH not yet returned
+    uint64_t stack[PROFILE_MAX_DEPTH];
+    uint64_t pairs[64 * 64]; // Under NANOCORE_PROFILE_PAIRS: [first << 6 | second]
+    uint32_t head;           // Oldest unread word
+    uint32_t count;          // Unread words
+    uint64_t samples[PROFILE_SAMPLE_WORDS];
+} profile_t;
+
+static void profile_push_word(profile_t* prof, uint64_t word) {
+    prof->samples[(prof->head + prof->count++) % PROFILE_SAMPLE_WORDS] = word;
+}
+
+static void profile_sample(profile_t* prof, uint64_t pc) {
+    uint32_t words = prof->flags & NANOCORE_PROFILE_STACKS ? prof->depth + 2 : 1;
+    
+    prof->taken++;
+    if (PROFILE_SAMPLE_WORDS - prof->count < words) {
+        prof->dropped++;
+        return;
+    }
+    if (prof->flags & NANOCORE_PROFILE_STACKS) {
+        profile_push_word(prof, prof->depth + 1);
+    }
+    profile_push_word(prof, pc);
+    if (prof->flags & NANOCORE_PROFILE_STACKS) {
+        for (uint32_t i = prof->depth; i > 0; i--) {
+            profile_push_word(prof, prof->stack[i - 1]);
+        }
+    }
+}
+
+// Track the shadow stack across a retired CALL or RET at pc
+static void profile_call(profile_t* prof, uint8_t opcode, uint64_t pc) {
+    if (opcode == 0x1E) {  // CALL
+        if (prof->depth < PROFILE_MAX_DEPTH) {
+            prof->stack[prof->depth++] = pc;
+        } else {
+            prof->deeper++;
+        }
+    } else if (opcode == 0x1F) {  // RET
+        if (prof->deeper) {
+            prof->deeper--;
+        } else if (prof->depth) {
+            prof->depth--;
+        }
+    }
+}
+
+// Account the first n ops of a block as retired. Ops that write R0 were
+// decoded as NOP and are counted as such.
+static void profile_block(profile_t* prof, const decoded_block_t* block, uint64_t n) {
+    if (prof->flags & NANOCORE_PROFILE_OPCODES) {
+        for (uint64_t i = 0; i < n; i++) {
+            prof->opcodes[decoded_opcode(block->ops[i].opcode) & 0x3F]++;
+        }
+    }
+    if (prof->flags & NANOCORE_PROFILE_PAIRS) {
+        for (uint64_t i = 1; i < n; i++) {
+            uint8_t first = decoded_opcode(block->ops[i - 1].opcode) & 0x3F;
+            prof->pairs[first << 6 | (decoded_opcode(block->ops[i].opcode) & 0x3F)]++;
+        }
+    }
+    if (prof->flags & NANOCORE_PROFILE_PCS) {
+        uint64_t index = 0;
+        while (n - index >= prof->countdown) {
+            index += prof->countdown;
+            profile_sample(prof, block->pc + (index - 1) * 4);
+            prof->countdown = prof->period;
+        }
+        prof->countdown -= n - index;
+    }
+    // CALL and RET end blocks, so only a block's last op can move the stack
+    if ((prof->flags & NANOCORE_PROFILE_STACKS) && n && n == block->num_ops) {
+        profile_call(prof, block->ops[n - 1].opcode, block->pc + (n - 1) * 4);
+    }
+}
+
+// Account one instruction retired by the stepping path
+static void profile_step(profile_t* prof, uint64_t pc, uint32_t instruction) {
+    if (prof->flags & NANOCORE_PROFILE_OPCODES) {
+        prof->opcodes[instruction >> 26]++;
+    }
+    if ((prof->flags & NANOCORE_PROFILE_PCS) && --prof->countdown == 0) {
+        profile_sample(prof, pc);
+        prof->countdown = prof->period;
+    }
+    if (prof->flags & NANOCORE_PROFILE_STACKS) {
+        profile_call(prof, instruction >> 26, pc);
+    }
+}
+
+// MCOPY: memmove len bytes from src to dst. The range is checked once and
+// page flags are walked once per page, not per byte. Out-of-range
+// requests do nothing, as ST does. True if decoded code was overwritten
+// or a watchpoint fired.
+static bool guest_copy(vm_instance_t* vm, uint64_t dst, uint64_t src, uint64_t len) {
+    uint64_t size = vm->memory_size;
+    if (len == 0 || dst >= size || size - dst < len || src >= size || size - src < len) {
+        return false;
+    }
+    memmove(vm->memory + dst, vm->memory + src, len);
+    bool read_hit = watch_access(vm, src, len, NANOCORE_WATCH_READ);
+    return guest_store_slow(vm, dst, len) || read_hit;
+}
+
+// MFILL: set len bytes at dst to value, with the same checks as guest_copy
+static bool guest_fill(vm_instance_t* vm, uint64_t dst, uint8_t value, uint64_t len) {
+    uint64_t size = vm->memory_size;
+    if (len == 0 || dst >= size || size - dst < len) {
+        return false;
+    }
+    memset(vm->memory + dst, value, len);
+    return guest_store_slow(vm, dst, len);
+}
+
+// ---------------------------------------------------------------------------
+// Vector engine: the V-type opcodes on the 256-bit vregs, viewed as four
+// 64-bit or eight 32-bit lanes. Kernels are fixed-width lane loops that
+// the compiler vectorizes (NEON on AArch64); on x86-64 Linux each is also
+// built for AVX2 and AVX-512 and the best clone is bound at load time.
+//
+// V-type: [25:21 vd][20:16 vs1][15:11 vs2][10:8 vmask][7:0 vfunct], with
+// vfunct = [7:6 element type][5:0 operation]. A nonzero vmask m predicates
+// the op on V(m): lanes where V(m) is zero keep their old value, and
+// reductions and gather/scatter skip them.
+// ---------------------------------------------------------------------------
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && !defined(__clang__)
+#define NANOCORE_VECTOR_CLONES __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#else
+#define NANOCORE_VECTOR_CLONES
+#endif
+
+// Element types (vfunct[7:6]); the odd ones have eight 32-bit lanes
+enum { VTYPE_F64 = 0, VTYPE_F32 = 1, VTYPE_I64 = 2, VTYPE_I32 = 3 };
+#define VTYPE_NARROW(type) ((type) & 1)
+
+// VOP (0x39) operations
+enum {
+    VOP_ADD = 0, VOP_SUB = 1, VOP_MUL = 2,
+    VOP_FMA = 3,    // vd = vs1 * vs2 + vd, fused for floats
+    VOP_MIN = 4, VOP_MAX = 5,
+    VOP_AND = 6, VOP_OR = 7, VOP_XOR = 8,  // Bitwise on any type
+    VOP_CMPEQ = 9, VOP_CMPLT = 10          // All-ones lanes where true
+};
+
+// VRED (0x3A) operations: rd = reduction of vs1's active lanes
+enum { VRED_SUM = 0, VRED_MIN = 1, VRED_MAX = 2 };
+
+// VMEM (0x3B) operations
+enum { VMEM_GATHER = 0, VMEM_SCATTER = 1 };
+
+// execute_vector result when a store overwrote decoded code or a
+// watchpoint fired
+#define VECTOR_END_BLOCK 1
+
+// All-ones or all-zeros per lane from the predicate register (NULL = all on)
+static void vector_lanes(const uint64_t* pred, bool narrow, uint64_t lanes[4]) {
+    for (int i = 0; i < 4; i++) {
+        if (!pred) {
+            lanes[i] = UINT64_MAX;
+        } else if (narrow) {
+            lanes[i] = ((uint32_t)pred[i] ? 0x00000000FFFFFFFFull : 0) |
+                       ((pred[i] >> 32) ? 0xFFFFFFFF00000000ull : 0);
+        } else {
+            lanes[i] = pred[i] ? UINT64_MAX : 0;
+        }
+    }
+}
+
+#define VECTOR_FLOAT_OPS(T, U, N, FMA)                                     \
+    {                                                                      \
+        T x[N], y[N], z[N];                                                \
+        U c[N];                                                            \
+        memcpy(x, a, 32);                                                  \
+        memcpy(y, b, 32);                                                  \
+        memcpy(z, d, 32);                                                  \
+        switch (op) {                                                      \
+            case VOP_ADD: for (int i = 0; i < N; i++) z[i] = x[i] + y[i]; break; \
+            case VOP_SUB: for (int i = 0; i < N; i++) z[i] = x[i] - y[i]; break; \
+            case VOP_MUL: for (int i = 0; i < N; i++) z[i] = x[i] * y[i]; break; \
+            case VOP_FMA: for (int i = 0; i < N; i++) z[i] = FMA(x[i], y[i], z[i]); break; \
+            case VOP_MIN: for (int i = 0; i < N; i++) z[i] = y[i] < x[i] ? y[i] : x[i]; break; \
+            case VOP_MAX: for (int i = 0; i < N; i++) z[i] = x[i] < y[i] ? y[i] : x[i]; break; \
+            case VOP_CMPEQ:                                                \
+                for (int i = 0; i < N; i++) c[i] = x[i] == y[i] ? (U)-1 : 0; \
+                memcpy(z, c, 32);                                          \
+                break;                                                     \
+            case VOP_CMPLT:                                                \
+                for (int i = 0; i < N; i++) c[i] = x[i] < y[i] ? (U)-1 : 0; \
+                memcpy(z, c, 32);                                          \
+                break;                                                     \
+            default:                                                       \
+                return false;                                              \
+        }                                                                  \
+        memcpy(r, z, 32);                                                  \
+    }
+
+// Integer lanes wrap, so arithmetic is done unsigned
+#define VECTOR_INT_OPS(S, U, N)                                            \
+    {                                                                      \
+        U x[N], y[N], z[N];                                                \
+        memcpy(x, a, 32);                                                  \
+        memcpy(y, b, 32);                                                  \
+        memcpy(z, d, 32);                                                  \
+        switch (op) {                                                      \
+            case VOP_ADD: for (int i = 0; i < N; i++) z[i] = x[i] + y[i]; break; \
+            case VOP_SUB: for (int i = 0; i < N; i++) z[i] = x[i] - y[i]; break; \
+            case VOP_MUL: for (int i = 0; i < N; i++) z[i] = x[i] * y[i]; break; \
+            case VOP_FMA: for (int i = 0; i < N; i++) z[i] = x[i] * y[i] + z[i]; break; \
+            case VOP_MIN: for (int i = 0; i < N; i++) z[i] = (S)y[i] < (S)x[i] ? y[i] : x[i]; break; \
+            case VOP_MAX: for (int i = 0; i < N; i++) z[i] = (S)x[i] < (S)y[i] ? y[i] : x[i]; break; \
+            case VOP_CMPEQ: for (int i = 0; i < N; i++) z[i] = x[i] == y[i] ? (U)-1 : 0; break; \
+            case VOP_CMPLT: for (int i = 0; i < N; i++) z[i] = (S)x[i] < (S)y[i] ? (U)-1 : 0; break; \
+            default:                                                       \
+                return false;                                              \
+        }                                                                  \
+        memcpy(r, z, 32);                                                  \
+    }
+
+// Lane-wise d = a op b under the predicate; false for an unknown op
+NANOCORE_VECTOR_CLONES
+static bool vector_arith(uint8_t funct, uint64_t d[4], const uint64_t a[4], const uint64_t b[4],
+                         const uint64_t* pred) {
+    uint8_t op = funct & 0x3F;
+    uint8_t type = funct >> 6;
+    uint64_t lanes[4];
+    uint64_t r[4];
+    
+    vector_lanes(pred, VTYPE_NARROW(type), lanes);
+    
+    if (op == VOP_AND || op == VOP_OR || op == VOP_XOR) {
+        for (int i = 0; i < 4; i++) {
+            r[i] = op == VOP_AND ? a[i] & b[i] : op == VOP_OR ? a[i] | b[i] : a[i] ^ b[i];
+        }
+    } else {
+        switch (type) {
+            case VTYPE_F64: VECTOR_FLOAT_OPS(double, uint64_t, 4, fma) break;
+            case VTYPE_F32: VECTOR_FLOAT_OPS(float, uint32_t, 8, fmaf) break;
+            case VTYPE_I64: VECTOR_INT_OPS(int64_t, uint64_t, 4) break;
+            default: VECTOR_INT_OPS(int32_t, uint32_t, 8) break;
+        }
+    }
+    
+    for (int i = 0; i < 4; i++) {
+        d[i] = (r[i] & lanes[i]) | (d[i] & ~lanes[i]);
+    }
+    return true;
+}
+
+// Fold the active lanes with a starting value of init; lanes are visited
+// in order, so float sums are reproducible
+#define VECTOR_REDUCE(T, N, init, RESULT)                                  \
+    {                                                                      \
+        T x[N];                                                            \
+        T acc = (init);                                                    \
+        memcpy(x, a, 32);                                                  \
+        for (int i = 0; i < N; i++) {                                      \
+            if (!on[i]) continue;                                          \
+            if (op == VRED_SUM) acc += x[i];                               \
+            else if (op == VRED_MIN ? x[i] < acc : acc < x[i]) acc = x[i]; \
+        }                                                                  \
+        RESULT;                                                            \
+    }
+
+// Horizontal reduction into a GPR: floats as their bit pattern (f32
+// zero-extended), i32 sign-extended. An empty predicate gives 0 for
+// sums and the type's identity (+/-inf, INT_MAX/MIN) for min and max.
+NANOCORE_VECTOR_CLONES
+static bool vector_reduce(uint8_t funct, const uint64_t a[4], const uint64_t* pred, uint64_t* result) {
+    uint8_t op = funct & 0x3F;
+    uint8_t type = funct >> 6;
+    uint64_t lanes[4];
+    bool on[8];
+    
+    if (op > VRED_MAX) {
+        return false;
+    }
+    vector_lanes(pred, VTYPE_NARROW(type), lanes);
+    for (int i = 0; i < 8; i++) {
+        on[i] = VTYPE_NARROW(type) ? (lanes[i / 2] >> (32 * (i % 2))) & 1 : i < 4 && (lanes[i] & 1);
+    }
+    
+    switch (type) {
+        case VTYPE_F64:
+            VECTOR_REDUCE(double, 4, op == VRED_SUM ? 0.0 : op == VRED_MIN ? INFINITY : -INFINITY,
+                          memcpy(result, &acc, 8))
             break;
-            
-        case 0x05:  // MOD
-            if (rd != 0 && vm->state.gprs[rs2] != 0) {
-                vm->state.gprs[rd] = vm->state.gprs[rs1] % vm->state.gprs[rs2];
-            }
+        case VTYPE_F32:
+            VECTOR_REDUCE(float, 8, op == VRED_SUM ? 0.0f : op == VRED_MIN ? INFINITY : -INFINITY,
+                          { uint32_t bits; memcpy(&bits, &acc, 4); *result = bits; })
             break;
-            
-        case 0x06:  // AND
-            if (rd != 0) {
-                vm->state.gprs[rd] = vm->state.gprs[rs1] & vm->state.gprs[rs2];
+        case VTYPE_I64:
+            {
+                // Wrapping sum; min/max compare signed
+                uint64_t x[4];
+                int64_t acc = op == VRED_MIN ? INT64_MAX : op == VRED_MAX ? INT64_MIN : 0;
+                uint64_t sum = 0;
+                memcpy(x, a, 32);
+                for (int i = 0; i < 4; i++) {
+                    if (!on[i]) continue;
+                    sum += x[i];
+                    if (op == VRED_MIN ? (int64_t)x[i] < acc : acc < (int64_t)x[i]) acc = (int64_t)x[i];
+                }
+                *result = op == VRED_SUM ? sum : (uint64_t)acc;
             }
             break;
-            
-        case 0x07:  // OR
-            if (rd != 0) {
-                vm->state.gprs[rd] = vm->state.gprs[rs1] | vm->state.gprs[rs2];
+        default:
+            {
+                // Summed in 64 bits, so eight lanes cannot overflow
+                int32_t x[8];
+                int64_t acc = op == VRED_MIN ? INT32_MAX : op == VRED_MAX ? INT32_MIN : 0;
+                memcpy(x, a, 32);
+                for (int i = 0; i < 8; i++) {
+                    if (!on[i]) continue;
+                    if (op == VRED_SUM) acc += x[i];
+                    else if (op == VRED_MIN ? x[i] < acc : acc < x[i]) acc = x[i];
+                }
+                *result = (uint64_t)acc;
             }
             break;
-            
-        case 0x08:  // XOR
-            if (rd != 0) {
-                vm->state.gprs[rd] = vm->state.gprs[rs1] ^ vm->state.gprs[rs2];
+    }
+    return true;
+}
+
+// VGATHER/VSCATTER: lane k accesses R[rs1] + idx[k] * element size, where
+// idx[k] is lane k of vs2 as a signed integer. Lanes outside guest memory
+// are skipped, as ST skips. VECTOR_END_BLOCK if a scatter hit code.
+static int vector_memory(vm_instance_t* vm, uint8_t funct, uint64_t v[4], const uint64_t idx[4],
+                         uint64_t base, const uint64_t* pred) {
+    uint8_t op = funct & 0x3F;
+    bool narrow = VTYPE_NARROW(funct >> 6);
+    uint64_t size = narrow ? 4 : 8;
+    uint64_t lanes[4];
+    bool hit = false;
+    
+    if (op > VMEM_SCATTER) {
+        return NANOCORE_ERROR;
+    }
+    vector_lanes(pred, narrow, lanes);
+    
+    for (uint64_t k = 0; k < 32 / size; k++) {
+        uint8_t* lane = (uint8_t*)v + k * size;
+        if (!(((const uint8_t*)lanes)[k * size])) {
+            continue;
+        }
+        int64_t index;
+        if (narrow) {
+            int32_t index32;
+            memcpy(&index32, (const uint8_t*)idx + k * 4, 4);
+            index = index32;
+        } else {
+            memcpy(&index, (const uint8_t*)idx + k * 8, 8);
+        }
+        
+        uint64_t addr = base + (uint64_t)index * size;
+        if (addr >= vm->memory_size || vm->memory_size - addr < size) {
+            continue;
+        }
+        if (op == VMEM_GATHER) {
+            memcpy(lane, vm->memory + addr, size);
+            if (watch_access(vm, addr, size, NANOCORE_WATCH_READ)) {
+                hit = true;
+            }
+        } else {
+            memcpy(vm->memory + addr, lane, size);
+            if (PAGE_STORE_SLOW(vm->page_flags[addr >> GUEST_PAGE_SHIFT],
+                                vm->page_flags[(addr + size - 1) >> GUEST_PAGE_SHIFT]) &&
+                guest_store_slow(vm, addr, size)) {
+                hit = true;
+            }
+        }
+    }
+    return hit ? VECTOR_END_BLOCK : NANOCORE_OK;
+}
+
+// Execute one vector opcode against the GPR file regs. Returns
+// NANOCORE_OK, VECTOR_END_BLOCK, or NANOCORE_ERROR for a bad vfunct.
+static int execute_vector(vm_instance_t* vm, const decoded_op_t* op, uint64_t* regs) {
+    uint64_t (*v)[4] = vm->state.vregs;
+    uint8_t vd = op->rd & 0xF;
+    uint8_t vs1 = op->rs1 & 0xF;
+    uint8_t vs2 = op->rs2 & 0xF;
+    uint8_t funct = (uint16_t)op->imm & 0xFF;
+    uint8_t vmask = ((uint16_t)op->imm >> 8) & 7;
+    const uint64_t* pred = vmask ? v[vmask] : NULL;
+    uint64_t addr;
+    
+    switch (op->opcode) {
+        case 0x30:  // VADD.F64
+            vector_arith(VOP_ADD, v[vd], v[vs1], v[vs2], NULL);
+            return NANOCORE_OK;
+            
+        case 0x31:  // VSUB.F64
+            vector_arith(VOP_SUB, v[vd], v[vs1], v[vs2], NULL);
+            return NANOCORE_OK;
+            
+        case 0x32:  // VMUL.F64
+            vector_arith(VOP_MUL, v[vd], v[vs1], v[vs2], NULL);
+            return NANOCORE_OK;
+            
+        case 0x33:  // VFMA.F64: vd = vs1 * vs2 + vs3, vs3 in [10:7]
+            {
+                uint64_t acc[4];
+                memcpy(acc, v[((uint16_t)op->imm >> 7) & 0xF], sizeof(acc));
+                vector_arith(VOP_FMA, acc, v[vs1], v[vs2], NULL);
+                memcpy(v[vd], acc, sizeof(acc));
+            }
+            return NANOCORE_OK;
+            
+        case 0x34:  // VLOAD vd, imm(rs1)
+            addr = regs[op->rs1] + (uint64_t)(int64_t)op->imm;
+            if (addr < vm->memory_size && vm->memory_size - addr >= 32) {
+                memcpy(v[vd], vm->memory + addr, 32);
+                if (watch_access(vm, addr, 32, NANOCORE_WATCH_READ)) {
+                    return VECTOR_END_BLOCK;
+                }
+            }
+            return NANOCORE_OK;
+            
+        case 0x35:  // VSTORE vs2, imm(rs1)
+            addr = regs[op->rs1] + (uint64_t)(int64_t)op->imm;
+            if (addr < vm->memory_size && vm->memory_size - addr >= 32) {
+                memcpy(vm->memory + addr, v[vs2], 32);
+                if (PAGE_STORE_SLOW(vm->page_flags[addr >> GUEST_PAGE_SHIFT],
+                                    vm->page_flags[(addr + 31) >> GUEST_PAGE_SHIFT]) &&
+                    guest_store_slow(vm, addr, 32)) {
+                    return VECTOR_END_BLOCK;
+                }
+            }
+            return NANOCORE_OK;
+            
+        case 0x36:  // VBROADCAST vd, rs1; a 32-bit vfunct type splats the low half
+            {
+                uint64_t x = regs[op->rs1];
+                if (VTYPE_NARROW(funct >> 6)) {
+                    x = (x & 0xFFFFFFFF) * 0x0000000100000001ull;
+                }
+                for (int i = 0; i < 4; i++) {
+                    v[vd][i] = x;
+                }
+            }
+            return NANOCORE_OK;
+            
+        case 0x39:  // VOP vd, vs1, vs2
+            return vector_arith(funct, v[vd], v[vs1], v[vs2], pred) ? NANOCORE_OK : NANOCORE_ERROR;
+            
+        case 0x3A:  // VRED rd, vs1
+            {
+                uint64_t result;
+                if (!vector_reduce(funct, v[vs1], pred, &result)) {
+                    return NANOCORE_ERROR;
+                }
+                if (op->rd != 0) {
+                    regs[op->rd] = result;
+                }
+            }
+            return NANOCORE_OK;
+            
+        case 0x3B:  // VGATHER/VSCATTER vd, rs1, vs2
+            return vector_memory(vm, funct, v[vd], v[vs2], regs[op->rs1], pred);
+            
+        default:
+            return NANOCORE_ERROR;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Harts and atomics. Harts sharing a guest RAM run on separate host threads
+// and meet only through memory: LR, SC and the AMOs act on aligned 64-bit
+// words with host atomics, and FENCE is a host fence. Plain stores are not
+// ordered between harts beyond what the host gives. Decoded code, page
+// flags and watchpoints stay per hart, so code another hart writes is seen
+// only after FENCE.I.
+// ---------------------------------------------------------------------------
+
+// FENCE modes, imm[2:0]
+enum {
+    FENCE_FULL = 0,
+    FENCE_ACQUIRE = 1,
+    FENCE_RELEASE = 2,
+    FENCE_ACQ_REL = 3,
+    FENCE_CODE = 4     // FENCE.I
+};
+
+// Drop all of vm's decoded code so it is decoded again from guest RAM
+static void fence_code(vm_instance_t* vm) {
+    uint64_t page_count = GUEST_PAGE_COUNT(vm->memory_size);
+    for (uint64_t page = 0; page < page_count; page++) {
+        if (vm->page_flags[page] & PAGE_FLAG_CODE) {
+            invalidate_code_page(vm, page);
+        }
+    }
+}
+
+// Execute FENCE, LR, SC or an AMO against the GPR file regs. AMOs write the
+// old word to rd; SC writes 0 on success, 1 on failure. Returns NANOCORE_OK,
+// VECTOR_END_BLOCK after FENCE.I, a code write or a watchpoint hit, or
+// NANOCORE_ERROR for an unaligned or out-of-range address or bad mode.
+static int execute_atomic(vm_instance_t* vm, const decoded_op_t* op, uint64_t* regs) {
+    if (op->opcode == 0x28) {  // FENCE
+        switch (op->imm & 7) {
+            case FENCE_FULL:
+                atomic_thread_fence(memory_order_seq_cst);
+                return NANOCORE_OK;
+            case FENCE_ACQUIRE:
+                atomic_thread_fence(memory_order_acquire);
+                return NANOCORE_OK;
+            case FENCE_RELEASE:
+                atomic_thread_fence(memory_order_release);
+                return NANOCORE_OK;
+            case FENCE_ACQ_REL:
+                atomic_thread_fence(memory_order_acq_rel);
+                return NANOCORE_OK;
+            case FENCE_CODE:
+                atomic_thread_fence(memory_order_seq_cst);
+                fence_code(vm);
+                return VECTOR_END_BLOCK;
+            default:
+                return NANOCORE_ERROR;
+        }
+    }
+    
+    uint64_t addr = regs[op->rs1];
+    if ((addr & 7) || addr >= vm->memory_size || vm->memory_size - addr < 8) {
+        return NANOCORE_ERROR;
+    }
+    _Atomic uint64_t* word = (_Atomic uint64_t*)(vm->memory + addr);
+    uint64_t value = regs[op->rs2];
+    uint64_t old;
+    bool loads = true;
+    bool stores = true;
+    
+    switch (op->opcode) {
+        case 0x29:  // LR rd, (rs1)
+            old = atomic_load_explicit(word, memory_order_seq_cst);
+            vm->lr_address = addr;
+            vm->lr_value = old;
+            vm->lr_valid = true;
+            stores = false;
+            break;
+            
+        case 0x2A:  // SC rd, rs2, (rs1): succeeds if the word still holds what LR saw
+            {
+                uint64_t expected = vm->lr_value;
+                stores = vm->lr_valid && vm->lr_address == addr &&
+                         atomic_compare_exchange_strong_explicit(word, &expected, value,
+                                                                 memory_order_seq_cst, memory_order_seq_cst);
+            }
+            vm->lr_valid = false;
+            old = stores ? 0 : 1;
+            loads = false;
+            break;
+            
+        case 0x2B:  // AMOSWAP
+            old = atomic_exchange_explicit(word, value, memory_order_seq_cst);
+            break;
+            
+        case 0x2C:  // AMOADD
+            old = atomic_fetch_add_explicit(word, value, memory_order_seq_cst);
+            break;
+            
+        case 0x2D:  // AMOAND
+            old = atomic_fetch_and_explicit(word, value, memory_order_seq_cst);
+            break;
+            
+        case 0x2E:  // AMOOR
+            old = atomic_fetch_or_explicit(word, value, memory_order_seq_cst);
+            break;
+            
+        default:    // AMOXOR
+            old = atomic_fetch_xor_explicit(word, value, memory_order_seq_cst);
+            break;
+    }
+    if (op->rd != 0) {
+        regs[op->rd] = old;
+    }
+    
+    bool hit = loads && watch_access(vm, addr, 8, NANOCORE_WATCH_READ);
+    uint8_t flags = vm->page_flags[addr >> GUEST_PAGE_SHIFT];
+    if (stores && PAGE_STORE_SLOW(flags, flags) && guest_store_slow(vm, addr, 8)) {
+        hit = true;
+    }
+    return hit ? VECTOR_END_BLOCK : NANOCORE_OK;
+}
+
+// ---------------------------------------------------------------------------
+// Interrupts. Devices and other host threads raise a vector by setting its
+// bit in irq_pending, then irq_signal. The engines test irq_signal once per
+// block: run_engine at each block boundary and translated code on block
+// entry, so a run without interrupts pays one load per block and nothing
+// per instruction. A set signal is taken at the next boundary. If FLAGS.IE
+// is set, the lowest pending vector is delivered: PC and FLAGS go to the
+// shadow registers, IE is cleared and the guest jumps to VBASE + vector * 8.
+// IRET restores both. With IE clear the signal is dropped and vectors stay
+// pending until IRET or nanocore_vm_set_interrupts sets IE again.
+//
+// The timer device raises NANOCORE_IRQ_TIMER on host monotonic time. One
+// host thread serves every armed timer, sleeping until the nearest deadline.
+// Ring devices raise NANOCORE_IRQ_RING0 + ring per batch of completions, and
+// every taken signal first services the rings, so completions reach guest
+// RAM before the handler runs.
+// ---------------------------------------------------------------------------
+
+// Interrupt vectors (docs/isa_spec.md); 0-2 are synchronous exceptions
+#define NANOCORE_IRQ_TIMER 3
+#define NANOCORE_IRQ_EXTERNAL0 4
+#define NANOCORE_IRQ_EXTERNAL1 5
+#define NANOCORE_IRQ_RING0 6  // Ring n raises NANOCORE_IRQ_RING0 + n
+#define NANOCORE_IRQ_VECTORS 32
+
+#define VM_FLAG_IE 0x10  // FLAGS.IE
+
+// Safe from any thread while the VM is alive
+static void irq_raise(vm_instance_t* vm, uint32_t vector) {
+    atomic_fetch_or(&vm->irq_pending, 1u << vector);
+    atomic_store(&vm->irq_signal, 1);
+}
+
+// Signal again if vectors became deliverable
+static void irq_rearm(vm_instance_t* vm) {
+    if ((vm->state.flags & VM_FLAG_IE) && atomic_load(&vm->irq_pending)) {
+        atomic_store(&vm->irq_signal, 1);
+    }
+}
+
+// Deliver the lowest pending vector if FLAGS.IE allows; the PC to continue at
+static uint64_t irq_take(vm_instance_t* vm, uint64_t pc) {
+    // Clearing the signal first means a racing raise signals again
+    atomic_store(&vm->irq_signal, 0);
+    ring_service(vm);
+    uint32_t pending = atomic_load(&vm->irq_pending);
+    if (pending == 0 || !(vm->state.flags & VM_FLAG_IE)) {
+        return pc;
+    }
+    
+    uint32_t vector = 0;
+    while (!(pending & (1u << vector))) {
+        vector++;
+    }
+    atomic_fetch_and(&vm->irq_pending, ~(1u << vector));
+    vm->irq_pc = pc;
+    vm->irq_flags = vm->state.flags;
+    vm->state.flags &= ~(uint64_t)VM_FLAG_IE;
+    return vm->state.vbase + (uint64_t)vector * 8;
+}
+
+// IRET: restore FLAGS from the shadow register; the PC to resume at
+static uint64_t irq_return(vm_instance_t* vm) {
+    vm->state.flags = vm->irq_flags;
+    irq_rearm(vm);
+    return vm->irq_pc;
+}
+
+// Raise an interrupt vector, NANOCORE_IRQ_TIMER up to
+// NANOCORE_IRQ_VECTORS - 1, from any thread, including while the VM runs.
+// Raising a vector that is still pending has no further effect.
+int nanocore_vm_raise_interrupt(int vm_handle, uint32_t vector) {
+    if (vector < NANOCORE_IRQ_TIMER || vector >= NANOCORE_IRQ_VECTORS) {
+        return NANOCORE_EINVAL;
+    }
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm) {
+        return NANOCORE_EINVAL;
+    }
+    
+    irq_raise(vm, vector);
+    return NANOCORE_OK;
+}
+
+// Set VBASE and FLAGS.IE; not while the VM runs
+int nanocore_vm_set_interrupts(int vm_handle, uint64_t vbase, int enable) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || (vbase & 7)) {
+        return NANOCORE_EINVAL;
+    }
+    
+    vm->state.vbase = vbase;
+    if (enable) {
+        vm->state.flags |= VM_FLAG_IE;
+    } else {
+        vm->state.flags &= ~(uint64_t)VM_FLAG_IE;
+    }
+    irq_rearm(vm);
+    return NANOCORE_OK;
+}
+
+#if NANOCORE_TIMER
+// VMs with an armed timer, served by timer_main
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    bool started;
+    vm_instance_t** armed;     // Unordered
+    uint32_t count;
+    uint32_t capacity;
+} timers = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t timer_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Raise the timer vector on every VM whose deadline passed, then sleep
+// until the next one. Runs for the life of the process.
+static void* timer_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&timers.lock);
+    for (;;) {
+        uint64_t now = timer_now();
+        uint64_t next = UINT64_MAX;
+        for (uint32_t i = 0; i < timers.count; i++) {
+            vm_instance_t* vm = timers.armed[i];
+            if (vm->timer_deadline <= now) {
+                irq_raise(vm, NANOCORE_IRQ_TIMER);
+                // Ticks missed while the host was busy merge into this one
+                uint64_t late = now - vm->timer_deadline;
+                vm->timer_deadline += (late / vm->timer_period + 1) * vm->timer_period;
+            }
+            if (vm->timer_deadline < next) {
+                next = vm->timer_deadline;
+            }
+        }
+        
+        if (next == UINT64_MAX) {
+            pthread_cond_wait(&timers.changed, &timers.lock);
+        } else {
+            struct timespec until = { .tv_sec = (time_t)(next / 1000000000u), .tv_nsec = (long)(next % 1000000000u) };
+            pthread_cond_timedwait(&timers.changed, &timers.lock, &until);
+        }
+    }
+    return NULL;
+}
+
+// Drop vm from the armed set; timers.lock must be held
+static void timer_remove_locked(vm_instance_t* vm) {
+    for (uint32_t i = 0; i < timers.count; i++) {
+        if (timers.armed[i] == vm) {
+            timers.armed[i] = timers.armed[--timers.count];
+            break;
+        }
+    }
+    vm->timer_period = 0;
+}
+
+// Start the timer thread on first use; timers.lock must be held
+static bool timer_start_locked(void) {
+    if (timers.started) {
+        return true;
+    }
+    
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timers.changed, &attr);
+    pthread_condattr_destroy(&attr);
+    
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, timer_main, NULL) != 0) {
+        pthread_cond_destroy(&timers.changed);
+        return false;
+    }
+    pthread_detach(thread);
+    timers.started = true;
+    return true;
+}
+
+// Add vm to the armed set; timers.lock must be held
+static int timer_arm_locked(vm_instance_t* vm, uint64_t period_ns) {
+    if (!timer_start_locked()) {
+        return NANOCORE_ERROR;
+    }
+    if (timers.count == timers.capacity) {
+        uint32_t capacity = timers.capacity ? timers.capacity * 2 : 16;
+        vm_instance_t** grown = realloc(timers.armed, capacity * sizeof(*grown));
+        if (!grown) {
+            return NANOCORE_ENOMEM;
+        }
+        timers.armed = grown;
+        timers.capacity = capacity;
+    }
+    
+    vm->timer_period = period_ns;
+    vm->timer_deadline = timer_now() + period_ns;
+    timers.armed[timers.count++] = vm;
+    pthread_cond_signal(&timers.changed);
+    return NANOCORE_OK;
+}
+#endif
+
+static void timer_disarm(vm_instance_t* vm) {
+#if NANOCORE_TIMER
+    // timer_main never changes timer_period, so an unarmed VM needs no lock
+    if (vm->timer_period == 0) {
+        return;
+    }
+    pthread_mutex_lock(&timers.lock);
+    timer_remove_locked(vm);
+    pthread_mutex_unlock(&timers.lock);
+#else
+    (void)vm;
+#endif
+}
+
+// Raise NANOCORE_IRQ_TIMER every period_ns nanoseconds of host monotonic
+// time, the first one period from now; 0 disarms the timer. Ticks the
+// guest has not taken yet merge. NANOCORE_ERROR on hosts without timers.
+int nanocore_vm_set_timer(int vm_handle, uint64_t period_ns) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm) {
+        return NANOCORE_EINVAL;
+    }
+    
+#if NANOCORE_TIMER
+    pthread_mutex_lock(&timers.lock);
+    timer_remove_locked(vm);
+    int result = period_ns ? timer_arm_locked(vm, period_ns) : NANOCORE_OK;
+    pthread_mutex_unlock(&timers.lock);
+    return result;
+#else
+    return period_ns == 0 ? NANOCORE_OK : NANOCORE_ERROR;
+#endif
+}
+
+// Split a 32-bit instruction word into its fields
+static void decode_instruction(uint32_t instruction, decoded_op_t* op) {
+    op->opcode = (instruction >> 26) & 0x3F;
+    op->rd = (instruction >> 21) & 0x1F;
+    op->rs1 = (instruction >> 16) & 0x1F;
+    op->rs2 = (instruction >> 11) & 0x1F;
+    op->imm = (int16_t)(instruction & 0xFFFF);
+    if (op->opcode == 0x1E) {
+        op->imm = (int32_t)(instruction << 6) >> 6;  // CALL: sign-extended imm26
+    }
+}
+
+// True for opcodes that end a basic block
+static bool ends_block(uint8_t opcode) {
+    switch (opcode) {
+        case 0x17:  // BEQ
+        case 0x18:  // BNE
+        case 0x19:  // BLT
+        case 0x1E:  // CALL
+        case 0x1F:  // RET
+        case 0x21:  // HALT
+        case 0x3C:  // IRET
+        case DECODED_BREAK:
+            return true;
+        case 0x00: case 0x01: case 0x02: case 0x04: case 0x05:
+        case 0x06: case 0x07: case 0x08: case 0x0A: case 0x0B:
+        case 0x0F: case 0x13: case 0x22: case 0x37: case 0x38:
+        case 0x30: case 0x31: case 0x32: case 0x33: case 0x34:
+        case 0x35: case 0x36: case 0x39: case 0x3A: case 0x3B:
+        case 0x28: case 0x29: case 0x2A: case 0x2B: case 0x2C:
+        case 0x2D: case 0x2E: case 0x2F:
+            return false;
+        default:
+            return true;  // Unknown opcode faults, so nothing follows it
+    }
+}
+
+// True for opcodes whose only effect is writing rd. Undefined opcodes in
+// the ALU range (0x03, 0x09) are not listed: they must still fault.
+static bool writes_rd(uint8_t opcode) {
+    switch (opcode) {
+        case 0x00: case 0x01: case 0x02:  // ADD, SUB, MUL
+        case 0x04: case 0x05:  // DIV, MOD
+        case 0x06: case 0x07: case 0x08:  // AND, OR, XOR
+        case 0x0A: case 0x0B:  // SHL, SHR
+        case 0x0F:  // LD
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Mark superinstruction pairs, left to right; an op ends at most one pair
+static void fuse_block(decoded_op_t* ops, uint32_t n) {
+    for (uint32_t i = 0; i + 1 < n; i++) {
+        uint8_t fused;
+        switch (ops[i].opcode << 8 | ops[i + 1].opcode) {
+            case 0x0F00: fused = DECODED_LD_ADD; break;
+            case 0x0013: fused = DECODED_ADD_ST; break;
+            case 0x0118: fused = DECODED_SUB_BNE; break;
+            case 0x0019: fused = DECODED_ADD_BLT; break;
+            default: continue;
+        }
+        ops[i++].opcode = fused;
+    }
+}
+
+// Decode and fuse the basic block starting at pc into ops. Returns the
+// op count, 0 if pc is out of bounds.
+static uint32_t decode_ops(const vm_instance_t* vm, uint64_t pc, decoded_op_t* ops) {
+    uint32_t n = 0;
+    
+    while (n < BLOCK_MAX_OPS && pc < vm->memory_size &&
+           vm->memory_size - pc >= (uint64_t)n * 4 + 4) {
+        uint64_t op_pc = pc + (uint64_t)n * 4;
+        if ((vm->page_flags[op_pc >> GUEST_PAGE_SHIFT] & PAGE_FLAG_BREAK) &&
+            breakpoint_test(&vm->breakpoints, op_pc)) {
+            if (n > 0) {
+                break;  // The breakpoint starts a block of its own
+            }
+            ops[n++] = (decoded_op_t){ .opcode = DECODED_BREAK };
+            break;
+        }
+        uint32_t instruction = *(uint32_t*)(vm->memory + op_pc);
+        decoded_op_t* op = &ops[n++];
+        decode_instruction(instruction, op);
+        if (op->rd == 0 && writes_rd(op->opcode)) {
+            op->opcode = 0x22;  // Writes to R0 are discarded, so run it as NOP
+        }
+        if (ends_block(op->opcode)) {
+            break;
+        }
+    }
+    
+    fuse_block(ops, n);
+    return n;
+}
+
+// Decode the basic block starting at pc into a cache slot
+static bool decode_block(vm_instance_t* vm, uint64_t pc, decoded_block_t* block) {
+    uint32_t n = decode_ops(vm, pc, block->ops);
+    if (n == 0) {
+        block->num_ops = 0;
+        return false;  // PC out of bounds
+    }
+    
+    block->pc = pc;
+    block->num_ops = n;
+    block->exec_count = 0;
+    block->jit_code = NULL;
+    
+    // Remember which pages now back decoded code
+    uint64_t first = pc >> GUEST_PAGE_SHIFT;
+    uint64_t last = (pc + n * 4 - 1) >> GUEST_PAGE_SHIFT;
+    for (uint64_t page = first; page <= last; page++) {
+        vm->page_flags[page] |= PAGE_FLAG_CODE;
+    }
+    
+    return true;
+}
+
+// Execute one decoded instruction (PC already points past it)
+static int execute_decoded(vm_instance_t* vm, const decoded_op_t* op) {
+    uint8_t opcode = op->opcode;
+    uint8_t rd = op->rd;
+    uint8_t rs1 = op->rs1;
+    uint8_t rs2 = op->rs2;
+    int32_t imm = op->imm;
+    
+    // Ensure R0 is always zero
+    vm->state.gprs[0] = 0;
+    
+    switch (opcode) {
+        case 0x00:  // ADD
+            if (rd != 0) {
+                vm->state.gprs[rd] = vm->state.gprs[rs1] + vm->state.gprs[rs2];
+            }
+            break;
+            
+        case 0x01:  // SUB
+            if (rd != 0) {
+                vm->state.gprs[rd] = vm->state.gprs[rs1] - vm->state.gprs[rs2];
+            }
+            break;
+            
+        case 0x02:  // MUL
+            if (rd != 0) {
+                vm->state.gprs[rd] = vm->state.gprs[rs1] * vm->state.gprs[rs2];
+            }
+            break;
+            
+        case 0x04:  // DIV
+            if (rd != 0 && vm->state.gprs[rs2] != 0) {
+                vm->state.gprs[rd] = vm->state.gprs[rs1] / vm->state.gprs[rs2];
+            }
+            break;
+            
+        case 0x05:  // MOD
+            if (rd != 0 && vm->state.gprs[rs2] != 0) {
+                vm->state.gprs[rd] = vm->state.gprs[rs1] % vm->state.gprs[rs2];
+            }
+            break;
+            
+        case 0x06:  // AND
+            if (rd != 0) {
+                vm->state.gprs[rd] = vm->state.gprs[rs1] & vm->state.gprs[rs2];
+            }
+            break;
+            
+        case 0x07:  // OR
+            if (rd != 0) {
+                vm->state.gprs[rd] = vm->state.gprs[rs1] | vm->state.gprs[rs2];
+            }
+            break;
+            
+        case 0x08:  // XOR
+            if (rd != 0) {
+                vm->state.gprs[rd] = vm->state.gprs[rs1] ^ vm->state.gprs[rs2];
             }
             break;
             
@@ -209,263 +2579,3568 @@ static int execute_instruction(vm_instance_t* vm, uint32_t instruction) {
             if (rd != 0) {
                 vm->state.gprs[rd] = vm->state.gprs[rs1] >> (vm->state.gprs[rs2] & 63);
             }
-            break;
-            
-        case 0x0F:  // LD (load immediate for now)
-            if (rd != 0) {
-                vm->state.gprs[rd] = (uint64_t)(int64_t)imm;  // Sign extend
+            break;
+            
+        case 0x0F:  // LD (load immediate for now)
+            if (rd != 0) {
+                vm->state.gprs[rd] = (uint64_t)(int64_t)imm;  // Sign extend
+            }
+            break;
+            
+        case 0x13:  // ST (simplified)
+            {
+                uint64_t addr = vm->state.gprs[rs1] + imm;
+                if (addr < vm->memory_size && vm->memory_size - addr >= 8) {
+                    *(uint64_t*)(vm->memory + addr) = vm->state.gprs[rd];
+                    if (PAGE_STORE_SLOW(vm->page_flags[addr >> GUEST_PAGE_SHIFT],
+                                        vm->page_flags[(addr + 7) >> GUEST_PAGE_SHIFT])) {
+                        guest_store_slow(vm, addr, 8);
+                    }
+                }
+            }
+            break;
+            
+        case 0x37:  // MCOPY
+            guest_copy(vm, vm->state.gprs[rd], vm->state.gprs[rs1], vm->state.gprs[rs2]);
+            break;
+            
+        case 0x38:  // MFILL
+            guest_fill(vm, vm->state.gprs[rd], (uint8_t)vm->state.gprs[rs1], vm->state.gprs[rs2]);
+            break;
+            
+        case 0x30: case 0x31: case 0x32: case 0x33: case 0x34:
+        case 0x35: case 0x36: case 0x39: case 0x3A: case 0x3B:
+            if (execute_vector(vm, op, vm->state.gprs) == NANOCORE_ERROR) {
+                vm->halted = true;
+                return NANOCORE_ERROR;
+            }
+            break;
+            
+        case 0x28: case 0x29: case 0x2A: case 0x2B:
+        case 0x2C: case 0x2D: case 0x2E: case 0x2F:
+            if (execute_atomic(vm, op, vm->state.gprs) == NANOCORE_ERROR) {
+                vm->halted = true;
+                return NANOCORE_ERROR;
+            }
+            break;
+            
+        case 0x17:  // BEQ
+            if (vm->state.gprs[rd] == vm->state.gprs[rs1]) {
+                vm->state.pc += (imm << 1) - 4;  // PC will be incremented by 4 later
+            }
+            break;
+            
+        case 0x18:  // BNE
+            if (vm->state.gprs[rd] != vm->state.gprs[rs1]) {
+                vm->state.pc += (imm << 1) - 4;
+            }
+            break;
+            
+        case 0x19:  // BLT
+            if ((int64_t)vm->state.gprs[rd] < (int64_t)vm->state.gprs[rs1]) {
+                vm->state.pc += (imm << 1) - 4;
+            }
+            break;
+            
+        case 0x1E:  // CALL: link in R31, target relative to the CALL in words
+            vm->state.gprs[31] = vm->state.pc;
+            vm->state.pc += (imm << 2) - 4;
+            break;
+            
+        case 0x1F:  // RET
+            vm->state.pc = vm->state.gprs[31];
+            break;
+            
+        case 0x21:  // HALT
+            vm->halted = true;
+            vm->state.flags |= 0x80;
+            return EVENT_HALTED;
+            
+        case 0x22:  // NOP
+            break;
+            
+        case 0x3C:  // IRET
+            vm->state.pc = irq_return(vm);
+            break;
+            
+        default:
+            // Unknown instruction
+            vm->halted = true;
+            return NANOCORE_ERROR;
+    }
+    
+    // Update performance counters
+    vm->state.perf_counters[0]++;  // Instruction count
+    vm->state.perf_counters[1]++;  // Cycle count
+    
+    return NANOCORE_OK;
+}
+
+// Decode and execute a single instruction word
+static int execute_instruction(vm_instance_t* vm, uint32_t instruction) {
+    decoded_op_t op;
+    decode_instruction(instruction, &op);
+    return execute_decoded(vm, &op);
+}
+
+// Execute one instruction with full checks (no handle validation)
+static int step_instance(vm_instance_t* vm) {
+    if (vm->halted) {
+        return EVENT_HALTED;
+    }
+    if (atomic_load_explicit(&vm->irq_signal, memory_order_relaxed)) {
+        vm->state.pc = irq_take(vm, vm->state.pc);
+    }
+    
+    // Check bounds; the PC is guest-controlled, so never form pc + 4
+    if (vm->memory_size < 4 || vm->state.pc > vm->memory_size - 4) {
+        vm->halted = true;
+        return NANOCORE_ERROR;
+    }
+    
+    // Check breakpoints
+    if ((vm->page_flags[vm->state.pc >> GUEST_PAGE_SHIFT] & PAGE_FLAG_BREAK) &&
+        breakpoint_test(&vm->breakpoints, vm->state.pc)) {
+        return EVENT_BREAKPOINT;
+    }
+    
+    // Fetch instruction
+    uint32_t instruction = *(uint32_t*)(vm->memory + vm->state.pc);
+    
+    // Execute
+    uint64_t pc = vm->state.pc;
+    vm->state.pc += 4;
+    int result = execute_instruction(vm, instruction);
+    if (vm->profile && result == NANOCORE_OK && !vm->halted) {
+        profile_step(vm->profile, pc, instruction);
+    }
+    if (vm->watch_hit) {
+        vm->watch_hit = false;
+        return result == NANOCORE_OK ? EVENT_WATCHPOINT : result;
+    }
+    return result;
+}
+
+#if NANOCORE_JIT
+// ---------------------------------------------------------------------------
+// Template JIT: each hot decoded block becomes a run of x86-64 templates
+// mirroring the run_engine handlers. Inside translated code r15 holds the
+// guest register file, rbp the jit_ctx_t, and up to four of the block's
+// busiest guest registers live in rbx/r12/r13/r14. Every block entry
+// subtracts its length from ctx->budget (or exits if it can't), so
+// blocks can jump straight into one another and instruction limits stay
+// exact.
+// ---------------------------------------------------------------------------
+
+#define JIT_CODE_SIZE (4u << 20)
+#define JIT_BLOCK_RESERVE 8192  // Generous upper bound for one block
+
+// Exit reasons reported through jit_ctx_t.status
+enum {
+    JIT_EXIT_CONTINUE = 0,
+    JIT_EXIT_HALT = 1,
+    JIT_EXIT_ERROR = 2
+};
+
+// State shared between run_engine and translated code
+typedef struct {
+    uint64_t budget;        // Instructions left to retire
+    uint64_t pc;            // Guest PC to resume at
+    int32_t* link;          // Unpatched chain jump that caused the exit
+    vm_instance_t* vm;
+    int32_t status;         // JIT_EXIT_*
+} jit_ctx_t;
+
+typedef void (*jit_enter_fn)(uint64_t* regs, jit_ctx_t* ctx, const uint8_t* entry);
+
+// x86-64 register numbers
+enum {
+    HOST_RAX = 0, HOST_RCX = 1, HOST_RDX = 2, HOST_RBX = 3,
+    HOST_RSP = 4, HOST_RBP = 5, HOST_RSI = 6, HOST_RDI = 7,
+    HOST_R12 = 12, HOST_R13 = 13, HOST_R14 = 14, HOST_R15 = 15
+};
+
+// Callee-saved registers available for pinning guest registers
+static const int jit_pin_regs[] = { HOST_RBX, HOST_R12, HOST_R13, HOST_R14 };
+#define JIT_NUM_PINS ((int)(sizeof(jit_pin_regs) / sizeof(jit_pin_regs[0])))
+
+// Code emission state for one block
+typedef struct {
+    uint8_t* p;
+    uint8_t* epilogue;
+    int8_t pin[32];         // Host register per guest register, -1 = memory
+    uint32_t dirty;         // Guest registers the block writes
+} jit_emit_t;
+
+static void emit8(jit_emit_t* e, uint8_t b) {
+    *e->p++ = b;
+}
+
+static void emit32(jit_emit_t* e, uint32_t v) {
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+
+static void emit64(jit_emit_t* e, uint64_t v) {
+    memcpy(e->p, &v, 8);
+    e->p += 8;
+}
+
+// Point a rel32 field at target
+static void jit_patch_rel32(uint8_t* rel, const uint8_t* target) {
+    int32_t disp = (int32_t)(target - (rel + 4));
+    memcpy(rel, &disp, 4);
+}
+
+// REX.W prefix for a ModRM reg/rm pair
+static void emit_rex_w(jit_emit_t* e, int reg, int rm) {
+    emit8(e, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// ModRM and displacement for [base + disp]
+static void emit_mem(jit_emit_t* e, int reg, int base, int32_t disp) {
+    bool short_disp = disp >= -128 && disp <= 127;
+    emit8(e, (short_disp ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == HOST_RSP) {
+        emit8(e, 0x24);  // SIB: no index
+    }
+    if (short_disp) {
+        emit8(e, (uint8_t)disp);
+    } else {
+        emit32(e, (uint32_t)disp);
+    }
+}
+
+// <opcode> dst, src for the r/m64, r64 ALU forms (mov/add/sub/and/or/xor/cmp/test)
+static void emit_rr(jit_emit_t* e, uint8_t opcode, int dst, int src) {
+    emit_rex_w(e, src, dst);
+    emit8(e, opcode);
+    emit8(e, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// <opcode> reg, [base + disp] or [base + disp], reg
+static void emit_rm(jit_emit_t* e, uint8_t opcode, int reg, int base, int32_t disp) {
+    emit_rex_w(e, reg, base);
+    emit8(e, opcode);
+    emit_mem(e, reg, base, disp);
+}
+
+// <group1 ext> qword [rbp + disp], imm32
+static void emit_ctx_imm(jit_emit_t* e, int ext, int32_t disp, uint32_t imm) {
+    emit_rex_w(e, 0, HOST_RBP);
+    emit8(e, 0x81);
+    emit_mem(e, ext, HOST_RBP, disp);
+    emit32(e, imm);
+}
+
+// mov reg, imm64
+static void emit_mov_imm64(jit_emit_t* e, int reg, uint64_t imm) {
+    emit8(e, 0x48 | (reg >> 3));
+    emit8(e, 0xB8 + (reg & 7));
+    emit64(e, imm);
+}
+
+// jcc rel32 with a placeholder target; returns the rel32 field
+static uint8_t* emit_jcc(jit_emit_t* e, uint8_t cc) {
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | cc);
+    uint8_t* rel = e->p;
+    emit32(e, 0);
+    return rel;
+}
+
+// jmp rel32 to target
+static void emit_jmp(jit_emit_t* e, const uint8_t* target) {
+    emit8(e, 0xE9);
+    uint8_t* rel = e->p;
+    emit32(e, 0);
+    jit_patch_rel32(rel, target);
+}
+
+// Copy a guest register into a host register
+static void jit_load_guest(jit_emit_t* e, int host, int guest) {
+    if (guest == 0) {
+        emit_rr(e, 0x31, host, host);  // xor host, host
+    } else if (e->pin[guest] >= 0) {
+        emit_rr(e, 0x89, host, e->pin[guest]);
+    } else {
+        emit_rm(e, 0x8B, host, HOST_R15, guest * 8);
+    }
+}
+
+// Copy a host register into a guest register
+static void jit_store_guest(jit_emit_t* e, int guest, int host) {
+    if (e->pin[guest] >= 0) {
+        emit_rr(e, 0x89, e->pin[guest], host);
+    } else {
+        emit_rm(e, 0x89, host, HOST_R15, guest * 8);
+    }
+}
+
+// Flush modified pinned registers back to the register file
+static void jit_emit_writeback(jit_emit_t* e) {
+    for (int g = 1; g < 32; g++) {
+        if (e->pin[g] >= 0 && (e->dirty & (1u << g))) {
+            emit_rm(e, 0x89, e->pin[g], HOST_R15, g * 8);
+        }
+    }
+}
+
+// Record the resume PC in the context
+static void jit_emit_set_pc(jit_emit_t* e, uint64_t pc) {
+    emit_mov_imm64(e, HOST_RAX, pc);
+    emit_rm(e, 0x89, HOST_RAX, HOST_RBP, offsetof(jit_ctx_t, pc));
+}
+
+// Leave translated code, refunding the budget of ops that did not run
+static void jit_emit_exit(jit_emit_t* e, uint64_t pc, int status, uint32_t refund) {
+    jit_emit_writeback(e);
+    if (refund) {
+        emit_ctx_imm(e, 0, offsetof(jit_ctx_t, budget), refund);  // add
+    }
+    jit_emit_set_pc(e, pc);
+    if (status != JIT_EXIT_CONTINUE) {
+        emit8(e, 0xC7);  // mov dword [rbp + status], imm32
+        emit_mem(e, 0, HOST_RBP, offsetof(jit_ctx_t, status));
+        emit32(e, (uint32_t)status);
+    }
+    emit_jmp(e, e->epilogue);
+}
+
+// Exit to a successor block through a jump run_engine can later patch
+// to go straight to the successor's translation
+static void jit_emit_chain(jit_emit_t* e, uint64_t pc) {
+    jit_emit_writeback(e);
+    emit8(e, 0xE9);  // jmp rel32, initially to the next instruction
+    uint8_t* link = e->p;
+    emit32(e, 0);
+    jit_emit_set_pc(e, pc);
+    emit8(e, 0x48);  // lea rax, [rip + link]
+    emit8(e, 0x8D);
+    emit8(e, 0x05);
+    jit_patch_rel32(e->p, link);
+    e->p += 4;
+    emit_rm(e, 0x89, HOST_RAX, HOST_RBP, offsetof(jit_ctx_t, link));
+    emit_jmp(e, e->epilogue);
+}
+
+// Store called from translated code; returns 1 when it hit decoded code
+// or a watchpoint
+static int jit_store(jit_ctx_t* ctx, uint64_t addr, uint64_t value) {
+    vm_instance_t* vm = ctx->vm;
+    
+    if (addr < vm->memory_size && vm->memory_size - addr >= 8) {
+        *(uint64_t*)(vm->memory + addr) = value;
+        if (PAGE_STORE_SLOW(vm->page_flags[addr >> GUEST_PAGE_SHIFT],
+                            vm->page_flags[(addr + 7) >> GUEST_PAGE_SHIFT])) {
+            return guest_store_slow(vm, addr, 8);
+        }
+    }
+    return 0;
+}
+
+// MCOPY/MFILL helpers called from translated code; nonzero if code or a
+// watchpoint was hit
+static int jit_copy(jit_ctx_t* ctx, uint64_t dst, uint64_t src, uint64_t len) {
+    return guest_copy(ctx->vm, dst, src, len);
+}
+
+static int jit_fill(jit_ctx_t* ctx, uint64_t dst, uint64_t value, uint64_t len) {
+    return guest_fill(ctx->vm, dst, (uint8_t)value, len);
+}
+
+// Vector ops called from translated code with the register file written
+// back: 0 to continue, 1 when a store hit decoded code, -1 on a fault
+static int jit_vector(jit_ctx_t* ctx, uint64_t instruction, uint64_t* regs) {
+    decoded_op_t op;
+    decode_instruction((uint32_t)instruction, &op);
+    return execute_vector(ctx->vm, &op, regs);
+}
+
+// IRET called from translated code; returns the PC to resume at
+static uint64_t jit_iret(jit_ctx_t* ctx) {
+    return irq_return(ctx->vm);
+}
+
+// FENCE, LR, SC and AMOs, called like jit_vector
+static int jit_atomic(jit_ctx_t* ctx, uint64_t instruction, uint64_t* regs) {
+    decoded_op_t op;
+    decode_instruction((uint32_t)instruction, &op);
+    return execute_atomic(ctx->vm, &op, regs);
+}
+
+// Emit the shared entry trampoline and exit epilogue
+static void jit_emit_trampoline(jit_cache_t* jit) {
+    static const uint8_t enter[] = {
+        0x55, 0x53,                 // push rbp; push rbx
+        0x41, 0x54, 0x41, 0x55,     // push r12; push r13
+        0x41, 0x56, 0x41, 0x57,     // push r14; push r15
+        0x48, 0x83, 0xEC, 0x08,     // sub rsp, 8 (keep helper calls aligned)
+        0x49, 0x89, 0xFF,           // mov r15, rdi (guest registers)
+        0x48, 0x89, 0xF5,           // mov rbp, rsi (context)
+        0xFF, 0xE2,                 // jmp rdx (block entry)
+    };
+    static const uint8_t leave[] = {
+        0x48, 0x83, 0xC4, 0x08,     // add rsp, 8
+        0x41, 0x5F, 0x41, 0x5E,     // pop r15; pop r14
+        0x41, 0x5D, 0x41, 0x5C,     // pop r13; pop r12
+        0x5B, 0x5D, 0xC3,           // pop rbx; pop rbp; ret
+    };
+    
+    memcpy(jit->code, enter, sizeof(enter));
+    jit->epilogue = jit->code + sizeof(enter);
+    memcpy(jit->epilogue, leave, sizeof(leave));
+    jit->trampoline_size = sizeof(enter) + sizeof(leave);
+    jit->used = jit->trampoline_size;
+}
+
+// Flip the pages holding [at, at + len) of the code cache between writable
+// and executable; no page is ever both
+static bool jit_protect(uint8_t* at, size_t len, bool writable) {
+    static long host_page;
+    if (!host_page) {
+        host_page = sysconf(_SC_PAGESIZE);
+    }
+    uintptr_t mask = (uintptr_t)host_page - 1;
+    uintptr_t start = (uintptr_t)at & ~mask;
+    uintptr_t end = ((uintptr_t)at + len + mask) & ~mask;
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+    return mprotect((void*)start, end - start, prot) == 0;
+}
+
+// Map the code cache for a VM. Pages are only made writable while run_engine
+// emits a block or patches a chain jump, and go back to read+execute after.
+static jit_cache_t* jit_create(uint32_t threshold) {
+    jit_cache_t* jit = calloc(1, sizeof(jit_cache_t));
+    if (!jit) {
+        return NULL;
+    }
+    
+    void* code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    
+    jit->code = code;
+    jit->size = JIT_CODE_SIZE;
+    jit->threshold = threshold;
+    jit_emit_trampoline(jit);
+    if (!jit_protect(jit->code, JIT_CODE_SIZE, false)) {
+        munmap(code, JIT_CODE_SIZE);
+        free(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+static void jit_destroy(jit_cache_t* jit) {
+    if (!jit) {
+        return;
+    }
+    munmap(jit->code, jit->size);
+    free(jit);
+}
+
+// Drop every translation; chain jumps go with the code that holds them
+static void jit_flush(vm_instance_t* vm) {
+    jit_cache_t* jit = vm->jit;
+    
+    if (vm->block_cache) {
+        for (int i = 0; i < BLOCK_CACHE_ENTRIES; i++) {
+            vm->block_cache[i].jit_code = NULL;
+        }
+    }
+    jit->used = jit->trampoline_size;
+    jit->flush_pending = false;
+}
+
+// Pick the block's most referenced guest registers for host registers
+static void jit_assign_pins(jit_emit_t* e, const decoded_block_t* block) {
+    uint32_t uses[32] = {0};
+    
+    for (uint32_t i = 0; i < block->num_ops; i++) {
+        decoded_op_t real = block->ops[i];
+        real.opcode = decoded_opcode(real.opcode);
+        const decoded_op_t* op = &real;
+        switch (op->opcode) {
+            case 0x00: case 0x01: case 0x02: case 0x04: case 0x05:
+            case 0x06: case 0x07: case 0x08: case 0x0A: case 0x0B:
+            case 0x37: case 0x38:
+                uses[op->rs2]++;
+                // Fall through
+            case 0x13: case 0x17: case 0x18: case 0x19:
+                uses[op->rs1]++;
+                // Fall through
+            case 0x0F:
+                uses[op->rd]++;
+                break;
+            default:
+                break;
+        }
+        if (writes_rd(op->opcode)) {
+            e->dirty |= 1u << op->rd;
+        } else if (op->opcode == 0x1E) {
+            e->dirty |= 1u << 31;  // CALL links in R31
+        }
+    }
+    uses[0] = 0;  // R0 is materialized with xor, never pinned
+    
+    memset(e->pin, -1, sizeof(e->pin));
+    for (int n = 0; n < JIT_NUM_PINS; n++) {
+        int best = 0;
+        for (int g = 1; g < 32; g++) {
+            if (e->pin[g] < 0 && uses[g] > uses[best]) {
+                best = g;
+            }
+        }
+        if (uses[best] < 2) {
+            break;  // A single use isn't worth the load and writeback
+        }
+        e->pin[best] = (int8_t)jit_pin_regs[n];
+    }
+}
+
+// Translate one decoded block; the caller makes sure the cache is writable
+// and has JIT_BLOCK_RESERVE bytes free
+static void jit_compile(vm_instance_t* vm, decoded_block_t* block) {
+    jit_cache_t* jit = vm->jit;
+    
+    jit_emit_t e = { .p = jit->code + jit->used, .epilogue = jit->epilogue };
+    uint8_t* entry = e.p;
+    uint32_t n = block->num_ops;
+    
+    jit_assign_pins(&e, block);
+    
+    // Entry: claim the whole block from the budget, or bail out untouched
+    // if the budget is short or an interrupt is signalled
+    emit_mov_imm64(&e, HOST_RAX, (uint64_t)(uintptr_t)&vm->irq_signal);
+    emit8(&e, 0x83);  // cmp dword [rax], 0
+    emit8(&e, 0x38);
+    emit8(&e, 0x00);
+    uint8_t* signalled = emit_jcc(&e, 0x5);                // jne
+    emit_ctx_imm(&e, 7, offsetof(jit_ctx_t, budget), n);  // cmp
+    uint8_t* enough = emit_jcc(&e, 0x3);                   // jae
+    jit_patch_rel32(signalled, e.p);
+    jit_emit_set_pc(&e, block->pc);
+    emit_jmp(&e, e.epilogue);
+    jit_patch_rel32(enough, e.p);
+    emit_ctx_imm(&e, 5, offsetof(jit_ctx_t, budget), n);  // sub
+    
+    for (int g = 1; g < 32; g++) {
+        if (e.pin[g] >= 0) {
+            emit_rm(&e, 0x8B, e.pin[g], HOST_R15, g * 8);
+        }
+    }
+    
+    for (uint32_t i = 0; i < n; i++) {
+        decoded_op_t real = block->ops[i];  // Translate pairs as their two ops
+        real.opcode = decoded_opcode(real.opcode);
+        const decoded_op_t* op = &real;
+        uint64_t op_pc = block->pc + (uint64_t)i * 4;
+        uint8_t* skip;
+        
+        switch (op->opcode) {
+            case 0x00:  // ADD
+            case 0x01:  // SUB
+            case 0x06:  // AND
+            case 0x07:  // OR
+            case 0x08:  // XOR
+                {
+                    static const uint8_t alu[] = {
+                        [0x00] = 0x01, [0x01] = 0x29, [0x06] = 0x21, [0x07] = 0x09, [0x08] = 0x31
+                    };
+                    jit_load_guest(&e, HOST_RAX, op->rs1);
+                    jit_load_guest(&e, HOST_RCX, op->rs2);
+                    emit_rr(&e, alu[op->opcode], HOST_RAX, HOST_RCX);
+                    jit_store_guest(&e, op->rd, HOST_RAX);
+                }
+                break;
+                
+            case 0x02:  // MUL
+                jit_load_guest(&e, HOST_RAX, op->rs1);
+                jit_load_guest(&e, HOST_RCX, op->rs2);
+                emit8(&e, 0x48);  // imul rax, rcx
+                emit8(&e, 0x0F);
+                emit8(&e, 0xAF);
+                emit8(&e, 0xC1);
+                jit_store_guest(&e, op->rd, HOST_RAX);
+                break;
+                
+            case 0x04:  // DIV
+            case 0x05:  // MOD
+                jit_load_guest(&e, HOST_RCX, op->rs2);
+                emit_rr(&e, 0x85, HOST_RCX, HOST_RCX);  // test rcx, rcx
+                skip = emit_jcc(&e, 0x4);                // jz: rd unchanged
+                jit_load_guest(&e, HOST_RAX, op->rs1);
+                emit8(&e, 0x31);  // xor edx, edx
+                emit8(&e, 0xD2);
+                emit8(&e, 0x48);  // div rcx
+                emit8(&e, 0xF7);
+                emit8(&e, 0xF1);
+                jit_store_guest(&e, op->rd, op->opcode == 0x04 ? HOST_RAX : HOST_RDX);
+                jit_patch_rel32(skip, e.p);
+                break;
+                
+            case 0x0A:  // SHL
+            case 0x0B:  // SHR (x86 masks the count to 6 bits, as the ISA does)
+                jit_load_guest(&e, HOST_RAX, op->rs1);
+                jit_load_guest(&e, HOST_RCX, op->rs2);
+                emit8(&e, 0x48);  // shl/shr rax, cl
+                emit8(&e, 0xD3);
+                emit8(&e, op->opcode == 0x0A ? 0xE0 : 0xE8);
+                jit_store_guest(&e, op->rd, HOST_RAX);
+                break;
+                
+            case 0x0F:  // LD (load immediate)
+                if (e.pin[op->rd] >= 0) {
+                    emit_rex_w(&e, 0, e.pin[op->rd]);  // mov pin, simm32
+                    emit8(&e, 0xC7);
+                    emit8(&e, 0xC0 | (e.pin[op->rd] & 7));
+                } else {
+                    emit_rm(&e, 0xC7, 0, HOST_R15, op->rd * 8);  // mov qword [r15 + rd*8], simm32
+                }
+                emit32(&e, (uint32_t)op->imm);
+                break;
+                
+            case 0x13:  // ST
+                jit_load_guest(&e, HOST_RSI, op->rs1);
+                emit_rex_w(&e, 0, HOST_RSI);  // add rsi, simm32
+                emit8(&e, 0x81);
+                emit8(&e, 0xC6);
+                emit32(&e, (uint32_t)op->imm);
+                jit_load_guest(&e, HOST_RDX, op->rd);
+                emit_rr(&e, 0x89, HOST_RDI, HOST_RBP);
+                emit_mov_imm64(&e, HOST_RAX, (uint64_t)(uintptr_t)&jit_store);
+                emit8(&e, 0xFF);  // call rax
+                emit8(&e, 0xD0);
+                emit8(&e, 0x85);  // test eax, eax
+                emit8(&e, 0xC0);
+                skip = emit_jcc(&e, 0x4);  // jz
+                // Self-modifying store: the rest of this block may be stale
+                jit_emit_exit(&e, op_pc + 4, JIT_EXIT_CONTINUE, n - i - 1);
+                jit_patch_rel32(skip, e.p);
+                break;
+                
+            case 0x37:  // MCOPY
+            case 0x38:  // MFILL
+                jit_load_guest(&e, HOST_RSI, op->rd);
+                jit_load_guest(&e, HOST_RDX, op->rs1);
+                jit_load_guest(&e, HOST_RCX, op->rs2);
+                emit_rr(&e, 0x89, HOST_RDI, HOST_RBP);
+                emit_mov_imm64(&e, HOST_RAX, op->opcode == 0x37 ? (uint64_t)(uintptr_t)&jit_copy
+                                                               : (uint64_t)(uintptr_t)&jit_fill);
+                emit8(&e, 0xFF);  // call rax
+                emit8(&e, 0xD0);
+                emit8(&e, 0x85);  // test eax, eax
+                emit8(&e, 0xC0);
+                skip = emit_jcc(&e, 0x4);  // jz
+                jit_emit_exit(&e, op_pc + 4, JIT_EXIT_CONTINUE, n - i - 1);
+                jit_patch_rel32(skip, e.p);
+                break;
+                
+            case 0x30: case 0x31: case 0x32: case 0x33: case 0x34:
+            case 0x35: case 0x36: case 0x39: case 0x3A: case 0x3B:
+            case 0x28: case 0x29: case 0x2A: case 0x2B:
+            case 0x2C: case 0x2D: case 0x2E: case 0x2F:
+                {
+                    uint8_t* fault;
+                    int (*helper)(jit_ctx_t*, uint64_t, uint64_t*) = op->opcode < 0x30 ? jit_atomic : jit_vector;
+                    uint32_t word = ((uint32_t)op->opcode << 26) | ((uint32_t)op->rd << 21) |
+                                    ((uint32_t)op->rs1 << 16) | (uint16_t)op->imm;
+                    jit_emit_writeback(&e);
+                    emit_rr(&e, 0x89, HOST_RDI, HOST_RBP);
+                    emit_mov_imm64(&e, HOST_RSI, word);
+                    emit_rr(&e, 0x89, HOST_RDX, HOST_R15);
+                    emit_mov_imm64(&e, HOST_RAX, (uint64_t)(uintptr_t)helper);
+                    emit8(&e, 0xFF);  // call rax
+                    emit8(&e, 0xD0);
+                    if ((op->opcode == 0x3A || (op->opcode > 0x28 && op->opcode < 0x30)) && e.pin[op->rd] >= 0) {
+                        emit_rm(&e, 0x8B, e.pin[op->rd], HOST_R15, op->rd * 8);  // Reload VRED's or an atomic's rd
+                    }
+                    emit8(&e, 0x85);  // test eax, eax
+                    emit8(&e, 0xC0);
+                    skip = emit_jcc(&e, 0x4);   // jz
+                    fault = emit_jcc(&e, 0x8);  // js
+                    // A store hit decoded code, or FENCE.I: the rest of this block may be stale
+                    jit_emit_exit(&e, op_pc + 4, JIT_EXIT_CONTINUE, n - i - 1);
+                    jit_patch_rel32(fault, e.p);
+                    jit_emit_exit(&e, op_pc + 4, JIT_EXIT_ERROR, n - i);
+                    jit_patch_rel32(skip, e.p);
+                }
+                break;
+                
+            case 0x17:  // BEQ
+            case 0x18:  // BNE
+            case 0x19:  // BLT
+                jit_load_guest(&e, HOST_RAX, op->rd);
+                jit_load_guest(&e, HOST_RCX, op->rs1);
+                emit_rr(&e, 0x39, HOST_RAX, HOST_RCX);  // cmp rax, rcx
+                // Jump over the taken path on the inverse condition (jne/je/jge)
+                skip = emit_jcc(&e, op->opcode == 0x17 ? 0x5 : op->opcode == 0x18 ? 0x4 : 0xD);
+                jit_emit_chain(&e, op_pc + (uint64_t)(int64_t)op->imm * 2);
+                jit_patch_rel32(skip, e.p);
+                jit_emit_chain(&e, op_pc + 4);
+                break;
+                
+            case 0x1E:  // CALL
+                emit_mov_imm64(&e, HOST_RAX, op_pc + 4);
+                jit_store_guest(&e, 31, HOST_RAX);
+                jit_emit_chain(&e, op_pc + (uint64_t)(int64_t)op->imm * 4);
+                break;
+                
+            case 0x1F:  // RET: the target is only known at run time
+                jit_load_guest(&e, HOST_RAX, 31);
+                jit_emit_writeback(&e);
+                emit_rm(&e, 0x89, HOST_RAX, HOST_RBP, offsetof(jit_ctx_t, pc));
+                emit_jmp(&e, e.epilogue);
+                break;
+                
+            case 0x21:  // HALT (not counted as retired)
+                jit_emit_exit(&e, op_pc + 4, JIT_EXIT_HALT, n - i);
+                break;
+                
+            case 0x3C:  // IRET: the target is only known at run time
+                jit_emit_writeback(&e);
+                emit_rr(&e, 0x89, HOST_RDI, HOST_RBP);
+                emit_mov_imm64(&e, HOST_RAX, (uint64_t)(uintptr_t)&jit_iret);
+                emit8(&e, 0xFF);  // call rax
+                emit8(&e, 0xD0);
+                emit_rm(&e, 0x89, HOST_RAX, HOST_RBP, offsetof(jit_ctx_t, pc));
+                emit_jmp(&e, e.epilogue);
+                break;
+                
+            case 0x22:  // NOP
+                break;
+                
+            default:
+                jit_emit_exit(&e, op_pc + 4, JIT_EXIT_ERROR, n - i);
+                break;
+        }
+    }
+    
+    // Block ran out of room or memory before reaching a branch
+    if (!ends_block(block->ops[n - 1].opcode)) {
+        jit_emit_chain(&e, block->pc + (uint64_t)n * 4);
+    }
+    
+    jit->used = (size_t)(e.p - jit->code);
+    block->jit_code = entry;
+}
+
+#endif
+
+// Computed-goto dispatch where the compiler supports it
+#if defined(__GNUC__) || defined(__clang__)
+#define NANOCORE_THREADED_DISPATCH 1
+#else
+#define NANOCORE_THREADED_DISPATCH 0
+#endif
+
+#if NANOCORE_THREADED_DISPATCH
+#define DISPATCH() goto *dispatch_table[op->opcode]
+#define HANDLER(opcode, label) label:
+#define HANDLER_ALSO(opcode)
+#define HANDLER_DEFAULT(label) label:
+#define NEXT_FUSED(label) do { if (++op == end) goto block_done; goto label; } while (0)
+#else
+#define DISPATCH() goto dispatch
+#define HANDLER(opcode, label) case opcode:
+#define HANDLER_ALSO(opcode) case opcode:
+#define HANDLER_DEFAULT(label) default:
+#define NEXT_FUSED(label) NEXT()
+#endif
+
+// Advance to the next op of the current block
+#define NEXT() do { if (++op == end) goto block_done; DISPATCH(); } while (0)
+
+// Fast run engine: executes decoded blocks with the register file,
+// PC and memory bounds hoisted into locals. Handles the instruction
+// limit by truncating the final block instead of counting per op.
+// Blocks that have been translated run natively when the whole block
+// fits in the remaining budget.
+static int run_engine(vm_instance_t* vm, uint64_t max_instructions) {
+#if NANOCORE_THREADED_DISPATCH
+    static const void* const dispatch_table[DECODED_OPCODES] = {
+        &&op_add, &&op_sub, &&op_mul, &&op_illegal,  // 0x00
+        &&op_div, &&op_mod, &&op_and, &&op_or,  // 0x04
+        &&op_xor, &&op_illegal, &&op_shl, &&op_shr,  // 0x08
+        &&op_illegal, &&op_illegal, &&op_illegal, &&op_ld,  // 0x0C
+        &&op_illegal, &&op_illegal, &&op_illegal, &&op_st,  // 0x10
+        &&op_illegal, &&op_illegal, &&op_illegal, &&op_beq,  // 0x14
+        &&op_bne, &&op_blt, &&op_illegal, &&op_illegal,  // 0x18
+        &&op_illegal, &&op_illegal, &&op_call, &&op_ret,  // 0x1C
+        &&op_illegal, &&op_halt, &&op_nop, &&op_illegal,  // 0x20
+        &&op_illegal, &&op_illegal, &&op_illegal, &&op_illegal,  // 0x24
+        &&op_atomic, &&op_atomic, &&op_atomic, &&op_atomic,  // 0x28
+        &&op_atomic, &&op_atomic, &&op_atomic, &&op_atomic,  // 0x2C
+        &&op_vector, &&op_vector, &&op_vector, &&op_vector,  // 0x30
+        &&op_vector, &&op_vector, &&op_vector, &&op_mcopy,  // 0x34
+        &&op_mfill, &&op_vector, &&op_vector, &&op_vector,  // 0x38
+        &&op_iret, &&op_illegal, &&op_illegal, &&op_illegal,  // 0x3C
+        &&op_break,  // DECODED_BREAK
+        &&op_ld_add, &&op_add_st, &&op_sub_bne, &&op_add_blt,  // Superinstructions
+    };
+#endif
+    
+    if (!vm->block_cache) {
+        vm->block_cache = calloc(BLOCK_CACHE_ENTRIES, sizeof(decoded_block_t));
+        if (!vm->block_cache) {
+            return NANOCORE_ENOMEM;
+        }
+    }
+    
+    uint64_t regs[32];
+    memcpy(regs, vm->state.gprs, sizeof(regs));
+    regs[0] = 0;
+    
+    decoded_block_t* const cache = vm->block_cache;
+    uint8_t* const memory = vm->memory;
+    uint8_t* const page_flags = vm->page_flags;
+    const uint64_t memory_size = vm->memory_size;
+    uint64_t pc = vm->state.pc;
+    uint64_t remaining = max_instructions ? max_instructions : UINT64_MAX;
+    uint64_t retired = 0;
+    int result = NANOCORE_OK;
+    
+    decoded_block_t* block;
+    const decoded_op_t* op;
+    const decoded_op_t* end;
+    
+    profile_t* const profile = vm->profile;
+    const decoded_block_t* profiled = NULL;  // Block whose retired ops are not yet accounted
+    uint64_t profiled_from = 0;
+    
+#if NANOCORE_JIT
+    // Translated blocks chain past run_engine, so profiling interprets
+    jit_cache_t* const jit = profile ? NULL : vm->jit;
+    int32_t* chain_link = NULL;  // Chain jump to patch once the next block is known
+#endif
+    
+next_block:
+    if (profiled) {
+        profile_block(profile, profiled, retired - profiled_from);
+        profiled = NULL;
+    }
+    if (remaining == 0 || vm->watch_hit) {
+        goto done;
+    }
+    if (atomic_load_explicit(&vm->irq_signal, memory_order_relaxed)) {
+        pc = irq_take(vm, pc);
+#if NANOCORE_JIT
+        chain_link = NULL;  // The exit that led here was headed for the old PC
+#endif
+    }
+    
+    block = &cache[(pc >> 2) & (BLOCK_CACHE_ENTRIES - 1)];
+    if (block->num_ops == 0 || block->pc != pc) {
+        if (!decode_block(vm, pc, block)) {
+            vm->halted = true;
+            result = NANOCORE_ERROR;
+            goto done;
+        }
+    }
+    block->exec_count++;
+    
+#if NANOCORE_JIT
+    if (jit) {
+        bool compile = !block->jit_code && block->exec_count >= jit->threshold &&
+                       block->ops[0].opcode != DECODED_BREAK;
+        if (compile && jit->size - jit->used < JIT_BLOCK_RESERVE) {
+            jit->flush_pending = true;  // Out of space: start over
+        }
+        if (jit->flush_pending) {
+            jit_flush(vm);
+            chain_link = NULL;  // It pointed into the code just dropped
+        }
+        
+        uint8_t* const at = jit->code + jit->used;
+        bool sealed = true;  // Written pages are executable again
+        if (compile && jit_protect(at, JIT_BLOCK_RESERVE, true)) {
+            jit_compile(vm, block);
+            sealed = jit_protect(at, JIT_BLOCK_RESERVE, false);
+        }
+        
+        // Let the previous exit jump straight here next time
+        if (sealed && chain_link && block->jit_code &&
+            jit_protect((uint8_t*)chain_link, 4, true)) {
+            jit_patch_rel32((uint8_t*)chain_link, block->jit_code);
+            sealed = jit_protect((uint8_t*)chain_link, 4, false);
+        }
+        chain_link = NULL;
+        if (!sealed) {
+            vm->halted = true;
+            result = NANOCORE_ERROR;
+            goto done;
+        }
+        
+        if (block->jit_code && remaining >= block->num_ops) {
+            jit_ctx_t ctx = { .budget = remaining, .pc = pc, .vm = vm };
+            ((jit_enter_fn)(void*)jit->code)(regs, &ctx, block->jit_code);
+            
+            retired += remaining - ctx.budget;
+            remaining = ctx.budget;
+            pc = ctx.pc;
+            
+            if (ctx.status == JIT_EXIT_HALT) {
+                vm->halted = true;
+                vm->state.flags |= 0x80;
+                result = EVENT_HALTED;
+                goto done;
+            }
+            if (ctx.status == JIT_EXIT_ERROR) {
+                vm->halted = true;
+                result = NANOCORE_ERROR;
+                goto done;
+            }
+            chain_link = ctx.link;
+            goto next_block;
+        }
+    }
+#endif
+    
+    op = block->ops;
+    end = op + (block->num_ops < remaining ? block->num_ops : remaining);
+    if (profile) {
+        profiled = block;
+        profiled_from = retired;
+    }
+    
+#if NANOCORE_THREADED_DISPATCH
+    DISPATCH();
+#else
+dispatch:
+    switch (op->opcode) {
+#endif
+    
+    HANDLER(0x00, op_add)
+        regs[op->rd] = regs[op->rs1] + regs[op->rs2];
+        NEXT();
+    
+    HANDLER(0x01, op_sub)
+        regs[op->rd] = regs[op->rs1] - regs[op->rs2];
+        NEXT();
+    
+    HANDLER(0x02, op_mul)
+        regs[op->rd] = regs[op->rs1] * regs[op->rs2];
+        NEXT();
+    
+    HANDLER(0x04, op_div)
+        if (regs[op->rs2] != 0) {
+            regs[op->rd] = regs[op->rs1] / regs[op->rs2];
+        }
+        NEXT();
+    
+    HANDLER(0x05, op_mod)
+        if (regs[op->rs2] != 0) {
+            regs[op->rd] = regs[op->rs1] % regs[op->rs2];
+        }
+        NEXT();
+    
+    HANDLER(0x06, op_and)
+        regs[op->rd] = regs[op->rs1] & regs[op->rs2];
+        NEXT();
+    
+    HANDLER(0x07, op_or)
+        regs[op->rd] = regs[op->rs1] | regs[op->rs2];
+        NEXT();
+    
+    HANDLER(0x08, op_xor)
+        regs[op->rd] = regs[op->rs1] ^ regs[op->rs2];
+        NEXT();
+    
+    HANDLER(0x0A, op_shl)
+        regs[op->rd] = regs[op->rs1] << (regs[op->rs2] & 63);
+        NEXT();
+    
+    HANDLER(0x0B, op_shr)
+        regs[op->rd] = regs[op->rs1] >> (regs[op->rs2] & 63);
+        NEXT();
+    
+    HANDLER(0x0F, op_ld)
+        regs[op->rd] = (uint64_t)(int64_t)op->imm;
+        NEXT();
+    
+    HANDLER(0x13, op_st)
+        {
+            uint64_t addr = regs[op->rs1] + (uint64_t)(int64_t)op->imm;
+            if (addr < memory_size && memory_size - addr >= 8) {
+                *(uint64_t*)(memory + addr) = regs[op->rd];
+                if (PAGE_STORE_SLOW(page_flags[addr >> GUEST_PAGE_SHIFT],
+                                    page_flags[(addr + 7) >> GUEST_PAGE_SHIFT]) &&
+                    guest_store_slow(vm, addr, 8)) {
+                    // Self-modifying or watched store: stop the block here
+                    op++;
+                    goto block_done;
+                }
+            }
+        }
+        NEXT();
+    
+    HANDLER(0x37, op_mcopy)
+        if (guest_copy(vm, regs[op->rd], regs[op->rs1], regs[op->rs2])) {
+            op++;
+            goto block_done;
+        }
+        NEXT();
+    
+    HANDLER(0x38, op_mfill)
+        if (guest_fill(vm, regs[op->rd], (uint8_t)regs[op->rs1], regs[op->rs2])) {
+            op++;
+            goto block_done;
+        }
+        NEXT();
+    
+    HANDLER_ALSO(0x30) HANDLER_ALSO(0x31) HANDLER_ALSO(0x32) HANDLER_ALSO(0x33)
+    HANDLER_ALSO(0x34) HANDLER_ALSO(0x35) HANDLER_ALSO(0x36) HANDLER_ALSO(0x39)
+    HANDLER_ALSO(0x3A) HANDLER(0x3B, op_vector)
+        switch (execute_vector(vm, op, regs)) {
+            case NANOCORE_OK:
+                break;
+            case VECTOR_END_BLOCK:
+                op++;
+                goto block_done;
+            default:
+                retired += (uint64_t)(op - block->ops);
+                pc = block->pc + ((uint64_t)(op - block->ops) << 2) + 4;
+                vm->halted = true;
+                result = NANOCORE_ERROR;
+                goto done;
+        }
+        NEXT();
+    
+    HANDLER_ALSO(0x28) HANDLER_ALSO(0x29) HANDLER_ALSO(0x2A) HANDLER_ALSO(0x2B)
+    HANDLER_ALSO(0x2C) HANDLER_ALSO(0x2D) HANDLER_ALSO(0x2E) HANDLER(0x2F, op_atomic)
+        switch (execute_atomic(vm, op, regs)) {
+            case NANOCORE_OK:
+                break;
+            case VECTOR_END_BLOCK:
+                op++;
+                goto block_done;
+            default:
+                retired += (uint64_t)(op - block->ops);
+                pc = block->pc + ((uint64_t)(op - block->ops) << 2) + 4;
+                vm->halted = true;
+                result = NANOCORE_ERROR;
+                goto done;
+        }
+        NEXT();
+    
+    HANDLER(0x17, op_beq)
+        if (regs[op->rd] == regs[op->rs1]) {
+            goto branch_taken;
+        }
+        NEXT();
+    
+    HANDLER(0x18, op_bne)
+        if (regs[op->rd] != regs[op->rs1]) {
+            goto branch_taken;
+        }
+        NEXT();
+    
+    HANDLER(0x19, op_blt)
+        if ((int64_t)regs[op->rd] < (int64_t)regs[op->rs1]) {
+            goto branch_taken;
+        }
+        NEXT();
+    
+    HANDLER(0x22, op_nop)
+        NEXT();
+    
+    // Superinstructions: run the first op, then enter the partner's handler
+    // without a dispatch. The instruction budget may split a pair.
+    HANDLER(DECODED_LD_ADD, op_ld_add)
+        regs[op->rd] = (uint64_t)(int64_t)op->imm;
+        NEXT_FUSED(op_add);
+    
+    HANDLER(DECODED_ADD_ST, op_add_st)
+        regs[op->rd] = regs[op->rs1] + regs[op->rs2];
+        NEXT_FUSED(op_st);
+    
+    HANDLER(DECODED_SUB_BNE, op_sub_bne)
+        regs[op->rd] = regs[op->rs1] - regs[op->rs2];
+        NEXT_FUSED(op_bne);
+    
+    HANDLER(DECODED_ADD_BLT, op_add_blt)
+        regs[op->rd] = regs[op->rs1] + regs[op->rs2];
+        NEXT_FUSED(op_blt);
+    
+    HANDLER(0x1E, op_call)
+        regs[31] = block->pc + ((uint64_t)(op - block->ops) << 2) + 4;
+        retired += (uint64_t)(op - block->ops) + 1;
+        remaining -= (uint64_t)(op - block->ops) + 1;
+        pc = regs[31] - 4 + (uint64_t)(int64_t)op->imm * 4;
+        goto next_block;
+    
+    HANDLER(0x1F, op_ret)
+        retired += (uint64_t)(op - block->ops) + 1;
+        remaining -= (uint64_t)(op - block->ops) + 1;
+        pc = regs[31];
+        goto next_block;
+    
+    HANDLER(0x3C, op_iret)
+        retired += (uint64_t)(op - block->ops) + 1;
+        remaining -= (uint64_t)(op - block->ops) + 1;
+        pc = irq_return(vm);
+        goto next_block;
+    
+    HANDLER(0x21, op_halt)
+        // HALT stops the run but is not counted as retired
+        retired += (uint64_t)(op - block->ops);
+        remaining -= (uint64_t)(op - block->ops) + 1;
+        pc = block->pc + ((uint64_t)(op - block->ops) << 2) + 4;
+        vm->halted = true;
+        vm->state.flags |= 0x80;
+        result = EVENT_HALTED;
+        goto done;
+    
+    HANDLER(DECODED_BREAK, op_break)
+        // Always alone in its block: stop before the instruction runs
+        pc = block->pc;
+        result = EVENT_BREAKPOINT;
+        goto done;
+    
+    HANDLER_DEFAULT(op_illegal)
+        retired += (uint64_t)(op - block->ops);
+        pc = block->pc + ((uint64_t)(op - block->ops) << 2) + 4;
+        vm->halted = true;
+        result = NANOCORE_ERROR;
+        goto done;
+    
+#if !NANOCORE_THREADED_DISPATCH
+    }
+#endif
+    
+branch_taken:
+    retired += (uint64_t)(op - block->ops) + 1;
+    remaining -= (uint64_t)(op - block->ops) + 1;
+    pc = block->pc + ((uint64_t)(op - block->ops) << 2) + (uint64_t)(int64_t)op->imm * 2;
+    goto next_block;
+    
+block_done:
+    retired += (uint64_t)(op - block->ops);
+    remaining -= (uint64_t)(op - block->ops);
+    pc = block->pc + ((uint64_t)(op - block->ops) << 2);
+    goto next_block;
+    
+done:
+    if (profiled) {
+        profile_block(profile, profiled, retired - profiled_from);
+    }
+    memcpy(vm->state.gprs, regs, sizeof(regs));
+    vm->state.pc = pc;
+    vm->state.perf_counters[0] += retired;  // Instruction count
+    vm->state.perf_counters[1] += retired;  // Cycle count
+    
+    if (vm->watch_hit) {
+        vm->watch_hit = false;
+        if (result == NANOCORE_OK) {
+            result = EVENT_WATCHPOINT;
+        }
+    }
+    if (result == NANOCORE_OK && vm->halted) {
+        result = EVENT_HALTED;
+    }
+    return result;
+}
+
+#undef NEXT
+#undef NEXT_FUSED
+#undef DISPATCH
+#undef HANDLER
+#undef HANDLER_DEFAULT
+
+// ---------------------------------------------------------------------------
+// Ring devices: the guest hands the host whole buffers through a descriptor
+// ring in its own RAM instead of moving bytes through device registers.
+// A ring at base is a 16-byte header, u64 avail (descriptors posted, written
+// by the guest) and u64 used (descriptors completed, written by the host),
+// followed by a power-of-two array of nanocore_ring_desc_t; descriptor n
+// lives in slot n & (entries - 1). Requests are serviced in ring order.
+//
+// Guest RAM is only touched on the VM's own thread: before and after each
+// nanocore_vm_run slice, and at the block boundary after an interrupt
+// signal. New descriptors are copied into host buffers and handed to the
+// ring's drain thread, and finished requests are written back to the ring.
+// The page holding avail is flagged PAGE_FLAG_RING, so a guest store to it
+// rings the doorbell by signalling the VM. The drain thread does the
+// blocking I/O on the host fd and, per batch, raises the ring's interrupt
+// vector and queues one EVENT_DEVICE_INTERRUPT with the ring id and count.
+// ---------------------------------------------------------------------------
+
+// Descriptor layout shared with guests (docs/isa_spec.md)
+typedef struct {
+    uint64_t addr;    // Guest buffer
+    uint32_t len;     // Buffer length; completion stores the bytes moved
+    uint16_t flags;   // NANOCORE_RING_DESC_*
+    uint16_t status;  // Set on completion: NANOCORE_RING_STATUS_*
+} nanocore_ring_desc_t;
+
+#define NANOCORE_RING_DESC_WRITE 0x01  // Device fills the buffer (input)
+
+enum {
+    NANOCORE_RING_STATUS_OK = 0,
+    NANOCORE_RING_STATUS_IOERR = 1,    // Host read or write failed
+    NANOCORE_RING_STATUS_BADADDR = 2   // Buffer outside guest RAM or too long
+};
+
+#define RING_HEADER_SIZE 16
+#define RING_MAX_ENTRIES 4096
+#define RING_MAX_TRANSFER (1u << 20)  // Longest single buffer
+#define RING_POLL_MS 50               // Drain thread checks for detach this often
+
+#if NANOCORE_RING
+// Host side of one descriptor
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint32_t done;       // Bytes moved, set by the drain thread
+    uint16_t flags;
+    uint16_t status;
+    uint32_t capacity;   // Size of data
+    uint8_t* data;       // Bounce buffer, reused across laps of the ring
+} ring_request_t;
+
+typedef struct ring_device {
+    uint64_t base;                // Guest address of the header
+    uint32_t mask;                // entries - 1
+    int fd;                       // Host end of the device
+    int id;                       // Slot in vm->rings
+    vm_instance_t* vm;            // Owner, for irq_raise
+    event_queue_t* events;        // Owning VM's queue
+    ring_request_t* requests;     // One per slot
+    uint64_t posted;              // Descriptors taken from the guest (lock)
+    uint64_t published;           // Completions written back to the guest
+    _Atomic uint64_t completed;   // Requests the drain thread has finished
+    _Atomic bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_t thread;
+} ring_device_t;
+
+// Move one request's bytes to or from the host fd. Input requests return
+// as soon as some data arrives; output requests run until all is written.
+static void ring_transfer(ring_device_t* ring, ring_request_t* req) {
+    bool input = req->flags & NANOCORE_RING_DESC_WRITE;
+    uint32_t done = 0;
+    
+    while (done < req->len && !atomic_load_explicit(&ring->stopping, memory_order_relaxed)) {
+        struct pollfd pfd = { .fd = ring->fd, .events = input ? POLLIN : POLLOUT };
+        int ready = poll(&pfd, 1, RING_POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            req->status = NANOCORE_RING_STATUS_IOERR;
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        
+        ssize_t n = input ? read(ring->fd, req->data + done, req->len - done)
+                          : write(ring->fd, req->data + done, req->len - done);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            req->status = NANOCORE_RING_STATUS_IOERR;
+            break;
+        }
+        if (n == 0) {
+            break;  // End of file
+        }
+        done += (uint32_t)n;
+        if (input) {
+            break;
+        }
+    }
+    req->done = done;
+}
+
+// Drain thread: takes every posted request in one go, raises one
+// interrupt for the batch, then sleeps
+static void* ring_worker_main(void* arg) {
+    ring_device_t* ring = arg;
+    uint64_t next = atomic_load_explicit(&ring->completed, memory_order_relaxed);
+    
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+        while (!atomic_load(&ring->stopping) && next == ring->posted) {
+            pthread_cond_wait(&ring->work_ready, &ring->lock);
+        }
+        if (atomic_load(&ring->stopping)) {
+            break;
+        }
+        uint64_t start = next;
+        uint64_t end = ring->posted;
+        pthread_mutex_unlock(&ring->lock);
+        
+        for (; next < end; next++) {
+            ring_request_t* req = &ring->requests[next & ring->mask];
+            if (req->status == NANOCORE_RING_STATUS_OK) {
+                ring_transfer(ring, req);
+            }
+            atomic_store_explicit(&ring->completed, next + 1, memory_order_release);
+        }
+        irq_raise(ring->vm, NANOCORE_IRQ_RING0 + (uint32_t)ring->id);
+        event_push(ring->events, EVENT_DEVICE_INTERRUPT, (uint64_t)ring->id << 32 | (next - start));
+        
+        pthread_mutex_lock(&ring->lock);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    
+    return NULL;
+}
+
+// Host write into a guest range already known to be in bounds
+static void ring_store(vm_instance_t* vm, uint64_t address, const void* data, uint64_t size) {
+    memcpy(vm->memory + address, data, size);
+    note_write(vm, address, size);
+}
+
+// Write finished requests back to the guest and bump used
+static void ring_publish(vm_instance_t* vm, ring_device_t* ring) {
+    uint64_t completed = atomic_load_explicit(&ring->completed, memory_order_acquire);
+    if (completed == ring->published) {
+        return;
+    }
+    
+    for (; ring->published < completed; ring->published++) {
+        uint32_t slot = (uint32_t)ring->published & ring->mask;
+        ring_request_t* req = &ring->requests[slot];
+        if ((req->flags & NANOCORE_RING_DESC_WRITE) && req->done) {
+            ring_store(vm, req->addr, req->data, req->done);
+        }
+        
+        uint64_t desc = ring->base + RING_HEADER_SIZE + (uint64_t)slot * sizeof(nanocore_ring_desc_t);
+        ring_store(vm, desc + offsetof(nanocore_ring_desc_t, len), &req->done, sizeof(uint32_t));
+        ring_store(vm, desc + offsetof(nanocore_ring_desc_t, status), &req->status, sizeof(uint16_t));
+    }
+    ring_store(vm, ring->base + 8, &ring->published, sizeof(uint64_t));
+}
+
+// Take newly posted descriptors and wake the drain thread once
+static void ring_collect(vm_instance_t* vm, ring_device_t* ring) {
+    uint64_t avail;
+    memcpy(&avail, vm->memory + ring->base, sizeof(avail));
+    
+    // Never run more than a full ring ahead of what the guest has seen
+    uint64_t room = (uint64_t)ring->mask + 1 - (ring->posted - ring->published);
+    uint64_t take = avail - ring->posted;
+    if (take > room) {
+        take = room;
+    }
+    if (take == 0) {
+        return;
+    }
+    
+    uint64_t posted = ring->posted;
+    for (uint64_t i = 0; i < take; i++, posted++) {
+        uint32_t slot = (uint32_t)posted & ring->mask;
+        ring_request_t* req = &ring->requests[slot];
+        nanocore_ring_desc_t desc;
+        memcpy(&desc, vm->memory + ring->base + RING_HEADER_SIZE + (uint64_t)slot * sizeof(desc), sizeof(desc));
+        
+        req->addr = desc.addr;
+        req->len = desc.len;
+        req->flags = desc.flags;
+        req->done = 0;
+        req->status = NANOCORE_RING_STATUS_OK;
+        if (desc.len > RING_MAX_TRANSFER || desc.addr >= vm->memory_size ||
+            vm->memory_size - desc.addr < desc.len) {
+            req->status = NANOCORE_RING_STATUS_BADADDR;
+            req->len = 0;
+            continue;
+        }
+        if (desc.len > req->capacity) {
+            uint8_t* data = realloc(req->data, desc.len);
+            if (!data) {
+                req->status = NANOCORE_RING_STATUS_IOERR;
+                req->len = 0;
+                continue;
+            }
+            req->data = data;
+            req->capacity = desc.len;
+        }
+        if (!(desc.flags & NANOCORE_RING_DESC_WRITE)) {
+            memcpy(req->data, vm->memory + desc.addr, desc.len);
+        }
+    }
+    
+    pthread_mutex_lock(&ring->lock);
+    ring->posted = posted;
+    pthread_cond_signal(&ring->work_ready);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// Stop the drain thread and free the ring; unfinished requests are dropped
+static void ring_destroy(ring_device_t* ring) {
+    pthread_mutex_lock(&ring->lock);
+    atomic_store(&ring->stopping, true);
+    pthread_cond_signal(&ring->work_ready);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->thread, NULL);
+    
+    for (uint32_t i = 0; i <= ring->mask; i++) {
+        free(ring->requests[i].data);
+    }
+    pthread_cond_destroy(&ring->work_ready);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->requests);
+    free(ring);
+}
+
+// Recompute PAGE_FLAG_RING for the pages of the avail word at base
+static void ring_reflag(vm_instance_t* vm, uint64_t base) {
+    vm->page_flags[base >> GUEST_PAGE_SHIFT] &= ~PAGE_FLAG_RING;
+    vm->page_flags[(base + 7) >> GUEST_PAGE_SHIFT] &= ~PAGE_FLAG_RING;
+    for (int i = 0; i < NANOCORE_MAX_RINGS; i++) {
+        if (vm->rings[i]) {
+            vm->page_flags[vm->rings[i]->base >> GUEST_PAGE_SHIFT] |= PAGE_FLAG_RING;
+            vm->page_flags[(vm->rings[i]->base + 7) >> GUEST_PAGE_SHIFT] |= PAGE_FLAG_RING;
+        }
+    }
+}
+#endif
+
+// Exchange completions and new requests with every attached ring
+static void ring_service(vm_instance_t* vm) {
+#if NANOCORE_RING
+    for (int i = 0; i < NANOCORE_MAX_RINGS; i++) {
+        if (vm->rings[i]) {
+            ring_publish(vm, vm->rings[i]);
+            ring_collect(vm, vm->rings[i]);
+        }
+    }
+#else
+    (void)vm;
+#endif
+}
+
+static void ring_detach_all(vm_instance_t* vm) {
+#if NANOCORE_RING
+    for (int i = 0; i < NANOCORE_MAX_RINGS; i++) {
+        if (vm->rings[i]) {
+            ring_destroy(vm->rings[i]);
+            vm->rings[i] = NULL;
+        }
+    }
+#else
+    (void)vm;
+#endif
+}
+
+// Attach a ring of entries descriptors (a power of two) at ring_addr,
+// backed by the host file descriptor fd, which stays owned by the caller.
+// The ring picks up from the guest's current used count.
+int nanocore_vm_ring_attach(int vm_handle, uint64_t ring_addr, uint32_t entries, int fd, int* ring_id) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !ring_id || fd < 0 || entries == 0 || entries > RING_MAX_ENTRIES ||
+        (entries & (entries - 1)) != 0) {
+        return NANOCORE_EINVAL;
+    }
+    uint64_t length = RING_HEADER_SIZE + (uint64_t)entries * sizeof(nanocore_ring_desc_t);
+    if (ring_addr >= vm->memory_size || vm->memory_size - ring_addr < length) {
+        return NANOCORE_EINVAL;
+    }
+    
+#if NANOCORE_RING
+    int slot = 0;
+    while (slot < NANOCORE_MAX_RINGS && vm->rings[slot]) {
+        slot++;
+    }
+    if (slot == NANOCORE_MAX_RINGS) {
+        return NANOCORE_ERROR;  // All ring slots in use
+    }
+    
+    ring_device_t* ring = calloc(1, sizeof(ring_device_t));
+    if (!ring) {
+        return NANOCORE_ENOMEM;
+    }
+    ring->requests = calloc(entries, sizeof(ring_request_t));
+    if (!ring->requests) {
+        free(ring);
+        return NANOCORE_ENOMEM;
+    }
+    
+    uint64_t used;
+    memcpy(&used, vm->memory + ring_addr + 8, sizeof(used));
+    ring->base = ring_addr;
+    ring->mask = entries - 1;
+    ring->fd = fd;
+    ring->id = slot;
+    ring->vm = vm;
+    ring->events = vm->events;
+    ring->posted = used;
+    ring->published = used;
+    atomic_init(&ring->completed, used);
+    atomic_init(&ring->stopping, false);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->work_ready, NULL);
+    if (pthread_create(&ring->thread, NULL, ring_worker_main, ring) != 0) {
+        pthread_cond_destroy(&ring->work_ready);
+        pthread_mutex_destroy(&ring->lock);
+        free(ring->requests);
+        free(ring);
+        return NANOCORE_ERROR;
+    }
+    
+    vm->rings[slot] = ring;
+    *ring_id = slot;
+    ring_reflag(vm, ring_addr);
+    ring_collect(vm, ring);
+    return NANOCORE_OK;
+#else
+    return NANOCORE_ERROR;  // No thread support on this platform
+#endif
+}
+
+// Detach a ring; requests still in flight are dropped without completion
+int nanocore_vm_ring_detach(int vm_handle, int ring_id) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || ring_id < 0 || ring_id >= NANOCORE_MAX_RINGS || !vm->rings[ring_id]) {
+        return NANOCORE_EINVAL;
+    }
+    
+#if NANOCORE_RING
+    uint64_t base = vm->rings[ring_id]->base;
+    ring_destroy(vm->rings[ring_id]);
+    vm->rings[ring_id] = NULL;
+    ring_reflag(vm, base);
+#endif
+    return NANOCORE_OK;
+}
+
+// Queue the reason a run or step stopped. EVENT_HALTED and NANOCORE_OK
+// share a value, so a halt is recognised by the VM having halted.
+static void report_stop(vm_instance_t* vm, int result) {
+    if (result == EVENT_BREAKPOINT) {
+        event_push(vm->events, EVENT_BREAKPOINT, vm->state.pc);
+    } else if (result == EVENT_WATCHPOINT) {
+        event_push(vm->events, EVENT_WATCHPOINT, vm->watch_address);
+    } else if (result == NANOCORE_ERROR) {
+        event_push(vm->events, EVENT_EXCEPTION, vm->state.pc);
+    } else if (vm->halted) {
+        event_push(vm->events, EVENT_HALTED, vm->state.pc);
+    }
+}
+
+// Execute single instruction
+int nanocore_vm_step(int vm_handle) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm) {
+        return NANOCORE_EINVAL;
+    }
+    if (vm->halted) {
+        return EVENT_HALTED;
+    }
+    
+    int result = step_instance(vm);
+    report_stop(vm, result);
+    return result;
+}
+
+// Run VM for specified number of instructions
+int nanocore_vm_run(int vm_handle, uint64_t max_instructions) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm) {
+        return NANOCORE_EINVAL;
+    }
+    
+    // Ring completions land before the slice, new requests go out after it
+    ring_service(vm);
+    if (vm->halted) {
+        return EVENT_HALTED;
+    }
+    
+    int result = run_engine(vm, max_instructions);
+    ring_service(vm);
+    report_stop(vm, result);
+    
+    return result;
+}
+
+// Get VM state
+int nanocore_vm_get_state(int vm_handle, vm_state_t* state) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !state) {
+        return NANOCORE_EINVAL;
+    }
+    
+    *state = vm->state;
+    return NANOCORE_OK;
+}
+
+// Get register value
+int nanocore_vm_get_register(int vm_handle, int reg_index, uint64_t* value) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || reg_index < 0 || reg_index >= 32 || !value) {
+        return NANOCORE_EINVAL;
+    }
+    
+    *value = vm->state.gprs[reg_index];
+    return NANOCORE_OK;
+}
+
+// Set register value
+int nanocore_vm_set_register(int vm_handle, int reg_index, uint64_t value) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || reg_index < 0 || reg_index >= 32) {
+        return NANOCORE_EINVAL;
+    }
+    
+    if (reg_index != 0) {  // R0 is hardwired to zero
+        vm->state.gprs[reg_index] = value;
+    }
+    
+    return NANOCORE_OK;
+}
+
+// Load program into memory
+int nanocore_vm_load_program(int vm_handle, const uint8_t* data, uint64_t size, uint64_t address) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !data) {
+        return NANOCORE_EINVAL;
+    }
+    
+    if (address > vm->memory_size || size > vm->memory_size - address) {
+        return NANOCORE_EINVAL;
+    }
+    
+    memcpy(vm->memory + address, data, size);
+    note_write(vm, address, size);
+    vm->state.pc = address;  // Set PC to start of program
+    vm->image_key = 0;
+    
+    return NANOCORE_OK;
+}
+
+// Read memory
+int nanocore_vm_read_memory(int vm_handle, uint64_t address, uint8_t* buffer, uint64_t size) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !buffer) {
+        return NANOCORE_EINVAL;
+    }
+    
+    if (address > vm->memory_size || size > vm->memory_size - address) {
+        return NANOCORE_EINVAL;
+    }
+    
+    memcpy(buffer, vm->memory + address, size);
+    return NANOCORE_OK;
+}
+
+// Write memory
+int nanocore_vm_write_memory(int vm_handle, uint64_t address, const uint8_t* data, uint64_t size) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !data) {
+        return NANOCORE_EINVAL;
+    }
+    
+    if (address > vm->memory_size || size > vm->memory_size - address) {
+        return NANOCORE_EINVAL;
+    }
+    
+    memcpy(vm->memory + address, data, size);
+    note_write(vm, address, size);
+    return NANOCORE_OK;
+}
+
+// Borrow [address, address + size) of guest RAM in place. The pointer
+// stays valid until the matching unmap, and the VM cannot be destroyed
+// while any view is outstanding. With NANOCORE_MAP_WRITE the caller may
+// store through it; decoded code in the range is dropped on map and again
+// on unmap. NANOCORE_ERROR while another hart shares the RAM: it could
+// write under the view at any time, so harts only copy.
+int nanocore_vm_map_memory(int vm_handle, uint64_t address, uint64_t size, uint32_t access, uint8_t** data) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !data || (access & ~NANOCORE_MAP_WRITE)) {
+        return NANOCORE_EINVAL;
+    }
+    if (address > vm->memory_size || size > vm->memory_size - address) {
+        return NANOCORE_EINVAL;
+    }
+    
+    hart_group_t* group = vm->harts;
+    if (group) {
+        hart_lock(group);
+    }
+    bool shared = group && group->count > 1;
+    if (!shared) {
+        atomic_fetch_add_explicit(&vm->pins, 1, memory_order_acq_rel);
+    }
+    if (group) {
+        hart_unlock(group);
+    }
+    if (shared) {
+        return NANOCORE_ERROR;
+    }
+    if (access & NANOCORE_MAP_WRITE) {
+        note_write(vm, address, size);
+    }
+    *data = vm->memory + address;
+    return NANOCORE_OK;
+}
+
+// Return a view from nanocore_vm_map_memory with the same range and access
+int nanocore_vm_unmap_memory(int vm_handle, uint64_t address, uint64_t size, uint32_t access) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || (access & ~NANOCORE_MAP_WRITE)) {
+        return NANOCORE_EINVAL;
+    }
+    if (address > vm->memory_size || size > vm->memory_size - address) {
+        return NANOCORE_EINVAL;
+    }
+    
+    uint32_t pins = atomic_load_explicit(&vm->pins, memory_order_relaxed);
+    do {
+        if (pins == 0) {
+            return NANOCORE_EINVAL;  // Unbalanced unmap
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&vm->pins, &pins, pins - 1,
+                                                    memory_order_acq_rel, memory_order_relaxed));
+    
+    // Code decoded from the range while it was mapped may be stale
+    if (access & NANOCORE_MAP_WRITE) {
+        note_write(vm, address, size);
+    }
+    return NANOCORE_OK;
+}
+
+// Dirty bits live in page_flags; these scan it a word (eight pages) at a
+// time, so sparse VMs only pay for the flag pages they actually touched.
+// Harts keep their own flags for the RAM they share, so a VM's dirty set
+// is the union over its hart group.
+#define DIRTY_WORD_MASK 0x1010101010101010ull
+
+// Flags of pages [page, page + len) in vm and every hart sharing its RAM,
+// ORed together; the caller holds the hart lock
+static uint64_t dirty_word(const vm_instance_t* vm, uint64_t page, size_t len) {
+    uint64_t word = 0;
+    memcpy(&word, vm->page_flags + page, len);
+    for (uint32_t i = 0; vm->harts && i < vm->harts->count; i++) {
+        uint64_t other = 0;
+        memcpy(&other, vm->harts->members[i]->page_flags + page, len);
+        word |= other;
+    }
+    return word;
+}
+
+// Clear the dirty bits of one VM's page flags
+static void dirty_clear(uint8_t* page_flags, uint64_t pages) {
+    for (uint64_t page = 0; page < pages; page += 8) {
+        uint64_t word = 0;
+        size_t len = pages - page >= 8 ? 8 : (size_t)(pages - page);
+        memcpy(&word, page_flags + page, len);
+        if (word & DIRTY_WORD_MASK) {
+            word &= ~DIRTY_WORD_MASK;
+            memcpy(page_flags + page, &word, len);  // Only touched flag pages are written
+        }
+    }
+}
+
+// Fill bitmap with one bit per GUEST_PAGE_SIZE page written since the last
+// nanocore_vm_clear_dirty (page n is bit n % 8 of byte n / 8), by the VM or
+// any hart sharing its RAM. bitmap_size must cover every page; count, if
+// given, gets the number of dirty pages.
+int nanocore_vm_get_dirty_pages(int vm_handle, uint8_t* bitmap, uint64_t bitmap_size, uint64_t* count) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !bitmap) {
+        return NANOCORE_EINVAL;
+    }
+    uint64_t pages = GUEST_PAGE_COUNT(vm->memory_size);
+    if (bitmap_size < (pages + 7) / 8) {
+        return NANOCORE_EINVAL;
+    }
+    
+    memset(bitmap, 0, (size_t)((pages + 7) / 8));
+    uint64_t dirty = 0;
+    hart_group_t* group = vm->harts;
+    if (group) {
+        hart_lock(group);
+    }
+    for (uint64_t page = 0; page < pages; page += 8) {
+        size_t len = pages - page >= 8 ? 8 : (size_t)(pages - page);
+        uint64_t word = dirty_word(vm, page, len);
+        if (!(word & DIRTY_WORD_MASK)) {
+            continue;
+        }
+        const uint8_t* flags = (const uint8_t*)&word;
+        for (size_t i = 0; i < len; i++) {
+            if (flags[i] & PAGE_FLAG_DIRTY) {
+                bitmap[(page + i) >> 3] |= (uint8_t)(1u << ((page + i) & 7));
+                dirty++;
+            }
+        }
+    }
+    if (group) {
+        hart_unlock(group);
+    }
+    
+    if (count) {
+        *count = dirty;
+    }
+    return NANOCORE_OK;
+}
+
+// Start a new dirty-tracking interval for the VM and every hart sharing its
+// RAM. The next guest store to each page takes the slow path once to mark
+// it again.
+int nanocore_vm_clear_dirty(int vm_handle) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm) {
+        return NANOCORE_EINVAL;
+    }
+    
+    uint64_t pages = GUEST_PAGE_COUNT(vm->memory_size);
+    hart_group_t* group = vm->harts;
+    if (!group) {
+        dirty_clear(vm->page_flags, pages);
+        return NANOCORE_OK;
+    }
+    hart_lock(group);
+    for (uint32_t i = 0; i < group->count; i++) {
+        dirty_clear(group->members[i]->page_flags, pages);
+    }
+    hart_unlock(group);
+    return NANOCORE_OK;
+}
+
+// Set breakpoint
+int nanocore_vm_set_breakpoint(int vm_handle, uint64_t address) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || address >= vm->memory_size) {
+        return NANOCORE_EINVAL;
+    }
+    
+    if (!breakpoint_insert(&vm->breakpoints, address)) {
+        return NANOCORE_ENOMEM;
+    }
+    
+    uint64_t page = address >> GUEST_PAGE_SHIFT;
+    vm->page_flags[page] |= PAGE_FLAG_BREAK;
+    debug_redecode_page(vm, page);
+    return NANOCORE_OK;
+}
+
+// Clear breakpoint
+int nanocore_vm_clear_breakpoint(int vm_handle, uint64_t address) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm) {
+        return NANOCORE_EINVAL;
+    }
+    
+    if (!breakpoint_remove(&vm->breakpoints, address)) {
+        return NANOCORE_ERROR;  // Breakpoint not found
+    }
+    
+    // Keep the page flag while other breakpoints share the page
+    uint64_t page = address >> GUEST_PAGE_SHIFT;
+    bool shared = false;
+    for (uint32_t i = 0; i < vm->breakpoints.capacity && !shared; i++) {
+        shared = vm->breakpoints.slots[i] && ((vm->breakpoints.slots[i] - 1) >> GUEST_PAGE_SHIFT) == page;
+    }
+    if (!shared) {
+        vm->page_flags[page] &= ~PAGE_FLAG_BREAK;
+    }
+    debug_redecode_page(vm, page);
+    return NANOCORE_OK;
+}
+
+// Stop a run when the guest reads and/or writes (access is a mask of
+// NANOCORE_WATCH_*) any byte of [address, address + size)
+int nanocore_vm_set_watchpoint(int vm_handle, uint64_t address, uint64_t size, uint32_t access) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || size == 0 || address >= vm->memory_size || vm->memory_size - address < size ||
+        access == 0 || (access & ~(uint32_t)(NANOCORE_WATCH_READ | NANOCORE_WATCH_WRITE))) {
+        return NANOCORE_EINVAL;
+    }
+    
+    return watch_insert(vm, address, size, access) ? NANOCORE_OK : NANOCORE_ENOMEM;
+}
+
+// Remove the watchpoint set with exactly this range
+int nanocore_vm_clear_watchpoint(int vm_handle, uint64_t address, uint64_t size) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm) {
+        return NANOCORE_EINVAL;
+    }
+    
+    for (uint32_t i = 0; i < vm->num_watchpoints; i++) {
+        if (vm->watchpoints[i].address == address && vm->watchpoints[i].size == size) {
+            vm->watchpoints[i] = vm->watchpoints[--vm->num_watchpoints];
+            watch_reflag(vm, address, size);
+            return NANOCORE_OK;
+        }
+    }
+    
+    return NANOCORE_ERROR;  // Watchpoint not found
+}
+
+// Gather every counter this engine keeps. There is no cache or timing
+// model here, so cycles equal instructions and those counters stay zero;
+// memory and SIMD op counts come from the opcode histogram when it is on.
+static void perf_collect(const vm_instance_t* vm, nanocore_perf_t* perf) {
+    memset(perf, 0, sizeof(*perf));
+    perf->struct_size = sizeof(*perf);
+    perf->counters[NANOCORE_PERF_INSTRUCTIONS] = vm->state.perf_counters[0];
+    perf->counters[NANOCORE_PERF_CYCLES] = vm->state.perf_counters[1];
+    perf->valid = 1u << NANOCORE_PERF_INSTRUCTIONS | 1u << NANOCORE_PERF_CYCLES;
+    
+    const profile_t* prof = vm->profile;
+    if (!prof) {
+        return;
+    }
+    perf->profile_flags = prof->flags;
+    perf->sample_period = prof->period;
+    perf->samples = prof->taken;
+    perf->samples_dropped = prof->dropped;
+    if (prof->flags & NANOCORE_PROFILE_OPCODES) {
+        memcpy(perf->opcodes, prof->opcodes, sizeof(perf->opcodes));
+        const uint64_t* op = prof->opcodes;
+        perf->counters[NANOCORE_PERF_MEM_OPS] = op[0x13] + op[0x34] + op[0x35] + op[0x37] + op[0x38] + op[0x3B];
+        for (int i = 0x29; i <= 0x2F; i++) {
+            perf->counters[NANOCORE_PERF_MEM_OPS] += op[i];
+        }
+        for (int i = 0x30; i <= 0x3B; i++) {
+            if (i != 0x37 && i != 0x38) {
+                perf->counters[NANOCORE_PERF_SIMD_OPS] += op[i];
+            }
+        }
+        perf->valid |= 1u << NANOCORE_PERF_MEM_OPS | 1u << NANOCORE_PERF_SIMD_OPS;
+    }
+}
+
+// Get performance counter (NANOCORE_PERF_*)
+int nanocore_vm_get_perf_counter(int vm_handle, int counter_index, uint64_t* value) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || counter_index < 0 || counter_index >= NANOCORE_PERF_COUNTERS || !value) {
+        return NANOCORE_EINVAL;
+    }
+    
+    nanocore_perf_t perf;
+    perf_collect(vm, &perf);
+    *value = perf.counters[counter_index];
+    return NANOCORE_OK;
+}
+
+// Read all counters, the profiling state and the opcode histogram at
+// once. Callers set perf->struct_size; older, shorter structs get the
+// fields they know about.
+int nanocore_vm_get_perf(int vm_handle, nanocore_perf_t* perf) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !perf || perf->struct_size < offsetof(nanocore_perf_t, counters)) {
+        return NANOCORE_EINVAL;
+    }
+    
+    nanocore_perf_t full;
+    perf_collect(vm, &full);
+    uint32_t size = perf->struct_size < sizeof(full) ? perf->struct_size : (uint32_t)sizeof(full);
+    memcpy(perf, &full, size);
+    perf->struct_size = size;
+    return NANOCORE_OK;
+}
+
+// Turn profiling on (flags = NANOCORE_PROFILE_*, sample_period 0 for the
+// default) or off (flags = 0). Enabling starts a fresh histogram, sample
+// buffer and shadow stack.
+int nanocore_vm_set_profiling(int vm_handle, uint32_t flags, uint32_t sample_period) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || (flags & ~(uint32_t)(NANOCORE_PROFILE_OPCODES | NANOCORE_PROFILE_PCS |
+                                    NANOCORE_PROFILE_STACKS | NANOCORE_PROFILE_PAIRS))) {
+        return NANOCORE_EINVAL;
+    }
+    if (flags & NANOCORE_PROFILE_STACKS) {
+        flags |= NANOCORE_PROFILE_PCS;
+    }
+    
+    if (flags == 0) {
+        free(vm->profile);
+        vm->profile = NULL;
+        return NANOCORE_OK;
+    }
+    
+    profile_t* prof = vm->profile ? vm->profile : malloc(sizeof(profile_t));
+    if (!prof) {
+        return NANOCORE_ENOMEM;
+    }
+    memset(prof, 0, offsetof(profile_t, samples));
+    prof->flags = flags;
+    prof->period = sample_period ? sample_period : PROFILE_DEFAULT_PERIOD;
+    prof->countdown = prof->period;
+    vm->profile = prof;
+    return NANOCORE_OK;
+}
+
+// Move up to max buffered PC samples, oldest first, into pcs
+int nanocore_vm_read_samples(int vm_handle, uint64_t* pcs, uint32_t max, uint32_t* count) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !count || (max && !pcs)) {
+        return NANOCORE_EINVAL;
+    }
+    
+    profile_t* prof = vm->profile;
+    uint32_t n = 0;
+    while (prof && prof->count && n < max) {
+        // Stack records keep their leaf PC after the frame count
+        uint32_t words = 1;
+        if (prof->flags & NANOCORE_PROFILE_STACKS) {
+            words = (uint32_t)prof->samples[prof->head] + 1;
+            pcs[n++] = prof->samples[(prof->head + 1) % PROFILE_SAMPLE_WORDS];
+        } else {
+            pcs[n++] = prof->samples[prof->head];
+        }
+        prof->head = (prof->head + words) % PROFILE_SAMPLE_WORDS;
+        prof->count -= words;
+    }
+    *count = n;
+    return NANOCORE_OK;
+}
+
+// Move whole stack samples, oldest first, into words while they fit.
+// Each sample is [frames, pc, call sites innermost first], so
+// PROFILE_MAX_DEPTH + 2 words always hold at least one. *used is the
+// number of words written.
+int nanocore_vm_read_stacks(int vm_handle, uint64_t* words, uint32_t max_words, uint32_t* used) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !used || (max_words && !words)) {
+        return NANOCORE_EINVAL;
+    }
+    
+    profile_t* prof = vm->profile;
+    uint32_t n = 0;
+    if (prof && (prof->flags & NANOCORE_PROFILE_STACKS)) {
+        while (prof->count) {
+            uint32_t record = (uint32_t)prof->samples[prof->head] + 1;
+            if (max_words - n < record) {
+                break;
+            }
+            for (uint32_t i = 0; i < record; i++) {
+                words[n++] = prof->samples[(prof->head + i) % PROFILE_SAMPLE_WORDS];
+            }
+            prof->head = (prof->head + record) % PROFILE_SAMPLE_WORDS;
+            prof->count -= record;
+        }
+    }
+    *used = n;
+    return NANOCORE_OK;
+}
+
+// Copy the NANOCORE_PROFILE_PAIRS counts: counts[first << 6 | second]
+// is how often opcode second retired right after first in the same block.
+// counts must hold 64 * 64 entries. Stepped instructions are not counted.
+int nanocore_vm_read_pairs(int vm_handle, uint64_t* counts) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !counts) {
+        return NANOCORE_EINVAL;
+    }
+    
+    profile_t* prof = vm->profile;
+    if (prof && (prof->flags & NANOCORE_PROFILE_PAIRS)) {
+        memcpy(counts, prof->pairs, sizeof(prof->pairs));
+    } else {
+        memset(counts, 0, sizeof(prof->pairs));
+    }
+    return NANOCORE_OK;
+}
+
+// Take the next queued event without blocking
+int nanocore_vm_poll_event(int vm_handle, int* event_type, uint64_t* event_data) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !event_type || !event_data) {
+        return NANOCORE_EINVAL;
+    }
+    
+    return event_take(vm->events, event_type, event_data) ? NANOCORE_OK : NANOCORE_ERROR;
+}
+
+// Take the next event, sleeping until one arrives. timeout_ms < 0 waits
+// indefinitely, 0 polls; NANOCORE_ERROR means the timeout passed first.
+int nanocore_vm_wait_event(int vm_handle, int timeout_ms, int* event_type, uint64_t* event_data) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !event_type || !event_data) {
+        return NANOCORE_EINVAL;
+    }
+    
+#if !defined(_WIN32)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t deadline = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + timeout_ms;
+#else
+    ULONGLONG deadline = GetTickCount64() + (ULONGLONG)(timeout_ms > 0 ? timeout_ms : 0);
+#endif
+    
+    for (;;) {
+        if (event_take(vm->events, event_type, event_data)) {
+            return NANOCORE_OK;
+        }
+        
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+#if !defined(_WIN32)
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int64_t left = deadline - ((int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+#else
+            int64_t left = (int64_t)(deadline - GetTickCount64());
+#endif
+            if (left <= 0) {
+                return NANOCORE_ERROR;
+            }
+            wait_ms = left > INT32_MAX ? INT32_MAX : (int)left;
+        }
+        
+#if !defined(_WIN32)
+        struct pollfd pfd = { .fd = vm->events->wake_fd, .events = POLLIN };
+        poll(&pfd, 1, wait_ms);
+#else
+        Sleep(wait_ms < 0 || wait_ms > 1 ? 1 : (DWORD)wait_ms);  // No wake fd here
+#endif
+    }
+}
+
+// File descriptor that becomes readable when the VM has events pending,
+// for the caller's own epoll/poll loop. It stays owned by the VM; drain
+// it with nanocore_vm_poll_event until that reports no events.
+int nanocore_vm_event_fd(int vm_handle, int* fd) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !fd) {
+        return NANOCORE_EINVAL;
+    }
+    
+#if !defined(_WIN32)
+    *fd = vm->events->wake_fd;
+    return NANOCORE_OK;
+#else
+    return NANOCORE_ERROR;  // Poll or wait instead
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// Program images, as written by assembler/nanocore_asm.py --format image
+// (layout in docs/isa_spec.md): a header, a section table, a symbol table
+// and an optional table of basic-block start addresses. Text and data
+// whose file offset and guest address agree modulo the page size are
+// mapped MAP_PRIVATE over guest RAM, so the guest faults its pages in from
+// the page cache and copies only those it writes; bss is remapped
+// anonymous and zero-filled on first touch. Ragged page ends, and hosts
+// without mmap, are copied. The file must not change while a VM uses it.
+// ---------------------------------------------------------------------------
+
+#define IMAGE_MAGIC 0x4D49434Eu  // "NCIM"
+#define IMAGE_VERSION 1
+#define IMAGE_MAX_SECTIONS 16
+
+enum {
+    IMAGE_SECTION_TEXT = 1,
+    IMAGE_SECTION_DATA = 2,
+    IMAGE_SECTION_BSS = 3,
+};
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint64_t entry;
+    uint32_t num_sections;
+    uint32_t section_offset;
+    uint32_t num_symbols;
+    uint32_t symbol_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+    uint32_t num_blocks;
+    uint32_t block_offset;
+    uint64_t key;  // Content hash naming the image's translation cache; 0 = none
+} image_header_t;
+
+typedef struct {
+    uint32_t type;     // IMAGE_SECTION_*
+    uint32_t flags;    // Reserved, zero
+    uint64_t address;  // Guest address
+    uint64_t offset;   // File offset (unused for bss)
+    uint64_t size;     // Bytes, in the file and in guest RAM
+} image_section_t;
+
+#if defined(_WIN32)
+#define image_seek(f, offset, whence) _fseeki64(f, (__int64)(offset), whence)
+#define image_tell(f) ((int64_t)_ftelli64(f))
+#else
+#define image_seek(f, offset, whence) fseeko(f, (off_t)(offset), whence)
+#define image_tell(f) ((int64_t)ftello(f))
+#endif
+
+static bool image_read(FILE* f, uint64_t offset, void* buffer, uint64_t size) {
+    return size == 0 ||
+           (image_seek(f, offset, SEEK_SET) == 0 && fread(buffer, 1, size, f) == size);
+}
+
+// Fill guest [address, address + size) from the file at offset, or with
+// zeros when f is NULL. Whole pages are mapped where possible.
+static bool image_place(vm_instance_t* vm, FILE* f, uint64_t offset, uint64_t address, uint64_t size) {
+    uint64_t start = address;
+    uint64_t end = address + size;
+    uint64_t map_start = end;
+    uint64_t map_end = end;
+    
+#if !defined(_WIN32)
+    static long host_page;
+    if (!host_page) {
+        host_page = sysconf(_SC_PAGESIZE);
+    }
+    uint64_t first = (start + GUEST_PAGE_SIZE - 1) & ~(GUEST_PAGE_SIZE - 1);
+    uint64_t last = end & ~(GUEST_PAGE_SIZE - 1);
+    if (host_page == (long)GUEST_PAGE_SIZE && first < last &&
+        (!f || ((offset ^ address) & (GUEST_PAGE_SIZE - 1)) == 0)) {
+        // A failed MAP_FIXED may already have dropped the old pages, so it
+        // is an error rather than a reason to fall back to copying
+        void* mapped = f ? mmap(vm->memory + first, last - first, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_FIXED, fileno(f), (off_t)(offset + first - start))
+                         : mmap(vm->memory + first, last - first, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        map_start = first;
+        map_end = last;
+    }
+#endif
+    
+    // Copy whatever was not mapped: the head before map_start, the tail after map_end
+    uint64_t pieces[2][2] = { { start, map_start }, { map_end, end } };
+    for (int i = 0; i < 2; i++) {
+        uint64_t from = pieces[i][0];
+        uint64_t length = pieces[i][1] - from;
+        if (length == 0) {
+            continue;
+        }
+        if (!f) {
+            memset(vm->memory + from, 0, length);
+        } else if (!image_read(f, offset + (from - start), vm->memory + from, length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Decode the image's block table into the block cache
+static int image_predecode(vm_instance_t* vm, FILE* f, const image_header_t* header) {
+    if (!vm->block_cache) {
+        vm->block_cache = calloc(BLOCK_CACHE_ENTRIES, sizeof(decoded_block_t));
+        if (!vm->block_cache) {
+            return NANOCORE_ENOMEM;
+        }
+    }
+    
+    uint64_t pcs[256];
+    for (uint32_t done = 0; done < header->num_blocks; ) {
+        uint32_t count = header->num_blocks - done;
+        count = count > 256 ? 256 : count;
+        if (!image_read(f, header->block_offset + (uint64_t)done * 8, pcs, (uint64_t)count * 8)) {
+            return NANOCORE_EINVAL;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            decoded_block_t* block = &vm->block_cache[(pcs[i] >> 2) & (BLOCK_CACHE_ENTRIES - 1)];
+            if ((pcs[i] & 3) || block->num_ops != 0) {
+                continue;  // First block wins a shared slot
+            }
+            decode_block(vm, pcs[i], block);
+        }
+        done += count;
+    }
+    return NANOCORE_OK;
+}
+
+// Load the program image at path into guest RAM and set the PC to its
+// entry point. Symbols are left to the host tools. On failure guest RAM
+// may have been partly overwritten.
+int nanocore_vm_load_image(int vm_handle, const char* path, uint32_t flags) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !path || (flags & ~NANOCORE_IMAGE_PREDECODE)) {
+        return NANOCORE_EINVAL;
+    }
+    
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return NANOCORE_ERROR;
+    }
+    
+    int result = NANOCORE_EINVAL;
+    image_header_t header;
+    image_section_t sections[IMAGE_MAX_SECTIONS];
+    int64_t file_size = -1;
+    if (image_seek(f, 0, SEEK_END) == 0) {
+        file_size = image_tell(f);
+    }
+    if (file_size < 0 || !image_read(f, 0, &header, sizeof(header)) ||
+        header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION ||
+        header.header_size < offsetof(image_header_t, key) || header.num_sections > IMAGE_MAX_SECTIONS ||
+        !image_read(f, header.section_offset, sections, (uint64_t)header.num_sections * sizeof(image_section_t))) {
+        goto out;
+    }
+    
+    if (header.header_size < sizeof(header)) {
+        header.key = 0;  // Written before images carried a key
+    }
+    
+    // Validate everything before touching guest RAM
+    for (uint32_t i = 0; i < header.num_sections; i++) {
+        const image_section_t* s = &sections[i];
+        if (s->type < IMAGE_SECTION_TEXT || s->type > IMAGE_SECTION_BSS ||
+            s->address > vm->memory_size || s->size > vm->memory_size - s->address) {
+            goto out;
+        }
+        if (s->type != IMAGE_SECTION_BSS &&
+            (s->offset > (uint64_t)file_size || s->size > (uint64_t)file_size - s->offset)) {
+            goto out;  // Mapping past end of file would fault on access
+        }
+    }
+    if (header.entry >= vm->memory_size || (header.num_blocks &&
+        (uint64_t)header.block_offset + (uint64_t)header.num_blocks * 8 > (uint64_t)file_size)) {
+        goto out;
+    }
+    
+    vm->image_key = 0;
+    for (uint32_t i = 0; i < header.num_sections; i++) {
+        const image_section_t* s = &sections[i];
+        if (!image_place(vm, s->type == IMAGE_SECTION_BSS ? NULL : f, s->offset, s->address, s->size)) {
+            result = NANOCORE_ERROR;
+            goto out;
+        }
+        note_write(vm, s->address, s->size);
+    }
+    
+    vm->state.pc = header.entry;
+    vm->image_key = header.key;
+    result = NANOCORE_OK;
+    if (flags & NANOCORE_IMAGE_PREDECODE) {
+        result = image_predecode(vm, f, &header);
+    }
+    
+out:
+    fclose(f);
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Translation cache: the decoded block cache of a VM running a program
+// image, saved as dir/<image key>.nctc so the next process running the
+// same image starts warm. The file is a header page, then the slots laid
+// out exactly like vm->block_cache, which a later run maps MAP_PRIVATE as
+// its block cache. The file is untrusted: every restored block is decoded
+// again from guest RAM and dropped unless the result matches op for op,
+// so a stale, corrupt or foreign entry only costs a re-decode and no
+// stored opcode or register index reaches the interpreter unchecked.
+// Blocks keep their execution
+// counts and lose their host code: hot blocks are re-translated by the
+// JIT on their first run instead of after jit_threshold runs.
+// ---------------------------------------------------------------------------
+
+#define TCACHE_MAGIC 0x4354434Eu  // "NCTC"
+#define TCACHE_VERSION 3  // 2: blocks may hold superinstructions, 3: no hash table
+#define TCACHE_BLOCK_OFFSET 4096
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t image_key;
+    uint32_t entries;     // BLOCK_CACHE_ENTRIES
+    uint32_t block_size;  // sizeof(decoded_block_t)
+    uint32_t max_ops;     // BLOCK_MAX_OPS
+    uint32_t reserved;
+} tcache_header_t;
+
+static void tcache_path(char* path, size_t size, const char* dir, uint64_t key) {
+    snprintf(path, size, "%s/%016llx.nctc", dir, (unsigned long long)key);
+}
+
+// Write the VM's decoded blocks to dir/<image key>.nctc. Blocks holding
+// breakpoints are left out. NANOCORE_ERROR if no image is loaded.
+int nanocore_vm_save_translations(int vm_handle, const char* dir) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !dir) {
+        return NANOCORE_EINVAL;
+    }
+    if (!vm->image_key || !vm->block_cache) {
+        return NANOCORE_ERROR;
+    }
+    
+    decoded_block_t* blocks = calloc(BLOCK_CACHE_ENTRIES, sizeof(decoded_block_t));
+    if (!blocks) {
+        return NANOCORE_ENOMEM;
+    }
+    for (int i = 0; i < BLOCK_CACHE_ENTRIES; i++) {
+        const decoded_block_t* block = &vm->block_cache[i];
+        bool keep = block->num_ops != 0;
+        for (uint32_t j = 0; keep && j < block->num_ops; j++) {
+            keep = block->ops[j].opcode != DECODED_BREAK;
+        }
+        if (keep) {
+            blocks[i] = *block;
+            blocks[i].jit_code = NULL;
+        }
+    }
+    
+    tcache_header_t header = {
+        .magic = TCACHE_MAGIC, .version = TCACHE_VERSION, .image_key = vm->image_key,
+        .entries = BLOCK_CACHE_ENTRIES, .block_size = sizeof(decoded_block_t), .max_ops = BLOCK_MAX_OPS,
+    };
+    static const uint8_t zeros[TCACHE_BLOCK_OFFSET];
+    
+    // Write under a private name and rename, so concurrent workers never
+    // map a half-written file
+    char path[4096];
+    char temp[4096 + 32];
+    tcache_path(path, sizeof(path), dir, vm->image_key);
+#if defined(_WIN32)
+    snprintf(temp, sizeof(temp), "%s.%lu", path, (unsigned long)GetCurrentProcessId());
+#else
+    snprintf(temp, sizeof(temp), "%s.%ld", path, (long)getpid());
+#endif
+    int result = NANOCORE_ERROR;
+    FILE* f = fopen(temp, "wb");
+    if (f) {
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                  fwrite(zeros, 1, TCACHE_BLOCK_OFFSET - sizeof(header), f) == TCACHE_BLOCK_OFFSET - sizeof(header) &&
+                  fwrite(blocks, sizeof(decoded_block_t), BLOCK_CACHE_ENTRIES, f) == BLOCK_CACHE_ENTRIES;
+        ok = fclose(f) == 0 && ok;
+#if defined(_WIN32)
+        remove(path);  // rename does not replace on Windows
+#endif
+        if (ok && rename(temp, path) == 0) {
+            result = NANOCORE_OK;
+        } else {
+            remove(temp);
+        }
+    }
+    
+    free(blocks);
+    return result;
+}
+
+// Replace the VM's block cache with the one saved for its loaded image.
+// restored, if given, gets the number of blocks that still match guest
+// RAM. NANOCORE_ERROR if there is no cache file for this image.
+int nanocore_vm_load_translations(int vm_handle, const char* dir, uint32_t* restored) {
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!vm || !dir) {
+        return NANOCORE_EINVAL;
+    }
+    if (!vm->image_key) {
+        return NANOCORE_ERROR;
+    }
+    
+    char path[4096];
+    tcache_path(path, sizeof(path), dir, vm->image_key);
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return NANOCORE_ERROR;
+    }
+    
+    const size_t cache_size = BLOCK_CACHE_ENTRIES * sizeof(decoded_block_t);
+    tcache_header_t header;
+    int64_t file_size = -1;
+    if (image_seek(f, 0, SEEK_END) == 0) {
+        file_size = image_tell(f);
+    }
+    if (file_size < (int64_t)(TCACHE_BLOCK_OFFSET + cache_size) ||
+        !image_read(f, 0, &header, sizeof(header)) ||
+        header.magic != TCACHE_MAGIC || header.version != TCACHE_VERSION ||
+        header.image_key != vm->image_key || header.entries != BLOCK_CACHE_ENTRIES ||
+        header.block_size != sizeof(decoded_block_t) || header.max_ops != BLOCK_MAX_OPS) {
+        fclose(f);
+        return NANOCORE_ERROR;
+    }
+    
+#if !defined(_WIN32)
+    decoded_block_t* cache = mmap(NULL, cache_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                                  fileno(f), TCACHE_BLOCK_OFFSET);
+    bool mapped = cache != MAP_FAILED;
+#else
+    decoded_block_t* cache = NULL;
+    bool mapped = false;
+#endif
+    if (!mapped) {
+        cache = malloc(cache_size);
+        if (!cache || !image_read(f, TCACHE_BLOCK_OFFSET, cache, cache_size)) {
+            free(cache);
+            fclose(f);
+            return cache ? NANOCORE_ERROR : NANOCORE_ENOMEM;
+        }
+    }
+    fclose(f);
+    
+    // Only reading a slot keeps its page shared with the file
+    uint32_t count = 0;
+    decoded_op_t ops[BLOCK_MAX_OPS];
+    for (int i = 0; i < BLOCK_CACHE_ENTRIES; i++) {
+        decoded_block_t* block = &cache[i];
+        if (block->num_ops == 0) {
+            continue;
+        }
+        bool valid = block->num_ops <= BLOCK_MAX_OPS && !(block->pc & 3) &&
+                     (int)((block->pc >> 2) & (BLOCK_CACHE_ENTRIES - 1)) == i &&
+                     block->pc < vm->memory_size &&
+                     (uint64_t)block->num_ops * 4 <= vm->memory_size - block->pc;
+        uint64_t first = block->pc >> GUEST_PAGE_SHIFT;
+        uint64_t last = (block->pc + block->num_ops * 4 - 1) >> GUEST_PAGE_SHIFT;
+        for (uint64_t page = first; valid && page <= last; page++) {
+            valid = !(vm->page_flags[page] & PAGE_FLAG_BREAK);  // Needs a fresh decode
+        }
+        // The stored ops must be exactly what decoding guest RAM gives
+        if (!valid || block->jit_code || decode_ops(vm, block->pc, ops) != block->num_ops ||
+            memcmp(ops, block->ops, block->num_ops * sizeof(decoded_op_t)) != 0) {
+            block->num_ops = 0;
+            continue;
+        }
+        for (uint64_t page = first; page <= last; page++) {
+            vm->page_flags[page] |= PAGE_FLAG_CODE;
+        }
+        count++;
+    }
+    
+    block_cache_release(vm);
+    vm->block_cache = cache;
+    vm->block_cache_mapped = mapped;
+#if NANOCORE_JIT
+    if (vm->jit) {
+        vm->jit->flush_pending = true;  // Old translations belong to the old cache
+    }
+#endif
+    if (restored) {
+        *restored = count;
+    }
+    return NANOCORE_OK;
+}
+
+// ---------------------------------------------------------------------------
+// Cohorts: VMs holding the same program run in lockstep from one
+// structure-of-arrays register file, regs[r][column], one column per lane.
+// The leader (column 0) supplies the decoded blocks and each op updates
+// every column with one lane loop, cloned for AVX2 and AVX-512 like the
+// vector unit. Stores and memory ops go to each lane's own RAM. A lane
+// whose branch, return address or store outcome differs from the leader's
+// is split off and finishes the run on its own engine; lanes back at the
+// leader's PC rejoin at the start of the next run. The caller guarantees
+// the lanes hold the same code (image keys, when set, must match).
+// ---------------------------------------------------------------------------
+
+#define NANOCORE_COHORT_MAX_LANES 64
+#define COHORT_CHUNK 8  // Columns per lane-loop step: one AVX-512 or two AVX2 registers
+
+typedef struct nanocore_cohort nanocore_cohort_t;
+
+struct nanocore_cohort {
+    _Alignas(64) uint64_t regs[32][NANOCORE_COHORT_MAX_LANES];  // Lockstep lanes in columns 0..active-1
+    vm_instance_t* vms[NANOCORE_COHORT_MAX_LANES];              // By column, during a run
+    uint32_t lane_of[NANOCORE_COHORT_MAX_LANES];                // Column to lane
+    uint32_t active;                                            // Columns still in lockstep
+    uint32_t lanes;
+    int handles[NANOCORE_COHORT_MAX_LANES];                     // By lane
+    uint64_t retired[NANOCORE_COHORT_MAX_LANES];                // Lockstep instructions per lane this run
+    bool pending[NANOCORE_COHORT_MAX_LANES];                    // Split off, finishes on its own engine
+    int results[NANOCORE_COHORT_MAX_LANES];
+    uint64_t lockstep_mask;                                     // Lanes the last run kept in lockstep
+};
+
+// d = a op b in every column; columns past n are padding and may hold
+// anything
+#define COHORT_LANES(EXPR)                                                 \
+    for (uint32_t j = 0; j < n; j += COHORT_CHUNK) {                       \
+        uint64_t x[COHORT_CHUNK], y[COHORT_CHUNK], z[COHORT_CHUNK];        \
+        memcpy(x, a + j, sizeof(x));                                       \
+        memcpy(y, b + j, sizeof(y));                                       \
+        memcpy(z, d + j, sizeof(z));                                       \
+        for (int k = 0; k < COHORT_CHUNK; k++) z[k] = (EXPR);              \
+        memcpy(d + j, z, sizeof(z));                                       \
+    }
+
+NANOCORE_VECTOR_CLONES
+static void cohort_alu(uint8_t opcode, uint64_t* d, const uint64_t* a, const uint64_t* b, uint32_t n) {
+    switch (opcode) {
+        case 0x00: COHORT_LANES(x[k] + y[k]) break;
+        case 0x01: COHORT_LANES(x[k] - y[k]) break;
+        case 0x02: COHORT_LANES(x[k] * y[k]) break;
+        case 0x04: COHORT_LANES(y[k] ? x[k] / y[k] : z[k]) break;
+        case 0x05: COHORT_LANES(y[k] ? x[k] % y[k] : z[k]) break;
+        case 0x06: COHORT_LANES(x[k] & y[k]) break;
+        case 0x07: COHORT_LANES(x[k] | y[k]) break;
+        case 0x08: COHORT_LANES(x[k] ^ y[k]) break;
+        case 0x0A: COHORT_LANES(x[k] << (y[k] & 63)) break;
+        default: COHORT_LANES(x[k] >> (y[k] & 63)) break;
+    }
+}
+
+NANOCORE_VECTOR_CLONES
+static void cohort_fill(uint64_t* d, uint64_t value, uint32_t n) {
+    for (uint32_t j = 0; j < n; j += COHORT_CHUNK) {
+        for (int k = 0; k < COHORT_CHUNK; k++) {
+            d[j + k] = value;
+        }
+    }
+}
+
+static bool cohort_taken(uint8_t opcode, uint64_t a, uint64_t b) {
+    return opcode == 0x17 ? a == b : opcode == 0x18 ? a != b : (int64_t)a < (int64_t)b;
+}
+
+// True if any of the first n columns branches unlike column 0
+NANOCORE_VECTOR_CLONES
+static bool cohort_diverged(uint8_t opcode, const uint64_t* a, const uint64_t* b, uint32_t n) {
+    uint64_t differ = 0;
+    
+    if (opcode == 0x17) {
+        for (uint32_t j = 1; j < n; j++) differ |= (a[j] == b[j]) ^ (a[0] == b[0]);
+    } else if (opcode == 0x18) {
+        for (uint32_t j = 1; j < n; j++) differ |= (a[j] != b[j]) ^ (a[0] != b[0]);
+    } else {
+        for (uint32_t j = 1; j < n; j++) differ |= ((int64_t)a[j] < (int64_t)b[j]) ^ ((int64_t)a[0] < (int64_t)b[0]);
+    }
+    return differ != 0;
+}
+
+// Move column c out of lockstep: its registers and PC go back to its VM,
+// which has retired lockstep instructions so far. The last column takes
+// its place, so loops over columns that split must run downwards.
+static void cohort_split(nanocore_cohort_t* cohort, uint32_t c, uint64_t pc, uint64_t retired) {
+    vm_instance_t* vm = cohort->vms[c];
+    uint32_t lane = cohort->lane_of[c];
+    uint32_t last = --cohort->active;
+    
+    for (int r = 1; r < 32; r++) {
+        vm->state.gprs[r] = cohort->regs[r][c];
+        cohort->regs[r][c] = cohort->regs[r][last];
+    }
+    vm->state.pc = pc;
+    vm->state.perf_counters[0] += retired;  // Instruction count
+    vm->state.perf_counters[1] += retired;  // Cycle count
+    cohort->retired[lane] = retired;
+    cohort->pending[lane] = !vm->halted;
+    
+    cohort->vms[c] = cohort->vms[last];
+    cohort->lane_of[c] = cohort->lane_of[last];
+}
+
+// Stop column c for good: HALT (result EVENT_HALTED) or a fault
+static void cohort_stop(nanocore_cohort_t* cohort, uint32_t c, uint64_t pc, uint64_t retired, int result) {
+    vm_instance_t* vm = cohort->vms[c];
+    vm->halted = true;
+    if (result == EVENT_HALTED) {
+        vm->state.flags |= 0x80;
+    }
+    cohort->results[cohort->lane_of[c]] = result;
+    cohort_split(cohort, c, pc, retired);
+}
+
+// The columns left made it to the end of the run together
+static void cohort_mark_lockstep(nanocore_cohort_t* cohort) {
+    for (uint32_t c = 0; c < cohort->active; c++) {
+        cohort->lockstep_mask |= 1ull << cohort->lane_of[c];
+    }
+}
+
+// MCOPY, MFILL, a vector op or an atomic on column c's own RAM: NANOCORE_OK,
+// VECTOR_END_BLOCK after a code write or watchpoint hit, or NANOCORE_ERROR
+static int cohort_lane_op(nanocore_cohort_t* cohort, uint32_t c, const decoded_op_t* op) {
+    vm_instance_t* vm = cohort->vms[c];
+    uint64_t regs[32];
+    int result;
+    
+    for (int r = 0; r < 32; r++) {
+        regs[r] = cohort->regs[r][c];
+    }
+    if (op->opcode == 0x37) {
+        result = guest_copy(vm, regs[op->rd], regs[op->rs1], regs[op->rs2]) ? VECTOR_END_BLOCK : NANOCORE_OK;
+    } else if (op->opcode == 0x38) {
+        result = guest_fill(vm, regs[op->rd], (uint8_t)regs[op->rs1], regs[op->rs2]) ? VECTOR_END_BLOCK : NANOCORE_OK;
+    } else if (op->opcode < 0x30) {
+        result = execute_atomic(vm, op, regs);
+    } else {
+        result = execute_vector(vm, op, regs);
+    }
+    for (int r = 1; r < 32; r++) {
+        cohort->regs[r][c] = regs[r];
+    }
+    return result;
+}
+
+// Run the lockstep group until it halts, faults, uses up the budget or
+// shrinks to one lane. Returns the retired count.
+static uint64_t cohort_lockstep(nanocore_cohort_t* cohort, uint64_t budget) {
+    uint64_t (*regs)[NANOCORE_COHORT_MAX_LANES] = cohort->regs;
+    vm_instance_t* const leader = cohort->vms[0];
+    uint64_t pc = leader->state.pc;
+    uint64_t retired = 0;
+    uint64_t marked_first = UINT64_MAX;  // Code pages already flagged on every lane
+    uint64_t marked_last = UINT64_MAX;
+    
+    while (retired < budget && cohort->active > 1) {
+        // Lanes with an interrupt signal take it on their own engine
+        for (uint32_t c = cohort->active; c-- > 0;) {
+            if (!atomic_load_explicit(&cohort->vms[c]->irq_signal, memory_order_relaxed)) {
+                continue;
+            }
+            if (c == 0) {
+                while (cohort->active > 0) {
+                    cohort_split(cohort, cohort->active - 1, pc, retired);
+                }
+                return retired;
             }
+            cohort_split(cohort, c, pc, retired);
+        }
+        if (cohort->active < 2) {
             break;
-            
-        case 0x13:  // ST (simplified)
-            {
-                uint64_t addr = vm->state.gprs[rs1] + imm;
-                if (addr + 8 <= vm->memory_size) {
-                    *(uint64_t*)(vm->memory + addr) = vm->state.gprs[rd];
+        }
+        
+        decoded_block_t* block = &leader->block_cache[(pc >> 2) & (BLOCK_CACHE_ENTRIES - 1)];
+        if (block->num_ops == 0 || block->pc != pc) {
+            if (!decode_block(leader, pc, block)) {
+                while (cohort->active > 0) {
+                    cohort_stop(cohort, cohort->active - 1, pc, retired, NANOCORE_ERROR);
                 }
+                return retired;
             }
-            break;
-            
-        case 0x17:  // BEQ
-            if (vm->state.gprs[rd] == vm->state.gprs[rs1]) {
-                vm->state.pc += (imm << 1) - 4;  // PC will be incremented by 4 later
+        }
+        block->exec_count++;
+        
+        // Stores into the shared code must end the writer's block too. A
+        // lane's flag only clears when it writes there, which splits it.
+        uint64_t first = pc >> GUEST_PAGE_SHIFT;
+        uint64_t last = (pc + block->num_ops * 4 - 1) >> GUEST_PAGE_SHIFT;
+        if (first != marked_first || last != marked_last) {
+            for (uint32_t c = 1; c < cohort->active; c++) {
+                cohort->vms[c]->page_flags[first] |= PAGE_FLAG_CODE;
+                cohort->vms[c]->page_flags[last] |= PAGE_FLAG_CODE;
             }
-            break;
+            marked_first = first;
+            marked_last = last;
+        }
+        
+        uint32_t n = block->num_ops;
+        if (budget - retired < n) {
+            n = (uint32_t)(budget - retired);
+        }
+        uint64_t next = pc + (uint64_t)n * 4;
+        bool leader_stopped = false;
+        
+        for (uint32_t i = 0; i < n && !leader_stopped; i++) {
+            const decoded_op_t* op = &block->ops[i];
+            uint64_t op_pc = pc + (uint64_t)i * 4;
+            uint8_t opcode = decoded_opcode(op->opcode);
+            uint32_t k = cohort->active;
             
-        case 0x18:  // BNE
-            if (vm->state.gprs[rd] != vm->state.gprs[rs1]) {
-                vm->state.pc += (imm << 1) - 4;
+            switch (opcode) {
+                case 0x00: case 0x01: case 0x02: case 0x04: case 0x05:
+                case 0x06: case 0x07: case 0x08: case 0x0A: case 0x0B:
+                    cohort_alu(opcode, regs[op->rd], regs[op->rs1], regs[op->rs2], k);
+                    break;
+                    
+                case 0x0F:  // LD (immediate)
+                    cohort_fill(regs[op->rd], (uint64_t)(int64_t)op->imm, k);
+                    break;
+                    
+                case 0x22:  // NOP
+                    break;
+                    
+                case 0x13:  // ST
+                    for (uint32_t c = k; c-- > 0;) {
+                        vm_instance_t* vm = cohort->vms[c];
+                        uint64_t addr = regs[op->rs1][c] + (uint64_t)(int64_t)op->imm;
+                        if (addr < vm->memory_size && vm->memory_size - addr >= 8) {
+                            *(uint64_t*)(vm->memory + addr) = regs[op->rd][c];
+                            if (PAGE_STORE_SLOW(vm->page_flags[addr >> GUEST_PAGE_SHIFT],
+                                                vm->page_flags[(addr + 7) >> GUEST_PAGE_SHIFT]) &&
+                                guest_store_slow(vm, addr, 8)) {
+                                if (c == 0) {
+                                    leader_stopped = true;
+                                } else {
+                                    cohort_split(cohort, c, op_pc + 4, retired + i + 1);
+                                }
+                            }
+                        }
+                    }
+                    break;
+                    
+                case 0x30: case 0x31: case 0x32: case 0x33: case 0x34:
+                case 0x35: case 0x36: case 0x37: case 0x38: case 0x39:
+                case 0x3A: case 0x3B: case 0x28: case 0x29: case 0x2A:
+                case 0x2B: case 0x2C: case 0x2D: case 0x2E: case 0x2F:
+                    for (uint32_t c = k; c-- > 0;) {
+                        int result = cohort_lane_op(cohort, c, op);
+                        if (result == NANOCORE_ERROR) {
+                            cohort_stop(cohort, c, op_pc + 4, retired + i, NANOCORE_ERROR);
+                        } else if (result == VECTOR_END_BLOCK && c > 0) {
+                            cohort_split(cohort, c, op_pc + 4, retired + i + 1);
+                        }
+                        if (result != NANOCORE_OK && c == 0) {
+                            leader_stopped = true;
+                        }
+                    }
+                    break;
+                    
+                case 0x17: case 0x18: case 0x19:  // BEQ, BNE, BLT
+                    {
+                        uint64_t taken_pc = op_pc + (uint64_t)(int64_t)op->imm * 2;
+                        bool taken = cohort_taken(opcode, regs[op->rd][0], regs[op->rs1][0]);
+                        next = taken ? taken_pc : op_pc + 4;
+                        if (!cohort_diverged(opcode, regs[op->rd], regs[op->rs1], k)) {
+                            break;
+                        }
+                        for (uint32_t c = k; c-- > 1;) {
+                            if (cohort_taken(opcode, regs[op->rd][c], regs[op->rs1][c]) != taken) {
+                                cohort_split(cohort, c, taken ? op_pc + 4 : taken_pc, retired + i + 1);
+                            }
+                        }
+                    }
+                    break;
+                    
+                case 0x1E:  // CALL
+                    cohort_fill(regs[31], op_pc + 4, k);
+                    next = op_pc + (uint64_t)(int64_t)op->imm * 4;
+                    break;
+                    
+                case 0x1F:  // RET
+                    next = regs[31][0];
+                    for (uint32_t c = k; c-- > 1;) {
+                        if (regs[31][c] != next) {
+                            cohort_split(cohort, c, regs[31][c], retired + i + 1);
+                        }
+                    }
+                    break;
+                    
+                case 0x3C:  // IRET
+                    next = irq_return(cohort->vms[0]);
+                    for (uint32_t c = k; c-- > 1;) {
+                        uint64_t resume = irq_return(cohort->vms[c]);
+                        if (resume != next) {
+                            cohort_split(cohort, c, resume, retired + i + 1);
+                        }
+                    }
+                    break;
+                    
+                case 0x21:  // HALT (not counted as retired)
+                    cohort_mark_lockstep(cohort);
+                    while (cohort->active > 0) {
+                        cohort_stop(cohort, cohort->active - 1, op_pc + 4, retired + i, EVENT_HALTED);
+                    }
+                    return retired + i;
+                    
+                default:
+                    while (cohort->active > 0) {
+                        cohort_stop(cohort, cohort->active - 1, op_pc + 4, retired + i, NANOCORE_ERROR);
+                    }
+                    return retired + i;
             }
-            break;
             
-        case 0x19:  // BLT
-            if ((int64_t)vm->state.gprs[rd] < (int64_t)vm->state.gprs[rs1]) {
-                vm->state.pc += (imm << 1) - 4;
+            if (leader_stopped) {
+                // The leader's code changed, faulted or hit a watchpoint
+                while (cohort->active > 0) {
+                    cohort_split(cohort, cohort->active - 1, op_pc + 4, retired + i + 1);
+                }
+                return retired + i + 1;
             }
-            break;
-            
-        case 0x21:  // HALT
-            vm->halted = true;
-            vm->state.flags |= 0x80;
-            return EVENT_HALTED;
-            
-        case 0x22:  // NOP
-            break;
-            
-        default:
-            // Unknown instruction
-            vm->halted = true;
-            return NANOCORE_ERROR;
+        }
+        
+        retired += n;
+        pc = next;
     }
     
-    // Update performance counters
-    vm->state.perf_counters[0]++;  // Instruction count
-    vm->state.perf_counters[1]++;  // Cycle count
-    
-    return NANOCORE_OK;
+    if (cohort->active > 1) {
+        cohort_mark_lockstep(cohort);
+    }
+    while (cohort->active > 0) {
+        cohort_split(cohort, cohort->active - 1, pc, retired);
+    }
+    return retired;
 }
 
-// Execute single instruction
-int nanocore_vm_step(int vm_handle) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle]) {
+// Group handles of VMs loaded with the same program into a cohort of up
+// to NANOCORE_COHORT_MAX_LANES lanes. The VMs stay usable on their own
+// between cohort runs.
+int nanocore_cohort_create(const int* vm_handles, uint32_t count, nanocore_cohort_t** cohort) {
+    if (!cohort) {
         return NANOCORE_EINVAL;
     }
-    
-    vm_instance_t* vm = vms[vm_handle];
-    
-    if (vm->halted) {
-        return EVENT_HALTED;
-    }
-    
-    // Check bounds
-    if (vm->state.pc + 4 > vm->memory_size) {
-        vm->halted = true;
-        return NANOCORE_ERROR;
+    *cohort = NULL;
+    if (!vm_handles || count == 0 || count > NANOCORE_COHORT_MAX_LANES) {
+        return NANOCORE_EINVAL;
     }
     
-    // Check breakpoints
-    for (int i = 0; i < vm->num_breakpoints; i++) {
-        if (vm->breakpoints[i] == vm->state.pc) {
-            return EVENT_BREAKPOINT;
+    vm_instance_t* first = vm_lookup(vm_handles[0]);
+    for (uint32_t i = 0; i < count; i++) {
+        vm_instance_t* vm = vm_lookup(vm_handles[i]);
+        if (!vm || vm->memory_size != first->memory_size || vm->image_key != first->image_key) {
+            return NANOCORE_EINVAL;
+        }
+        for (uint32_t j = 0; j < i; j++) {
+            if (vm_handles[j] == vm_handles[i]) {
+                return NANOCORE_EINVAL;
+            }
         }
     }
     
-    // Fetch instruction
-    uint32_t instruction = *(uint32_t*)(vm->memory + vm->state.pc);
+    nanocore_cohort_t* c = aligned_alloc(_Alignof(nanocore_cohort_t), sizeof(nanocore_cohort_t));
+    if (!c) {
+        return NANOCORE_ENOMEM;
+    }
+    memset(c, 0, sizeof(*c));
+    c->lanes = count;
+    memcpy(c->handles, vm_handles, count * sizeof(int));
     
-    // Execute
-    vm->state.pc += 4;
-    return execute_instruction(vm, instruction);
+    *cohort = c;
+    return NANOCORE_OK;
 }
 
-// Run VM for specified number of instructions
-int nanocore_vm_run(int vm_handle, uint64_t max_instructions) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle]) {
+// Run every lane for up to max_instructions (0 = until it stops), as
+// nanocore_vm_run would, storing each lane's result in results[lane].
+// Lanes at the first runnable lane's PC start in lockstep; lanes with
+// breakpoints or profiling run on their own.
+int nanocore_cohort_run(nanocore_cohort_t* cohort, uint64_t max_instructions, int* results) {
+    if (!cohort || !results) {
         return NANOCORE_EINVAL;
     }
     
-    vm_instance_t* vm = vms[vm_handle];
-    uint64_t count = 0;
+    vm_instance_t* lanes[NANOCORE_COHORT_MAX_LANES];
+    for (uint32_t i = 0; i < cohort->lanes; i++) {
+        lanes[i] = vm_lookup(cohort->handles[i]);
+        if (!lanes[i]) {
+            return NANOCORE_EINVAL;
+        }
+    }
+    
+    uint64_t budget = max_instructions ? max_instructions : UINT64_MAX;
+    bool ran[NANOCORE_COHORT_MAX_LANES];
+    vm_instance_t* leader = NULL;
+    cohort->active = 0;
+    cohort->lockstep_mask = 0;
     
-    while (!vm->halted && (max_instructions == 0 || count < max_instructions)) {
-        int result = nanocore_vm_step(vm_handle);
-        if (result != NANOCORE_OK) {
-            return result;
+    // Ring completions land before the slice, as in nanocore_vm_run
+    for (uint32_t i = 0; i < cohort->lanes; i++) {
+        vm_instance_t* vm = lanes[i];
+        ring_service(vm);
+        cohort->results[i] = vm->halted ? EVENT_HALTED : NANOCORE_OK;
+        cohort->retired[i] = 0;
+        cohort->pending[i] = !vm->halted;
+        ran[i] = !vm->halted;
+        if (vm->halted || vm->profile || vm->breakpoints.count > 0 ||
+            atomic_load_explicit(&vm->irq_signal, memory_order_relaxed) ||
+            (leader && vm->state.pc != leader->state.pc)) {
+            continue;
         }
-        count++;
+        if (!leader) {
+            if (!vm->block_cache) {
+                vm->block_cache = calloc(BLOCK_CACHE_ENTRIES, sizeof(decoded_block_t));
+                if (!vm->block_cache) {
+                    continue;  // Runs on its own, which reports the failure
+                }
+            }
+            leader = vm;
+        }
+        
+        uint32_t c = cohort->active++;
+        cohort->vms[c] = vm;
+        cohort->lane_of[c] = i;
+        cohort->pending[i] = false;
+        for (int r = 0; r < 32; r++) {
+            cohort->regs[r][c] = vm->state.gprs[r];
+        }
+        cohort->regs[0][c] = 0;
+    }
+    
+    // A group of one is faster on the lane's own engine
+    if (cohort->active == 1) {
+        cohort->active = 0;
+        cohort->pending[cohort->lane_of[0]] = true;
+    }
+    if (cohort->active > 0) {
+        cohort_lockstep(cohort, budget);
     }
     
-    return vm->halted ? EVENT_HALTED : NANOCORE_OK;
+    // Split-off lanes finish their budget alone
+    for (uint32_t i = 0; i < cohort->lanes; i++) {
+        vm_instance_t* vm = lanes[i];
+        if (cohort->pending[i]) {
+            if (budget - cohort->retired[i] > 0) {
+                cohort->results[i] = run_engine(vm, budget - cohort->retired[i]);
+            } else if (vm->watch_hit) {
+                vm->watch_hit = false;
+                cohort->results[i] = EVENT_WATCHPOINT;
+            }
+        }
+        results[i] = cohort->results[i];
+        if (ran[i]) {
+            ring_service(vm);
+            report_stop(vm, results[i]);
+        }
+    }
+    return NANOCORE_OK;
 }
 
-// Get VM state
-int nanocore_vm_get_state(int vm_handle, vm_state_t* state) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle] || !state) {
+// Lanes that stayed in lockstep until the last run ended, one bit per lane
+int nanocore_cohort_get_lockstep(const nanocore_cohort_t* cohort, uint64_t* lane_mask) {
+    if (!cohort || !lane_mask) {
         return NANOCORE_EINVAL;
     }
-    
-    *state = vms[vm_handle]->state;
+    *lane_mask = cohort->lockstep_mask;
     return NANOCORE_OK;
 }
 
-// Get register value
-int nanocore_vm_get_register(int vm_handle, int reg_index, uint64_t* value) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle] || 
-        reg_index < 0 || reg_index >= 32 || !value) {
+// Free a cohort; its VMs are not touched
+int nanocore_cohort_destroy(nanocore_cohort_t* cohort) {
+    if (!cohort) {
         return NANOCORE_EINVAL;
     }
-    
-    *value = vms[vm_handle]->state.gprs[reg_index];
+    free(cohort);
     return NANOCORE_OK;
 }
 
-// Set register value
-int nanocore_vm_set_register(int vm_handle, int reg_index, uint64_t value) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle] || 
-        reg_index < 0 || reg_index >= 32) {
-        return NANOCORE_EINVAL;
+// ---------------------------------------------------------------------------
+// Worker-pool scheduler: a fixed set of host threads time-slices submitted
+// VMs with nanocore_vm_run(handle, quantum). Each worker owns a Chase-Lev
+// deque. It pushes preempted jobs at the bottom and takes from the top, so
+// its own jobs round-robin; idle workers steal from the top of other
+// deques. New submissions go through a shared injection queue. A VM
+// belongs to the scheduler from submit until its completion is delivered
+// and must not be used or destroyed by the caller in between.
+// ---------------------------------------------------------------------------
+
+// Why a scheduled VM stopped
+enum {
+    NANOCORE_DONE_HALTED = 0,      // HALT retired
+    NANOCORE_DONE_BREAKPOINT = 1,  // Stopped at a breakpoint or watchpoint
+    NANOCORE_DONE_BUDGET = 2,      // Instruction budget used up
+    NANOCORE_DONE_ERROR = 3,       // Run failed or the handle went stale; see status
+    NANOCORE_DONE_CANCELLED = 4    // Scheduler destroyed first
+};
+
+// Result delivered once for every submitted VM
+typedef struct {
+    int vm_handle;
+    int status;             // Last nanocore_vm_run result
+    uint32_t reason;        // NANOCORE_DONE_*
+    uint32_t reserved;
+    uint64_t instructions;  // Retired while scheduled
+    uint64_t user_data;
+} nanocore_completion_t;
+
+// Runs on a worker thread in place of queueing the completion
+typedef void (*nanocore_completion_fn)(const nanocore_completion_t* completion, void* context);
+
+typedef struct nanocore_scheduler nanocore_scheduler_t;
+
+#define SCHED_MAX_WORKERS 256
+#define SCHED_DEFAULT_QUANTUM 10000
+#define SCHED_DEQUE_INITIAL 64  // Slots per worker deque; doubles when full
+
+#if NANOCORE_SCHEDULER
+typedef struct sched_job {
+    nanocore_completion_t result;  // vm_handle and user_data set at submit
+    uint64_t quantum;
+    uint64_t budget;               // Instructions left, 0 = run until it stops
+    uint64_t start_count;          // Instruction counter at submit
+    struct sched_job* next;        // Injection or completion queue link
+} sched_job_t;
+
+typedef struct sched_ring {
+    int64_t capacity;              // Power of two
+    struct sched_ring* retired;    // Smaller rings thieves may still read
+    _Atomic(sched_job_t*) slots[];
+} sched_ring_t;
+
+// Chase-Lev deque; top and bottom live on separate cache lines
+typedef struct {
+    _Alignas(64) _Atomic int64_t top;
+    _Alignas(64) _Atomic int64_t bottom;
+    _Atomic(sched_ring_t*) ring;
+} sched_deque_t;
+
+typedef struct {
+    sched_deque_t deque;
+    nanocore_scheduler_t* sched;
+    pthread_t thread;
+    uint32_t index;
+    uint32_t rng;                  // Victim selection
+} sched_worker_t;
+
+struct nanocore_scheduler {
+    sched_worker_t* workers;
+    uint32_t num_workers;
+    uint32_t started;              // Threads actually running
+    nanocore_completion_fn callback;
+    void* callback_context;
+    
+    pthread_mutex_t lock;          // Injection queue and sleeping workers
+    pthread_cond_t work_ready;
+    sched_job_t* inject_head;
+    sched_job_t* inject_tail;
+    _Atomic int64_t queued;        // Runnable jobs not yet picked up
+    _Atomic int idle;              // Workers waiting on work_ready
+    _Atomic bool stopping;
+    
+    pthread_mutex_t done_lock;     // Completion queue
+    pthread_cond_t done_ready;
+    sched_job_t* done_head;
+    sched_job_t* done_tail;
+    int64_t outstanding;           // Submitted, not yet delivered (done_lock)
+};
+
+static sched_ring_t* sched_ring_create(int64_t capacity) {
+    sched_ring_t* ring = calloc(1, sizeof(sched_ring_t) + (size_t)capacity * sizeof(ring->slots[0]));
+    if (ring) {
+        ring->capacity = capacity;
+    }
+    return ring;
+}
+
+static bool sched_deque_init(sched_deque_t* deque) {
+    sched_ring_t* ring = sched_ring_create(SCHED_DEQUE_INITIAL);
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->ring, ring);
+    return ring != NULL;
+}
+
+static void sched_deque_free(sched_deque_t* deque) {
+    sched_ring_t* ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+    while (ring) {
+        sched_ring_t* older = ring->retired;
+        free(ring);
+        ring = older;
     }
+}
+
+// Owner only: append at the bottom, growing the ring when full
+static bool sched_deque_push(sched_deque_t* deque, sched_job_t* job) {
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    sched_ring_t* ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
     
-    if (reg_index != 0) {  // R0 is hardwired to zero
-        vms[vm_handle]->state.gprs[reg_index] = value;
+    if (b - t > ring->capacity - 1) {
+        sched_ring_t* grown = sched_ring_create(ring->capacity * 2);
+        if (!grown) {
+            return false;
+        }
+        for (int64_t i = t; i < b; i++) {
+            sched_job_t* moved = atomic_load_explicit(&ring->slots[i & (ring->capacity - 1)], memory_order_relaxed);
+            atomic_store_explicit(&grown->slots[i & (grown->capacity - 1)], moved, memory_order_relaxed);
+        }
+        grown->retired = ring;
+        atomic_store_explicit(&deque->ring, grown, memory_order_release);
+        ring = grown;
     }
     
-    return NANOCORE_OK;
+    atomic_store_explicit(&ring->slots[b & (ring->capacity - 1)], job, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_release);
+    return true;
 }
 
-// Load program into memory
-int nanocore_vm_load_program(int vm_handle, const uint8_t* data, uint64_t size, uint64_t address) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle] || !data) {
-        return NANOCORE_EINVAL;
+// Any thread, owner included: remove the oldest job, NULL when empty
+static sched_job_t* sched_deque_steal(sched_deque_t* deque) {
+    for (;;) {
+        int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+        if (t >= b) {
+            return NULL;
+        }
+        
+        sched_ring_t* ring = atomic_load_explicit(&deque->ring, memory_order_acquire);
+        sched_job_t* job = atomic_load_explicit(&ring->slots[t & (ring->capacity - 1)], memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                    memory_order_seq_cst, memory_order_relaxed)) {
+            return job;
+        }
+        // Lost the race for this slot; look again
     }
+}
+
+// Hand a finished job to the callback or the completion queue
+static void sched_complete(nanocore_scheduler_t* sched, sched_job_t* job, uint32_t reason, int status) {
+    vm_instance_t* vm = vm_lookup(job->result.vm_handle);
+    job->result.reason = reason;
+    job->result.status = status;
+    job->result.instructions = vm ? vm->state.perf_counters[0] - job->start_count : 0;
     
-    vm_instance_t* vm = vms[vm_handle];
+    if (sched->callback) {
+        sched->callback(&job->result, sched->callback_context);
+        free(job);
+        pthread_mutex_lock(&sched->done_lock);
+        sched->outstanding--;
+        pthread_mutex_unlock(&sched->done_lock);
+        return;
+    }
     
-    if (address + size > vm->memory_size) {
-        return NANOCORE_EINVAL;
+    job->next = NULL;
+    pthread_mutex_lock(&sched->done_lock);
+    if (sched->done_tail) {
+        sched->done_tail->next = job;
+    } else {
+        sched->done_head = job;
     }
+    sched->done_tail = job;
+    pthread_cond_signal(&sched->done_ready);
+    pthread_mutex_unlock(&sched->done_lock);
+}
+
+// Make a job runnable again from a worker, waking a sleeper if any
+static void sched_requeue(sched_worker_t* worker, sched_job_t* job) {
+    nanocore_scheduler_t* sched = worker->sched;
     
-    memcpy(vm->memory + address, data, size);
-    vm->state.pc = address;  // Set PC to start of program
+    if (!sched_deque_push(&worker->deque, job)) {
+        // Out of memory for a bigger ring: fall back to the shared queue
+        pthread_mutex_lock(&sched->lock);
+        job->next = NULL;
+        if (sched->inject_tail) {
+            sched->inject_tail->next = job;
+        } else {
+            sched->inject_head = job;
+        }
+        sched->inject_tail = job;
+        pthread_mutex_unlock(&sched->lock);
+    }
     
-    return NANOCORE_OK;
+    // Publish before checking for sleepers; workers check in the opposite order
+    atomic_fetch_add(&sched->queued, 1);
+    if (atomic_load(&sched->idle) > 0) {
+        pthread_mutex_lock(&sched->lock);
+        pthread_cond_signal(&sched->work_ready);
+        pthread_mutex_unlock(&sched->lock);
+    }
 }
 
-// Read memory
-int nanocore_vm_read_memory(int vm_handle, uint64_t address, uint8_t* buffer, uint64_t size) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle] || !buffer) {
-        return NANOCORE_EINVAL;
+// Own deque first, then new submissions, then other workers' deques
+static sched_job_t* sched_find_work(sched_worker_t* worker) {
+    nanocore_scheduler_t* sched = worker->sched;
+    
+    sched_job_t* job = sched_deque_steal(&worker->deque);
+    if (job) {
+        return job;
     }
     
-    vm_instance_t* vm = vms[vm_handle];
+    pthread_mutex_lock(&sched->lock);
+    job = sched->inject_head;
+    if (job) {
+        sched->inject_head = job->next;
+        if (!sched->inject_head) {
+            sched->inject_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+    if (job) {
+        return job;
+    }
     
-    if (address + size > vm->memory_size) {
-        return NANOCORE_EINVAL;
+    worker->rng ^= worker->rng << 13;
+    worker->rng ^= worker->rng >> 17;
+    worker->rng ^= worker->rng << 5;
+    uint32_t start = worker->rng % sched->num_workers;
+    for (uint32_t i = 0; i < sched->num_workers; i++) {
+        uint32_t victim = (start + i) % sched->num_workers;
+        if (victim == worker->index) {
+            continue;
+        }
+        job = sched_deque_steal(&sched->workers[victim].deque);
+        if (job) {
+            return job;
+        }
     }
     
-    memcpy(buffer, vm->memory + address, size);
-    return NANOCORE_OK;
+    return NULL;
 }
 
-// Write memory
-int nanocore_vm_write_memory(int vm_handle, uint64_t address, const uint8_t* data, uint64_t size) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle] || !data) {
-        return NANOCORE_EINVAL;
-    }
+// Run slices of one job until it finishes or someone else is waiting
+static void sched_run_job(sched_worker_t* worker, sched_job_t* job) {
+    nanocore_scheduler_t* sched = worker->sched;
     
-    vm_instance_t* vm = vms[vm_handle];
+    for (;;) {
+        vm_instance_t* vm = vm_lookup(job->result.vm_handle);
+        if (!vm) {
+            sched_complete(sched, job, NANOCORE_DONE_ERROR, NANOCORE_EINVAL);
+            return;
+        }
+        
+        uint64_t slice = job->quantum;
+        if (job->budget && job->budget < slice) {
+            slice = job->budget;
+        }
+        
+        uint64_t before = vm->state.perf_counters[0];
+        int status = nanocore_vm_run(job->result.vm_handle, slice);
+        uint64_t ran = vm->state.perf_counters[0] - before;
+        
+        if (status == EVENT_BREAKPOINT || status == EVENT_WATCHPOINT) {
+            sched_complete(sched, job, NANOCORE_DONE_BREAKPOINT, status);
+            return;
+        }
+        if (status < 0) {
+            sched_complete(sched, job, NANOCORE_DONE_ERROR, status);
+            return;
+        }
+        if (vm->halted) {
+            sched_complete(sched, job, NANOCORE_DONE_HALTED, status);
+            return;
+        }
+        if (job->budget) {
+            job->budget -= ran < job->budget ? ran : job->budget;
+            if (job->budget == 0) {
+                sched_complete(sched, job, NANOCORE_DONE_BUDGET, status);
+                return;
+            }
+        }
+        
+        // Nothing else runnable: keep the VM hot on this thread
+        if (atomic_load(&sched->queued) <= 0 && !atomic_load(&sched->stopping)) {
+            continue;
+        }
+        sched_requeue(worker, job);
+        return;
+    }
+}
+
+static void* sched_worker_main(void* arg) {
+    sched_worker_t* worker = arg;
+    nanocore_scheduler_t* sched = worker->sched;
     
-    if (address + size > vm->memory_size) {
-        return NANOCORE_EINVAL;
+    while (!atomic_load(&sched->stopping)) {
+        sched_job_t* job = sched_find_work(worker);
+        if (job) {
+            atomic_fetch_sub(&sched->queued, 1);
+            sched_run_job(worker, job);
+            continue;
+        }
+        
+        pthread_mutex_lock(&sched->lock);
+        atomic_fetch_add(&sched->idle, 1);
+        while (!atomic_load(&sched->stopping) && atomic_load(&sched->queued) <= 0) {
+            pthread_cond_wait(&sched->work_ready, &sched->lock);
+        }
+        atomic_fetch_sub(&sched->idle, 1);
+        pthread_mutex_unlock(&sched->lock);
     }
     
-    memcpy(vm->memory + address, data, size);
-    return NANOCORE_OK;
+    return NULL;
 }
 
-// Set breakpoint
-int nanocore_vm_set_breakpoint(int vm_handle, uint64_t address) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle]) {
-        return NANOCORE_EINVAL;
+// Stop and join the workers, then cancel whatever never finished
+static void sched_shutdown(nanocore_scheduler_t* sched) {
+    pthread_mutex_lock(&sched->lock);
+    atomic_store(&sched->stopping, true);
+    pthread_cond_broadcast(&sched->work_ready);
+    pthread_mutex_unlock(&sched->lock);
+    
+    for (uint32_t i = 0; i < sched->started; i++) {
+        pthread_join(sched->workers[i].thread, NULL);
     }
     
-    vm_instance_t* vm = vms[vm_handle];
+    for (uint32_t i = 0; i < sched->num_workers; i++) {
+        sched_job_t* job;
+        while ((job = sched_deque_steal(&sched->workers[i].deque)) != NULL) {
+            sched_complete(sched, job, NANOCORE_DONE_CANCELLED, NANOCORE_OK);
+        }
+        sched_deque_free(&sched->workers[i].deque);
+    }
+    while (sched->inject_head) {
+        sched_job_t* job = sched->inject_head;
+        sched->inject_head = job->next;
+        sched_complete(sched, job, NANOCORE_DONE_CANCELLED, NANOCORE_OK);
+    }
     
-    if (vm->num_breakpoints >= 64) {
-        return NANOCORE_ERROR;  // Too many breakpoints
+    // Nobody can wait on a scheduler that is going away
+    while (sched->done_head) {
+        sched_job_t* job = sched->done_head;
+        sched->done_head = job->next;
+        free(job);
     }
     
-    vm->breakpoints[vm->num_breakpoints++] = address;
-    return NANOCORE_OK;
+    pthread_cond_destroy(&sched->done_ready);
+    pthread_mutex_destroy(&sched->done_lock);
+    pthread_cond_destroy(&sched->work_ready);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->workers);
+    free(sched);
 }
+#endif
 
-// Clear breakpoint
-int nanocore_vm_clear_breakpoint(int vm_handle, uint64_t address) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle]) {
+// Start a scheduler with num_workers threads (0 = one per online CPU).
+// With a callback, completions are delivered on worker threads; without
+// one they queue up for nanocore_scheduler_wait.
+int nanocore_scheduler_create(uint32_t num_workers, nanocore_completion_fn callback, void* context,
+                              nanocore_scheduler_t** scheduler) {
+    if (!scheduler) {
         return NANOCORE_EINVAL;
     }
+    *scheduler = NULL;
+    
+#if NANOCORE_SCHEDULER
+    if (num_workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    if (num_workers > SCHED_MAX_WORKERS) {
+        num_workers = SCHED_MAX_WORKERS;
+    }
     
-    vm_instance_t* vm = vms[vm_handle];
+    nanocore_scheduler_t* sched = calloc(1, sizeof(nanocore_scheduler_t));
+    if (!sched) {
+        return NANOCORE_ENOMEM;
+    }
+    sched->workers = aligned_alloc(_Alignof(sched_worker_t), num_workers * sizeof(sched_worker_t));
+    if (!sched->workers) {
+        free(sched);
+        return NANOCORE_ENOMEM;
+    }
+    memset(sched->workers, 0, num_workers * sizeof(sched_worker_t));
     
-    for (int i = 0; i < vm->num_breakpoints; i++) {
-        if (vm->breakpoints[i] == address) {
-            // Remove by shifting others down
-            for (int j = i; j < vm->num_breakpoints - 1; j++) {
-                vm->breakpoints[j] = vm->breakpoints[j + 1];
-            }
-            vm->num_breakpoints--;
-            return NANOCORE_OK;
+    sched->num_workers = num_workers;
+    sched->callback = callback;
+    sched->callback_context = context;
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work_ready, NULL);
+    pthread_mutex_init(&sched->done_lock, NULL);
+    pthread_cond_init(&sched->done_ready, NULL);
+    atomic_init(&sched->queued, 0);
+    atomic_init(&sched->idle, 0);
+    atomic_init(&sched->stopping, false);
+    
+    int result = NANOCORE_OK;
+    for (uint32_t i = 0; i < num_workers; i++) {
+        sched_worker_t* worker = &sched->workers[i];
+        worker->sched = sched;
+        worker->index = i;
+        worker->rng = 0x9E3779B9u * (i + 1);
+        if (!sched_deque_init(&worker->deque)) {
+            result = NANOCORE_ENOMEM;
+        }
+    }
+    for (uint32_t i = 0; i < num_workers && result == NANOCORE_OK; i++) {
+        if (pthread_create(&sched->workers[i].thread, NULL, sched_worker_main, &sched->workers[i]) != 0) {
+            result = NANOCORE_ERROR;
+            break;
         }
+        sched->started++;
+    }
+    if (result != NANOCORE_OK) {
+        sched_shutdown(sched);
+        return result;
     }
     
-    return NANOCORE_ERROR;  // Breakpoint not found
+    *scheduler = sched;
+    return NANOCORE_OK;
+#else
+    (void)num_workers;
+    (void)callback;
+    (void)context;
+    return NANOCORE_ERROR;  // No thread support on this platform
+#endif
 }
 
-// Get performance counter
-int nanocore_vm_get_perf_counter(int vm_handle, int counter_index, uint64_t* value) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle] || 
-        counter_index < 0 || counter_index >= 8 || !value) {
+// Hand a VM to the scheduler. It runs in slices of quantum instructions
+// (0 = default) until it halts, hits a breakpoint, fails, or has retired
+// max_instructions (0 = no budget).
+int nanocore_scheduler_submit(nanocore_scheduler_t* scheduler, int vm_handle, uint64_t quantum,
+                              uint64_t max_instructions, uint64_t user_data) {
+#if NANOCORE_SCHEDULER
+    vm_instance_t* vm = vm_lookup(vm_handle);
+    if (!scheduler || !vm) {
         return NANOCORE_EINVAL;
     }
+    if (atomic_load(&scheduler->stopping)) {
+        return NANOCORE_ERROR;
+    }
+    
+    sched_job_t* job = calloc(1, sizeof(sched_job_t));
+    if (!job) {
+        return NANOCORE_ENOMEM;
+    }
+    job->result.vm_handle = vm_handle;
+    job->result.user_data = user_data;
+    job->quantum = quantum ? quantum : SCHED_DEFAULT_QUANTUM;
+    job->budget = max_instructions;
+    job->start_count = vm->state.perf_counters[0];
+    
+    pthread_mutex_lock(&scheduler->done_lock);
+    scheduler->outstanding++;
+    pthread_mutex_unlock(&scheduler->done_lock);
+    
+    pthread_mutex_lock(&scheduler->lock);
+    if (scheduler->inject_tail) {
+        scheduler->inject_tail->next = job;
+    } else {
+        scheduler->inject_head = job;
+    }
+    scheduler->inject_tail = job;
+    atomic_fetch_add(&scheduler->queued, 1);
+    pthread_cond_signal(&scheduler->work_ready);
+    pthread_mutex_unlock(&scheduler->lock);
     
-    *value = vms[vm_handle]->state.perf_counters[counter_index];
     return NANOCORE_OK;
+#else
+    (void)scheduler;
+    (void)vm_handle;
+    (void)quantum;
+    (void)max_instructions;
+    (void)user_data;
+    return NANOCORE_EINVAL;
+#endif
 }
 
-// Poll for events (simplified)
-int nanocore_vm_poll_event(int vm_handle, int* event_type, uint64_t* event_data) {
-    if (vm_handle < 0 || vm_handle >= 256 || !vms[vm_handle] || !event_type || !event_data) {
+// Take the next completion. timeout_ms < 0 waits indefinitely, 0 polls.
+// Fails with NANOCORE_ERROR on timeout or when nothing is outstanding.
+int nanocore_scheduler_wait(nanocore_scheduler_t* scheduler, nanocore_completion_t* completion, int timeout_ms) {
+#if NANOCORE_SCHEDULER
+    if (!scheduler || !completion || scheduler->callback) {
         return NANOCORE_EINVAL;
     }
     
-    vm_instance_t* vm = vms[vm_handle];
+    struct timespec deadline;
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
     
-    if (vm->halted) {
-        *event_type = EVENT_HALTED;
-        *event_data = 0;
-        return NANOCORE_OK;
+    pthread_mutex_lock(&scheduler->done_lock);
+    while (!scheduler->done_head) {
+        if (scheduler->outstanding == 0 || timeout_ms == 0) {
+            pthread_mutex_unlock(&scheduler->done_lock);
+            return NANOCORE_ERROR;
+        }
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&scheduler->done_ready, &scheduler->done_lock);
+        } else if (pthread_cond_timedwait(&scheduler->done_ready, &scheduler->done_lock, &deadline) == ETIMEDOUT) {
+            timeout_ms = 0;  // One last look, then give up
+        }
+    }
+    
+    sched_job_t* job = scheduler->done_head;
+    scheduler->done_head = job->next;
+    if (!scheduler->done_head) {
+        scheduler->done_tail = NULL;
     }
+    scheduler->outstanding--;
+    pthread_mutex_unlock(&scheduler->done_lock);
     
-    // No events pending
-    return NANOCORE_ERROR;
-}
\ No newline at end of file
+    *completion = job->result;
+    free(job);
+    return NANOCORE_OK;
+#else
+    (void)scheduler;
+    (void)completion;
+    (void)timeout_ms;
+    return NANOCORE_EINVAL;
+#endif
+}
+
+// Stop the workers after their current slice and free the scheduler.
+// Unfinished VMs are reported as NANOCORE_DONE_CANCELLED to the callback;
+// queued completions that were never waited for are dropped.
+int nanocore_scheduler_destroy(nanocore_scheduler_t* scheduler) {
+    if (!scheduler) {
+        return NANOCORE_EINVAL;
+    }
+#if NANOCORE_SCHEDULER
+    sched_shutdown(scheduler);
+#endif
+    return NANOCORE_OK;
+}
@@ -67,6 +67,7 @@ class EventType(IntEnum):
     BREAKPOINT = 1
     EXCEPTION = 2
     DEVICE_INTERRUPT = 3
+    WATCHPOINT = 4
 
 class Flags(IntEnum):
     """CPU flags"""
@@ -88,6 +89,14 @@ class PerfCounter(IntEnum):
     PIPELINE_STALL = 5
     MEM_OPS = 6
     SIMD_OPS = 7
+    L1I_HITS = 8
+    L1I_MISSES = 9
+    L1D_HITS = 10
+    L1D_MISSES = 11
+    L2_HITS = 12
+    L2_CACHE_MISSES = 13
+    WRITEBACKS = 14
+    INVALIDATES = 15
 
 # C structure definitions
 class VmState(ctypes.Structure):
@@ -103,13 +112,111 @@ class VmState(ctypes.Structure):
         ("vbase", ctypes.c_uint64),
     ]
 
+class VmOptions(ctypes.Structure):
+    """Creation options for nanocore_vm_create_ex"""
+    _fields_ = [
+        ("struct_size", ctypes.c_uint32),
+        ("flags", ctypes.c_uint32),
+        ("jit_threshold", ctypes.c_uint32),
+        ("reserved", ctypes.c_uint32),
+    ]
+
+class Perf(ctypes.Structure):
+    """Every counter plus the profiling state (nanocore_vm_get_perf)"""
+    _fields_ = [
+        ("struct_size", ctypes.c_uint32),
+        ("valid", ctypes.c_uint32),          # Bit n set when counters[n] is measured
+        ("counters", ctypes.c_uint64 * 16),  # Indexed by PerfCounter
+        ("profile_flags", ctypes.c_uint32),
+        ("sample_period", ctypes.c_uint32),
+        ("samples", ctypes.c_uint64),
+        ("samples_dropped", ctypes.c_uint64),
+        ("opcodes", ctypes.c_uint64 * 64),
+    ]
+    
+    def get(self, counter: PerfCounter) -> Optional[int]:
+        """A counter's value, or None if the engine does not measure it"""
+        return self.counters[counter] if self.valid >> counter & 1 else None
+
+class Profile(IntEnum):
+    """Profiling modes for VM.set_profiling"""
+    OPCODES = 1 << 0
+    PCS = 1 << 1
+    STACKS = 1 << 2  # PC samples carry their CALL stack; implies PCS
+    PAIRS = 1 << 3   # Count adjacent opcode pairs retired within a block
+
+PROFILE_MAX_DEPTH = 64
+
+class VmOption(IntEnum):
+    """VM creation option flags"""
+    JIT = 1 << 0
+    HUGE_PAGES = 1 << 1
+    SPARSE = 1 << 2
+
+# Guest RAM of a sparse VM: the 40-bit physical space
+SPARSE_MEMORY_SIZE = 1 << 40
+
+# Ring descriptor flag: the device fills the buffer (input)
+RING_DESC_WRITE = 0x01
+
+# Granularity of dirty-page tracking
+PAGE_SIZE = 4096
+
+# nanocore_vm_load_image flags
+IMAGE_PREDECODE = 0x01
+
+# Watchpoint access mask
+WATCH_READ = 0x01
+WATCH_WRITE = 0x02
+
+# Interrupt vectors; handlers start at VBASE + vector * 8
+IRQ_TIMER = 3
+IRQ_EXTERNAL0 = 4
+IRQ_EXTERNAL1 = 5
+IRQ_RING0 = 6  # Ring n raises IRQ_RING0 + n per batch of completions
+IRQ_VECTORS = 32
+
+class DoneReason(IntEnum):
+    """Why a scheduled VM stopped"""
+    HALTED = 0
+    BREAKPOINT = 1
+    BUDGET = 2
+    ERROR = 3
+    CANCELLED = 4
+
+class Completion(ctypes.Structure):
+    """Scheduler completion record"""
+    _fields_ = [
+        ("vm_handle", ctypes.c_int),
+        ("status", ctypes.c_int),
+        ("reason", ctypes.c_uint32),
+        ("reserved", ctypes.c_uint32),
+        ("instructions", ctypes.c_uint64),
+        ("user_data", ctypes.c_uint64),
+    ]
+
+ABI_VERSION = 1
+
+class Abi(ctypes.Structure):
+    """Struct layouts reported by nanocore_get_abi"""
+    _fields_ = [(name, ctypes.c_uint32) for name in (
+        "struct_size", "version", "state_size", "state_pc", "state_sp", "state_flags",
+        "state_gprs", "state_vregs", "state_perf_counters", "state_cache_ctrl",
+        "state_vbase", "perf_size", "options_size", "reserved")]
+
 # Function prototypes
 _lib.nanocore_init.argtypes = []
 _lib.nanocore_init.restype = ctypes.c_int
 
+_lib.nanocore_get_abi.argtypes = [ctypes.POINTER(Abi)]
+_lib.nanocore_get_abi.restype = ctypes.c_int
+
 _lib.nanocore_vm_create.argtypes = [ctypes.c_uint64, ctypes.POINTER(ctypes.c_int)]
 _lib.nanocore_vm_create.restype = ctypes.c_int
 
+_lib.nanocore_vm_create_ex.argtypes = [ctypes.c_uint64, ctypes.POINTER(VmOptions), ctypes.POINTER(ctypes.c_int)]
+_lib.nanocore_vm_create_ex.restype = ctypes.c_int
+
 _lib.nanocore_vm_destroy.argtypes = [ctypes.c_int]
 _lib.nanocore_vm_destroy.restype = ctypes.c_int
 
@@ -134,24 +241,123 @@ _lib.nanocore_vm_get_register.restype = ctypes.c_int
 _lib.nanocore_vm_load_program.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_uint8), ctypes.c_uint64, ctypes.c_uint64]
 _lib.nanocore_vm_load_program.restype = ctypes.c_int
 
+_lib.nanocore_vm_load_image.argtypes = [ctypes.c_int, ctypes.c_char_p, ctypes.c_uint32]
+_lib.nanocore_vm_load_image.restype = ctypes.c_int
+
+_lib.nanocore_vm_save_translations.argtypes = [ctypes.c_int, ctypes.c_char_p]
+_lib.nanocore_vm_save_translations.restype = ctypes.c_int
+
+_lib.nanocore_vm_load_translations.argtypes = [ctypes.c_int, ctypes.c_char_p, ctypes.POINTER(ctypes.c_uint32)]
+_lib.nanocore_vm_load_translations.restype = ctypes.c_int
+
 _lib.nanocore_vm_read_memory.argtypes = [ctypes.c_int, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint8), ctypes.c_uint64]
 _lib.nanocore_vm_read_memory.restype = ctypes.c_int
 
 _lib.nanocore_vm_write_memory.argtypes = [ctypes.c_int, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint8), ctypes.c_uint64]
 _lib.nanocore_vm_write_memory.restype = ctypes.c_int
 
+_lib.nanocore_vm_map_memory.argtypes = [ctypes.c_int, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_uint32, ctypes.POINTER(ctypes.c_void_p)]
+_lib.nanocore_vm_map_memory.restype = ctypes.c_int
+
+_lib.nanocore_vm_unmap_memory.argtypes = [ctypes.c_int, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_uint32]
+_lib.nanocore_vm_unmap_memory.restype = ctypes.c_int
+
+_lib.nanocore_vm_get_dirty_pages.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_uint8), ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint64)]
+_lib.nanocore_vm_get_dirty_pages.restype = ctypes.c_int
+
+_lib.nanocore_vm_clear_dirty.argtypes = [ctypes.c_int]
+_lib.nanocore_vm_clear_dirty.restype = ctypes.c_int
+
 _lib.nanocore_vm_set_breakpoint.argtypes = [ctypes.c_int, ctypes.c_uint64]
 _lib.nanocore_vm_set_breakpoint.restype = ctypes.c_int
 
 _lib.nanocore_vm_clear_breakpoint.argtypes = [ctypes.c_int, ctypes.c_uint64]
 _lib.nanocore_vm_clear_breakpoint.restype = ctypes.c_int
 
+_lib.nanocore_vm_set_watchpoint.argtypes = [ctypes.c_int, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_uint32]
+_lib.nanocore_vm_set_watchpoint.restype = ctypes.c_int
+
+_lib.nanocore_vm_clear_watchpoint.argtypes = [ctypes.c_int, ctypes.c_uint64, ctypes.c_uint64]
+_lib.nanocore_vm_clear_watchpoint.restype = ctypes.c_int
+
 _lib.nanocore_vm_get_perf_counter.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.POINTER(ctypes.c_uint64)]
 _lib.nanocore_vm_get_perf_counter.restype = ctypes.c_int
 
+_lib.nanocore_vm_get_perf.argtypes = [ctypes.c_int, ctypes.POINTER(Perf)]
+_lib.nanocore_vm_get_perf.restype = ctypes.c_int
+
+_lib.nanocore_vm_set_profiling.argtypes = [ctypes.c_int, ctypes.c_uint32, ctypes.c_uint32]
+_lib.nanocore_vm_set_profiling.restype = ctypes.c_int
+
+_lib.nanocore_vm_read_samples.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_uint64), ctypes.c_uint32, ctypes.POINTER(ctypes.c_uint32)]
+_lib.nanocore_vm_read_samples.restype = ctypes.c_int
+
+_lib.nanocore_vm_read_stacks.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_uint64), ctypes.c_uint32, ctypes.POINTER(ctypes.c_uint32)]
+_lib.nanocore_vm_read_stacks.restype = ctypes.c_int
+
+_lib.nanocore_vm_read_pairs.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_uint64)]
+_lib.nanocore_vm_read_pairs.restype = ctypes.c_int
+
 _lib.nanocore_vm_poll_event.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_int), ctypes.POINTER(ctypes.c_uint64)]
 _lib.nanocore_vm_poll_event.restype = ctypes.c_int
 
+_lib.nanocore_vm_wait_event.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.POINTER(ctypes.c_int), ctypes.POINTER(ctypes.c_uint64)]
+_lib.nanocore_vm_wait_event.restype = ctypes.c_int
+
+_lib.nanocore_vm_event_fd.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_int)]
+_lib.nanocore_vm_event_fd.restype = ctypes.c_int
+
+_lib.nanocore_vm_ring_attach.argtypes = [ctypes.c_int, ctypes.c_uint64, ctypes.c_uint32, ctypes.c_int, ctypes.POINTER(ctypes.c_int)]
+_lib.nanocore_vm_ring_attach.restype = ctypes.c_int
+
+_lib.nanocore_vm_ring_detach.argtypes = [ctypes.c_int, ctypes.c_int]
+_lib.nanocore_vm_ring_detach.restype = ctypes.c_int
+
+_lib.nanocore_vm_snapshot.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_void_p)]
+_lib.nanocore_vm_snapshot.restype = ctypes.c_int
+
+_lib.nanocore_vm_fork.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_int)]
+_lib.nanocore_vm_fork.restype = ctypes.c_int
+
+_lib.nanocore_vm_create_hart.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_int)]
+_lib.nanocore_vm_create_hart.restype = ctypes.c_int
+
+_lib.nanocore_vm_raise_interrupt.argtypes = [ctypes.c_int, ctypes.c_uint32]
+_lib.nanocore_vm_raise_interrupt.restype = ctypes.c_int
+
+_lib.nanocore_vm_set_interrupts.argtypes = [ctypes.c_int, ctypes.c_uint64, ctypes.c_int]
+_lib.nanocore_vm_set_interrupts.restype = ctypes.c_int
+
+_lib.nanocore_vm_set_timer.argtypes = [ctypes.c_int, ctypes.c_uint64]
+_lib.nanocore_vm_set_timer.restype = ctypes.c_int
+
+_lib.nanocore_snapshot_destroy.argtypes = [ctypes.c_void_p]
+_lib.nanocore_snapshot_destroy.restype = ctypes.c_int
+
+_lib.nanocore_scheduler_create.argtypes = [ctypes.c_uint32, ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(ctypes.c_void_p)]
+_lib.nanocore_scheduler_create.restype = ctypes.c_int
+
+_lib.nanocore_scheduler_submit.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_uint64]
+_lib.nanocore_scheduler_submit.restype = ctypes.c_int
+
+_lib.nanocore_scheduler_wait.argtypes = [ctypes.c_void_p, ctypes.POINTER(Completion), ctypes.c_int]
+_lib.nanocore_scheduler_wait.restype = ctypes.c_int
+
+_lib.nanocore_scheduler_destroy.argtypes = [ctypes.c_void_p]
+_lib.nanocore_scheduler_destroy.restype = ctypes.c_int
+
+_lib.nanocore_cohort_create.argtypes = [ctypes.POINTER(ctypes.c_int), ctypes.c_uint32, ctypes.POINTER(ctypes.c_void_p)]
+_lib.nanocore_cohort_create.restype = ctypes.c_int
+
+_lib.nanocore_cohort_run.argtypes = [ctypes.c_void_p, ctypes.c_uint64, ctypes.POINTER(ctypes.c_int)]
+_lib.nanocore_cohort_run.restype = ctypes.c_int
+
+_lib.nanocore_cohort_get_lockstep.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint64)]
+_lib.nanocore_cohort_get_lockstep.restype = ctypes.c_int
+
+_lib.nanocore_cohort_destroy.argtypes = [ctypes.c_void_p]
+_lib.nanocore_cohort_destroy.restype = ctypes.c_int
+
 # Initialize library
 _initialized = False
 def _ensure_initialized():
@@ -160,22 +366,60 @@ def _ensure_initialized():
         result = _lib.nanocore_init()
         if result != Status.OK:
             raise RuntimeError(f"Failed to initialize NanoCore: {result}")
+        _check_abi()
         _initialized = True
 
+def _check_abi():
+    """Refuse a library whose struct layouts differ from the ones above"""
+    abi = Abi(struct_size=ctypes.sizeof(Abi))
+    if _lib.nanocore_get_abi(ctypes.byref(abi)) != Status.OK:
+        raise RuntimeError("Failed to query the NanoCore ABI")
+    expected = {
+        "struct_size": ctypes.sizeof(Abi),
+        "version": ABI_VERSION,
+        "state_size": ctypes.sizeof(VmState),
+        "perf_size": ctypes.sizeof(Perf),
+        "options_size": ctypes.sizeof(VmOptions),
+    }
+    for field in ("pc", "sp", "flags", "gprs", "vregs", "perf_counters", "cache_ctrl", "vbase"):
+        expected["state_" + field] = getattr(VmState, field).offset
+    mismatched = [name for name, value in expected.items() if getattr(abi, name) != value]
+    if mismatched:
+        raise RuntimeError(f"NanoCore library ABI version {abi.version} does not match "
+                           f"these bindings (version {ABI_VERSION}): {', '.join(mismatched)}")
+
 class VM:
     """NanoCore Virtual Machine"""
     
-    def __init__(self, memory_size: int = 64 * 1024 * 1024):
+    def __init__(self, memory_size: int = 64 * 1024 * 1024, jit: bool = False,
+                 jit_threshold: int = 0, huge_pages: bool = False, sparse: bool = False):
         """
         Create a new VM instance
         
+        Guest memory is reserved up front and backed by the host only as the
+        guest touches it, so large sizes are cheap until used.
+        
         Args:
             memory_size: VM memory size in bytes (default: 64MB)
+            jit: Translate hot blocks to native code where supported
+            jit_threshold: Block executions before translation (0 = default)
+            huge_pages: Ask the host for transparent huge pages
+            sparse: Cover the full ISA address layout (at least SPARSE_MEMORY_SIZE)
         """
         _ensure_initialized()
         
+        options = VmOptions()
+        options.struct_size = ctypes.sizeof(VmOptions)
+        options.flags = ((VmOption.JIT if jit else 0) |
+                         (VmOption.HUGE_PAGES if huge_pages else 0) |
+                         (VmOption.SPARSE if sparse else 0))
+        options.jit_threshold = jit_threshold
+        if sparse:
+            memory_size = max(memory_size, SPARSE_MEMORY_SIZE)
+        
         self._handle = ctypes.c_int()
-        result = _lib.nanocore_vm_create(memory_size, ctypes.byref(self._handle))
+        result = _lib.nanocore_vm_create_ex(memory_size, ctypes.byref(options),
+                                            ctypes.byref(self._handle))
         if result != Status.OK:
             raise RuntimeError(f"Failed to create VM: {result}")
         
@@ -183,6 +427,16 @@ class VM:
         self._breakpoints = set()
         self._event_handlers = {}
     
+    @classmethod
+    def _adopt(cls, handle: ctypes.c_int, memory_size: int) -> 'VM':
+        """Wrap a handle the library already created"""
+        vm = cls.__new__(cls)
+        vm._handle = handle
+        vm._memory_size = memory_size
+        vm._breakpoints = set()
+        vm._event_handlers = {}
+        return vm
+    
     def __del__(self):
         """Clean up VM instance"""
         if hasattr(self, '_handle'):
@@ -269,6 +523,45 @@ class VM:
         if result != Status.OK:
             raise RuntimeError(f"Failed to load program: {result}")
     
+    def load_image(self, path: str, predecode: bool = False):
+        """
+        Load a program image (nanocore_asm.py --format image) and set the
+        PC to its entry point. Text and data are mapped from the file rather
+        than copied, so the file must stay unchanged while the VM runs.
+        
+        Args:
+            path: Image file
+            predecode: Decode the image's basic blocks up front
+        """
+        flags = IMAGE_PREDECODE if predecode else 0
+        result = _lib.nanocore_vm_load_image(self._handle, os.fsencode(path), flags)
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to load image {path}: {result}")
+    
+    def save_translations(self, directory: str):
+        """Save the decoded blocks of the loaded image to directory, in a
+        file named by the image's key"""
+        result = _lib.nanocore_vm_save_translations(self._handle, os.fsencode(directory))
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to save translations: {result}")
+    
+    def load_translations(self, directory: str) -> Optional[int]:
+        """
+        Warm the block cache from save_translations output for the loaded
+        image. Call after load_image.
+        
+        Returns:
+            Blocks restored, or None when directory has no cache for this image
+        """
+        restored = ctypes.c_uint32()
+        result = _lib.nanocore_vm_load_translations(self._handle, os.fsencode(directory),
+                                                    ctypes.byref(restored))
+        if result == Status.ERROR:
+            return None
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to load translations: {result}")
+        return restored.value
+    
     def read_memory(self, address: int, size: int) -> bytes:
         """
         Read memory from VM
@@ -304,6 +597,38 @@ class VM:
         if result != Status.OK:
             raise RuntimeError(f"Failed to write memory: {result}")
     
+    def dirty_pages(self) -> List[int]:
+        """Indices (address // PAGE_SIZE) of pages written since the last clear_dirty"""
+        pages = (self._memory_size + PAGE_SIZE - 1) // PAGE_SIZE
+        bitmap = (ctypes.c_uint8 * ((pages + 7) // 8))()
+        count = ctypes.c_uint64()
+        result = _lib.nanocore_vm_get_dirty_pages(self._handle, bitmap, len(bitmap), ctypes.byref(count))
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to get dirty pages: {result}")
+        return [i * 8 + bit for i, byte in enumerate(bitmap) if byte for bit in range(8) if byte >> bit & 1]
+    
+    def clear_dirty(self):
+        """Start a new dirty-tracking interval"""
+        result = _lib.nanocore_vm_clear_dirty(self._handle)
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to clear dirty pages: {result}")
+    
+    def memory_view(self, address: int, size: int, writable: bool = False) -> 'MemoryView':
+        """
+        Borrow guest memory in place, without copying
+        
+        Args:
+            address: Starting address
+            size: Number of bytes
+            writable: Allow stores through the view
+            
+        Returns:
+            MemoryView; use as a context manager or call release()
+        
+        Raises RuntimeError while harts share the RAM; use read_memory then.
+        """
+        return MemoryView(self, address, size, writable)
+    
     def set_breakpoint(self, address: int):
         """Set a breakpoint at the specified address"""
         result = _lib.nanocore_vm_set_breakpoint(self._handle, address)
@@ -318,6 +643,89 @@ class VM:
             raise RuntimeError(f"Failed to clear breakpoint: {result}")
         self._breakpoints.discard(address)
     
+    def set_watchpoint(self, address: int, size: int, access: int = WATCH_WRITE):
+        """Stop runs when the guest reads or writes the given range"""
+        result = _lib.nanocore_vm_set_watchpoint(self._handle, address, size, access)
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to set watchpoint: {result}")
+    
+    def clear_watchpoint(self, address: int, size: int):
+        """Clear the watchpoint set on exactly this range"""
+        result = _lib.nanocore_vm_clear_watchpoint(self._handle, address, size)
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to clear watchpoint: {result}")
+    
+    def snapshot(self) -> 'Snapshot':
+        """Capture this VM so copies can be started from its current state"""
+        raw = ctypes.c_void_p()
+        result = _lib.nanocore_vm_snapshot(self._handle, ctypes.byref(raw))
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to snapshot VM: {result}")
+        return Snapshot(raw, self._memory_size, set(self._breakpoints))
+    
+    def create_hart(self) -> 'VM':
+        """
+        Add a hardware thread sharing this VM's guest memory
+        
+        The hart starts from a copy of this VM's registers and may run on
+        another thread. Harts synchronize through LR/SC, the AMOs and FENCE.
+        Fails while a memory_view of this VM is held.
+        """
+        handle = ctypes.c_int()
+        result = _lib.nanocore_vm_create_hart(self._handle, ctypes.byref(handle))
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to create hart: {result}")
+        return VM._adopt(handle, self._memory_size)
+    
+    def set_interrupts(self, vbase: int, enable: bool = True):
+        """Set the interrupt vector base and FLAGS.IE"""
+        result = _lib.nanocore_vm_set_interrupts(self._handle, vbase, int(enable))
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to set interrupts: {result}")
+    
+    def set_timer(self, period: Optional[float]):
+        """Raise IRQ_TIMER every period seconds of host monotonic time; None disarms"""
+        period_ns = 0 if period is None else max(1, int(period * 1e9))
+        result = _lib.nanocore_vm_set_timer(self._handle, period_ns)
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to set timer: {result}")
+    
+    def raise_interrupt(self, vector: int):
+        """
+        Raise an interrupt vector, IRQ_TIMER up to IRQ_VECTORS - 1
+        
+        Safe from any thread, including while another runs the VM; the
+        vector is taken at the next block boundary once FLAGS.IE is set.
+        """
+        result = _lib.nanocore_vm_raise_interrupt(self._handle, vector)
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to raise interrupt: {result}")
+    
+    def attach_ring(self, ring_address: int, entries: int, fd: int) -> int:
+        """
+        Serve a descriptor ring in guest memory from a host file descriptor
+        
+        Args:
+            ring_address: Guest address of the ring header
+            entries: Number of descriptors (a power of two)
+            fd: Host file descriptor; keep it open until the ring is detached
+            
+        Returns:
+            Ring id; completions arrive as DEVICE_INTERRUPT events with
+            data ring_id << 32 | count
+        """
+        ring_id = ctypes.c_int()
+        result = _lib.nanocore_vm_ring_attach(self._handle, ring_address, entries, fd, ctypes.byref(ring_id))
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to attach ring: {result}")
+        return ring_id.value
+    
+    def detach_ring(self, ring_id: int):
+        """Detach a ring; requests still in flight are dropped"""
+        result = _lib.nanocore_vm_ring_detach(self._handle, ring_id)
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to detach ring: {result}")
+    
     def get_perf_counter(self, counter: PerfCounter) -> int:
         """Get performance counter value"""
         value = ctypes.c_uint64()
@@ -326,6 +734,62 @@ class VM:
             raise RuntimeError(f"Failed to get performance counter: {result}")
         return value.value
     
+    def perf(self) -> Perf:
+        """Read every performance counter and the profiling state at once"""
+        perf = Perf(struct_size=ctypes.sizeof(Perf))
+        result = _lib.nanocore_vm_get_perf(self._handle, ctypes.byref(perf))
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to get performance counters: {result}")
+        return perf
+    
+    def set_profiling(self, flags: int, sample_period: int = 0):
+        """Enable Profile.OPCODES and/or Profile.PCS (0 turns profiling off)"""
+        result = _lib.nanocore_vm_set_profiling(self._handle, flags, sample_period)
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to set profiling: {result}")
+    
+    def read_samples(self) -> List[int]:
+        """Drain buffered PC samples, oldest first"""
+        samples = []
+        chunk = (ctypes.c_uint64 * 4096)()
+        count = ctypes.c_uint32()
+        while True:
+            result = _lib.nanocore_vm_read_samples(self._handle, chunk, len(chunk), ctypes.byref(count))
+            if result != Status.OK:
+                raise RuntimeError(f"Failed to read samples: {result}")
+            samples.extend(chunk[:count.value])
+            if count.value < len(chunk):
+                return samples
+    
+    def read_stacks(self) -> List[List[int]]:
+        """Drain buffered Profile.STACKS samples, oldest first: each is the
+        sampled PC followed by the enclosing CALL sites, innermost first"""
+        stacks = []
+        chunk = (ctypes.c_uint64 * 4096)()
+        used = ctypes.c_uint32()
+        while True:
+            result = _lib.nanocore_vm_read_stacks(self._handle, chunk, len(chunk), ctypes.byref(used))
+            if result != Status.OK:
+                raise RuntimeError(f"Failed to read stacks: {result}")
+            words = chunk[:used.value]
+            i = 0
+            while i < len(words):
+                frames = words[i]
+                stacks.append(words[i + 1:i + 1 + frames])
+                i += 1 + frames
+            if used.value < len(chunk) - (PROFILE_MAX_DEPTH + 2):
+                return stacks
+    
+    def read_pairs(self) -> List[tuple[tuple[int, int], int]]:
+        """Profile.PAIRS counts as ((first, second), count), most frequent
+        first: the opcode sequences worth fusing for this workload"""
+        counts = (ctypes.c_uint64 * (64 * 64))()
+        result = _lib.nanocore_vm_read_pairs(self._handle, counts)
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to read pairs: {result}")
+        pairs = [((i >> 6, i & 63), n) for i, n in enumerate(counts) if n]
+        return sorted(pairs, key=lambda p: p[1], reverse=True)
+    
     def poll_event(self) -> Optional[tuple[EventType, int]]:
         """
         Poll for VM events (non-blocking)
@@ -342,6 +806,39 @@ class VM:
             return (EventType(event_type.value), event_data.value)
         return None
     
+    def wait_event(self, timeout: Optional[float] = None) -> Optional[tuple[EventType, int]]:
+        """
+        Wait for the next VM event
+        
+        Args:
+            timeout: Seconds to wait, or None to wait indefinitely
+            
+        Returns:
+            Tuple of (event_type, event_data) or None if the timeout passed
+        """
+        timeout_ms = -1 if timeout is None else int(timeout * 1000)
+        event_type = ctypes.c_int()
+        event_data = ctypes.c_uint64()
+        result = _lib.nanocore_vm_wait_event(self._handle, timeout_ms,
+                                             ctypes.byref(event_type),
+                                             ctypes.byref(event_data))
+        if result == Status.OK:
+            return (EventType(event_type.value), event_data.value)
+        if result != Status.ERROR:
+            raise RuntimeError(f"Failed to wait for event: {result}")
+        return None
+    
+    def event_fd(self) -> int:
+        """
+        File descriptor that turns readable when events are pending, for
+        selectors/epoll loops; drain it with process_events()
+        """
+        fd = ctypes.c_int()
+        result = _lib.nanocore_vm_event_fd(self._handle, ctypes.byref(fd))
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to get event fd: {result}")
+        return fd.value
+    
     def on_event(self, event_type: EventType, handler: Callable[[int], None]):
         """Register an event handler"""
         self._event_handlers[event_type] = handler
@@ -376,6 +873,249 @@ class VM:
                                   "BR_MISS", "STALL", "MEM", "SIMD"]):
             print(f"  {name}: {state.perf_counters[i]:,}")
 
+class MemoryView:
+    """
+    Pinned window onto guest memory
+    
+    .view (a flat memoryview) and .numpy() read guest RAM directly and are
+    the zero-copy paths; hand .view to other buffer consumers. The object
+    itself exports the buffer protocol only on Python 3.12+ (PEP 688),
+    where memoryview(view) and np.frombuffer(view) work too. The window
+    must not be used after release(); the VM cannot be destroyed while it
+    is held.
+    """
+    
+    def __init__(self, vm: VM, address: int, size: int, writable: bool):
+        self._vm = vm
+        self._address = address
+        self._size = size
+        self._access = 1 if writable else 0
+        data = ctypes.c_void_p()
+        result = _lib.nanocore_vm_map_memory(vm._handle, address, size, self._access,
+                                             ctypes.byref(data))
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to map memory: {result}")
+        view = memoryview((ctypes.c_uint8 * size).from_address(data.value or 0)).cast('B')
+        self._view = view if writable else view.toreadonly()
+    
+    def __buffer__(self, flags):
+        return self._view
+    
+    def __len__(self):
+        return self._size
+    
+    def __getitem__(self, index):
+        return self._view[index]
+    
+    def __setitem__(self, index, value):
+        self._view[index] = value
+    
+    @property
+    def view(self) -> memoryview:
+        """Flat memoryview of unsigned bytes"""
+        if self._view is None:
+            raise ValueError("Memory view has been released")
+        return self._view
+    
+    def numpy(self, dtype=np.uint8) -> np.ndarray:
+        """NumPy array sharing the guest memory"""
+        return np.frombuffer(self.view, dtype=dtype)
+    
+    def release(self):
+        """Unpin the guest memory; fails while derived buffers are alive"""
+        if getattr(self, '_view', None) is None:
+            return
+        self._view.release()  # BufferError if a NumPy array still shares it
+        self._view = None
+        _lib.nanocore_vm_unmap_memory(self._vm._handle, self._address, self._size, self._access)
+    
+    def __del__(self):
+        try:
+            self.release()
+        except BufferError:
+            pass  # Stay pinned rather than leave dangling arrays
+    
+    def __enter__(self):
+        return self
+    
+    def __exit__(self, *exc):
+        self.release()
+
+class Snapshot:
+    """
+    Frozen VM state that new VMs fork from
+    
+    Forks share guest memory with the snapshot copy-on-write, so they are
+    cheap to create and only pay for the pages they modify.
+    """
+    
+    def __init__(self, raw: ctypes.c_void_p, memory_size: int, breakpoints: set):
+        self._raw = raw
+        self._memory_size = memory_size
+        self._breakpoints = breakpoints
+    
+    def __del__(self):
+        if getattr(self, '_raw', None):
+            _lib.nanocore_snapshot_destroy(self._raw)
+            self._raw = None
+    
+    def fork(self) -> VM:
+        """Start a new VM from this snapshot"""
+        handle = ctypes.c_int()
+        result = _lib.nanocore_vm_fork(self._raw, ctypes.byref(handle))
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to fork VM: {result}")
+        vm = VM._adopt(handle, self._memory_size)
+        vm._breakpoints = set(self._breakpoints)
+        return vm
+
+class CompletedRun:
+    """Outcome of a VM run on a Scheduler"""
+    
+    def __init__(self, vm: VM, completion: Completion):
+        self.vm = vm
+        self.reason = DoneReason(completion.reason)
+        self.status = completion.status
+        self.instructions = completion.instructions
+    
+    def __repr__(self):
+        return (f"CompletedRun(reason={self.reason.name}, status={self.status}, "
+                f"instructions={self.instructions})")
+
+class Scheduler:
+    """
+    Runs many VMs on a pool of native worker threads
+    
+    The workers time-slice submitted VMs without holding the GIL. A VM
+    belongs to the scheduler until wait() returns it; do not use it from
+    Python in the meantime.
+    """
+    
+    def __init__(self, workers: int = 0):
+        """
+        Args:
+            workers: Worker threads (0 = one per CPU)
+        """
+        _ensure_initialized()
+        self._raw = ctypes.c_void_p()
+        result = _lib.nanocore_scheduler_create(workers, None, None, ctypes.byref(self._raw))
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to create scheduler: {result}")
+        self._jobs = {}
+        self._next_token = 0
+    
+    def __del__(self):
+        self.close()
+    
+    def close(self):
+        """Stop the workers and drop unfinished runs"""
+        if getattr(self, '_raw', None):
+            _lib.nanocore_scheduler_destroy(self._raw)
+            self._raw = None
+            self._jobs.clear()
+    
+    def submit(self, vm: VM, quantum: int = 0, max_instructions: int = 0):
+        """
+        Queue a VM to run until it halts or hits a breakpoint
+        
+        Args:
+            vm: VM to run
+            quantum: Instructions per time slice (0 = default)
+            max_instructions: Stop after this many instructions (0 = no limit)
+        """
+        token = self._next_token
+        self._next_token += 1
+        self._jobs[token] = vm
+        result = _lib.nanocore_scheduler_submit(self._raw, vm._handle, quantum,
+                                                max_instructions, token)
+        if result != Status.OK:
+            del self._jobs[token]
+            raise RuntimeError(f"Failed to submit VM: {result}")
+    
+    def wait(self, timeout: Optional[float] = None) -> Optional[CompletedRun]:
+        """
+        Wait for the next VM to finish
+        
+        Args:
+            timeout: Seconds to wait (None = until one finishes)
+            
+        Returns:
+            CompletedRun, or None on timeout or when nothing is pending
+        """
+        completion = Completion()
+        timeout_ms = -1 if timeout is None else int(timeout * 1000)
+        result = _lib.nanocore_scheduler_wait(self._raw, ctypes.byref(completion), timeout_ms)
+        if result != Status.OK:
+            return None
+        return CompletedRun(self._jobs.pop(completion.user_data), completion)
+    
+    def __enter__(self):
+        return self
+    
+    def __exit__(self, *exc):
+        self.close()
+
+class Cohort:
+    """
+    VMs holding the same program, run in lockstep from one shared
+    instruction stream
+    
+    Lanes whose control flow or stores diverge leave lockstep and finish
+    each run on their own engine. The VMs stay usable between runs.
+    """
+    
+    MAX_LANES = 64
+    
+    def __init__(self, vms: List[VM]):
+        """
+        Args:
+            vms: Up to MAX_LANES VMs of equal memory size and program
+        """
+        self.vms = list(vms)
+        handles = (ctypes.c_int * len(self.vms))(*(vm._handle for vm in self.vms))
+        self._raw = ctypes.c_void_p()
+        result = _lib.nanocore_cohort_create(handles, len(self.vms), ctypes.byref(self._raw))
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to create cohort: {result}")
+    
+    def __del__(self):
+        self.close()
+    
+    def close(self):
+        """Dissolve the cohort; the VMs are not touched"""
+        if getattr(self, '_raw', None):
+            _lib.nanocore_cohort_destroy(self._raw)
+            self._raw = None
+    
+    def run(self, max_instructions: int = 0) -> List[int]:
+        """
+        Run every lane as VM.run would
+        
+        Args:
+            max_instructions: Maximum instructions per lane (0 = unlimited)
+            
+        Returns:
+            Each lane's exit code
+        """
+        results = (ctypes.c_int * len(self.vms))()
+        result = _lib.nanocore_cohort_run(self._raw, max_instructions, results)
+        if result != Status.OK:
+            raise RuntimeError(f"Failed to run cohort: {result}")
+        return list(results)
+    
+    @property
+    def lockstep_lanes(self) -> List[int]:
+        """Lanes that stayed in lockstep until the last run ended"""
+        mask = ctypes.c_uint64()
+        _lib.nanocore_cohort_get_lockstep(self._raw, ctypes.byref(mask))
+        return [lane for lane in range(len(self.vms)) if mask.value >> lane & 1]
+    
+    def __enter__(self):
+        return self
+    
+    def __exit__(self, *exc):
+        self.close()
+
 class RegisterBank:
     """Access to general-purpose registers"""
     
@@ -457,10 +1197,18 @@ def disassemble(bytecode: bytes, address: int = 0) -> str:
 # Module initialization
 __all__ = [
     "VM",
+    "MemoryView",
+    "Snapshot",
+    "Scheduler",
+    "CompletedRun",
+    "Cohort",
+    "DoneReason",
     "Status",
     "EventType", 
     "Flags",
     "PerfCounter",
+    "Perf",
+    "Profile",
     "VmState",
     "RegisterBank",
     "VectorRegisterBank",
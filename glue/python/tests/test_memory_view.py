@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+"""
+MemoryView binding tests
+Run after `make build/lib/libnanocore_ffi.so`
+"""
+
+import os
+import sys
+import unittest
+
+import numpy as np
+
+# Import the package from this checkout
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+import nanocore
+
+
+class TestMemoryView(unittest.TestCase):
+    def setUp(self):
+        self.vm = nanocore.VM(1024 * 1024)
+        self.vm.write_memory(0x2000, bytes(range(16)))
+
+    def test_view_reads_in_place(self):
+        with self.vm.memory_view(0x2000, 16) as view:
+            self.assertEqual(len(view), 16)
+            self.assertEqual(view.view.tobytes(), bytes(range(16)))
+            self.assertEqual(memoryview(view.view)[3], 3)
+            self.assertTrue(view.view.readonly)
+
+            # Guest writes show through without a new view
+            self.vm.write_memory(0x2000, b'\xff')
+            self.assertEqual(view[0], 0xFF)
+
+    def test_numpy_shares_guest_memory(self):
+        with self.vm.memory_view(0x2000, 16, writable=True) as view:
+            words = view.numpy(np.uint64)
+            self.assertEqual(words.shape, (2,))
+            words[1] = 0x1122334455667788
+            del words  # release() refuses while an array shares the view
+        self.assertEqual(self.vm.read_memory(0x2008, 8), (0x1122334455667788).to_bytes(8, 'little'))
+
+    @unittest.skipIf(sys.version_info >= (3, 12), "PEP 688 buffer export")
+    def test_object_is_not_a_buffer_before_312(self):
+        with self.vm.memory_view(0x2000, 16) as view:
+            with self.assertRaises(TypeError):
+                memoryview(view)
+
+    @unittest.skipIf(sys.version_info < (3, 12), "needs PEP 688")
+    def test_object_is_a_buffer_on_312(self):
+        with self.vm.memory_view(0x2000, 16) as view:
+            self.assertEqual(bytes(memoryview(view)), bytes(range(16)))
+            self.assertEqual(np.frombuffer(view, dtype=np.uint8)[15], 15)
+
+
+if __name__ == '__main__':
+    unittest.main()
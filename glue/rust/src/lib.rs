@@ -43,9 +43,13 @@ fn main() -> Result<(), Box<dyn std::error::Error>> {
 ```
 */
 
-use std::ffi::CStr;
-use std::os::raw::{c_int, c_uint, c_void};
+use std::ffi::{CStr, CString};
+use std::os::raw::{c_char, c_int, c_uint, c_void};
+use std::collections::HashMap;
 use std::ptr;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+use std::time::Duration;
 
 mod ffi {
     use super::*;
@@ -62,9 +66,78 @@ mod ffi {
         pub vbase: u64,
     }
     
+    #[repr(C)]
+    pub struct VmOptions {
+        pub struct_size: u32,
+        pub flags: u32,
+        pub jit_threshold: u32,
+        pub reserved: u32,
+    }
+    
+    #[repr(C)]
+    pub struct Perf {
+        pub struct_size: u32,
+        pub valid: u32,
+        pub counters: [u64; 16],
+        pub profile_flags: u32,
+        pub sample_period: u32,
+        pub samples: u64,
+        pub samples_dropped: u64,
+        pub opcodes: [u64; 64],
+    }
+    
+    #[repr(C)]
+    #[derive(Default, PartialEq)]
+    pub struct Abi {
+        pub struct_size: u32,
+        pub version: u32,
+        pub state_size: u32,
+        pub state_pc: u32,
+        pub state_sp: u32,
+        pub state_flags: u32,
+        pub state_gprs: u32,
+        pub state_vregs: u32,
+        pub state_perf_counters: u32,
+        pub state_cache_ctrl: u32,
+        pub state_vbase: u32,
+        pub perf_size: u32,
+        pub options_size: u32,
+        pub reserved: u32,
+    }
+    
+    pub const ABI_VERSION: u32 = 1;
+    
+    pub const PROFILE_OPCODES: u32 = 0x01;
+    pub const PROFILE_PCS: u32 = 0x02;
+    pub const PROFILE_STACKS: u32 = 0x04;
+    pub const PROFILE_PAIRS: u32 = 0x08;
+    pub const PROFILE_MAX_DEPTH: usize = 64;
+    
+    pub const VM_OPT_JIT: u32 = 0x01;
+    pub const VM_OPT_HUGE_PAGES: u32 = 0x02;
+    pub const VM_OPT_SPARSE: u32 = 0x04;
+    
+    pub const MAP_READ: u32 = 0x00;
+    pub const MAP_WRITE: u32 = 0x01;
+    
+    #[repr(C)]
+    #[derive(Default)]
+    pub struct Completion {
+        pub vm_handle: c_int,
+        pub status: c_int,
+        pub reason: u32,
+        pub reserved: u32,
+        pub instructions: u64,
+        pub user_data: u64,
+    }
+    
+    pub type CompletionFn = Option<unsafe extern "C" fn(*const Completion, *mut c_void)>;
+    
     extern "C" {
         pub fn nanocore_init() -> c_int;
+        pub fn nanocore_get_abi(abi: *mut Abi) -> c_int;
         pub fn nanocore_vm_create(memory_size: u64, vm_handle: *mut c_int) -> c_int;
+        pub fn nanocore_vm_create_ex(memory_size: u64, options: *const VmOptions, vm_handle: *mut c_int) -> c_int;
         pub fn nanocore_vm_destroy(vm_handle: c_int) -> c_int;
         pub fn nanocore_vm_reset(vm_handle: c_int) -> c_int;
         pub fn nanocore_vm_run(vm_handle: c_int, max_instructions: u64) -> c_int;
@@ -73,12 +146,45 @@ mod ffi {
         pub fn nanocore_vm_get_register(vm_handle: c_int, reg_index: c_int, value: *mut u64) -> c_int;
         pub fn nanocore_vm_set_register(vm_handle: c_int, reg_index: c_int, value: u64) -> c_int;
         pub fn nanocore_vm_load_program(vm_handle: c_int, data: *const u8, size: u64, address: u64) -> c_int;
+        pub fn nanocore_vm_load_image(vm_handle: c_int, path: *const c_char, flags: u32) -> c_int;
+        pub fn nanocore_vm_save_translations(vm_handle: c_int, dir: *const c_char) -> c_int;
+        pub fn nanocore_vm_load_translations(vm_handle: c_int, dir: *const c_char, restored: *mut u32) -> c_int;
         pub fn nanocore_vm_read_memory(vm_handle: c_int, address: u64, buffer: *mut u8, size: u64) -> c_int;
         pub fn nanocore_vm_write_memory(vm_handle: c_int, address: u64, data: *const u8, size: u64) -> c_int;
+        pub fn nanocore_vm_map_memory(vm_handle: c_int, address: u64, size: u64, access: u32, data: *mut *mut u8) -> c_int;
+        pub fn nanocore_vm_unmap_memory(vm_handle: c_int, address: u64, size: u64, access: u32) -> c_int;
+        pub fn nanocore_vm_get_dirty_pages(vm_handle: c_int, bitmap: *mut u8, bitmap_size: u64, count: *mut u64) -> c_int;
+        pub fn nanocore_vm_clear_dirty(vm_handle: c_int) -> c_int;
         pub fn nanocore_vm_set_breakpoint(vm_handle: c_int, address: u64) -> c_int;
         pub fn nanocore_vm_clear_breakpoint(vm_handle: c_int, address: u64) -> c_int;
+        pub fn nanocore_vm_set_watchpoint(vm_handle: c_int, address: u64, size: u64, access: u32) -> c_int;
+        pub fn nanocore_vm_clear_watchpoint(vm_handle: c_int, address: u64, size: u64) -> c_int;
         pub fn nanocore_vm_get_perf_counter(vm_handle: c_int, counter_index: c_int, value: *mut u64) -> c_int;
+        pub fn nanocore_vm_get_perf(vm_handle: c_int, perf: *mut Perf) -> c_int;
+        pub fn nanocore_vm_set_profiling(vm_handle: c_int, flags: u32, sample_period: u32) -> c_int;
+        pub fn nanocore_vm_read_samples(vm_handle: c_int, pcs: *mut u64, max: u32, count: *mut u32) -> c_int;
+        pub fn nanocore_vm_read_stacks(vm_handle: c_int, words: *mut u64, max_words: u32, used: *mut u32) -> c_int;
+        pub fn nanocore_vm_read_pairs(vm_handle: c_int, counts: *mut u64) -> c_int;
         pub fn nanocore_vm_poll_event(vm_handle: c_int, event_type: *mut c_int, event_data: *mut u64) -> c_int;
+        pub fn nanocore_vm_wait_event(vm_handle: c_int, timeout_ms: c_int, event_type: *mut c_int, event_data: *mut u64) -> c_int;
+        pub fn nanocore_vm_event_fd(vm_handle: c_int, fd: *mut c_int) -> c_int;
+        pub fn nanocore_vm_ring_attach(vm_handle: c_int, ring_addr: u64, entries: u32, fd: c_int, ring_id: *mut c_int) -> c_int;
+        pub fn nanocore_vm_ring_detach(vm_handle: c_int, ring_id: c_int) -> c_int;
+        pub fn nanocore_vm_snapshot(vm_handle: c_int, snapshot: *mut *mut c_void) -> c_int;
+        pub fn nanocore_vm_fork(snapshot: *const c_void, vm_handle: *mut c_int) -> c_int;
+        pub fn nanocore_vm_create_hart(vm_handle: c_int, hart_handle: *mut c_int) -> c_int;
+        pub fn nanocore_vm_raise_interrupt(vm_handle: c_int, vector: u32) -> c_int;
+        pub fn nanocore_vm_set_interrupts(vm_handle: c_int, vbase: u64, enable: c_int) -> c_int;
+        pub fn nanocore_vm_set_timer(vm_handle: c_int, period_ns: u64) -> c_int;
+        pub fn nanocore_snapshot_destroy(snapshot: *mut c_void) -> c_int;
+        pub fn nanocore_scheduler_create(num_workers: u32, callback: CompletionFn, context: *mut c_void, scheduler: *mut *mut c_void) -> c_int;
+        pub fn nanocore_scheduler_submit(scheduler: *mut c_void, vm_handle: c_int, quantum: u64, max_instructions: u64, user_data: u64) -> c_int;
+        pub fn nanocore_scheduler_wait(scheduler: *mut c_void, completion: *mut Completion, timeout_ms: c_int) -> c_int;
+        pub fn nanocore_scheduler_destroy(scheduler: *mut c_void) -> c_int;
+        pub fn nanocore_cohort_create(vm_handles: *const c_int, count: u32, cohort: *mut *mut c_void) -> c_int;
+        pub fn nanocore_cohort_run(cohort: *mut c_void, max_instructions: u64, results: *mut c_int) -> c_int;
+        pub fn nanocore_cohort_get_lockstep(cohort: *const c_void, lane_mask: *mut u64) -> c_int;
+        pub fn nanocore_cohort_destroy(cohort: *mut c_void) -> c_int;
     }
 }
 
@@ -121,6 +227,8 @@ pub enum EventType {
     Exception = 2,
     /// Device interrupt
     DeviceInterrupt = 3,
+    /// Guest touched a watched range; data is the access address
+    Watchpoint = 4,
 }
 
 impl EventType {
@@ -130,6 +238,7 @@ impl EventType {
             1 => Some(EventType::Breakpoint),
             2 => Some(EventType::Exception),
             3 => Some(EventType::DeviceInterrupt),
+            4 => Some(EventType::Watchpoint),
             _ => None,
         }
     }
@@ -164,6 +273,37 @@ pub enum PerfCounter {
     PipelineStall = 5,
     MemoryOps = 6,
     SIMDOps = 7,
+    L1IHits = 8,
+    L1IMisses = 9,
+    L1DHits = 10,
+    L1DMisses = 11,
+    L2Hits = 12,
+    L2CacheMisses = 13,
+    Writebacks = 14,
+    Invalidates = 15,
+}
+
+/// Every counter plus the profiling state, read with one call
+#[derive(Debug, Clone)]
+pub struct Perf {
+    /// Indexed by `PerfCounter`
+    pub counters: [u64; 16],
+    /// Bit n set when the engine measures `counters[n]`
+    pub valid: u32,
+    /// PC samples recorded since profiling was enabled
+    pub samples: u64,
+    /// Samples lost because the buffer was full
+    pub samples_dropped: u64,
+    /// Retired instructions per opcode, with the opcode histogram on
+    pub opcodes: [u64; 64],
+}
+
+impl Perf {
+    /// A counter's value, or `None` if the engine does not measure it
+    pub fn get(&self, counter: PerfCounter) -> Option<u64> {
+        let index = counter as usize;
+        if self.valid & (1 << index) != 0 { Some(self.counters[index]) } else { None }
+    }
 }
 
 /// VM state snapshot
@@ -230,12 +370,96 @@ fn check_status(status: c_int, operation: &str) -> Result<()> {
     }
 }
 
+fn c_path(path: &str) -> Result<CString> {
+    CString::new(path).map_err(|_| Error {
+        status: Status::InvalidParameter,
+        message: "Path contains a NUL byte".to_string(),
+    })
+}
+
 /// Initialize the NanoCore library
+///
+/// Fails if the library's struct layouts differ from these bindings.
 pub fn init() -> Result<()> {
     let result = unsafe { ffi::nanocore_init() };
-    check_status(result, "initialize NanoCore")
+    check_status(result, "initialize NanoCore")?;
+    check_abi()
+}
+
+fn check_abi() -> Result<()> {
+    use std::mem::{offset_of, size_of};
+    
+    let mut abi = ffi::Abi { struct_size: size_of::<ffi::Abi>() as u32, ..Default::default() };
+    let result = unsafe { ffi::nanocore_get_abi(&mut abi) };
+    check_status(result, "query the library ABI")?;
+    
+    let expected = ffi::Abi {
+        struct_size: size_of::<ffi::Abi>() as u32,
+        version: ffi::ABI_VERSION,
+        state_size: size_of::<ffi::VmState>() as u32,
+        state_pc: offset_of!(ffi::VmState, pc) as u32,
+        state_sp: offset_of!(ffi::VmState, sp) as u32,
+        state_flags: offset_of!(ffi::VmState, flags) as u32,
+        state_gprs: offset_of!(ffi::VmState, gprs) as u32,
+        state_vregs: offset_of!(ffi::VmState, vregs) as u32,
+        state_perf_counters: offset_of!(ffi::VmState, perf_counters) as u32,
+        state_cache_ctrl: offset_of!(ffi::VmState, cache_ctrl) as u32,
+        state_vbase: offset_of!(ffi::VmState, vbase) as u32,
+        perf_size: size_of::<ffi::Perf>() as u32,
+        options_size: size_of::<ffi::VmOptions>() as u32,
+        reserved: 0,
+    };
+    if abi != expected {
+        return Err(Error {
+            status: Status::InitializationError,
+            message: format!("Library ABI version {} does not match these bindings (version {})",
+                             abi.version, ffi::ABI_VERSION),
+        });
+    }
+    Ok(())
+}
+
+/// VM creation options
+#[derive(Debug, Clone, Copy, Default)]
+pub struct VmOptions {
+    /// Translate hot blocks to native code where supported
+    pub jit: bool,
+    /// Block executions before translation (0 = library default)
+    pub jit_threshold: u32,
+    /// Ask the host for transparent huge pages for guest RAM
+    pub huge_pages: bool,
+    /// Cover the full ISA address layout (at least `SPARSE_MEMORY_SIZE`)
+    pub sparse: bool,
 }
 
+/// Guest RAM of a sparse VM: the 40-bit physical space
+pub const SPARSE_MEMORY_SIZE: u64 = 1 << 40;
+
+/// Granularity of dirty-page tracking
+pub const PAGE_SIZE: u64 = 4096;
+
+/// Watchpoint access: stop on guest reads
+pub const WATCH_READ: u32 = 0x01;
+
+/// Watchpoint access: stop on guest writes
+pub const WATCH_WRITE: u32 = 0x02;
+
+/// Ring descriptor flag: the device fills the buffer (input)
+pub const RING_DESC_WRITE: u16 = 0x01;
+
+/// Interrupt vector raised by the timer device; handlers start at VBASE + vector * 8
+pub const IRQ_TIMER: u32 = 3;
+
+/// External interrupt vectors; device vectors follow up to `IRQ_VECTORS - 1`
+pub const IRQ_EXTERNAL0: u32 = 4;
+pub const IRQ_EXTERNAL1: u32 = 5;
+
+/// Ring `n` raises `IRQ_RING0 + n` for each batch of completions
+pub const IRQ_RING0: u32 = 6;
+
+/// Number of interrupt vectors
+pub const IRQ_VECTORS: u32 = 32;
+
 /// NanoCore Virtual Machine
 pub struct VM {
     handle: c_int,
@@ -252,6 +476,37 @@ impl VM {
         Ok(VM { handle, memory_size })
     }
     
+    /// Create a new VM instance with explicit options
+    ///
+    /// Guest memory is reserved up front and backed by the host only as the
+    /// guest touches it.
+    pub fn with_options(memory_size: u64, options: &VmOptions) -> Result<Self> {
+        let mut flags = 0;
+        if options.jit {
+            flags |= ffi::VM_OPT_JIT;
+        }
+        if options.huge_pages {
+            flags |= ffi::VM_OPT_HUGE_PAGES;
+        }
+        let memory_size = if options.sparse {
+            flags |= ffi::VM_OPT_SPARSE;
+            memory_size.max(SPARSE_MEMORY_SIZE)
+        } else {
+            memory_size
+        };
+        let raw = ffi::VmOptions {
+            struct_size: std::mem::size_of::<ffi::VmOptions>() as u32,
+            flags,
+            jit_threshold: options.jit_threshold,
+            reserved: 0,
+        };
+        let mut handle = 0;
+        let result = unsafe { ffi::nanocore_vm_create_ex(memory_size, &raw, &mut handle) };
+        check_status(result, "create VM")?;
+        
+        Ok(VM { handle, memory_size })
+    }
+    
     /// Reset VM to initial state
     pub fn reset(&mut self) -> Result<()> {
         let result = unsafe { ffi::nanocore_vm_reset(self.handle) };
@@ -344,6 +599,38 @@ impl VM {
         check_status(result, "load program")
     }
     
+    /// Load a program image from `nanocore_asm.py --format image` and set
+    /// the PC to its entry point. Text and data are mapped from the file,
+    /// not copied, so it must stay unchanged while the VM runs. With
+    /// `predecode` the image's basic blocks are decoded up front.
+    pub fn load_image(&mut self, path: &str, predecode: bool) -> Result<()> {
+        let path = c_path(path)?;
+        let flags = if predecode { 0x01 } else { 0 };  // NANOCORE_IMAGE_PREDECODE
+        let result = unsafe { ffi::nanocore_vm_load_image(self.handle, path.as_ptr(), flags) };
+        check_status(result, "load image")
+    }
+    
+    /// Save the decoded blocks of the loaded image to `dir`, in a file
+    /// named by the image's key
+    pub fn save_translations(&self, dir: &str) -> Result<()> {
+        let dir = c_path(dir)?;
+        let result = unsafe { ffi::nanocore_vm_save_translations(self.handle, dir.as_ptr()) };
+        check_status(result, "save translations")
+    }
+    
+    /// Warm the block cache from `save_translations` output for the loaded
+    /// image. Returns the blocks restored, or None when `dir` has no cache
+    /// for this image.
+    pub fn load_translations(&mut self, dir: &str) -> Result<Option<u32>> {
+        let dir = c_path(dir)?;
+        let mut restored = 0u32;
+        let result = unsafe { ffi::nanocore_vm_load_translations(self.handle, dir.as_ptr(), &mut restored) };
+        if Status::from_code(result) == Status::Error {
+            return Ok(None);
+        }
+        check_status(result, "load translations").map(|_| Some(restored))
+    }
+    
     /// Read memory from VM
     pub fn read_memory(&self, address: u64, size: u64) -> Result<Vec<u8>> {
         let mut buffer = vec![0u8; size as usize];
@@ -373,6 +660,61 @@ impl VM {
         check_status(result, "write memory")
     }
     
+    /// Borrow guest memory in place, without copying
+    ///
+    /// Fails while the RAM is shared with a hart, which could write under
+    /// the view; use `read_memory` then.
+    pub fn memory(&self, address: u64, size: u64) -> Result<MemoryRef<'_>> {
+        let data = self.map_memory(address, size, ffi::MAP_READ)?;
+        Ok(MemoryRef { vm: self, address, data, len: size as usize })
+    }
+    
+    /// Borrow guest memory mutably in place; the VM cannot run meanwhile.
+    /// Fails while the RAM is shared with a hart, like `memory`.
+    pub fn memory_mut(&mut self, address: u64, size: u64) -> Result<MemoryMut<'_>> {
+        let data = self.map_memory(address, size, ffi::MAP_WRITE)?;
+        Ok(MemoryMut { vm: self, address, data, len: size as usize })
+    }
+    
+    fn map_memory(&self, address: u64, size: u64, access: u32) -> Result<*mut u8> {
+        if size > usize::MAX as u64 {
+            return Err(Error { status: Status::InvalidParameter, message: "Failed to map memory".into() });
+        }
+        let mut data = ptr::null_mut();
+        let result = unsafe { ffi::nanocore_vm_map_memory(self.handle, address, size, access, &mut data) };
+        check_status(result, "map memory")?;
+        Ok(data)
+    }
+    
+    /// Indices (`address / PAGE_SIZE`) of the pages written since the last
+    /// `clear_dirty`, by the guest, any hart sharing its RAM, or through
+    /// this API
+    pub fn dirty_pages(&self) -> Result<Vec<u64>> {
+        let pages = (self.memory_size + PAGE_SIZE - 1) / PAGE_SIZE;
+        let mut bitmap = vec![0u8; ((pages + 7) / 8) as usize];
+        let mut count = 0u64;
+        let result = unsafe {
+            ffi::nanocore_vm_get_dirty_pages(self.handle, bitmap.as_mut_ptr(), bitmap.len() as u64, &mut count)
+        };
+        check_status(result, "get dirty pages")?;
+        
+        let mut dirty = Vec::with_capacity(count as usize);
+        for (i, &byte) in bitmap.iter().enumerate() {
+            let mut bits = byte;
+            while bits != 0 {
+                dirty.push(i as u64 * 8 + bits.trailing_zeros() as u64);
+                bits &= bits - 1;
+            }
+        }
+        Ok(dirty)
+    }
+    
+    /// Start a new dirty-tracking interval, for every hart sharing the RAM
+    pub fn clear_dirty(&mut self) -> Result<()> {
+        let result = unsafe { ffi::nanocore_vm_clear_dirty(self.handle) };
+        check_status(result, "clear dirty pages")
+    }
+    
     /// Set a breakpoint
     pub fn set_breakpoint(&mut self, address: u64) -> Result<()> {
         let result = unsafe { ffi::nanocore_vm_set_breakpoint(self.handle, address) };
@@ -385,6 +727,35 @@ impl VM {
         check_status(result, "clear breakpoint")
     }
     
+    /// Stop runs when the guest accesses `[address, address + size)`;
+    /// `access` is a mask of `WATCH_READ` and `WATCH_WRITE`
+    pub fn set_watchpoint(&mut self, address: u64, size: u64, access: u32) -> Result<()> {
+        let result = unsafe { ffi::nanocore_vm_set_watchpoint(self.handle, address, size, access) };
+        check_status(result, "set watchpoint")
+    }
+    
+    /// Clear the watchpoint set on exactly this range
+    pub fn clear_watchpoint(&mut self, address: u64, size: u64) -> Result<()> {
+        let result = unsafe { ffi::nanocore_vm_clear_watchpoint(self.handle, address, size) };
+        check_status(result, "clear watchpoint")
+    }
+    
+    /// Serve a descriptor ring at `ring_addr` from the host file descriptor
+    /// `fd`, which must stay open until the ring is detached. Completions
+    /// are reported as `DeviceInterrupt` events with data `ring << 32 | count`.
+    pub fn attach_ring(&mut self, ring_addr: u64, entries: u32, fd: c_int) -> Result<u32> {
+        let mut ring = 0;
+        let result = unsafe { ffi::nanocore_vm_ring_attach(self.handle, ring_addr, entries, fd, &mut ring) };
+        check_status(result, "attach ring")?;
+        Ok(ring as u32)
+    }
+    
+    /// Detach a ring; requests still in flight are dropped
+    pub fn detach_ring(&mut self, ring: u32) -> Result<()> {
+        let result = unsafe { ffi::nanocore_vm_ring_detach(self.handle, ring as c_int) };
+        check_status(result, "detach ring")
+    }
+    
     /// Get performance counter value
     pub fn get_perf_counter(&self, counter: PerfCounter) -> Result<u64> {
         let mut value = 0;
@@ -396,6 +767,116 @@ impl VM {
         Ok(value)
     }
     
+    /// Read every performance counter and the profiling state at once
+    pub fn perf(&self) -> Result<Perf> {
+        let mut raw = ffi::Perf {
+            struct_size: std::mem::size_of::<ffi::Perf>() as u32,
+            valid: 0,
+            counters: [0; 16],
+            profile_flags: 0,
+            sample_period: 0,
+            samples: 0,
+            samples_dropped: 0,
+            opcodes: [0; 64],
+        };
+        let result = unsafe { ffi::nanocore_vm_get_perf(self.handle, &mut raw) };
+        check_status(result, "get performance counters")?;
+        
+        Ok(Perf {
+            counters: raw.counters,
+            valid: raw.valid,
+            samples: raw.samples,
+            samples_dropped: raw.samples_dropped,
+            opcodes: raw.opcodes,
+        })
+    }
+    
+    /// Turn profiling on or off: a per-opcode histogram and/or a PC sample
+    /// every `sample_period` instructions (0 = library default). Enabling
+    /// starts from empty; profiled runs don't use the JIT.
+    pub fn set_profiling(&mut self, opcodes: bool, pcs: bool, sample_period: u32) -> Result<()> {
+        let mut flags = 0;
+        if opcodes {
+            flags |= ffi::PROFILE_OPCODES;
+        }
+        if pcs {
+            flags |= ffi::PROFILE_PCS;
+        }
+        let result = unsafe { ffi::nanocore_vm_set_profiling(self.handle, flags, sample_period) };
+        check_status(result, "set profiling")
+    }
+    
+    /// Drain buffered PC samples, oldest first
+    pub fn read_samples(&mut self) -> Result<Vec<u64>> {
+        let mut samples = Vec::new();
+        let mut chunk = vec![0u64; 4096];
+        loop {
+            let mut count = 0;
+            let result = unsafe {
+                ffi::nanocore_vm_read_samples(self.handle, chunk.as_mut_ptr(), chunk.len() as u32, &mut count)
+            };
+            check_status(result, "read samples")?;
+            samples.extend_from_slice(&chunk[..count as usize]);
+            if (count as usize) < chunk.len() {
+                return Ok(samples);
+            }
+        }
+    }
+    
+    /// Sample the PC together with its CALL stack every `sample_period`
+    /// instructions (0 = library default), replacing any other profiling
+    pub fn set_stack_profiling(&mut self, sample_period: u32) -> Result<()> {
+        let result = unsafe { ffi::nanocore_vm_set_profiling(self.handle, ffi::PROFILE_STACKS, sample_period) };
+        check_status(result, "set profiling")
+    }
+    
+    /// Drain buffered stack samples, oldest first. Each stack is the
+    /// sampled PC followed by the enclosing CALL sites, innermost first.
+    pub fn read_stacks(&mut self) -> Result<Vec<Vec<u64>>> {
+        let mut stacks = Vec::new();
+        let mut chunk = vec![0u64; 4096];
+        loop {
+            let mut used = 0;
+            let result = unsafe {
+                ffi::nanocore_vm_read_stacks(self.handle, chunk.as_mut_ptr(), chunk.len() as u32, &mut used)
+            };
+            check_status(result, "read stacks")?;
+            let mut words = &chunk[..used as usize];
+            while let Some((&frames, rest)) = words.split_first() {
+                let (stack, rest) = rest.split_at(frames as usize);
+                stacks.push(stack.to_vec());
+                words = rest;
+            }
+            if (used as usize) < chunk.len() - (ffi::PROFILE_MAX_DEPTH + 2) {
+                return Ok(stacks);
+            }
+        }
+    }
+    
+    /// Count adjacent opcode pairs retired within blocks, replacing any
+    /// other profiling; `read_pairs` then shows which would pay off as
+    /// superinstructions
+    pub fn set_pair_profiling(&mut self) -> Result<()> {
+        let result = unsafe { ffi::nanocore_vm_set_profiling(self.handle, ffi::PROFILE_PAIRS, 0) };
+        check_status(result, "set profiling")
+    }
+    
+    /// Opcode pairs retired since pair profiling was enabled, as
+    /// ((first, second), count), most frequent first
+    pub fn read_pairs(&self) -> Result<Vec<((u8, u8), u64)>> {
+        let mut counts = vec![0u64; 64 * 64];
+        let result = unsafe { ffi::nanocore_vm_read_pairs(self.handle, counts.as_mut_ptr()) };
+        check_status(result, "read pairs")?;
+        let mut pairs: Vec<((u8, u8), u64)> = counts
+            .iter()
+            .enumerate()
+            .filter(|&(_, &count)| count != 0)
+            .map(|(i, &count)| (((i >> 6) as u8, (i & 63) as u8), count))
+            .collect();
+        pairs.sort_by(|a, b| b.1.cmp(&a.1));
+        Ok(pairs)
+    }
+    
     /// Poll for VM events (non-blocking)
     pub fn poll_event(&self) -> Result<Option<Event>> {
         let mut event_type = 0;
@@ -403,27 +884,214 @@ impl VM {
         let result = unsafe {
             ffi::nanocore_vm_poll_event(self.handle, &mut event_type, &mut event_data)
         };
+        Self::take_event(result, event_type, event_data, "poll for event")
+    }
+    
+    /// Wait for the next VM event; `None` waits indefinitely. Returns
+    /// `Ok(None)` if the timeout passes first.
+    pub fn wait_event(&self, timeout: Option<Duration>) -> Result<Option<Event>> {
+        let timeout_ms = timeout.map_or(-1, |t| t.as_millis().min(i32::MAX as u128) as c_int);
+        let mut event_type = 0;
+        let mut event_data = 0;
+        let result = unsafe {
+            ffi::nanocore_vm_wait_event(self.handle, timeout_ms, &mut event_type, &mut event_data)
+        };
+        Self::take_event(result, event_type, event_data, "wait for event")
+    }
+    
+    // NANOCORE_ERROR means no event; an event type this binding doesn't
+    // know is an error rather than being dropped
+    fn take_event(result: c_int, event_type: c_int, data: u64, operation: &str) -> Result<Option<Event>> {
+        if result == Status::Error as c_int {
+            return Ok(None);
+        }
+        check_status(result, operation)?;
         
-        if result == 0 {
-            if let Some(event_type) = EventType::from_code(event_type) {
-                Ok(Some(Event {
-                    event_type,
-                    data: event_data,
-                }))
-            } else {
-                Ok(None)
-            }
-        } else {
-            Ok(None)
+        match EventType::from_code(event_type) {
+            Some(event_type) => Ok(Some(Event { event_type, data })),
+            None => Err(Error {
+                status: Status::Error,
+                message: format!("Unknown event type {} (data {:#x})", event_type, data),
+            }),
         }
     }
     
+    /// Descriptor that turns readable when events are pending, for an
+    /// external epoll/poll loop; drain it with `poll_event`
+    pub fn event_fd(&self) -> Result<c_int> {
+        let mut fd = -1;
+        let result = unsafe { ffi::nanocore_vm_event_fd(self.handle, &mut fd) };
+        check_status(result, "get event fd")?;
+        Ok(fd)
+    }
+    
     /// Get memory size
     pub fn memory_size(&self) -> u64 {
         self.memory_size
     }
+    
+    /// Capture this VM so copies can be started from its current state
+    pub fn snapshot(&self) -> Result<Snapshot> {
+        let mut raw = ptr::null_mut();
+        let result = unsafe { ffi::nanocore_vm_snapshot(self.handle, &mut raw) };
+        check_status(result, "snapshot VM")?;
+        
+        Ok(Snapshot { raw, memory_size: self.memory_size })
+    }
+    
+    /// Add a hardware thread sharing this VM's guest memory
+    ///
+    /// The hart starts from a copy of this VM's registers and can run on
+    /// another host thread. Harts synchronize through LR/SC, the AMOs and
+    /// FENCE; code written by one hart reaches another after FENCE.I.
+    /// Shared RAM is only reachable by copying, so this fails while a
+    /// `memory` view of this VM is alive.
+    pub fn create_hart(&self) -> Result<VM> {
+        let mut handle = 0;
+        let result = unsafe { ffi::nanocore_vm_create_hart(self.handle, &mut handle) };
+        check_status(result, "create hart")?;
+        
+        Ok(VM { handle, memory_size: self.memory_size })
+    }
+    
+    /// Set the interrupt vector base and FLAGS.IE
+    pub fn set_interrupts(&mut self, vbase: u64, enable: bool) -> Result<()> {
+        let result = unsafe { ffi::nanocore_vm_set_interrupts(self.handle, vbase, enable as c_int) };
+        check_status(result, "set interrupts")
+    }
+    
+    /// Raise `IRQ_TIMER` every `period` of host monotonic time; `None` disarms
+    pub fn set_timer(&mut self, period: Option<Duration>) -> Result<()> {
+        let period_ns = period.map_or(0, |p| (p.as_nanos().min(u64::MAX as u128) as u64).max(1));
+        let result = unsafe { ffi::nanocore_vm_set_timer(self.handle, period_ns) };
+        check_status(result, "set timer")
+    }
+    
+    /// Raise an interrupt vector; it is taken at the next block boundary
+    /// once FLAGS.IE is set
+    pub fn raise_interrupt(&self, vector: u32) -> Result<()> {
+        self.interrupter().raise(vector)
+    }
+    
+    /// Handle that raises interrupts from other threads, even mid-run
+    pub fn interrupter(&self) -> Interrupter {
+        Interrupter { handle: self.handle }
+    }
+}
+
+/// Raises interrupts on a VM from any thread
+///
+/// Raising through an interrupter whose VM was dropped fails with
+/// `InvalidParameter`.
+#[derive(Debug, Clone, Copy)]
+pub struct Interrupter {
+    handle: c_int,
+}
+
+impl Interrupter {
+    /// Raise an interrupt vector (`IRQ_TIMER` up to `IRQ_VECTORS - 1`)
+    pub fn raise(&self, vector: u32) -> Result<()> {
+        let result = unsafe { ffi::nanocore_vm_raise_interrupt(self.handle, vector) };
+        check_status(result, "raise interrupt")
+    }
+}
+
+/// Shared view of guest memory; derefs to `&[u8]`
+pub struct MemoryRef<'a> {
+    vm: &'a VM,
+    address: u64,
+    data: *mut u8,
+    len: usize,
+}
+
+impl std::ops::Deref for MemoryRef<'_> {
+    type Target = [u8];
+    
+    fn deref(&self) -> &[u8] {
+        if self.len == 0 {
+            return &[];
+        }
+        unsafe { std::slice::from_raw_parts(self.data, self.len) }
+    }
+}
+
+impl Drop for MemoryRef<'_> {
+    fn drop(&mut self) {
+        unsafe {
+            ffi::nanocore_vm_unmap_memory(self.vm.handle, self.address, self.len as u64, ffi::MAP_READ);
+        }
+    }
+}
+
+/// Exclusive view of guest memory; derefs to `&mut [u8]`
+pub struct MemoryMut<'a> {
+    vm: &'a mut VM,
+    address: u64,
+    data: *mut u8,
+    len: usize,
+}
+
+impl std::ops::Deref for MemoryMut<'_> {
+    type Target = [u8];
+    
+    fn deref(&self) -> &[u8] {
+        if self.len == 0 {
+            return &[];
+        }
+        unsafe { std::slice::from_raw_parts(self.data, self.len) }
+    }
+}
+
+impl std::ops::DerefMut for MemoryMut<'_> {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        if self.len == 0 {
+            return &mut [];
+        }
+        unsafe { std::slice::from_raw_parts_mut(self.data, self.len) }
+    }
+}
+
+impl Drop for MemoryMut<'_> {
+    fn drop(&mut self) {
+        // Unmapping also drops code decoded from bytes written here
+        unsafe {
+            ffi::nanocore_vm_unmap_memory(self.vm.handle, self.address, self.len as u64, ffi::MAP_WRITE);
+        }
+    }
+}
+
+/// Frozen VM state that new VMs fork from
+///
+/// Forks share guest memory with the snapshot copy-on-write and only pay
+/// for the pages they modify.
+pub struct Snapshot {
+    raw: *mut c_void,
+    memory_size: u64,
+}
+
+impl Snapshot {
+    /// Start a new VM from this snapshot
+    pub fn fork(&self) -> Result<VM> {
+        let mut handle = 0;
+        let result = unsafe { ffi::nanocore_vm_fork(self.raw, &mut handle) };
+        check_status(result, "fork VM")?;
+        
+        Ok(VM { handle, memory_size: self.memory_size })
+    }
+}
+
+impl Drop for Snapshot {
+    fn drop(&mut self) {
+        unsafe {
+            ffi::nanocore_snapshot_destroy(self.raw);
+        }
+    }
 }
 
+// A snapshot is immutable once taken
+unsafe impl Send for Snapshot {}
+unsafe impl Sync for Snapshot {}
+
 impl Drop for VM {
     fn drop(&mut self) {
         unsafe {
@@ -436,6 +1104,185 @@ impl Drop for VM {
 unsafe impl Send for VM {}
 unsafe impl Sync for VM {}
 
+/// Why a scheduled VM stopped
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum DoneReason {
+    /// Program halted normally
+    Halted = 0,
+    /// Stopped at a breakpoint or watchpoint
+    Breakpoint = 1,
+    /// Instruction budget used up
+    Budget = 2,
+    /// Run failed; see `status`
+    Error = 3,
+    /// Scheduler shut down first
+    Cancelled = 4,
+}
+
+impl DoneReason {
+    fn from_code(code: u32) -> Self {
+        match code {
+            0 => DoneReason::Halted,
+            1 => DoneReason::Breakpoint,
+            2 => DoneReason::Budget,
+            4 => DoneReason::Cancelled,
+            _ => DoneReason::Error,
+        }
+    }
+}
+
+/// A VM handed back by the scheduler
+pub struct Completion {
+    /// Token returned by `Scheduler::submit`
+    pub token: u64,
+    pub vm: VM,
+    pub reason: DoneReason,
+    pub status: Status,
+    /// Instructions retired while scheduled
+    pub instructions: u64,
+}
+
+/// Runs many VMs on a pool of native worker threads
+///
+/// Submitted VMs are owned by the scheduler until `wait` returns them.
+pub struct Scheduler {
+    raw: *mut c_void,
+    jobs: Mutex<HashMap<u64, VM>>,
+    next_token: AtomicU64,
+}
+
+impl Scheduler {
+    /// Start a scheduler with `workers` threads (0 = one per CPU)
+    pub fn new(workers: u32) -> Result<Self> {
+        let mut raw = ptr::null_mut();
+        let result = unsafe { ffi::nanocore_scheduler_create(workers, None, ptr::null_mut(), &mut raw) };
+        check_status(result, "create scheduler")?;
+        
+        Ok(Scheduler { raw, jobs: Mutex::new(HashMap::new()), next_token: AtomicU64::new(0) })
+    }
+    
+    /// Queue a VM to run in slices of `quantum` instructions (0 = default)
+    /// until it halts, hits a breakpoint or retires `budget` instructions
+    pub fn submit(&self, vm: VM, quantum: u64, budget: Option<u64>) -> Result<u64> {
+        let token = self.next_token.fetch_add(1, Ordering::Relaxed);
+        let handle = vm.handle;
+        // Park the VM first so a fast completion always finds it
+        self.jobs.lock().unwrap().insert(token, vm);
+        
+        let result = unsafe {
+            ffi::nanocore_scheduler_submit(self.raw, handle, quantum, budget.unwrap_or(0), token)
+        };
+        if let Err(error) = check_status(result, "submit VM") {
+            self.jobs.lock().unwrap().remove(&token);
+            return Err(error);
+        }
+        Ok(token)
+    }
+    
+    /// Wait for the next VM to finish; `None` on timeout or when idle
+    pub fn wait(&self, timeout: Option<Duration>) -> Option<Completion> {
+        let timeout_ms = match timeout {
+            Some(duration) => duration.as_millis().min(c_int::MAX as u128) as c_int,
+            None => -1,
+        };
+        let mut raw = ffi::Completion::default();
+        let result = unsafe { ffi::nanocore_scheduler_wait(self.raw, &mut raw, timeout_ms) };
+        if result != 0 {
+            return None;
+        }
+        
+        let vm = self.jobs.lock().unwrap().remove(&raw.user_data)?;
+        Some(Completion {
+            token: raw.user_data,
+            vm,
+            reason: DoneReason::from_code(raw.reason),
+            status: Status::from_code(raw.status),
+            instructions: raw.instructions,
+        })
+    }
+}
+
+impl Drop for Scheduler {
+    fn drop(&mut self) {
+        // Joins the workers before the parked VMs are dropped
+        unsafe {
+            ffi::nanocore_scheduler_destroy(self.raw);
+        }
+    }
+}
+
+unsafe impl Send for Scheduler {}
+unsafe impl Sync for Scheduler {}
+
+/// Most VMs a cohort can hold
+pub const COHORT_MAX_LANES: usize = 64;
+
+/// VMs holding the same program, run in lockstep from one shared
+/// instruction stream
+///
+/// Lanes whose control flow or stores diverge leave lockstep and finish
+/// each run on their own engine.
+pub struct Cohort {
+    raw: *mut c_void,
+    vms: Vec<VM>,
+}
+
+impl Cohort {
+    /// Group up to `COHORT_MAX_LANES` VMs of equal memory size and program
+    pub fn new(vms: Vec<VM>) -> Result<Self> {
+        let handles: Vec<c_int> = vms.iter().map(|vm| vm.handle).collect();
+        let mut raw = ptr::null_mut();
+        let result = unsafe { ffi::nanocore_cohort_create(handles.as_ptr(), handles.len() as u32, &mut raw) };
+        check_status(result, "create cohort")?;
+        
+        Ok(Cohort { raw, vms })
+    }
+    
+    /// Run every lane as `VM::run` would, returning each lane's status
+    pub fn run(&mut self, max_instructions: Option<u64>) -> Result<Vec<Status>> {
+        let mut results = vec![0 as c_int; self.vms.len()];
+        let result = unsafe {
+            ffi::nanocore_cohort_run(self.raw, max_instructions.unwrap_or(0), results.as_mut_ptr())
+        };
+        check_status(result, "run cohort")?;
+        
+        Ok(results.into_iter().map(|result| match result {
+            0 => Status::Ok,
+            1 => Status::Error,
+            _ => Status::from_code(result),
+        }).collect())
+    }
+    
+    /// Bit n set when lane n stayed in lockstep until the last run ended
+    pub fn lockstep_lanes(&self) -> Result<u64> {
+        let mut mask = 0u64;
+        let result = unsafe { ffi::nanocore_cohort_get_lockstep(self.raw, &mut mask) };
+        check_status(result, "get lockstep lanes")?;
+        Ok(mask)
+    }
+    
+    pub fn vms(&self) -> &[VM] {
+        &self.vms
+    }
+    
+    pub fn vms_mut(&mut self) -> &mut [VM] {
+        &mut self.vms
+    }
+    
+    /// Dissolve the cohort, handing the VMs back
+    pub fn into_vms(mut self) -> Vec<VM> {
+        std::mem::take(&mut self.vms)
+    }
+}
+
+impl Drop for Cohort {
+    fn drop(&mut self) {
+        unsafe {
+            ffi::nanocore_cohort_destroy(self.raw);
+        }
+    }
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -474,6 +1321,25 @@ mod tests {
         assert_eq!(read_data, data);
     }
     
+    #[test]
+    fn test_wrapping_addresses_are_rejected() {
+        init().unwrap();
+        let mut vm = VM::new(1024 * 1024).unwrap();
+        
+        // LD R31, -4; RET: the next fetch is at 2^64 - 4
+        let program: Vec<u8> = [0x3FE0FFFCu32, 0x7C000000].iter().flat_map(|w| w.to_le_bytes()).collect();
+        vm.load_program(&program, 0x10000).unwrap();
+        assert_eq!(vm.step().unwrap(), Status::Ok);
+        assert_eq!(vm.step().unwrap(), Status::Ok);
+        assert_eq!(vm.get_state().unwrap().pc, u64::MAX - 3);
+        assert_eq!(vm.step().unwrap(), Status::Error);
+        
+        // Host ranges whose end wraps past zero
+        assert!(vm.read_memory(u64::MAX - 3, 8).is_err());
+        assert!(vm.write_memory(u64::MAX - 3, &[0; 8]).is_err());
+        assert!(vm.load_program(&[0; 8], u64::MAX - 3).is_err());
+    }
+    
     #[test]
     fn test_simple_program() {
         init().unwrap();
@@ -495,4 +1361,883 @@ mod tests {
             status => panic!("Expected Ok, got {:?}", status),
         }
     }
-}
\ No newline at end of file
+    
+    #[test]
+    fn test_jit_matches_interpreter() {
+        init().unwrap();
+        
+        // R1 = 1000; R3 = 1; loop: R2 += R1; R1 -= R3; BNE R1, R0, loop; HALT
+        let words: [u32; 7] = [
+            0x3C2003E8, 0x3C400000, 0x3C600001,
+            0x00420800, 0x04211800, 0x6020FFFC,
+            0x84000000,
+        ];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        
+        for jit in [false, true] {
+            let options = VmOptions { jit, jit_threshold: 1, ..Default::default() };
+            let mut vm = VM::with_options(1024 * 1024, &options).unwrap();
+            vm.load_program(&program, 0x10000).unwrap();
+            
+            // Stop mid-loop, then run to completion
+            vm.run(Some(100)).unwrap();
+            assert_eq!(vm.get_perf_counter(PerfCounter::InstructionCount).unwrap(), 100);
+            vm.run(None).unwrap();
+            assert_eq!(vm.get_register(2).unwrap(), 500500);
+            assert_eq!(vm.get_perf_counter(PerfCounter::InstructionCount).unwrap(), 3003);
+        }
+    }
+    
+    #[test]
+    fn test_illegal_opcodes_fault_and_r0_stays_zero() {
+        init().unwrap();
+        let bytes = |words: &[u32]| -> Vec<u8> { words.iter().flat_map(|w| w.to_le_bytes()).collect() };
+        
+        for jit in [false, true] {
+            let options = VmOptions { jit, jit_threshold: 1, ..Default::default() };
+            
+            // Undefined opcodes in the ALU range fault even with rd = R0;
+            // the LD R1, 7 after them never runs
+            for word in [0x0C000000u32, 0x24000000, 0x0C200000, 0x24200000] {
+                let mut vm = VM::with_options(1024 * 1024, &options).unwrap();
+                vm.load_program(&bytes(&[word, 0x3C200007, 0x84000000]), 0x10000).unwrap();
+                assert_eq!(vm.run(None).unwrap(), Status::Error);
+                assert_eq!(vm.get_register(1).unwrap(), 0);
+            }
+            
+            // R1 = 3; LD R0, 5; ADD R0, R1, R1; LD R2, 1; ADD R3, R0, R2; HALT
+            let mut vm = VM::with_options(1024 * 1024, &options).unwrap();
+            let words = [0x3C200003, 0x3C000005, 0x00010800, 0x3C400001, 0x00601000, 0x84000000];
+            vm.load_program(&bytes(&words), 0x10000).unwrap();
+            assert_eq!(vm.run(None).unwrap(), Status::Ok);
+            assert_eq!(vm.get_register(0).unwrap(), 0);
+            assert_eq!(vm.get_register(3).unwrap(), 1);
+        }
+    }
+    
+    #[test]
+    fn test_store_into_running_block_takes_effect() {
+        init().unwrap();
+        
+        // R4 = 0x1010; R5 = 0x2000; LR R2, (R5); ST R2, 0(R4) overwrites the
+        // next two words of this block, LD R3, 1; HALT, with LD R3, 2; HALT
+        let words: [u32; 6] = [0x3C801010, 0x3CA02000, 0xA4450000, 0x4C440000, 0x3C600001, 0x84000000];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        let patch: Vec<u8> = [0x3C600002u32, 0x84000000].iter().flat_map(|w| w.to_le_bytes()).collect();
+        
+        for jit in [false, true] {
+            let options = VmOptions { jit, jit_threshold: 1, ..Default::default() };
+            let mut vm = VM::with_options(1024 * 1024, &options).unwrap();
+            vm.write_memory(0x2000, &patch).unwrap();
+            vm.load_program(&program, 0x1000).unwrap();
+            assert_eq!(vm.run(None).unwrap(), Status::Ok);
+            assert_eq!(vm.get_register(3).unwrap(), 2);
+        }
+    }
+    
+    #[test]
+    fn test_jit_survives_code_cache_overflow() {
+        init().unwrap();
+        
+        // X0..X11 at 0x10000: BNE R1, R0 to Yi, then BEQ R1, R0 to the
+        // fillers, HALT. Yi: 31 x ST R3, 0(R4), BEQ R0, R0 back to X(i+1).
+        // Each filler is 32 x ADD R2, R2, R3 and the last sets R1 = 1 and
+        // CALLs back, so every Yi is first reached through the chain exit of
+        // a block near the start of the code cache. Fillers sit in block
+        // cache slots the Xs don't use.
+        let (x, y, f) = (0x10000u64, 0x12050u64, 0x18040u64);
+        let rel16 = |from: u64, to: u64| ((to as i64 - from as i64) / 2) as u32 & 0xFFFF;
+        let mut image = vec![0u32; ((y + 12 * 128 - x) / 4) as usize];
+        let mut put = |at: u64, word: u32| image[((at - x) / 4) as usize] = word;
+        for i in 0..12 {
+            let (xi, yi) = (x + 4 * i, y + 128 * i);
+            put(xi, 0x60200000 | rel16(xi, yi));
+            for j in 0..31 {
+                put(yi + 4 * j, 0x4C640000);
+            }
+            put(yi + 124, 0x5C000000 | rel16(yi + 124, xi + 4));
+        }
+        put(x + 48, 0x5C200000 | rel16(x + 48, f));
+        put(x + 52, 0x84000000);
+        let image: Vec<u8> = image.iter().flat_map(|w| w.to_le_bytes()).collect();
+        
+        // Sweep the filler count so that, whatever the exact size of each
+        // translation, some runs fill the cache while compiling a Yi
+        for fillers in (8440..8600u64).step_by(8) {
+            let mut words = vec![0x00421800u32; (fillers * 32) as usize];
+            let back = f + fillers * 128 + 4;
+            words.push(0x3C200001);
+            words.push(0x78000000 | ((x as i64 - back as i64) / 4) as u32 & 0x3FFFFFF);
+            let fill: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+            
+            let options = VmOptions { jit: true, jit_threshold: 1, ..Default::default() };
+            let mut vm = VM::with_options(16 * 1024 * 1024, &options).unwrap();
+            vm.write_memory(f, &fill).unwrap();
+            vm.load_program(&image, x).unwrap();
+            vm.set_register(3, 1).unwrap();
+            vm.set_register(4, 0x3000).unwrap();
+            
+            assert_eq!(vm.run(None).unwrap(), Status::Ok);
+            assert_eq!(vm.get_register(2).unwrap(), 32 * fillers);
+            assert_eq!(vm.read_memory(0x3000, 1).unwrap(), vec![1]);
+        }
+    }
+    
+    #[test]
+    fn test_bulk_memory_ops() {
+        init().unwrap();
+        
+        // R1 = 0x3000; R2 = 0x5A; R3 = 0x1800; MFILL R1, R2, R3; ST R3, 0(R1);
+        // R4 = 0x3800; MCOPY R4, R1, R3 (overlapping, across pages); HALT
+        let words: [u32; 8] = [
+            0x3C203000, 0x3C40005A, 0x3C601800, 0xE0221800,
+            0x4C610000, 0x3C803800, 0xDC811800, 0x84000000,
+        ];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        
+        for jit in [false, true] {
+            let options = VmOptions { jit, jit_threshold: 1, ..Default::default() };
+            let mut vm = VM::with_options(1024 * 1024, &options).unwrap();
+            vm.load_program(&program, 0x10000).unwrap();
+            vm.run(None).unwrap();
+            
+            let copied = vm.read_memory(0x3800, 0x1800).unwrap();
+            assert_eq!(&copied[..8], &0x1800u64.to_le_bytes());
+            assert!(copied[8..].iter().all(|&b| b == 0x5A));
+            assert_eq!(vm.read_memory(0x5000, 1).unwrap(), vec![0]);
+        }
+    }
+    
+    #[test]
+    fn test_vector_ops() {
+        init().unwrap();
+        
+        // R1 = 0x2000; VLOAD V1/V2/V3/V7 from 0(R1), 32, 64, 96;
+        // VADD.I32 V4, V1, V2, V3; VREDSUM.I32 R5, V4;
+        // VGATHER.I64 V6, R1, V7; VREDSUM.I64 R6, V6; HALT
+        let words: [u32; 10] = [
+            0x3C202000, 0xD0210000, 0xD0410020, 0xD0610040, 0xD0E10060,
+            0xE48113C0, 0xE8A400C0, 0xECC13880, 0xE8C60080, 0x84000000,
+        ];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        
+        // V1 = 1..8, V2 = 10..80, V3 masks even i32 lanes, V7 = i64 indices
+        let mut data: Vec<u8> = Vec::new();
+        data.extend((1..=8u32).flat_map(|x| x.to_le_bytes()));
+        data.extend((1..=8u32).flat_map(|x| (x * 10).to_le_bytes()));
+        data.extend((0..8u32).flat_map(|i| if i % 2 == 0 { 0x8000_0000u32 } else { 0 }.to_le_bytes()));
+        data.extend([0u64, 1, 4, 0x20000].iter().flat_map(|x| x.to_le_bytes()));
+        
+        for jit in [false, true] {
+            let options = VmOptions { jit, jit_threshold: 1, ..Default::default() };
+            let mut vm = VM::with_options(1024 * 1024, &options).unwrap();
+            vm.load_program(&data, 0x2000).unwrap();
+            vm.load_program(&program, 0x10000).unwrap();
+            vm.run(None).unwrap();
+            
+            // Masked lanes stay zero: 11 + 33 + 55 + 77
+            assert_eq!(vm.get_register(5).unwrap(), 176);
+            // The out-of-range gather lane is left untouched
+            assert_eq!(vm.get_register(6).unwrap(), 14 + (26 << 32));
+        }
+    }
+    
+    #[test]
+    fn test_ring_device_batches_io() {
+        use std::io::{Read, Write};
+        use std::os::unix::io::AsRawFd;
+        use std::os::unix::net::UnixStream;
+        
+        init().unwrap();
+        let (device, mut host) = UnixStream::pair().unwrap();
+        let mut vm = VM::new(1024 * 1024).unwrap();
+        vm.load_program(&0x84000000u32.to_le_bytes(), 0x10000).unwrap();
+        vm.write_memory(0x3000, b"hello").unwrap();
+        
+        // Ring at 0x2000: an output descriptor, then an input descriptor
+        let ring = vm.attach_ring(0x2000, 4, device.as_raw_fd()).unwrap();
+        let mut descs = Vec::new();
+        for (addr, len, flags) in [(0x3000u64, 5u32, 0u16), (0x4000, 16, RING_DESC_WRITE)] {
+            descs.extend(addr.to_le_bytes());
+            descs.extend(len.to_le_bytes());
+            descs.extend(flags.to_le_bytes());
+            descs.extend(0u16.to_le_bytes());
+        }
+        vm.write_memory(0x2010, &descs).unwrap();
+        vm.write_memory(0x2000, &2u64.to_le_bytes()).unwrap();
+        vm.run(None).unwrap();
+        
+        let mut output = [0u8; 5];
+        host.read_exact(&mut output).unwrap();
+        assert_eq!(&output, b"hello");
+        host.write_all(b"abc").unwrap();
+        
+        // Both completions arrive, possibly over more than one interrupt
+        let mut completed = 0;
+        while completed < 2 {
+            let event = vm.wait_event(Some(Duration::from_secs(5))).unwrap().unwrap();
+            if event.event_type == EventType::DeviceInterrupt {
+                assert_eq!(event.data >> 32, ring as u64);
+                completed += event.data & 0xFFFF_FFFF;
+            }
+        }
+        assert_eq!(completed, 2);
+        
+        // The next run slice writes the completions back to the ring
+        vm.run(None).unwrap();
+        assert_eq!(vm.read_memory(0x2008, 8).unwrap(), 2u64.to_le_bytes().to_vec());
+        assert_eq!(vm.read_memory(0x4000, 3).unwrap(), b"abc".to_vec());
+        assert_eq!(vm.read_memory(0x2028, 4).unwrap(), 3u32.to_le_bytes().to_vec());
+        vm.detach_ring(ring).unwrap();
+    }
+    
+    #[test]
+    fn test_ring_completes_within_one_run() {
+        use std::io::Write;
+        use std::os::unix::io::AsRawFd;
+        use std::os::unix::net::UnixStream;
+        
+        init().unwrap();
+        let bytes = |words: &[u32]| -> Vec<u8> { words.iter().flat_map(|w| w.to_le_bytes()).collect() };
+        
+        // R1 = ring, R3 = &used, R2 = 1; ST R2, 0(R1) posts descriptor 0,
+        // then either spin: LR R4, (R3); BNE R4, R2, spin
+        // or wait for the handler: spin: BEQ R10, R0, spin
+        let post = [0x3C202000, 0x3C602008, 0x3C400001, 0x4C410000];
+        let poll = [0xA4830000, 0x6082FFFE, 0x84000000];
+        let wait = [0x5D400000, 0x84000000];
+        // Vector IRQ_RING0 jumps to LR R11, (R3); LD R10, 1; IRET
+        let vector = [0x5C0007E8];
+        let handler = [0xA5630000, 0x3D400001, 0xF0000000];
+        
+        for (jit, irq) in [(false, false), (false, true), (true, false), (true, true)] {
+            let (device, mut host) = UnixStream::pair().unwrap();
+            let options = VmOptions { jit, jit_threshold: 1, ..Default::default() };
+            let mut vm = VM::with_options(1024 * 1024, &options).unwrap();
+            let mut desc = 0x4000u64.to_le_bytes().to_vec();
+            desc.extend(16u32.to_le_bytes());
+            desc.extend(RING_DESC_WRITE.to_le_bytes());
+            desc.extend(0u16.to_le_bytes());
+            vm.write_memory(0x2010, &desc).unwrap();
+            let ring = vm.attach_ring(0x2000, 4, device.as_raw_fd()).unwrap();
+            assert_eq!(ring, 0);
+        
+            let mut main = post.to_vec();
+            main.extend(if irq { &wait[..] } else { &poll[..] });
+            if irq {
+                vm.load_program(&bytes(&vector), 0x20000 + IRQ_RING0 as u64 * 8).unwrap();
+                vm.load_program(&bytes(&handler), 0x21000).unwrap();
+            }
+            vm.load_program(&bytes(&main), 0x10000).unwrap();
+            vm.set_interrupts(0x20000, irq).unwrap();
+            host.write_all(b"abc").unwrap();
+        
+            // The doorbell store, the drain thread and the completion all
+            // happen inside this one run
+            vm.run(Some(2_000_000_000)).unwrap();
+            let state = vm.get_state().unwrap();
+            assert!(state.flags.is_set(Flags::HALTED));
+            assert_eq!(vm.read_memory(0x4000, 3).unwrap(), b"abc".to_vec());
+            if irq {
+                assert_eq!(state.gprs[11], 1);  // used was already published
+            }
+            vm.detach_ring(ring).unwrap();
+        }
+    }
+    
+    #[test]
+    fn test_event_queue_reports_stops() {
+        init().unwrap();
+        
+        // LD R1, 1; LD R2, 2; HALT
+        let words: [u32; 3] = [0x3C200001, 0x3C400002, 0x84000000];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        let mut vm = VM::new(1024 * 1024).unwrap();
+        vm.load_program(&program, 0x10000).unwrap();
+        vm.set_breakpoint(0x10004).unwrap();
+        
+        let fd = vm.event_fd().unwrap();
+        assert!(fd >= 0);
+        assert!(vm.wait_event(Some(Duration::from_millis(10))).unwrap().is_none());
+        
+        vm.run(None).unwrap();
+        let event = vm.wait_event(None).unwrap().unwrap();
+        assert_eq!(event.event_type, EventType::Breakpoint);
+        assert_eq!(event.data, 0x10004);
+        
+        vm.clear_breakpoint(0x10004).unwrap();
+        vm.run(None).unwrap();
+        vm.run(None).unwrap();
+        let event = vm.poll_event().unwrap().unwrap();
+        assert_eq!(event.event_type, EventType::Halted);
+        
+        // A halt is reported once, not on every poll
+        assert!(vm.poll_event().unwrap().is_none());
+    }
+    
+    #[test]
+    fn test_breakpoints_and_watchpoints_in_hot_loop() {
+        init().unwrap();
+        
+        // R1 = 1000; R3 = 1; R4 = 0x3000; loop: R2 += R1; ST R2, 0(R4);
+        // R1 -= R3; BNE R1, R0, loop; HALT
+        let words: [u32; 8] = [
+            0x3C2003E8, 0x3C600001, 0x3C803000,
+            0x00420800, 0x4C440000, 0x04211800, 0x6020FFFA,
+            0x84000000,
+        ];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        
+        for jit in [false, true] {
+            let options = VmOptions { jit, jit_threshold: 1, ..Default::default() };
+            let mut vm = VM::with_options(1024 * 1024, &options).unwrap();
+            vm.load_program(&program, 0x10000).unwrap();
+            
+            // Warm the loop up, then break inside it
+            vm.run(Some(500)).unwrap();
+            vm.set_breakpoint(0x10014).unwrap();
+            vm.run(None).unwrap();
+            assert_eq!(vm.get_state().unwrap().pc, 0x10014);
+            vm.clear_breakpoint(0x10014).unwrap();
+            
+            // The store right after the breakpoint trips a write watchpoint
+            vm.set_watchpoint(0x3004, 4, WATCH_WRITE).unwrap();
+            vm.run(None).unwrap();
+            vm.clear_watchpoint(0x3004, 4).unwrap();
+            
+            let mut kinds = Vec::new();
+            while let Some(event) = vm.poll_event().unwrap() {
+                kinds.push((event.event_type, event.data));
+            }
+            assert_eq!(kinds, vec![(EventType::Breakpoint, 0x10014), (EventType::Watchpoint, 0x3000)]);
+            assert_eq!(vm.get_state().unwrap().pc, 0x10014);
+            
+            vm.run(None).unwrap();
+            assert_eq!(vm.get_register(2).unwrap(), 500500);
+        }
+    }
+    
+    #[test]
+    fn test_scheduler_runs_many_vms() {
+        init().unwrap();
+        
+        let words: [u32; 7] = [
+            0x3C2003E8, 0x3C400000, 0x3C600001,
+            0x00420800, 0x04211800, 0x6020FFFC,
+            0x84000000,
+        ];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        
+        let scheduler = Scheduler::new(2).unwrap();
+        for _ in 0..8 {
+            let mut vm = VM::new(1024 * 1024).unwrap();
+            vm.load_program(&program, 0x10000).unwrap();
+            scheduler.submit(vm, 100, None).unwrap();
+        }
+        
+        let mut finished = 0;
+        while let Some(done) = scheduler.wait(None) {
+            assert_eq!(done.reason, DoneReason::Halted);
+            assert_eq!(done.vm.get_register(2).unwrap(), 500500);
+            assert_eq!(done.instructions, 3003);
+            finished += 1;
+        }
+        assert_eq!(finished, 8);
+    }
+    
+    #[test]
+    fn test_fork_shares_memory_copy_on_write() {
+        init().unwrap();
+        
+        let words: [u32; 7] = [
+            0x3C2003E8, 0x3C400000, 0x3C600001,
+            0x00420800, 0x04211800, 0x6020FFFC,
+            0x84000000,
+        ];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        
+        let mut parent = VM::new(1024 * 1024).unwrap();
+        parent.load_program(&program, 0x10000).unwrap();
+        parent.run(Some(100)).unwrap();
+        let snapshot = parent.snapshot().unwrap();
+        
+        let mut first = snapshot.fork().unwrap();
+        let mut second = snapshot.fork().unwrap();
+        drop(snapshot);
+        
+        first.write_memory(0x8000, &[0xAB]).unwrap();
+        assert_eq!(second.read_memory(0x8000, 1).unwrap(), vec![0]);
+        
+        for vm in [&mut first, &mut second] {
+            assert_eq!(vm.get_perf_counter(PerfCounter::InstructionCount).unwrap(), 100);
+            vm.run(None).unwrap();
+            assert_eq!(vm.get_register(2).unwrap(), 500500);
+        }
+    }
+    
+    #[test]
+    fn test_sparse_memory_covers_isa_layout() {
+        init().unwrap();
+        
+        let options = VmOptions { sparse: true, ..Default::default() };
+        let mut vm = VM::with_options(0, &options).unwrap();
+        assert_eq!(vm.memory_size(), SPARSE_MEMORY_SIZE);
+        
+        // User heap and stack regions from docs/isa_spec.md
+        vm.write_memory(0x8000_0000, &[1, 2, 3]).unwrap();
+        vm.write_memory(0x1_0000_0000, &[4]).unwrap();
+        assert_eq!(vm.read_memory(0x8000_0000, 3).unwrap(), vec![1, 2, 3]);
+        assert_eq!(vm.read_memory(0x1_0000_0000, 1).unwrap(), vec![4]);
+        assert_eq!(vm.get_state().unwrap().sp, SPARSE_MEMORY_SIZE - 8);
+    }
+    
+    #[test]
+    fn test_memory_views_are_zero_copy() {
+        init().unwrap();
+        let mut vm = VM::new(1024 * 1024).unwrap();
+        
+        {
+            let mut view = vm.memory_mut(0x2000, 4096).unwrap();
+            view[..5].copy_from_slice(b"hello");
+        }
+        assert_eq!(vm.read_memory(0x2000, 5).unwrap(), b"hello".to_vec());
+        
+        vm.write_memory(0x2000, b"J").unwrap();
+        let first = vm.memory(0x2000, 5).unwrap();
+        let second = vm.memory(0x2000, 5).unwrap();
+        assert_eq!(&*first, b"Jello");
+        assert_eq!(first.as_ptr(), second.as_ptr());
+        
+        assert!(vm.memory(1024 * 1024 - 4, 8).is_err());
+    }
+    
+    #[test]
+    fn test_dirty_pages_track_guest_and_host_writes() {
+        init().unwrap();
+        
+        // LD R4, 0x3000; ST R4, 0(R4); LD R5, 0x5008; ST R5, 0(R5); HALT
+        let words: [u32; 5] = [0x3C803000, 0x4C840000, 0x3CA05008, 0x4CA50000, 0x84000000];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        let mut vm = VM::new(1024 * 1024).unwrap();
+        vm.load_program(&program, 0x10000).unwrap();
+        vm.run(None).unwrap();
+        assert_eq!(vm.dirty_pages().unwrap(), vec![0x3, 0x5, 0x10]);
+        
+        // Pages already written must still be caught after a clear
+        vm.clear_dirty().unwrap();
+        assert!(vm.dirty_pages().unwrap().is_empty());
+        vm.reset().unwrap();
+        vm.write_memory(0x7000, b"x").unwrap();
+        vm.run(None).unwrap();
+        assert_eq!(vm.dirty_pages().unwrap(), vec![0x3, 0x5, 0x7]);
+    }
+    
+    #[test]
+    fn test_profiling_counts_opcodes_and_samples_pcs() {
+        init().unwrap();
+        
+        // R1 = 1000; R3 = 1; loop: R2 += R1; R1 -= R3; BNE R1, R0, loop; HALT
+        let words: [u32; 7] = [
+            0x3C2003E8, 0x3C400000, 0x3C600001,
+            0x00420800, 0x04211800, 0x6020FFFC,
+            0x84000000,
+        ];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        let options = VmOptions { jit: true, jit_threshold: 1, ..Default::default() };
+        let mut vm = VM::with_options(1024 * 1024, &options).unwrap();
+        vm.load_program(&program, 0x10000).unwrap();
+        
+        assert!(vm.perf().unwrap().get(PerfCounter::MemoryOps).is_none());
+        vm.set_profiling(true, true, 100).unwrap();
+        vm.run(None).unwrap();
+        
+        let perf = vm.perf().unwrap();
+        assert_eq!(perf.get(PerfCounter::InstructionCount), Some(3003));
+        assert_eq!(perf.get(PerfCounter::MemoryOps), Some(0));
+        assert_eq!(perf.opcodes[0x00], 1000);  // ADD
+        assert_eq!(perf.opcodes[0x18], 1000);  // BNE
+        assert_eq!(perf.samples, 30);
+        
+        // Instruction 100 is the ADD of the 33rd iteration
+        let samples = vm.read_samples().unwrap();
+        assert_eq!(samples.len(), 30);
+        assert_eq!(samples[0], 0x1000C);
+        assert!(vm.read_samples().unwrap().is_empty());
+    }
+    
+    #[test]
+    fn test_stack_profiling_follows_call_and_ret() {
+        init().unwrap();
+        
+        // main: R1 = 100; R3 = 1; loop: CALL f; R1 -= R3; BNE R1, R0, loop; HALT
+        // f: R2 += R3; R20 = R31; CALL g; R31 = R20; RET
+        // g: R4 += R3; RET
+        let words: [u32; 13] = [
+            0x3C200064, 0x3C600001, 0x78000004, 0x04211800, 0x6020FFFC, 0x84000000,
+            0x00421800, 0x029F0000, 0x78000003, 0x03F40000, 0x7C000000,
+            0x00841800, 0x7C000000,
+        ];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        let mut vm = VM::new(1024 * 1024).unwrap();
+        vm.load_program(&program, 0x10000).unwrap();
+        
+        vm.set_stack_profiling(7).unwrap();
+        vm.run(None).unwrap();
+        assert_eq!(vm.get_register(2).unwrap(), 100);
+        assert_eq!(vm.get_register(4).unwrap(), 100);
+        
+        // 1002 instructions retire, a sample every 7th
+        let stacks = vm.read_stacks().unwrap();
+        assert_eq!(stacks.len(), 143);
+        for stack in &stacks {
+            match stack[0] {
+                0x10000..=0x10014 => assert_eq!(stack.len(), 1),
+                0x10018..=0x10028 => assert_eq!(stack[1..], [0x10008]),
+                _ => assert_eq!(stack[1..], [0x10020, 0x10008]),
+            }
+        }
+        assert!(stacks.iter().any(|stack| stack.len() == 3));
+        assert!(vm.read_stacks().unwrap().is_empty());
+    }
+    
+    #[test]
+    fn test_load_image_maps_sections() {
+        init().unwrap();
+        
+        // Text at 0x10000: 1100 NOPs, R2 = 7, HALT (one whole page plus a
+        // ragged tail); data at 0x12000; 8 KiB of bss at 0x13000
+        let mut text: Vec<u32> = vec![0x88000000; 1100];
+        text.extend([0x3C400007, 0x84000000]);
+        let text: Vec<u8> = text.iter().flat_map(|w| w.to_le_bytes()).collect();
+        let data = b"imagedat";
+        
+        let mut image = Vec::new();
+        let header: [u32; 12] = [0x4D49434E, 1 | (48 << 16), 0x10000, 0, 3, 48, 0, 144, 144, 0, 1, 144];
+        image.extend(header.iter().flat_map(|w| w.to_le_bytes()));
+        let sections: [(u32, u64, u64, u64); 3] = [
+            (1, 0x10000, 0x1000, text.len() as u64),
+            (2, 0x12000, 0x3000, data.len() as u64),
+            (3, 0x13000, 0, 0x2000),
+        ];
+        for (kind, address, offset, size) in sections {
+            image.extend(kind.to_le_bytes());
+            image.extend(0u32.to_le_bytes());
+            image.extend(address.to_le_bytes());
+            image.extend(offset.to_le_bytes());
+            image.extend(size.to_le_bytes());
+        }
+        image.extend(0x10000u64.to_le_bytes());  // Block table
+        image.resize(0x1000, 0);
+        image.extend(&text);
+        image.resize(0x3000, 0);
+        image.extend(data);
+        
+        let path = std::env::temp_dir().join(format!("nanocore-test-{}.nci", std::process::id()));
+        std::fs::write(&path, &image).unwrap();
+        
+        let mut vm = VM::new(1024 * 1024).unwrap();
+        vm.write_memory(0x13ff8, &[0xAA; 16]).unwrap();  // Stale bss
+        vm.load_image(path.to_str().unwrap(), true).unwrap();
+        vm.run(None).unwrap();
+        assert_eq!(vm.get_register(2).unwrap(), 7);
+        assert_eq!(vm.read_memory(0x12000, 8).unwrap(), data);
+        assert_eq!(vm.read_memory(0x13ff8, 16).unwrap(), vec![0; 16]);
+        
+        // Private mappings: guest writes never reach the file
+        vm.write_memory(0x10000, &[0; 4]).unwrap();
+        assert_eq!(std::fs::read(&path).unwrap(), image);
+        
+        let mut bad = image.clone();
+        bad[0] = 0;
+        std::fs::write(&path, &bad).unwrap();
+        assert!(vm.load_image(path.to_str().unwrap(), false).is_err());
+        std::fs::remove_file(&path).unwrap();
+    }
+    
+    #[test]
+    fn test_translation_cache_survives_restart() {
+        init().unwrap();
+        
+        // Text-only image keyed 0x1234: R1 = 100; R3 = 1; loop: R2 += R3;
+        // R1 -= R3; BNE R1, R0, loop; HALT
+        let words: [u32; 6] = [0x3C200064, 0x3C600001, 0x00421800, 0x04211800, 0x6020FFFC, 0x84000000];
+        let mut image = Vec::new();
+        let header: [u32; 12] = [0x4D49434E, 1 | (56 << 16), 0x10000, 0, 1, 56, 0, 88, 88, 0, 0, 88];
+        image.extend(header.iter().flat_map(|w| w.to_le_bytes()));
+        image.extend(0x1234u64.to_le_bytes());
+        image.extend(1u32.to_le_bytes());
+        image.extend(0u32.to_le_bytes());
+        for field in [0x10000u64, 0x1000, words.len() as u64 * 4] {
+            image.extend(field.to_le_bytes());
+        }
+        image.resize(0x1000, 0);
+        image.extend(words.iter().flat_map(|w| w.to_le_bytes()));
+        
+        let dir = std::env::temp_dir().join(format!("nanocore-tcache-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("loop.nci");
+        std::fs::write(&path, &image).unwrap();
+        let (path, dir_name) = (path.to_str().unwrap(), dir.to_str().unwrap());
+        
+        let mut vm = VM::new(1024 * 1024).unwrap();
+        vm.load_image(path, false).unwrap();
+        assert_eq!(vm.load_translations(dir_name).unwrap(), None);
+        vm.run(None).unwrap();
+        vm.save_translations(dir_name).unwrap();
+        assert!(dir.join("0000000000001234.nctc").exists());
+        
+        // A restarted worker maps the blocks back in
+        let mut warm = VM::new(1024 * 1024).unwrap();
+        warm.load_image(path, false).unwrap();
+        assert_eq!(warm.load_translations(dir_name).unwrap(), Some(3));
+        warm.run(None).unwrap();
+        assert_eq!(warm.get_register(2).unwrap(), 100);
+        
+        // Blocks whose guest words changed are decoded afresh
+        let mut patched = VM::new(1024 * 1024).unwrap();
+        patched.load_image(path, false).unwrap();
+        patched.write_memory(0x10000, &0x3C200032u32.to_le_bytes()).unwrap();  // R1 = 50
+        assert_eq!(patched.load_translations(dir_name).unwrap(), Some(2));
+        patched.run(None).unwrap();
+        assert_eq!(patched.get_register(2).unwrap(), 50);
+        
+        // A corrupt op is caught by re-decoding, even with the guest words intact
+        let cache_path = dir.join("0000000000001234.nctc");
+        let mut cache = std::fs::read(&cache_path).unwrap();
+        let field = |at: usize| u32::from_le_bytes(cache[at..at + 4].try_into().unwrap()) as usize;
+        let (entries, block_size) = (field(16), field(20));
+        let slot = (0..entries).map(|i| 4096 + i * block_size).find(|&at| field(at + 8) != 0).unwrap();
+        cache[slot + 24] = 0xFF;  // ops[0].opcode
+        cache[slot + 25] = 0xFF;  // ops[0].rd
+        std::fs::write(&cache_path, &cache).unwrap();
+        let mut corrupt = VM::new(1024 * 1024).unwrap();
+        corrupt.load_image(path, false).unwrap();
+        assert_eq!(corrupt.load_translations(dir_name).unwrap(), Some(2));
+        corrupt.run(None).unwrap();
+        assert_eq!(corrupt.get_register(2).unwrap(), 100);
+        
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+    
+    #[test]
+    fn test_superinstructions_match_plain_dispatch() {
+        init().unwrap();
+        
+        // R1 = 200; R3 = 1; loop: R4 = 3; R2 += R4; R6 = R5 + R1;
+        // ST R2, 0(R6); R1 -= R3; BNE R1, R0, loop; HALT with R5 = 0x20000
+        // (LD+ADD, ADD+ST and SUB+BNE pairs)
+        let words: [u32; 9] = [
+            0x3C2000C8, 0x3C600001, 0x3C800003, 0x00422000, 0x00C50800,
+            0x4C460000, 0x04211800, 0x6020FFF6, 0x84000000,
+        ];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        let mut vm = VM::new(1024 * 1024).unwrap();
+        vm.load_program(&program, 0x10000).unwrap();
+        vm.set_register(5, 0x20000).unwrap();
+        vm.set_pair_profiling().unwrap();
+        vm.run(None).unwrap();
+        assert_eq!(vm.get_register(2).unwrap(), 600);
+        assert_eq!(vm.read_memory(0x20001, 8).unwrap(), 600u64.to_le_bytes());
+        
+        // Pairs are counted as separate opcodes, fused or not
+        let pairs = vm.read_pairs().unwrap();
+        let count = |first: u8, second: u8| {
+            pairs.iter().find(|p| p.0 == (first, second)).map_or(0, |p| p.1)
+        };
+        assert_eq!(count(0x0F, 0x00), 200);  // LD, ADD
+        assert_eq!(count(0x00, 0x13), 200);  // ADD, ST
+        assert_eq!(count(0x01, 0x18), 200);  // SUB, BNE
+        
+        // Budgets that end inside a pair stop exactly there
+        let mut stepped = VM::new(1024 * 1024).unwrap();
+        stepped.load_program(&program, 0x10000).unwrap();
+        stepped.set_register(5, 0x20000).unwrap();
+        for _ in 0..7 {
+            stepped.run(Some(5)).unwrap();
+        }
+        assert_eq!(stepped.get_register(1).unwrap(), 195);  // 2 + 5 * 6 + 3 instructions
+        assert_eq!(stepped.get_register(2).unwrap(), 18);
+    }
+    
+    #[test]
+    fn test_cohort_matches_individual_runs() {
+        init().unwrap();
+        
+        // R1 = R7 * 4; loop: R2 += R1; ST R2, 0(R5); R1 -= R3;
+        // BNE R1, R0, loop; HALT. R7 differs per lane, so lanes leave the
+        // loop at different times.
+        let words: [u32; 7] = [
+            0x3C600001, 0x3C800004, 0x08272000, 0x00420800, 0x4C450000,
+            0x04211800, 0x6020FFFA,
+        ];
+        let mut program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        program.extend_from_slice(&0x84000000u32.to_le_bytes());
+        
+        let make = |seed: u64| {
+            let mut vm = VM::new(1024 * 1024).unwrap();
+            vm.load_program(&program, 0x10000).unwrap();
+            vm.set_register(5, 0x20000).unwrap();
+            vm.set_register(7, seed).unwrap();
+            vm
+        };
+        let seeds = [5u64, 5, 5, 9, 5, 3, 5, 5, 5, 12];
+        let mut cohort = Cohort::new(seeds.iter().map(|&seed| make(seed)).collect()).unwrap();
+        let statuses = cohort.run(None).unwrap();
+        
+        let mut alone: Vec<VM> = seeds.iter().map(|&seed| make(seed)).collect();
+        for (lane, vm) in alone.iter_mut().enumerate() {
+            assert_eq!(vm.run(None).unwrap(), statuses[lane]);
+            let together = &cohort.vms()[lane];
+            let (ours, theirs) = (together.get_state().unwrap(), vm.get_state().unwrap());
+            assert!(ours.flags.is_set(Flags::HALTED));
+            assert_eq!(ours.gprs, theirs.gprs);
+            assert_eq!(ours.pc, theirs.pc);
+            assert_eq!(together.read_memory(0x20000, 8).unwrap(), vm.read_memory(0x20000, 8).unwrap());
+            assert_eq!(together.get_perf_counter(PerfCounter::InstructionCount).unwrap(),
+                       vm.get_perf_counter(PerfCounter::InstructionCount).unwrap());
+        }
+        
+        // The seed-5 lanes never diverged; the rest were split off
+        let lanes = cohort.lockstep_lanes().unwrap();
+        assert_eq!(lanes, 0b0111010111);
+    }
+    
+    #[test]
+    fn test_harts_share_memory_atomically() {
+        init().unwrap();
+        
+        // R1 = 0x2000; R8 = 0x2008; R4 = 1; R5 = 1000; loop: AMOADD R3, R4, (R1);
+        // retry: LR R7, (R8); R7 += R4; SC R9, R7, (R8); BNE R9, R0, retry;
+        // R6 += R4; BLT R6, R5, loop; FENCE; HALT
+        let words: [u32; 13] = [
+            0x3C202000, 0x3D002008, 0x3C800001, 0x3CA003E8, 0xB0612000, 0xA4E80000, 0x00E72000,
+            0xA9283800, 0x6120FFFA, 0x00C62000, 0x64C5FFF4, 0xA0000000, 0x84000000,
+        ];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        
+        let options = VmOptions { jit: true, ..VmOptions::default() };
+        let mut vm = VM::with_options(1024 * 1024, &options).unwrap();
+        vm.load_program(&program, 0x10000).unwrap();
+        let harts: Vec<VM> = (0..3).map(|_| vm.create_hart().unwrap()).collect();
+        
+        let threads: Vec<_> = harts.into_iter().map(|mut hart| {
+            std::thread::spawn(move || {
+                assert_eq!(hart.run(None).unwrap(), Status::Ok);
+                hart
+            })
+        }).collect();
+        assert_eq!(vm.run(None).unwrap(), Status::Ok);
+        let harts: Vec<VM> = threads.into_iter().map(|t| t.join().unwrap()).collect();
+        
+        // Every increment landed, whichever hart made it
+        let counters = vm.read_memory(0x2000, 16).unwrap();
+        assert_eq!(u64::from_le_bytes(counters[..8].try_into().unwrap()), 4000);
+        assert_eq!(u64::from_le_bytes(counters[8..].try_into().unwrap()), 4000);
+        
+        // The RAM outlives the VM that created it
+        drop(vm);
+        assert_eq!(harts[2].read_memory(0x2000, 8).unwrap(), counters[..8].to_vec());
+    }
+    
+    #[test]
+    fn test_shared_memory_is_never_borrowed() {
+        init().unwrap();
+        let vm = VM::new(1024 * 1024).unwrap();
+        
+        let view = vm.memory(0x2000, 8).unwrap();
+        assert!(vm.create_hart().is_err());
+        drop(view);
+        
+        // Once harts share the RAM, only the copying accessors work
+        let mut hart = vm.create_hart().unwrap();
+        assert!(vm.memory(0x2000, 8).is_err());
+        assert!(hart.memory_mut(0x2000, 8).is_err());
+        hart.write_memory(0x2000, &[1]).unwrap();
+        assert_eq!(vm.read_memory(0x2000, 1).unwrap(), [1]);
+        
+        drop(hart);
+        assert_eq!(vm.memory(0x2000, 1).unwrap()[0], 1);
+    }
+    
+    #[test]
+    fn test_dirty_pages_cover_every_hart() {
+        init().unwrap();
+        
+        // LD R4, 0x5000; ST R4, 0(R4); HALT, run only by the second hart
+        let words: [u32; 3] = [0x3C805000, 0x4C840000, 0x84000000];
+        let program: Vec<u8> = words.iter().flat_map(|w| w.to_le_bytes()).collect();
+        let mut vm = VM::new(1024 * 1024).unwrap();
+        vm.load_program(&program, 0x10000).unwrap();
+        let mut hart = vm.create_hart().unwrap();
+        vm.clear_dirty().unwrap();
+        
+        hart.run(None).unwrap();
+        assert_eq!(vm.dirty_pages().unwrap(), vec![0x5]);
+        assert_eq!(hart.dirty_pages().unwrap(), vec![0x5]);
+        
+        // Clearing through either VM starts a new interval for both
+        vm.clear_dirty().unwrap();
+        assert!(hart.dirty_pages().unwrap().is_empty());
+        hart.reset().unwrap();  // Back to PC 0x10000
+        hart.run(None).unwrap();
+        assert_eq!(vm.dirty_pages().unwrap(), vec![0x5]);
+    }
+
+    #[test]
+    fn test_timer_and_raised_interrupts_preempt_guest() {
+        init().unwrap();
+        
+        // R11 = 1; R12 = 3; spin: BLT R10, R12, spin; HALT. Only the
+        // handler, R10 += R11; IRET, lets the guest out of the loop.
+        let main: [u32; 4] = [0x3D600001, 0x3D800003, 0x654C0000, 0x84000000];
+        let handler: [u32; 2] = [0x014A5800, 0xF0000000];
+        let bytes = |words: &[u32]| -> Vec<u8> { words.iter().flat_map(|w| w.to_le_bytes()).collect() };
+        
+        let options = VmOptions { jit: true, ..VmOptions::default() };
+        let make = || {
+            let mut vm = VM::with_options(1024 * 1024, &options).unwrap();
+            for vector in [IRQ_TIMER, IRQ_EXTERNAL0] {
+                vm.load_program(&bytes(&handler), 0x20000 + vector as u64 * 8).unwrap();
+            }
+            vm.load_program(&bytes(&main), 0x10000).unwrap();  // Also sets the PC
+            vm.set_interrupts(0x20000, true).unwrap();
+            vm
+        };
+        
+        // Host monotonic timer ticks
+        let mut vm = make();
+        vm.set_timer(Some(Duration::from_millis(1))).unwrap();
+        vm.run(None).unwrap();
+        let state = vm.get_state().unwrap();
+        assert_eq!(state.gprs[10], 3);
+        assert!(state.flags.is_set(Flags::HALTED));
+        assert!(state.flags.is_set(Flags::INTERRUPT_ENABLE));
+        vm.set_timer(None).unwrap();
+        
+        // Another thread raising a vector while the guest spins
+        let mut vm = make();
+        let irq = vm.interrupter();
+        let done = std::sync::Arc::new(std::sync::atomic::AtomicBool::new(false));
+        let raiser = {
+            let done = done.clone();
+            std::thread::spawn(move || {
+                while !done.load(Ordering::Relaxed) {
+                    irq.raise(IRQ_EXTERNAL0).unwrap();
+                    std::thread::sleep(Duration::from_micros(200));
+                }
+            })
+        };
+        vm.run(None).unwrap();
+        done.store(true, Ordering::Relaxed);
+        raiser.join().unwrap();
+        assert_eq!(vm.get_state().unwrap().gprs[10], 3);
+        
+        // With IE clear, raised vectors wait
+        let mut vm = make();
+        vm.set_interrupts(0x20000, false).unwrap();
+        vm.raise_interrupt(IRQ_EXTERNAL0).unwrap();
+        vm.run(Some(1000)).unwrap();
+        assert_eq!(vm.get_state().unwrap().gprs[10], 0);
+        assert!(vm.raise_interrupt(2).is_err());
+    }
+}
@@ -19,7 +19,7 @@ chmod +x build.sh
 # Step 2: Build FFI Library
 echo -e "\n🔧 Building FFI library..."
 mkdir -p build/lib
-gcc -shared -fPIC -O2 -o build/lib/libnanocore_ffi.so glue/ffi/nanocore_ffi.c
+gcc -shared -fPIC -O2 -o build/lib/libnanocore_ffi.so glue/ffi/nanocore_ffi.c -lm
 
 # Step 3: Set library path
 export LD_LIBRARY_PATH=$PWD/build/lib:$LD_LIBRARY_PATH
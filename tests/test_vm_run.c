@@ -0,0 +1,447 @@
+/*
+ * Smoke test for the assembly core's vm_run
+ * Runs short guest programs through the dispatch loop, once untimed and
+ * once with the timing model, and checks registers, guest memory, the
+ * exit code and the retired instruction count.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Core entry points (every one but nanocore_init takes the VM context)
+extern int nanocore_init(void);
+extern void* vm_context_create(void);
+extern void vm_context_destroy(void* ctx);
+extern int vm_init(void* ctx, uint64_t memory_size);
+extern void vm_reset(void* ctx);
+extern int vm_run(void* ctx, uint64_t max_instructions);
+extern void vm_set_pc(void* ctx, uint64_t pc);
+extern void vm_set_register(void* ctx, int index, uint64_t value);
+extern uint64_t vm_get_register(void* ctx, int index);
+extern void vm_set_timing_mode(void* ctx, int enable);
+extern void vm_set_debug_mode(void* ctx, int enable);
+extern int vm_set_breakpoint(void* ctx, uint64_t pc);
+extern int vm_clear_breakpoint(void* ctx, uint64_t pc);
+extern const void* vm_get_state(void* ctx);
+extern const void* vm_get_abi(void);
+extern void vm_get_perf(void* ctx, uint64_t perf[16]);
+extern int memory_write(void* ctx, uint64_t addr, const void* data, uint64_t size);
+extern int memory_read(void* ctx, uint64_t addr, void* data, uint64_t size);
+
+#define MEMORY_SIZE (1024 * 1024)
+#define CODE_BASE 0x10000
+#define DATA_BASE 0x20000
+
+// Architectural state as cli/main.c declares it; vm_get_abi must agree
+typedef struct {
+    uint64_t pc;
+    uint64_t sp;
+    uint64_t flags;
+    uint64_t gprs[32];
+    uint64_t vregs[16][4];
+    uint64_t perf_counters[8];
+    uint64_t cache_ctrl;
+    uint64_t vbase;
+} vm_state_t;
+
+#define VM_ABI_VERSION 1
+
+typedef struct {
+    uint32_t struct_size;
+    uint32_t version;
+    uint32_t state_size;
+    uint32_t state_pc, state_sp, state_flags, state_gprs;
+    uint32_t state_vregs, state_perf_counters, state_cache_ctrl, state_vbase;
+    uint32_t perf_size, options_size, reserved;
+} abi_t;
+
+// vm_get_perf layout: the PERF_* counters (asm/core/vm.asm), then the
+// cache_get_stats STAT_* entries (asm/core/cache.asm)
+#define PERF_COUNTERS 8
+#define PERF_MEM_OPS 6
+#define PERF_SIMD_OPS 7
+#define STAT_L1I_HITS (PERF_COUNTERS + 0)
+#define STAT_L1I_MISSES (PERF_COUNTERS + 1)
+#define STAT_L1D_HITS (PERF_COUNTERS + 2)
+#define STAT_L1D_MISSES (PERF_COUNTERS + 3)
+
+// Instruction encodings (docs/isa_spec.md); stores take their value
+// register in the rd field
+#define OP_R(op, rd, rs1, rs2) (((uint32_t)(op) << 26) | ((rd) << 21) | ((rs1) << 16) | ((rs2) << 11))
+#define OP_I(op, rd, rs1, imm) (((uint32_t)(op) << 26) | ((rd) << 21) | ((rs1) << 16) | ((uint32_t)(imm) & 0xFFFF))
+#define OP_CALL(words) ((0x1Eu << 26) | ((uint32_t)(words) & 0x3FFFFFF))
+#define OP_RET (0x1Fu << 26)
+#define OP_HALT (0x21u << 26)
+
+#define ADD(rd, a, b) OP_R(0x00, rd, a, b)
+#define SUB(rd, a, b) OP_R(0x01, rd, a, b)
+#define MUL(rd, a, b) OP_R(0x02, rd, a, b)
+#define DIV(rd, a, b) OP_R(0x04, rd, a, b)
+#define MOD(rd, a, b) OP_R(0x05, rd, a, b)
+#define AND(rd, a, b) OP_R(0x06, rd, a, b)
+#define OR(rd, a, b) OP_R(0x07, rd, a, b)
+#define XOR(rd, a, b) OP_R(0x08, rd, a, b)
+#define SHL(rd, a, b) OP_R(0x0A, rd, a, b)
+#define SHR(rd, a, b) OP_R(0x0B, rd, a, b)
+#define LD(rd, off, base) OP_I(0x0F, rd, base, off)
+#define LW(rd, off, base) OP_I(0x10, rd, base, off)
+#define LB(rd, off, base) OP_I(0x12, rd, base, off)
+#define ST(rs, off, base) OP_I(0x13, rs, base, off)
+#define SW(rs, off, base) OP_I(0x14, rs, base, off)
+#define SB(rs, off, base) OP_I(0x16, rs, base, off)
+#define AMOSWAP(rd, addr, rs) OP_R(0x2B, rd, addr, rs)
+#define AMOADD(rd, addr, rs) OP_R(0x2C, rd, addr, rs)
+#define AMOXOR(rd, addr, rs) OP_R(0x2F, rd, addr, rs)
+#define VADD(vd, a, b) OP_R(0x30, vd, a, b)
+#define VSTORE(vs, off, base) (OP_I(0x35, 0, base, off) | ((vs) << 11))
+#define VBROADCAST(vd, rs) OP_R(0x36, vd, rs, 0)
+#define MCOPY(dst, src, len) OP_R(0x37, dst, src, len)
+#define MFILL(dst, byte, len) OP_R(0x38, dst, byte, len)
+#define ILLEGAL (0x3Fu << 26)
+
+// Branch offsets are in halfwords from the branch itself
+#define BEQ(a, b, words) OP_I(0x17, a, b, (words) * 2)
+#define BNE(a, b, words) OP_I(0x18, a, b, (words) * 2)
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("  FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+#define CHECK_REG(vm, index, expected) do { \
+    uint64_t value_ = vm_get_register(vm, index); \
+    CHECK(value_ == (uint64_t)(expected), "R%d = 0x%llx, expected 0x%llx", index, \
+          (unsigned long long)value_, (unsigned long long)(uint64_t)(expected)); \
+} while (0)
+
+static uint64_t double_bits(double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+static uint64_t read_u64(void* vm, uint64_t addr) {
+    uint64_t value = 0;
+    CHECK(memory_read(vm, addr, &value, sizeof(value)) == 0, "memory_read(0x%llx) failed",
+          (unsigned long long)addr);
+    return value;
+}
+
+// Perf counter, or cache statistic when index >= PERF_COUNTERS
+static uint64_t perf_counter(void* vm, int index) {
+    uint64_t perf[16];
+    vm_get_perf(vm, perf);
+    return perf[index];
+}
+
+// Reset the VM, load a program at CODE_BASE and point the PC at it
+static void load(void* vm, const uint32_t* code, size_t words, int timing) {
+    vm_set_timing_mode(vm, timing);
+    vm_reset(vm);
+    CHECK(memory_write(vm, CODE_BASE, code, words * 4) == 0, "program load failed");
+    vm_set_pc(vm, CODE_BASE);
+}
+
+// Run to completion and check the exit code and instruction count
+static void run(void* vm, uint64_t max, int expected_exit, uint64_t expected_instructions) {
+    int exit_code = vm_run(vm, max);
+    CHECK(exit_code == expected_exit, "vm_run returned %d, expected %d", exit_code, expected_exit);
+
+    uint64_t perf[16];
+    vm_get_perf(vm, perf);
+    CHECK(perf[0] == expected_instructions, "%llu instructions retired, expected %llu",
+          (unsigned long long)perf[0], (unsigned long long)expected_instructions);
+}
+
+// ---------------------------------------------------------------------------
+// Programs
+// ---------------------------------------------------------------------------
+
+static void test_alu(void* vm, int timing) {
+    static const uint32_t code[] = {
+        ADD(4, 1, 2), SUB(5, 1, 2), MUL(6, 1, 2), DIV(7, 1, 2), MOD(8, 1, 2),
+        AND(9, 1, 2), OR(10, 1, 2), XOR(11, 1, 2), SHL(12, 1, 3), SHR(13, 12, 3),
+        ADD(0, 1, 2),  // R0 stays zero
+        OP_HALT,
+    };
+    load(vm, code, sizeof(code) / 4, timing);
+    vm_set_register(vm, 1, 7);
+    vm_set_register(vm, 2, 5);
+    vm_set_register(vm, 3, 3);
+    run(vm, 0, 0, 12);
+
+    CHECK_REG(vm, 0, 0);
+    CHECK_REG(vm, 4, 12);
+    CHECK_REG(vm, 5, 2);
+    CHECK_REG(vm, 6, 35);
+    CHECK_REG(vm, 7, 1);
+    CHECK_REG(vm, 8, 2);
+    CHECK_REG(vm, 9, 5);
+    CHECK_REG(vm, 10, 7);
+    CHECK_REG(vm, 11, 2);
+    CHECK_REG(vm, 12, 56);
+    CHECK_REG(vm, 13, 7);
+}
+
+static void test_load_store(void* vm, int timing) {
+    static const uint32_t code[] = {
+        ST(2, 8, 1), LD(3, 8, 1),
+        SW(2, 16, 1), LW(4, 16, 1),
+        SB(2, 24, 1), LB(5, 24, 1),
+        OP_HALT,
+    };
+    load(vm, code, sizeof(code) / 4, timing);
+    vm_set_register(vm, 1, DATA_BASE);
+    vm_set_register(vm, 2, 0x1122334455667788ull);
+
+    // Cache statistics survive vm_reset, so compare deltas
+    uint64_t fetches = perf_counter(vm, STAT_L1I_HITS) + perf_counter(vm, STAT_L1I_MISSES);
+    uint64_t accesses = perf_counter(vm, STAT_L1D_HITS) + perf_counter(vm, STAT_L1D_MISSES);
+    run(vm, 0, 0, 7);
+    CHECK(perf_counter(vm, PERF_MEM_OPS) == 6, "PERF_MEM_OPS = %llu, expected 6",
+          (unsigned long long)perf_counter(vm, PERF_MEM_OPS));
+    fetches = perf_counter(vm, STAT_L1I_HITS) + perf_counter(vm, STAT_L1I_MISSES) - fetches;
+    accesses = perf_counter(vm, STAT_L1D_HITS) + perf_counter(vm, STAT_L1D_MISSES) - accesses;
+    CHECK(fetches == 7, "%llu L1I accesses, expected 7", (unsigned long long)fetches);
+    if (timing) {
+        CHECK(accesses == 6, "%llu L1D accesses, expected 6", (unsigned long long)accesses);
+    }
+
+    CHECK_REG(vm, 3, 0x1122334455667788ull);
+    CHECK_REG(vm, 4, 0x55667788);
+    CHECK_REG(vm, 5, 0xFFFFFFFFFFFFFF88ull);  // LB sign extends
+    CHECK(read_u64(vm, DATA_BASE + 8) == 0x1122334455667788ull, "ST did not reach guest memory");
+}
+
+static void test_loop(void* vm, int timing) {
+    // R3 = R1 + (R1 - 1) + ... + 1
+    static const uint32_t code[] = {
+        ADD(3, 3, 1),
+        SUB(1, 1, 2),
+        BNE(1, 0, -2),
+        OP_HALT,
+    };
+    load(vm, code, sizeof(code) / 4, timing);
+    vm_set_register(vm, 1, 10);
+    vm_set_register(vm, 2, 1);
+    run(vm, 0, 0, 31);
+
+    CHECK_REG(vm, 1, 0);
+    CHECK_REG(vm, 3, 55);
+}
+
+static void test_call_ret(void* vm, int timing) {
+    static const uint32_t code[] = {
+        OP_CALL(3),    // to double_r1
+        ADD(3, 2, 0),
+        OP_HALT,
+        ADD(2, 1, 1),  // double_r1
+        OP_RET,
+    };
+    load(vm, code, sizeof(code) / 4, timing);
+    vm_set_register(vm, 1, 21);
+    run(vm, 0, 0, 5);
+
+    CHECK_REG(vm, 2, 42);
+    CHECK_REG(vm, 3, 42);
+    CHECK_REG(vm, 31, CODE_BASE + 4);
+}
+
+static void test_bulk_memory(void* vm, int timing) {
+    static const uint32_t code[] = {
+        MFILL(1, 2, 3),
+        MCOPY(4, 1, 3),
+        LD(5, 56, 4),
+        OP_HALT,
+    };
+    load(vm, code, sizeof(code) / 4, timing);
+    vm_set_register(vm, 1, DATA_BASE + 0x100);
+    vm_set_register(vm, 2, 0x5A);
+    vm_set_register(vm, 3, 64);
+    vm_set_register(vm, 4, DATA_BASE + 0x200);
+    run(vm, 0, 0, 4);
+    CHECK(perf_counter(vm, PERF_MEM_OPS) == 3, "MFILL/MCOPY/LD not counted as memory ops");
+
+    CHECK_REG(vm, 5, 0x5A5A5A5A5A5A5A5Aull);
+    CHECK(read_u64(vm, DATA_BASE + 0x200) == 0x5A5A5A5A5A5A5A5Aull, "MCOPY missed the first qword");
+}
+
+static void test_simd(void* vm, int timing) {
+    static const uint32_t code[] = {
+        VBROADCAST(1, 1),
+        VBROADCAST(2, 2),
+        VADD(0, 1, 2),
+        VSTORE(0, 0, 3),
+        OP_HALT,
+    };
+    load(vm, code, sizeof(code) / 4, timing);
+    vm_set_register(vm, 1, double_bits(1.5));
+    vm_set_register(vm, 2, double_bits(2.25));
+    vm_set_register(vm, 3, DATA_BASE + 0x300);
+    run(vm, 0, 0, 5);
+    CHECK(perf_counter(vm, PERF_SIMD_OPS) == 4, "PERF_SIMD_OPS = %llu, expected 4",
+          (unsigned long long)perf_counter(vm, PERF_SIMD_OPS));
+    CHECK(perf_counter(vm, PERF_MEM_OPS) == 1, "VSTORE not counted as a memory op");
+
+    for (int lane = 0; lane < 4; lane++) {
+        uint64_t bits = read_u64(vm, DATA_BASE + 0x300 + lane * 8);
+        CHECK(bits == double_bits(3.75), "lane %d = 0x%llx, expected 3.75", lane,
+              (unsigned long long)bits);
+    }
+}
+
+static void test_atomics(void* vm, int timing) {
+    static const uint32_t code[] = {
+        AMOADD(3, 1, 2),   // 100 -> 105
+        AMOSWAP(4, 1, 2),  // 105 -> 5
+        AMOXOR(5, 1, 2),   // 5 -> 0
+        LD(6, 0, 1),
+        OP_HALT,
+    };
+    uint64_t initial = 100;
+    load(vm, code, sizeof(code) / 4, timing);
+    CHECK(memory_write(vm, DATA_BASE + 0x400, &initial, sizeof(initial)) == 0, "data load failed");
+    vm_set_register(vm, 1, DATA_BASE + 0x400);
+    vm_set_register(vm, 2, 5);
+    vm_set_register(vm, 6, 1);
+    run(vm, 0, 0, 5);
+    CHECK(perf_counter(vm, PERF_MEM_OPS) == 4, "PERF_MEM_OPS = %llu, expected 4",
+          (unsigned long long)perf_counter(vm, PERF_MEM_OPS));
+
+    CHECK_REG(vm, 3, 100);
+    CHECK_REG(vm, 4, 105);
+    CHECK_REG(vm, 5, 5);
+    CHECK_REG(vm, 6, 0);
+}
+
+static void test_illegal(void* vm, int timing) {
+    static const uint32_t code[] = { ADD(1, 1, 1), ILLEGAL, ADD(1, 1, 1) };
+    load(vm, code, sizeof(code) / 4, timing);
+    vm_set_register(vm, 1, 1);
+    run(vm, 0, 1, 2);
+
+    CHECK_REG(vm, 1, 2);
+}
+
+static void test_breakpoint(void* vm, int timing) {
+    static const uint32_t code[] = {
+        ADD(1, 1, 2),
+        ADD(1, 1, 2),  // breakpoint
+        ADD(1, 1, 2),
+        OP_HALT,
+    };
+    load(vm, code, sizeof(code) / 4, timing);
+    vm_set_register(vm, 2, 1);
+    vm_set_debug_mode(vm, 1);
+    CHECK(vm_set_breakpoint(vm, CODE_BASE + 4) == 0, "vm_set_breakpoint failed");
+    run(vm, 0, 2, 1);
+
+    const vm_state_t* state = vm_get_state(vm);
+    CHECK(state->pc == CODE_BASE + 4, "stopped at the wrong PC");
+    CHECK_REG(vm, 1, 1);
+
+    CHECK(vm_clear_breakpoint(vm, CODE_BASE + 4) == 0, "vm_clear_breakpoint failed");
+    CHECK(vm_clear_breakpoint(vm, CODE_BASE + 4) == 1, "breakpoint cleared twice");
+    run(vm, 0, 0, 4);
+    vm_set_debug_mode(vm, 0);
+
+    CHECK_REG(vm, 1, 3);
+}
+
+static void test_state_layout(void* vm, int timing) {
+    const abi_t* abi = vm_get_abi();
+    CHECK(abi->struct_size == sizeof(abi_t), "abi struct_size = %u", abi->struct_size);
+    CHECK(abi->version == VM_ABI_VERSION, "abi version = %u", abi->version);
+    CHECK(abi->state_size == sizeof(vm_state_t), "abi state_size = %u", abi->state_size);
+    CHECK(abi->state_pc == offsetof(vm_state_t, pc) && abi->state_sp == offsetof(vm_state_t, sp) &&
+              abi->state_flags == offsetof(vm_state_t, flags) &&
+              abi->state_gprs == offsetof(vm_state_t, gprs) &&
+              abi->state_vregs == offsetof(vm_state_t, vregs) &&
+              abi->state_perf_counters == offsetof(vm_state_t, perf_counters) &&
+              abi->state_cache_ctrl == offsetof(vm_state_t, cache_ctrl) &&
+              abi->state_vbase == offsetof(vm_state_t, vbase),
+          "abi offsets do not match vm_state_t");
+
+    static const uint32_t code[] = {
+        ADD(3, 1, 2),
+        VBROADCAST(4, 3),
+        OP_HALT,
+    };
+    load(vm, code, sizeof(code) / 4, timing);
+    vm_set_register(vm, 1, 40);
+    vm_set_register(vm, 2, 2);
+    run(vm, 0, 0, 3);
+
+    // The state block is the live context, not a copy
+    const vm_state_t* state = vm_get_state(vm);
+    for (int i = 1; i < 32; i++) {
+        CHECK(state->gprs[i] == vm_get_register(vm, i), "state gprs[%d] differs from vm_get_register", i);
+    }
+    CHECK(state->gprs[3] == 42, "state gprs[3] = %llu", (unsigned long long)state->gprs[3]);
+    for (int lane = 0; lane < 4; lane++) {
+        CHECK(state->vregs[4][lane] == 42, "state vregs[4][%d] = %llu", lane,
+              (unsigned long long)state->vregs[4][lane]);
+    }
+    CHECK(state->perf_counters[0] == perf_counter(vm, 0), "state perf_counters differ from vm_get_perf");
+}
+
+static void test_limit(void* vm, int timing) {
+    static const uint32_t code[] = { BEQ(0, 0, 0) };
+    load(vm, code, sizeof(code) / 4, timing);
+    run(vm, 100, 0, 100);
+}
+
+// ---------------------------------------------------------------------------
+// Driver
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const char* name;
+    void (*run)(void* vm, int timing);
+} test_case_t;
+
+static const test_case_t tests[] = {
+    { "alu", test_alu },
+    { "load_store", test_load_store },
+    { "loop", test_loop },
+    { "call_ret", test_call_ret },
+    { "bulk_memory", test_bulk_memory },
+    { "simd", test_simd },
+    { "atomics", test_atomics },
+    { "illegal", test_illegal },
+    { "breakpoint", test_breakpoint },
+    { "state_layout", test_state_layout },
+    { "limit", test_limit },
+};
+
+int main(void) {
+    nanocore_init();
+    void* vm = vm_context_create();
+    if (!vm || vm_init(vm, MEMORY_SIZE) != 0) {
+        printf("Error: Could not initialize VM\n");
+        vm_context_destroy(vm);
+        return 1;
+    }
+
+    for (int timing = 0; timing <= 1; timing++) {
+        for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+            int before = failures;
+            tests[i].run(vm, timing);
+            printf("%s %s%s\n", failures == before ? "ok  " : "FAIL", tests[i].name,
+                   timing ? " (timing)" : "");
+        }
+    }
+
+    vm_context_destroy(vm);
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+    return failures ? 1 : 0;
+}